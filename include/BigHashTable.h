@@ -29,14 +29,28 @@ using namespace std;
 class BigHashTable
 {
     public:
-        BigHashTable(const char *dbname = 0, const char *bfname = 0);
+        //tnum: keys expected by the bloom filter, cnum: cache slots, see HashDB
+        //md5keys: every key is a 32-char hex md5 string, see BlockedBloomFilter
+        BigHashTable(const char *dbname = 0, const char *bfname = 0,
+                     const uint64_t tnum = HASHDB_DEFAULT_TNUM, const uint32_t cnum = HASHDB_DEFAULT_CNUM,
+                     const bool md5keys = false);
         virtual ~BigHashTable();
         void insert(const void *key, const void *data, const int datasz);
-        void* getvalue(const void *key, int &valuesize);
-        inline bool contain(const void *key){
-            int valuesize = 0;
-            return (getvalue(key, valuesize)) ? true : false;
-        }
+        void* getvalue(const void *key, int &valuesize); //a malloc'd copy, freed by the caller
+        //copy the value into buf of HASHDB_VALUE_MAX_SZ bytes, return false if key does not exist
+        bool getvalue(const void *key, void *buf, int &valuesize);
+        //a borrowed view of the value, valid until the next call on the table
+        const void* peekvalue(const void *key, int &valuesize);
+        //membership only, allocates nothing
+        bool contain(const void *key);
+        /*batched insert/getvalue of nr keys, for callers holding many keys at once;
+          batchgetvalue mallocs values[i] (0 if keys[i] does not exist), and returns
+          the number of keys found*/
+        void batchinsert(const void **keys, const void **datas, const int *datasizes, const int nr);
+        int batchgetvalue(const void **keys, const int nr, void **values, int *valuesizes);
+
+        uint64_t memusage() const { return (db) ? db->memusage() : 0; }
+        uint64_t bloomusage() const { return (db) ? db->bloomusage() : 0; }
     protected:
     private:
         HashDB *db;
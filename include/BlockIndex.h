@@ -0,0 +1,242 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef BLOCKINDEX_H
+#define BLOCKINDEX_H
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BigHashTable.h"
+#include "LSMIndex.h"
+#include "CuckooFilter.h"
+#include "utils.h"
+
+using namespace std;
+
+/* The block index persisted in the deduped package, as runs the package lists:
+    1. fingerprint index: runs of BINDEX_ENTRY, each sorted by (md5, block id);
+       in a package with fingerprint filters the CuckooFilter of a run follows
+       it, from the next BINDEX_ALIGN offset on
+    2. checksum set: runs of uint32_t, the sorted adler32 checksums of the
+       unique blocks registered by SB chunking, the only chunking using them
+   Reopening a package maps the runs read-only; the blocks registered afterwards
+   are kept in BigHashTables until the package is written again, when they are
+   appended as one more run of each section, merged with the newest runs smaller
+   than BINDEX_RUNS_RATIO times the merged run: an entry is rewritten O(log
+   entries) times, and a lookup searches O(log entries) runs.
+   The new fingerprint entries to be written are buffered spill_nr at a
+   time; every full buffer is sorted into a temp file under data/BlockIndex,
+   whose chunks the writing merges with the runs.
+*/
+typedef struct _block_index_entry{
+    unsigned char md5[16]; //binary md5 of the unique block
+    uint32_t bid;          //unique block id
+} BINDEX_ENTRY;
+#define BINDEX_ENTRY_SZ (sizeof(BINDEX_ENTRY))
+#define BINDEX_CSUM_SZ (sizeof(uint32_t))
+#define BINDEX_ALIGN 8 //the runs and their filters start at 8 bytes aligned offsets
+#define BINDEX_RUNS_RATIO 2
+#define BINDEX_SPILL_NR 65536 //default of the new fingerprint entries buffered in memory
+#define BINDEX_MAX_BIDS 32 //block ids returned per fingerprint at most
+#define BINDEX_NEW_BIDS_MAX ((int)(HASHDB_VALUE_MAX_SZ / sizeof(uint32_t)) - 1) //new block ids kept per fingerprint
+
+/* Sampled index mode, for packages whose fingerprint index does not fit in RAM:
+   only the "hook" fingerprints, whose top sample_bits bits are zero, are kept in
+   memory; as the index is sorted by md5, the hooks are the head of the section.
+   A hook hit prefetches the run of logic block entries that follows the hooked
+   block (block id order is the order the blocks were first stored) into one of
+   BINDEX_CACHE_SEGS cache segments, so the next duplicates of a backup stream
+   are resolved from memory. A fingerprint found neither in the hooks nor in the
+   cache is taken as a new block, thus deduplication becomes approximate.
+*/
+#define BINDEX_MAX_SAMPLE_BITS 16
+#define BINDEX_CACHE_SEGS 16
+#define BINDEX_PREFETCH_NR 1024 //default logic block entries prefetched per hook hit
+
+/*backends of the table of new fingerprints: a HashDB updated in place, or an
+  LSMIndex of sorted runs written sequentially (see LSMIndex.h)*/
+#define BINDEX_BACKEND_HASHDB 0
+#define BINDEX_BACKEND_LSM 1
+
+//a run of logic block entries: block ids [first, first + nr) stored at offset
+typedef struct _block_index_run{
+    uint64_t offset;
+    uint32_t first;
+    uint32_t nr;
+} BINDEX_RUN;
+
+//the logic block entries of the package, nr entries of entry_sz bytes in
+//block id order, each with the 32-char hex md5 at md5_pos; stored from
+//offset on, or in runs_nr runs sorted by first block id if runs != 0
+//runs need not cover every block id, blocks of no run are not prefetched
+typedef struct _block_index_seq{
+    uint64_t offset;
+    uint32_t nr;
+    uint32_t entry_sz;
+    uint32_t md5_pos;
+    const BINDEX_RUN *runs; //copied by openindex(...)
+    uint32_t runs_nr;
+    uint32_t flags; //BINDEX_SEQ_*
+} BINDEX_SEQ;
+#define BINDEX_SEQ_BINMD5 0x1 //the md5 at md5_pos is 16 binary bytes
+#define BINDEX_SEQ_WHOLE 0x2 //a run is prefetched from its first entry on, e.g. the slot table of a container
+
+//the bytes of a run in the package, its filter included
+typedef struct _block_index_extent{
+    uint64_t offset;
+    uint64_t len;
+} BINDEX_EXTENT;
+
+//a run of a persisted section, mapped by openindex(...)
+typedef struct _block_index_map{
+    uint64_t offset; //of the run in the package
+    uint64_t len; //BINDEX_EXTENT::len
+    uint32_t nr;
+    void *map_addr;
+    size_t map_len;
+    const void *entries; //in the mapping
+    CuckooFilter *filter; //of a fingerprint run, 0: none
+} BINDEX_MAP;
+
+typedef struct _block_index_cache_slot{
+    unsigned char md5[16];
+    uint32_t bid;
+    int32_t next; //next slot in the hash chain, -1 for the end
+} BINDEX_CACHE_SLOT;
+
+class BlockIndex
+{
+    public:
+        //lookup == false: only collect entries to be written, e.g. when rebuilding a package;
+        //cnum, tnum: cache slots and expected keys of the tables of new entries, see HashDB,
+        //the checksum table gets half the slots; spill_nr: new entries buffered in memory
+        BlockIndex(bool lookup = true, const uint32_t cnum = HASHDB_DEFAULT_CNUM,
+                   const uint64_t tnum = HASHDB_DEFAULT_TNUM, const uint32_t spill_nr = BINDEX_SPILL_NR);
+        virtual ~BlockIndex();
+
+        //sample_bits == 0: exact index (default); call before openindex
+        int setsampling(const unsigned int sample_bits, const unsigned int prefetch_nr = BINDEX_PREFETCH_NR);
+        //call before any insert
+        int setbackend(const int backend, const uint32_t memtable_nr = LSM_MEMTABLE_NR);
+
+        /*the runs of the sections, oldest first: nr entries at offset, first is
+          not used; seq is required by the sampled mode, for prefetching*/
+        int openindex(const char *pkg_name, const BINDEX_RUN *fp_runs, const uint32_t fp_nr,
+                      const BINDEX_RUN *csum_runs, const uint32_t csum_nr, const BINDEX_SEQ *seq = 0);
+        void closeindex();
+
+        /*fingerprint index, keyed by the 32-char hex md5 string:
+          getvalue writes at most maxnr block ids of md5str into the caller's bids
+          and returns their number; neither getvalue nor contain allocates*/
+        int getvalue(const void *md5str, uint32_t *bids, const int maxnr);
+        bool contain(const void *md5str);
+        int insert(const void *md5str, const uint32_t bid);
+
+        /*fingerprint filters, see CuckooFilter.h: writeindex gives every run it
+          writes a filter of its fingerprints, a miss skips the search of the run.
+          openfilter (after openindex) reads the filters following the runs if
+          stored, otherwise the next writeindex merges every run into one, with
+          its filter*/
+        int openfilter(const char *pkg_name, const bool stored);
+        //drop (md5, bid) from the runs, e.g. a block released in place: writeindex merges the runs holding it
+        int removeindex(const void *md5str, const uint32_t bid);
+
+        /*adler32 checksum set of the unique blocks*/
+        bool containcsum(const uint32_t csum);
+        int insertcsum(const uint32_t csum);
+
+        //add the bytes held in memory to: index (tables, hooks, new entries), bloom, block (prefetch cache)
+        void memusage(uint64_t &index, uint64_t &bloom, uint64_t &block) const;
+        //bytes per prefetched logic block in the sampled mode, for memory planning
+        static uint32_t prefetchcost(const uint32_t entry_sz);
+
+        /*append the new entries as a run of each section from the current position
+          of out on, merged with the runs BINDEX_RUNS_RATIO asks for and the runs
+          holding a removed entry; stale gets the bytes of the runs replaced.
+          bindex_off, csum_off: of the newest run; bindex_nr, csum_nr: the entries
+          of every run; filter_off: the filter of the newest run, filter_len: the
+          bytes of every filter. The index is not searched afterwards*/
+        int writeindex(ostream &out, unsigned long long &bindex_off, unsigned int &bindex_nr,
+                       unsigned long long &csum_off, unsigned int &csum_nr,
+                       unsigned long long &filter_off, unsigned long long &filter_len,
+                       vector<BINDEX_EXTENT> &stale);
+        //the runs of the sections, oldest first, and the bytes they take
+        void runs(vector<BINDEX_RUN> &fp_runs, vector<BINDEX_RUN> &csum_runs) const;
+        void extents(vector<BINDEX_EXTENT> &live) const;
+
+    private:
+        static void unmap(vector<BINDEX_MAP> &maps);
+        //sort new_bindex into a chunk of the spill file
+        int spill();
+        void dropspill();
+        int mapruns(const char *pkg_name, const BINDEX_RUN *runs, const uint32_t nr,
+                    const uint32_t entry_sz, vector<BINDEX_MAP> &maps);
+        bool infilter(const unsigned char *md5) const;
+        int findhook(const unsigned char *md5, uint32_t &first) const;
+        bool ishook(const unsigned char *md5) const;
+
+        int prefetch(const uint32_t bid, const bool follow = true);
+        void cacheevict(const uint32_t seg);
+        int cachefind(const unsigned char *md5, uint32_t *bids, int nr, const int maxnr) const;
+
+    private:
+        vector<BINDEX_MAP> fp_maps; //runs of the package, oldest first
+        vector<BINDEX_MAP> csum_maps;
+
+        BigHashTable *htab_bindex; //md5 => new block ids
+        LSMIndex *lsm_bindex; //the same, BINDEX_BACKEND_LSM
+        BigHashTable *htab_csum;
+        uint64_t htab_tnum; //the sizes of the constructor, for the table setbackend(...) makes
+        uint32_t htab_cnum;
+        vector<BINDEX_ENTRY> new_bindex; //at most spill_nr, then spilled
+        uint32_t spill_nr;
+        uint64_t new_nr; //new entries, those spilled included
+        int spill_fd; //-1: nothing spilled
+        char spill_path[PATH_MAX_LEN];
+        uint64_t spill_len;
+        vector<BINDEX_EXTENT> spill_runs; //sorted chunks of the spill file
+        vector<uint32_t> new_csum;
+        vector<BINDEX_ENTRY> dead_bindex; //entries left out by writeindex
+        bool lookup;
+
+        bool filters; //write a filter after every fingerprint run
+        bool filters_merge; //the runs have none yet
+
+        /*sampled mode*/
+        unsigned int sample_bits;
+        unsigned int prefetch_nr;
+        BINDEX_ENTRY *hooks; //copy of the hook entries of the persisted index
+        uint32_t hooks_nr;
+        int seq_fd;
+        BINDEX_SEQ seq;
+        vector<BINDEX_RUN> seq_runs;
+        char *seq_buf;
+        BINDEX_CACHE_SLOT *cache; //BINDEX_CACHE_SEGS segments of prefetch_nr slots
+        int32_t *cache_bucket;
+        uint32_t cache_mask;
+        uint32_t seg_first[BINDEX_CACHE_SEGS]; //first block id of each segment
+        uint32_t seg_nr[BINDEX_CACHE_SEGS];
+        uint32_t seg_next; //the segment to be replaced by the next prefetch
+};
+
+//32-char hex md5 string => 16 bytes md5, return -1 if not a hex string
+int md5str2bin(const void *md5str, unsigned char *md5);
+
+#endif // BLOCKINDEX_H
@@ -21,6 +21,8 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 //#include "utils.h"
 
@@ -88,7 +90,7 @@ class BloomFilter
 
         inline virtual unsigned long long int size() const { return bf_hdr.tablesize_;}
         inline unsigned int elementCount() const { return bf_hdr.inserted_element_count_;}
-        inline double effectiveFPP() const; //The effective false positive probability
+        virtual double effectiveFPP() const; //The effective false positive probability
         inline const unsigned char* table() const { return bittable_;}
         inline unsigned int hashCount() { return salt_.size(); }
         inline void clear();//BFλbittable_ǲɾ洢ռ
@@ -101,7 +103,7 @@ class BloomFilter
         inline bool friend operator! (const BloomFilter&);
 
         //insert an element into the BloomFilter
-        void insert(const unsigned char* key_begin, const unsigned int len);
+        virtual void insert(const unsigned char* key_begin, const unsigned int len);
         void insert(const char* data, const unsigned int len);
         void insert(const std::string& key);
         template<class InputIter>
@@ -131,6 +133,10 @@ bool operator! (const BloomFilter&);
 int writebf(ofstream &des_file, BloomFilter *bf);
 int readbf(ifstream &src_file, BloomFilter *bf);
 
+//bittable_ is allocated on a cache line boundary (BBF_BLOCK_BYTES)
+unsigned char* allocbittable(std::size_t size);
+void freebittable(unsigned char* table);
+
 /** Bloom Filter ڴļжӦĴ洢ṹΪ
         unsigned int saltcount_;
         unsigned long long int tablesize_;    //per bit
@@ -151,6 +157,112 @@ std::ostream& operator<< (std::ostream&, const BloomParameters::OptParametersT&)
 std::ostream& operator<< (std::ostream&, const BloomParameters&);
 
 
+/** Blocked Bloom Filter
+    All the k probe bits of a key fall into one BBF_BLOCK_BYTES block of
+    bittable_, so that insert/contains touch a single cache line. The block
+    and the bits inside it come from two 64-bit values derived once per key:
+    when the owner declares its keys 32-char hex MD5 fingerprints (md5keys),
+    their words are folded directly, otherwise all the key bytes are hashed
+    twice by hashAP. The first value picks the block, the probes take
+    successive BBF_PROBE_BITS slices of the second one.
+    A blocked filter needs more bits than a standard one for the same fpp
+    since the blocks are not loaded evenly: the table size and probe count
+    are chosen against the fpp averaged over the Poisson distributed block
+    loads, which is also what effectiveFPP() reports.
+**/
+#define BBF_BLOCK_BYTES 64
+#define BBF_BLOCK_BITS (BBF_BLOCK_BYTES * BITS_PER_CHAR)
+#define BBF_BLOCK_WORDS (BBF_BLOCK_BYTES / sizeof(uint64_t))
+#define BBF_PROBE_BITS 9        //log2(BBF_BLOCK_BITS)
+#define BBF_MAX_PROBES 16       //probe bits per key at most
+
+class BlockedBloomFilter : public BloomFilter
+{
+    public:
+        BlockedBloomFilter(bool md5keys = false);
+        BlockedBloomFilter(const BloomParameters&, bool md5keys = false);
+        virtual ~BlockedBloomFilter() {}
+
+        using BloomFilter::insert;
+        using BloomFilter::contains;
+        virtual void insert(const unsigned char* key_begin, const unsigned int len);
+        virtual bool contains(const unsigned char* key_begin, const unsigned int len) const;
+        virtual double effectiveFPP() const;
+
+    protected:
+        inline const unsigned char* probe(const unsigned char* key_begin, const unsigned int len,
+                                          uint64_t* mask) const;
+
+        bool md5keys_; //keys are 32-char hex md5 strings, fold instead of hashing
+};
+
+
+/** Scalable Bloom Filter
+    A chain of BloomFilter stages. Elements always go into the newest stage;
+    once its effective fpp exceeds the stage's designed fpp, a new stage is
+    appended with SBF_GROWTH_RATIO times the capacity and SBF_TIGHTEN_RATIO
+    times the fpp. With stage i designed for fpp * (1 - r) * r^i, the overall
+    false positive probability stays below fpp however many elements arrive.
+**/
+#define SBF_MAGIC_NUM 0x5BF00003
+#define SBF_GROWTH_RATIO 2      //capacity ratio between two successive stages
+#define SBF_TIGHTEN_RATIO 0.5   //fpp ratio between two successive stages
+#define SBF_MAX_FILTERS 32      //stop growing after this many stages
+
+typedef struct _Scalable_Bloom_Header{
+     unsigned int magic_;
+     unsigned int filtercount_;
+     unsigned int blocked_; //stages are BlockedBloomFilter
+     unsigned int md5keys_; //blocked stages fold the keys as md5 fingerprints
+     unsigned long long int initial_element_count_; //capacity of the first stage
+     unsigned long long int randseed_;
+     double desiredfpp_; //the overall false positive probability
+}ScalableBloomHeader;
+#define SBF_HDR_SZ (sizeof(ScalableBloomHeader))
+
+class ScalableBloomFilter
+{
+    public:
+        ScalableBloomFilter();
+        ScalableBloomFilter(const BloomParameters&, bool blocked = false, bool md5keys = false);
+        virtual ~ScalableBloomFilter();
+
+        unsigned long long int size() const; //bits of all the stages
+        unsigned long long int elementCount() const;
+        double effectiveFPP() const;
+        inline unsigned int filterCount() const { return filters_.size(); }
+
+        void insert(const unsigned char* key_begin, const unsigned int len);
+        void insert(const char* data, const unsigned int len);
+        void insert(const std::string& key);
+
+        bool contains(const unsigned char* key_begin, const unsigned int len) const;
+        bool contains(const char* data, const unsigned int len) const;
+        bool contains(const std::string& key) const;
+
+        friend int writesbf(ofstream &des_file, ScalableBloomFilter *sbf);
+        friend int readsbf(ifstream &src_file, ScalableBloomFilter *sbf);
+
+    private:
+        ScalableBloomFilter(const ScalableBloomFilter&);
+        ScalableBloomFilter& operator= (const ScalableBloomFilter&);
+        int grow(); //append a new stage
+        void release();
+
+    public:
+        std::vector<BloomFilter*> filters_;
+        ScalableBloomHeader sbf_hdr;
+};
+
+int writesbf(ofstream &des_file, ScalableBloomFilter *sbf);
+int readsbf(ifstream &src_file, ScalableBloomFilter *sbf);
+
+/** The on-disk layout of a Scalable Bloom Filter:
+        ScalableBloomHeader sbf_hdr;
+        BloomFilter[0..filtercount_] //each stage in the format of writebf
+**/
+
+
 /*
 class CompressibleBF : public BloomFilter{
 public:
@@ -0,0 +1,96 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef CUCKOOFILTER_H
+#define CUCKOOFILTER_H
+
+#include <iostream>
+#include <fstream>
+#include <cmath>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+/** Cuckoo Filter
+    A 16-bit fingerprint of every key is kept in one of two candidate buckets
+    of CF_BUCKET_SLOTS slots; the second bucket is derived from the first one
+    and the fingerprint only (partial-key cuckoo hashing), so a fingerprint can
+    be moved, and deleted, without the key. Unlike BloomFilter, remove() takes
+    a key out again: remove only keys inserted before, every insert of a key
+    needs a remove of its own.
+    At the CF_LOAD_MAX load the false positive probability is about
+    2 * CF_BUCKET_SLOTS / 2^16 = 0.00012, at 16 / CF_LOAD_MAX = 17 bits per key,
+    where a BlockedBloomFilter needs 21 for 0.0001 (HASHDB_BLOOM_KEY_BITS).
+    Once an insert gives up after CF_MAX_KICKS moves, the homeless fingerprint
+    is kept aside as the victim, so no inserted key is lost; the filter is full
+    from then on, and the owner rebuilds a larger one from its keys.
+**/
+#define CF_BUCKET_SLOTS 4
+#define CF_MAX_KICKS 500
+#define CF_LOAD_MAX 0.95
+#define CF_MAGIC_NUM 0xCF161101
+
+typedef struct _cuckoo_header{
+    uint32_t magic;
+    uint32_t victim_fp; //0: no victim
+    uint64_t bucket_nr;
+    uint64_t victim_idx;
+    uint64_t count; //fingerprints stored, the victim included
+} CuckooHeader;
+#define CF_HDR_SZ (sizeof(CuckooHeader))
+
+class CuckooFilter
+{
+    public:
+        //room for capacity keys at CF_LOAD_MAX load
+        CuckooFilter(const uint64_t capacity = 10000);
+        virtual ~CuckooFilter();
+
+        //false: the filter is full, the key is not inserted
+        bool insert(const unsigned char* key_begin, const unsigned int len);
+        bool contains(const unsigned char* key_begin, const unsigned int len) const;
+        //false: key was not found
+        bool remove(const unsigned char* key_begin, const unsigned int len);
+
+        inline bool full() const { return 0 != cf_hdr.victim_fp; }
+        inline uint64_t elementCount() const { return cf_hdr.count; }
+        inline uint64_t capacity() const { return cf_hdr.bucket_nr * CF_BUCKET_SLOTS; }
+        inline uint64_t size() const { return cf_hdr.bucket_nr * CF_BUCKET_SLOTS * 16; } //bits of the table
+        inline uint64_t bytes() const { return CF_HDR_SZ + cf_hdr.bucket_nr * CF_BUCKET_SLOTS * sizeof(uint16_t); }
+        double effectiveFPP() const;
+
+        friend int writecf(ostream &des_file, CuckooFilter *cf);
+        friend int readcf(istream &src_file, CuckooFilter *cf);
+
+    private:
+        inline void hashkey(const unsigned char* key_begin, const unsigned int len, uint64_t &idx, uint16_t &fp) const;
+        inline uint64_t altindex(const uint64_t idx, const uint16_t fp) const;
+        bool insertslot(const uint64_t idx, const uint16_t fp);
+        bool findslot(const uint64_t idx, const uint16_t fp) const;
+        bool removeslot(const uint64_t idx, const uint16_t fp);
+
+    private:
+        CuckooHeader cf_hdr;
+        uint16_t *table; //bucket_nr buckets of CF_BUCKET_SLOTS fingerprints, 0 for an empty slot
+        uint32_t seed; //walks the random kicks
+};
+
+int writecf(ostream &des_file, CuckooFilter *cf);
+int readcf(istream &src_file, CuckooFilter *cf);
+
+/** Cuckoo Filter ڴļжӦĴ洢ṹΪ
+        CuckooHeader
+        table[0..bucket_nr * CF_BUCKET_SLOTS] //16-bit fingerprints
+**/
+
+#endif // CUCKOOFILTER_H
@@ -13,6 +13,8 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <iostream>
 #include <fstream>
 #include <limits>
+#include <vector>
+#include <algorithm>
 
 #include <stdint.h>
 #include <unistd.h>
@@ -32,6 +34,11 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #define HASHDB_DEFAULT_TNUM	100000
 #define HASHDB_DEFAULT_BNUM	16384 //131072 //2^(17) 0.5MB //40970
 #define HASHDB_DEFAULT_CNUM	16384 //131072//2^(17) //40970 //3717
+#define HASHDB_SPLIT_LOAD	2 //split one bucket once the average bucket holds more entries than this
+#define HASHDB_BLOCKED_BLOOM	true //one cache line per bloom filter probe, see BlockedBloomFilter
+#define HASHDB_BLOOM_FPP	0.0001
+#define HASHDB_BLOOM_KEY_BITS	21 //bloom filter bits per key at HASHDB_BLOOM_FPP, for memory planning
+#define HASHDB_CACHED_ENTRY_MEM	(HASH_ENTRY_SZ + 96) //a filled cache slot with its key and value, estimated
 
 #ifndef PATH_MAX_LEN
 #define PATH_MAX_LEN 256
@@ -42,6 +49,7 @@ using namespace std;
 typedef struct hash_entry
 {
     bool iscached;
+    bool isdirty; //the cached entry differs from its copy in the disk file
     char *key;
     void *value;
     uint32_t ksize; //key size
@@ -54,13 +62,28 @@ typedef struct hash_entry
 } HASH_ENTRY;
 #define HASH_ENTRY_SZ sizeof(HASH_ENTRY)
 
+//a hash entry (and its key) gathered from a bucket which is being split
+typedef struct split_node
+{
+    HASH_ENTRY he;
+    char key[HASHDB_KEY_MAX_SZ];
+} SPLIT_NODE;
+
 typedef struct hash_bucket
 {
     uint64_t off; //bucketеĵһhash entryĵַff
 } HASH_BUCKET;
 #define HASH_BUCKET_SZ sizeof(HASH_BUCKET)
 
-#define HASHDB_MAGIC 20160415
+//a key of batchgetDB walking down its bucket tree
+typedef struct batch_probe
+{
+    uint64_t off; //offset of the next hash entry to compare with
+    uint32_t hash2;
+    int idx; //index of the key in the batch
+} BATCH_PROBE;
+
+#define HASHDB_MAGIC 20161019
 
 typedef uint32_t (*hashfunc_t)(const char*);
 
@@ -73,6 +96,9 @@ typedef struct hashdb_header
    // uint64_t bfoff; // offset of the bloom filter
     uint64_t hbucket_off; //offset of hash buckets
     uint64_t hentry_off; //offset of hash values
+    uint32_t bnum0; // number of hash buckets the hashdb was created with
+    uint32_t bcap; // number of bucket slots reserved at hbucket_off
+    uint64_t inum; // number of hash entries written into the disk file
 } HASHDB_HDR;
 #define HASHDB_HDR_SZ sizeof(HASHDB_HDR)
 
@@ -81,31 +107,52 @@ class HashDB
 public:
     HashDB(uint64_t tnum, uint32_t bnum,
            uint32_t cnum, hashfunc_t hfunc1,
-           hashfunc_t hfunc2);
+           hashfunc_t hfunc2, bool md5keys = false);
     virtual ~HashDB();
     int openDB(const char* dbname, const char* bfname, bool isnewdb);
     int closeDB(int flash = 1);
     int setDB(const char* key, const void* value, const int vsize);
     int getDB(const char* key, void* value, int &vsize);
+    int peekDB(const char* key, const void** value, int &vsize);
+    int containDB(const char* key);
+    /* batched operations, see HashDB.cpp */
+    int batchgetDB(const char **keys, const int nr, void **values, int *vsizes, int *rets);
+    int batchsetDB(const char **keys, const void **values, const int *vsizes, const int nr);
     int unlinkDB();
 
     const char* getdbpath() { return dbpath; }
+    //bytes held in memory by the cache (with the cached keys and values) and the buckets
+    uint64_t memusage() const;
+    uint64_t bloomusage() const;
 private:
     int swapout(const uint32_t hash1, const uint32_t hash2, HASH_ENTRY* he);
     int swapin (const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY* he);
+    /* the same, sharing the disk file opened by opendbfile among several swaps */
+    int opendbfile(fstream &db_file);
+    int setDB(fstream &db_file, const char* key, const void* value, const int vsize);
+    int swapout(fstream &db_file, const uint32_t hash1, const uint32_t hash2, HASH_ENTRY* he);
+    int swapin (fstream &db_file, const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY* he);
     int read2fillcache(fstream &db_file);
 
+    /* linear hashing over the bucket array */
+    uint32_t bucketpos(const uint32_t hash1) const;
+    int splitbucket(fstream &db_file);
+    int growbuckets(fstream &db_file);
+    uint64_t buildtree(fstream &db_file, SPLIT_NODE *nodes, int lo, int hi);
+
 private:
 
     char dbpath[PATH_MAX_LEN]; //hashdb file path
     char bfpath[PATH_MAX_LEN]; //bloom filter path
     HASHDB_HDR header; // hashdb header
-    BloomFilter* bloom;
+    ScalableBloomFilter* bloom;
     HASH_BUCKET* bucket; // hash buckets
     HASH_ENTRY* cache; //hash item cache
+    uint64_t bsplit; // buckets [0, bsplit) are addressed by hash1 % bsplit before splitting
     hashfunc_t hfunc1; // hash function for hash bucket
     hashfunc_t hfunc2;
     // hash function for btree in the hash bucket
+    bool md5keys; // keys are 32-char hex md5 strings, the bloom folds them
 };
 
 #endif // HASHDB_H
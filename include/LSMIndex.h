@@ -0,0 +1,131 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef LSMINDEX_H
+#define LSMINDEX_H
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BloomFilter.h"
+
+#ifndef PATH_MAX_LEN
+#define PATH_MAX_LEN 256
+#endif
+
+using namespace std;
+
+/* Log-structured fingerprint index: a multimap of fixed size keys to uint32_t
+   values kept in sorted immutable runs, as an alternative to HashDB whose
+   tree updates make every new key a random write.
+    1. new entries go to an in-memory memtable (a chained hash over an array);
+       a full memtable is sorted and written as one run, sequentially
+    2. every run keeps in memory a BlockedBloomFilter of its keys and a fence
+       pointer (the first key) for every LSM_FENCE_NR entries, so a probe of a
+       run costs no I/O on a bloom miss and one pread of a fence block otherwise
+    3. a level gathering LSM_MERGE_RUNS runs is merged into one run of the next
+       level, by a background thread (or in flush() without it)
+   The runs are temporary files, removed with the index. One thread inserts and
+   looks up; only the runs list is shared with the compaction thread.
+*/
+#define LSM_KEY_SZ 16 //binary md5
+#define LSM_MEMTABLE_NR 65536 //entries buffered before a run is written
+#define LSM_FENCE_NR 256 //entries per fence block
+#define LSM_MERGE_RUNS 4 //runs of one level merged into the next level
+#define LSM_BLOOM_FPP 0.001
+#define LSM_IO_NR 16384 //entries per buffered read/write of a run
+
+typedef struct _lsm_entry{
+    unsigned char key[LSM_KEY_SZ];
+    uint32_t value;
+} LSM_ENTRY;
+#define LSM_ENTRY_SZ (sizeof(LSM_ENTRY))
+
+typedef struct _lsm_run{
+    char path[PATH_MAX_LEN + 16]; //prefix_seq.run
+    int fd;
+    uint32_t level;
+    uint64_t nr; //entries of the run
+    vector<LSM_ENTRY> fences; //first entry of every fence block
+    BlockedBloomFilter *bloom;
+    bool merging; //taken by the compaction thread
+
+    /*while the run is written*/
+    LSM_ENTRY *wbuf;
+    uint32_t wbuf_nr;
+} LSM_RUN;
+
+class LSMIndex
+{
+    public:
+        //name == 0: a temporary name; background == false: merge runs in flush()
+        LSMIndex(const char *name = 0, const uint32_t memtable_nr = LSM_MEMTABLE_NR, bool background = true);
+        virtual ~LSMIndex();
+
+        int insert(const void *key, const uint32_t value);
+        //write at most maxnr values of key into values, return their number
+        int getvalue(const void *key, uint32_t *values, const int maxnr);
+        bool contain(const void *key);
+        //write the memtable as a run
+        int flush();
+
+        uint32_t runs();
+        uint64_t entries() const { return entries_nr; }
+        //bytes held in memory by the memtable and the fences, and by the bloom filters
+        uint64_t memusage();
+        uint64_t bloomusage();
+
+    private:
+        LSM_RUN* newrun(const uint32_t level, const uint64_t nr_hint);
+        int appendrun(LSM_RUN *run, const LSM_ENTRY *entry);
+        int writerun(LSM_RUN *run);
+        int sealrun(LSM_RUN *run);
+        void freerun(LSM_RUN *run);
+        int findrun(LSM_RUN *run, const void *key, uint32_t *values, int n, const int maxnr) const;
+
+        int pickmerge(vector<LSM_RUN*> &victims);
+        int mergeruns(vector<LSM_RUN*> &victims);
+        static void* compactthread(void *arg);
+
+    private:
+        char prefix[PATH_MAX_LEN]; //path prefix of the run files
+        uint32_t run_seq;
+
+        /*memtable*/
+        LSM_ENTRY *mem;
+        int32_t *mem_next;
+        int32_t *mem_bucket;
+        uint32_t mem_mask;
+        uint32_t mem_nr;
+        uint32_t mem_cap;
+
+        uint64_t entries_nr;
+
+        vector<LSM_RUN*> run_list; //guarded by lock
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t compactor;
+        uint32_t pending; //runs added since the last merge pass
+        bool background;
+        bool stop;
+};
+
+#endif // LSMINDEX_H
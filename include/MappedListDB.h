@@ -0,0 +1,75 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef MAPPEDLISTDB_H
+#define MAPPEDLISTDB_H
+
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LISTDB_MAP_EXTENT 16777216 //16MB, the file and its mapping grow by whole extents
+
+using namespace std;
+
+/* A ListDB backend which maps the whole array of fixed size values instead
+   of swapping DEFAULT_SWAP_SZ groups through a cache: a value is read or
+   written in place, and the page cache does the caching. The mapping is
+   shared, other processes may read the file while it is written.
+   Values [0, size()) are set; fillvalue() or a setvalue() beyond size()
+   grows the array, the values of the gap read as zero.
+   The batched operations work on uint32_t values (unit_sz == 4), e.g. the
+   reference counts of the unique blocks when files are removed.
+*/
+class MappedListDB
+{
+    public:
+        MappedListDB(unsigned int unit_sz);
+        virtual ~MappedListDB();
+        int opendb(const char *path);
+        int closedb();
+        int unlinkdb();
+
+        int setvalue(const unsigned int index, const void *value);
+        int getvalue(const unsigned int index, void *value); //-2: value not set
+        //set values [0, nr) as value
+        int fillvalue(const unsigned int nr, const void *value);
+        //the value in the mapping, valid until the array grows
+        void* valueptr(const unsigned int index);
+
+        //values[indexes[i]] += delta
+        int batchinc(const uint32_t *indexes, const unsigned int nr, const uint32_t delta = 1);
+        int batchget(const uint32_t *indexes, const unsigned int nr, uint32_t *values);
+        /*values[indexes[i]] is set to values[i] if it equals unset, otherwise
+          values[i] gets the stored value; return the number of values set*/
+        int batchgetorset(const uint32_t *indexes, const unsigned int nr, uint32_t *values, const uint32_t unset);
+
+        uint64_t size() const { return value_nr; }
+
+    private:
+        int grow(const uint64_t nr);
+        bool checkbatch(const uint32_t *indexes, const unsigned int nr) const;
+
+    private:
+        char *dbname;
+        int fd;
+        unsigned int unit_size;
+        char *map_addr;
+        uint64_t map_len; //a multiple of LISTDB_MAP_EXTENT, the file size
+        uint64_t value_nr;
+};
+
+#endif // MAPPEDLISTDB_H
@@ -0,0 +1,135 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef PACKAGEVIEW_H
+#define PACKAGEVIEW_H
+
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "deduplication.h"
+
+using namespace std;
+
+//how PackageView::copy_to(...) moves bytes, it steps down on a file system which refuses one
+#define PKG_COPY_WRITE 0 // write(2) from the mapping
+#define PKG_COPY_SENDFILE 1
+#define PKG_COPY_RANGE 2 // copy_file_range(2)
+
+/*nr values of T at base: the sections of a package are not aligned, a value
+  is copied out by operator[]*/
+template <class T>
+struct PkgSpan{
+    const char *base;
+    unsigned int nr;
+
+    T operator[](const unsigned int i) const
+    {
+        T value;
+        memcpy(&value, base + (size_t)i * sizeof(T), sizeof(T));
+        return value;
+    }
+};
+
+//a file entry where it lies in the mapping
+typedef struct _pkg_file_view{
+    D_File_Entry entry;
+    const char *name; // fname_len bytes, not terminated
+    PkgSpan<block_id_t> blocks;
+    const char *last_block; // last_block_sz bytes
+} D_File_View;
+
+/* A read-only view of a package: the whole package is mapped and open()
+   locates the header, the runs of logic block entries and of file entries,
+   the removed file entries and the container table once; the readers
+   (extract, list, stat) take every entry and block where it lies, without a
+   seek and a read of their own. The offsets of the file entries are found
+   by the first file(...), a path is found by the path index alone.
+   A view is not updated: it is for packages no insert_files(...) or
+   remove_files(...) changes meanwhile.
+*/
+class PackageView
+{
+    public:
+        PackageView();
+        virtual ~PackageView();
+        int open(const char *pkg_name);
+        void close();
+
+        const D_Package_Header& header() const { return pkg_hdr; }
+        uint64_t size() const { return map_len; }
+        //len bytes at offset, 0: not inside the package
+        const char* at(const uint64_t offset, const uint64_t len) const;
+        //offset of p, which at(...) returned
+        uint64_t offset(const char *p) const { return p - map_addr; }
+        /*len bytes at offset to des_fd at dest_off, copied by the kernel
+          without passing through a buffer of ours*/
+        int copy_to(const int des_fd, const uint64_t offset, const uint64_t len, const uint64_t dest_off) const;
+
+        //false: no such block
+        bool lbentry(const block_id_t id, D_Logic_Block_Entry &lbentry) const;
+        //bytes of block id when restored, from its slot or logic block entry; 0: no such block
+        unsigned int block_len(const block_id_t id) const;
+        /*the slot of block id and the offset of its bytes as stored, nothing
+          read ahead; a block in no container gets a slot from its logic block entry*/
+        bool stored(const block_id_t id, D_Container_Slot &slot, uint64_t &offset) const;
+        //ask the kernel to read [offset, offset + len) ahead, in one request
+        void willneed(const uint64_t offset, const uint64_t len) const;
+        unsigned int files_nr() const { return pkg_hdr.files_nr; }
+        bool file_removed(const unsigned int i) const;
+        int file(const unsigned int i, D_File_View &fv) const;
+
+        //false: an older package, find the files by file(...)
+        bool has_path_index() const { return 0 != pkg_hdr.pathidx_offset; }
+        //runs of the path index, the newest last
+        unsigned int path_runs_nr() const { return path_runs.nr; }
+        unsigned int paths_nr(const unsigned int r) const { return r < path_runs.nr ? path_runs[r].nr : 0; }
+        //the first entry of run r not less than the len bytes of path, paths_nr(r): none
+        unsigned int find_path(const unsigned int r, const char *path, const unsigned int len) const;
+        //the file entry of the k-th entry of run r
+        int path_file(const unsigned int r, const unsigned int k, D_File_View &fv) const;
+        //the file entry of path, from the newest run listing it; false: none
+        bool find_file(const char *path, const unsigned int len, D_File_View &fv) const;
+        //the file entry at fentry_offset, e.g. one another view of the package found
+        int file_at(const uint64_t fentry_offset, D_File_View &fv) const;
+        /*the slot of block id and its bytes as stored, the kernel is asked to
+          read ahead the whole container; false: the block is in no container*/
+        bool slot(const block_id_t id, D_Container_Slot &slot, const char *&data) const;
+
+    private:
+        int locate_files() const;
+        //the entries of the r-th run of the path index
+        PkgSpan<D_Path_Entry> path_run(const unsigned int r) const;
+
+    private:
+        int fd;
+        char *map_addr;
+        uint64_t map_len;
+        D_Package_Header pkg_hdr;
+        D_Extent one_run[3]; // a package without extent table has a run each at ldata_offset, mdata_offset and pathidx_offset
+        PkgSpan<D_Extent> ldata_runs;
+        PkgSpan<D_Extent> mdata_runs;
+        PkgSpan<unsigned int> dead_files;
+        PkgSpan<D_Container> containers;
+        PkgSpan<D_Extent> path_runs;
+        mutable vector<uint64_t> fentry_off; // offset of every file entry, once located
+        mutable bool located;
+        mutable int last_cont; // the container read ahead last
+        mutable int copy_mode; // PKG_COPY_*
+};
+
+#endif // PACKAGEVIEW_H
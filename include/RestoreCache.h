@@ -0,0 +1,61 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef RESTORECACHE_H
+#define RESTORECACHE_H
+
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+/* A cache of decoded blocks for extraction, least recently used first out:
+   the blocks many files share are decoded once and copied from memory
+   afterwards. It holds at most capacity bytes of block data; what to put
+   into it is up to the caller (see Dedupe::restore_block). The threads of
+   a parallel extraction share one cache, a block is copied out under the lock.
+*/
+class RestoreCache
+{
+    public:
+        RestoreCache(uint64_t capacity);
+        virtual ~RestoreCache();
+
+        //the len bytes of block id copied to buf, false: not cached
+        bool get(const uint32_t id, char *buf, unsigned int &len);
+        //a copy of block id, the least recently used blocks make room; -1: larger than the cache
+        int put(const uint32_t id, const char *data, const unsigned int len);
+        void clear();
+
+        uint64_t hits() const { return hit_nr; }
+        uint64_t lookups() const { return lookup_nr; }
+        uint64_t size() const { return used; }
+
+    private:
+        typedef struct _cache_entry{
+            uint32_t id;
+            unsigned int len;
+            char *data;
+        } Entry;
+
+        uint64_t capacity;
+        uint64_t used;
+        list<Entry> lru; // most recently used first
+        map<uint32_t, list<Entry>::iterator> index;
+        uint64_t hit_nr;
+        uint64_t lookup_nr;
+        pthread_mutex_t lock;
+};
+
+#endif // RESTORECACHE_H
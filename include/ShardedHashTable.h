@@ -0,0 +1,59 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef SHARDEDHASHTABLE_H
+#define SHARDEDHASHTABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "BigHashTable.h"
+#include "hashfunc.h"
+
+#define SHT_DEFAULT_SHARDS 16
+#define SHT_MAX_SHARDS 1024
+
+/* A BigHashTable for concurrent ingest threads: the key space is partitioned
+   across shards_nr independent BigHashTables, each one with its own HashDB
+   file, bloom filter and entry cache, and its own mutex. Threads working on
+   keys of different shards never wait for each other, and a batch locks each
+   shard it touches only once.
+*/
+class ShardedHashTable
+{
+    public:
+        //name == 0: every shard gets a temporary name, as BigHashTable does
+        ShardedHashTable(const unsigned int shards_nr = SHT_DEFAULT_SHARDS, const char *name = 0);
+        virtual ~ShardedHashTable();
+
+        void insert(const void *key, const void *data, const int datasz);
+        void* getvalue(const void *key, int &valuesize);
+        //copy the value into buf of HASHDB_VALUE_MAX_SZ bytes; a borrowed view is not
+        //offered, it would not outlive the shard lock
+        bool getvalue(const void *key, void *buf, int &valuesize);
+        bool contain(const void *key);
+        //insert key only if it does not exist yet, as one step for concurrent threads:
+        //return 1 if inserted, 0 if key exists (its value is returned in *value if value != 0)
+        int insertnew(const void *key, const void *data, const int datasz, void **value = 0, int *valuesize = 0);
+
+        void batchinsert(const void **keys, const void **datas, const int *datasizes, const int nr);
+        int batchgetvalue(const void **keys, const int nr, void **values, int *valuesizes);
+
+        unsigned int shard(const void *key) const;
+        unsigned int shards() const { return shards_nr; }
+
+    private:
+        unsigned int shards_nr;
+        BigHashTable **tables;
+        pthread_mutex_t *locks;
+};
+
+#endif // SHARDEDHASHTABLE_H
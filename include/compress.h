@@ -0,0 +1,73 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef COMPRESS_H_INCLUDED
+#define COMPRESS_H_INCLUDED
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** A byte oriented LZ77 codec in the manner of LZ4 for the unique blocks:
+    a sequence is a token (literal length << 4 | match length - LZ_MIN_MATCH),
+    the extra length bytes of the literals, the literals, a 2-byte offset into
+    the last 64KB and the extra length bytes of the match; the last sequence
+    has literals only. Level 1 tries one earlier position per 4-byte hash,
+    level 2 walks a chain of LZ_HC_DEPTH of them for longer matches.
+**/
+#define CODEC_NONE 0 //stored as is
+#define CODEC_LZ   1
+#define CODEC_DELTA 2 //LZ with another block, the base, as dictionary
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HC_DEPTH 16
+#define LZ_LEVEL_FAST 1
+#define LZ_LEVEL_HIGH 2
+
+//the compressed length, 0: it would not fit into cap bytes
+unsigned int lz_compress(const char *src, unsigned int len, char *dst, unsigned int cap, int level);
+//the decompressed length, -1: src is corrupt or does not decompress into cap bytes
+int lz_decompress(const char *src, unsigned int len, char *dst, unsigned int cap);
+
+/** order-0 entropy of a sample of the bytes, above LZ_ENTROPY_MAX bits per
+    byte the block is taken as compressed already (media, archives) and is
+    not given to lz_compress
+**/
+#define LZ_SAMPLE_NR 512
+#define LZ_ENTROPY_MAX 7.2
+bool lz_incompressible(const char *src, unsigned int len);
+
+/*a delta is an LZ stream of src which starts after base: its matches
+  reach back into base as into the bytes decoded before them, the first
+  64KB before a position only*/
+unsigned int lz_delta_encode(const char *base, unsigned int base_len, const char *src, unsigned int len,
+                             char *dst, unsigned int cap, int level);
+int lz_delta_decode(const char *base, unsigned int base_len, const char *src, unsigned int len,
+                    char *dst, unsigned int cap);
+
+/** super features for resemblance detection: a gear hash rolls over the
+    block, and at the positions where it has SF_SAMPLE_MASK bits clear each
+    of SF_FEATURE_NR linear transforms of it is maximized; the features are
+    hashed in groups of SF_GROUP_NR into SF_SUPER_NR super features. Two
+    blocks sharing a super feature are likely to differ in a few bytes only.
+**/
+#define SF_FEATURE_NR 12
+#define SF_GROUP_NR 4
+#define SF_SUPER_NR (SF_FEATURE_NR / SF_GROUP_NR)
+#define SF_SAMPLE_MASK 0x7
+#define SF_MIN_LEN 256
+//false: the block is too small, or too uniform, to have features
+bool super_features(const char *src, unsigned int len, uint64_t sf[SF_SUPER_NR]);
+
+//raw_len bytes of a block stored with codec into dst, -1: error; not for CODEC_DELTA
+int decode_block(unsigned int codec, const char *src, unsigned int len, char *dst, unsigned int raw_len);
+
+#endif // COMPRESS_H_INCLUDED
@@ -13,24 +13,32 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <map>
+#include <set>
 
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <utime.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "hashfunc.h"
 #include "RabinHash.h"
 #include "checksum.h"
+#include "compress.h"
 #include "MD5.h"
 
 #include "BigHashTable.h"
+#include "BlockIndex.h"
 #include "ListDB.h"
+#include "MappedListDB.h"
 #include "utils.h"
 #include "FileType.h"
 
@@ -55,7 +63,12 @@ typedef unsigned int block_id_t;
 #define PATH_MAX_LEN 255
 #endif //PATH_MAX_LEN
 
-#define DEDUP_MAGIC_NUM 0x160427
+/*the layout of runs: the sections listed by the extent table, the filters
+  of the fingerprint runs and the sections offset. Packages of the first
+  layout, DEDUP_MAGIC_NUM_160427, are not readable: extract them with a
+  build of that layout and insert the files into a new package*/
+#define DEDUP_MAGIC_NUM 0x161201
+#define DEDUP_MAGIC_NUM_160427 0x160427
 typedef struct _dedup_package_header{
     unsigned int magic_nr; //magic number for package header
     unsigned int files_nr;  //ô洢ϵͳļ
@@ -67,13 +80,167 @@ typedef struct _dedup_package_header{
 
     unsigned long long ldata_offset; // the offset of logic blocks
     unsigned long long mdata_offset; // the offset of file metadata
+
+    unsigned long long bindex_offset; // the offset of the newest run of the fingerprint index
+    unsigned long long csum_offset;   // the offset of the newest run of block checksums
+    unsigned int bindex_nr; // fingerprint index entries of every run
+    unsigned int csum_nr;   // distinct block checksums of every run
+
+    unsigned long long cfilter_offset; // the offset of the filter of the newest fingerprint index run
+    unsigned long long cfilter_len;    // bytes of the filters of every run, 0: the package has no fingerprint filter
+
+    unsigned long long refcnt_offset; // the offset of the newest run of block reference counts
+    unsigned int refcnt_nr; // the runs hold one uint32 count per unique block, otherwise the counts are rebuilt from the file metadata
+
+    unsigned int ldata_extents_nr; // runs of logic block entries in the extent table
+    unsigned int mdata_extents_nr; // runs of file entries in the extent table, after the logic block runs
+    unsigned long long extent_offset; // 0: no extent table, one run each at ldata_offset and mdata_offset
+
+    unsigned long long free_offset; // the offset of the free extent table
+    unsigned long long free_len;    // bytes of the free extents
+    unsigned int free_nr;    // entries of the free extent table
+    unsigned int dblocks_nr; // unique blocks released in place, their ids are not used again
+    unsigned long long dfiles_offset; // the offset of the numbers of the file entries removed in place
+    unsigned int dfiles_nr;  // file entries removed in place, files_nr counts them still
+
+    unsigned long long container_offset; // the offset of the container table
+    unsigned int containers_nr; // 0: the unique blocks are in no container
+
+    unsigned long long zblocks_len; // bytes the unique blocks take in the package, ublocks_len before compression
+
+    unsigned long long simidx_offset; // the offset of the newest run of the similarity index
+    unsigned int simidx_nr; // entries of every run of the similarity index
+    unsigned int delta_nr;  // unique blocks stored as deltas
+    unsigned long long delta_saved; // bytes the deltas save, counted in ublocks_len - zblocks_len
+
+    unsigned long long pathidx_offset; // the offset of the newest run of the path index, 0: the package has none
+    unsigned int pathidx_nr; // entries of every run of the path index
+
+    unsigned int pathidx_runs_nr; // runs of the path index in the extent table, after the file entry runs; 0: one at pathidx_offset
+    unsigned int simidx_runs_nr;  // runs of the similarity index in the extent table, after the path index runs; 0: one at simidx_offset
+    unsigned int bindex_runs_nr;  // runs of the fingerprint index, after the similarity index runs; 0: one at bindex_offset
+    unsigned int csum_runs_nr;    // runs of block checksums, after the fingerprint index runs; 0: one at csum_offset
+    unsigned int refcnt_runs_nr;  // runs of reference counts, after the checksum runs; 0: one at refcnt_offset
+    unsigned long long sections_offset; // where the index sections written by the last operation start
 } D_Package_Header;
 #define D_PKG_HDR_SZ (sizeof(D_Package_Header))
 
+/*insert_files(...) appends to the package instead of rewriting it:
+    [header][unique blocks, index sections of earlier insertions ...]
+    [containers of new unique blocks][new logic block entries][new file entries]
+    [fingerprint index run][its filter][checksum run][reference count runs]
+    [container table][similarity index run][path index run][extent table]
+  and writes the header last, so the package keeps its former sections until
+  the header points at the new ones. The logic block entries and the file
+  entries of every insertion are one run each in the extent table; the index
+  sections left behind, but the index runs still listed, become free extents
+  once the header is written. No index section is written whole again: the
+  entries of an insertion are one more run of the fingerprint index (with
+  its filter, see BlockIndex.h), of the checksums, of the similarity index
+  and of the path index, merged with the newest runs smaller than
+  DEDUP_RUNS_RATIO times the merged run, so an entry is rewritten O(log
+  entries) times. The reference counts changed, in chunks of
+  DEDUP_REFCNT_CHUNK blocks, and those of the new blocks are one more run
+  too, a later run overriding the earlier ones; once the runs hold
+  DEDUP_RUNS_RATIO times the counts of the package, they are written as one
+  run again. The runs are listed in the extent table after the file entry
+  runs, in the order of the header fields.
+*/
+typedef struct _dedup_extent{
+    unsigned long long offset; // the offset of the run in the package
+    unsigned int first; // block id of the first logic block entry or reference count, number of the first file entry, or of the first index entry
+    unsigned int nr;    // entries of the run
+} D_Extent;
+#define D_EXTENT_SZ (sizeof(D_Extent))
+#define DEDUP_RUNS_RATIO 2
+#define DEDUP_REFCNT_CHUNK 1024 //reference counts written again when one of them changes
+
+/*remove_files(...) in place (see Dedupe::set_remove_inplace) rewrites nothing
+  but the index sections: the removed file entries stay where they are and
+  their numbers are listed at dfiles_offset, the blocks no file refers to any
+  more keep their ids, with REFCNT_RELEASED as reference count, and their
+  bytes are punched out of the package as free extents. The free extent table
+  (after the extent table) is where the next insertions put new blocks before
+  appending them. Once the free extents exceed REMOVE_COMPACT_PCT percent of
+  the unique blocks and free extents, the package is compacted as before.
+*/
+typedef struct _dedup_free_extent{
+    unsigned long long offset;
+    unsigned long long len;
+} D_Free_Extent;
+#define D_FREE_EXTENT_SZ (sizeof(D_Free_Extent))
+#define REFCNT_RELEASED 0xFFFFFFFF
+#define REMOVE_COMPACT_PCT 50
+
+/*the unique blocks are packed into containers of at most DEDUP_CONTAINER_SZ
+  bytes, appended or put into a free extent of at least DEDUP_CONTAINER_MIN:
+    [D_Container_Header][block data ...][D_Container_Slot of every block]
+  The blocks of a container have consecutive ids, so block id maps to
+  (container, slot) by the container table alone: extraction reads a whole
+  container at once (see PackageView::slot), and the sampled block index
+  prefetches the fingerprints of a container from its slot table. The logic
+  block entries keep the offsets of the blocks for the other readers.
+*/
+typedef struct _dedup_container_header{
+    unsigned int magic;
+    unsigned int nr;       // blocks of the container, slots of the slot table
+    unsigned int first;    // block id of the first block
+    unsigned int data_len; // bytes of block data, the slot table follows them
+} D_Container_Header;
+#define D_CONTAINER_HDR_SZ (sizeof(D_Container_Header))
+
+typedef struct _dedup_container_slot{
+    unsigned char md5[16];
+    unsigned int offset; // from the start of the container
+    unsigned int len;    // as stored
+    unsigned int raw_len;
+    unsigned int codec;  // CODEC_*, see compress.h
+    unsigned int base;   // the base block of a CODEC_DELTA block
+} D_Container_Slot;
+#define D_CONTAINER_SLOT_SZ (sizeof(D_Container_Slot))
+
+//an entry of the container table
+typedef struct _dedup_container{
+    unsigned long long offset;
+    unsigned int first;
+    unsigned int nr;
+    unsigned int data_len;
+    unsigned int reserved;
+} D_Container;
+#define D_CONTAINER_SZ (sizeof(D_Container))
+#define DEDUP_CONTAINER_MAGIC 0xC0161101
+#define DEDUP_CONTAINER_SZ 4194304 //4MB
+#define DEDUP_CONTAINER_MIN 65536 //smaller free extents are left to compaction
+
+//a block is stored compressed if that saves 1/COMPRESS_MIN_GAIN of it
+#define COMPRESS_MIN_GAIN 8
+
+/*with Dedupe::set_similarity(...) a new block that shares a super feature
+  (see compress.h) with a stored one, the base, is tried as a delta against
+  it. The base always has a smaller id, so a chain of deltas has no cycle,
+  and it ends after at most DELTA_MAX_DEPTH deltas. A delta holds one
+  reference to its base: the base is released with its last delta.
+  A run of the similarity index maps super features to the blocks having
+  them, sorted by super feature then block id; a newer run holds greater
+  block ids.
+*/
+typedef struct _dedup_sim_entry{
+    uint64_t sf;
+    block_id_t id;
+    unsigned int reserved;
+} D_Sim_Entry;
+#define D_SIM_ENTRY_SZ (sizeof(D_Sim_Entry))
+#define DELTA_MAX_DEPTH 4
+#define DELTA_DEPTH_LIMIT 16
+
 typedef struct _dedup_logic_block_entry{
     unsigned long long ublock_off; //the offset of the unique block in the deduped package
     unsigned int ublock_len;
     unsigned char block_md5[33];
+    unsigned char codec; //CODEC_*, see compress.h
+    unsigned char depth; //deltas up to a block stored whole, 0 unless CODEC_DELTA
+    unsigned int zblock_len; //the bytes stored at ublock_off
+    block_id_t base_id; //the base of a CODEC_DELTA block
 } D_Logic_Block_Entry;
 #define D_LOGIC_BLOCK_ENTRY_SZ (sizeof(D_Logic_Block_Entry))
 
@@ -90,6 +257,74 @@ typedef struct _dedup_file_entry{
 } D_File_Entry;
 #define D_FILE_ENTRY_SZ (sizeof(D_File_Entry))
 
+/*a run of the path index lists file entries not removed sorted by their
+  path names, compared as bytes; the names stay in the file entries. A path
+  inserted again is in the newest run having it with its last file entry,
+  the one extraction leaves behind, an older run may still list the former
+  one. Every insertion appends the paths it added as a run, so a file or a
+  directory is found by a binary search of each run instead of a scan of
+  the file entries (see PackageView::find_file).
+*/
+/*Dedupe::read_file(...) keeps the package mapped from one call to the next
+  and, for every file it reads, a sparse seek index: the offset in the file
+  of every DEDUP_SEEK_STRIDE-th block, taken from the block lengths in the
+  slot tables. A read starts at the nearest of them and decodes no block
+  but those holding the bytes asked for.
+*/
+#define DEDUP_SEEK_STRIDE 64
+
+/*with Dedupe::set_restore_schedule(...) extraction reads the package in
+  offset order rather than file order: the blocks of a batch of files, at
+  most DEDUP_SCHED_FILES files and batch_blocks blocks, are sorted by where
+  they are stored, the ones less than DEDUP_SCHED_GAP bytes apart are read
+  ahead as one run, and every block is written to its offset in its file.
+  A file may span batches, it stays open until its last block is written.
+*/
+typedef struct _dedup_fetch{
+    unsigned long long pkg_off;  // of the block as stored
+    unsigned long long dest_off; // in the extracted file
+    unsigned int file; // of the batch
+    block_id_t id; // DEDUP_FETCH_LAST: the last block of the file entry
+    unsigned int len; // as stored
+    unsigned int raw_len;
+    unsigned int codec;
+} D_Fetch;
+#define DEDUP_FETCH_LAST 0xFFFFFFFF
+#define DEDUP_SCHED_BLOCKS 65536
+#define DEDUP_SCHED_FILES 256
+#define DEDUP_SCHED_GAP 65536
+#define DEDUP_SCHED_RUN 8388608 //8MB, read ahead at most at once
+
+/*extraction keeps the decoded blocks the extracted files refer to at least
+  DEDUP_CACHE_MIN_REFS times in a RestoreCache of Dedupe::set_restore_cache(...)
+  bytes; the blocks stored whole are read from the mapping anyway*/
+#define DEDUP_RESTORE_CACHE 33554432 //32MB
+#define DEDUP_CACHE_MIN_REFS 2
+
+/*with Dedupe::set_restore_threads(...) extraction runs a pool of threads,
+  each with a PackageView of its own, which take the files one at a time; a
+  file of more than DEDUP_RESTORE_SPLIT blocks is cut into ranges of that
+  many blocks, written with pwrite by whichever threads take them. The
+  directories are made once each and the files cut into ranges created
+  before the threads start.
+*/
+typedef struct _dedup_restore_unit{
+    unsigned long long fentry_off; // of the file entry, the same in every view
+    unsigned long long dest_off; // of block first in the extracted file
+    unsigned int file; // of the files extracted
+    unsigned int first; // blocks [first, end) of the file, fblocks_nr + 1: up to the last block
+    unsigned int end;
+} D_Restore_Unit;
+#define DEDUP_RESTORE_SPLIT 4096
+#define DEDUP_RESTORE_THREADS_MAX 64
+
+typedef struct _dedup_path_entry{
+    unsigned long long offset; // the offset of the file entry
+    unsigned int file; // number of the file entry
+    unsigned int reserved;
+} D_Path_Entry;
+#define D_PATH_ENTRY_SZ (sizeof(D_Path_Entry))
+
 //deduplication operations
 enum DEDUP_OPERATIONS{
     DEDUP_CREAT = 0,
@@ -111,6 +346,10 @@ enum D_CHUNK_ALG{
     D_CHUNK_SB,
     D_CHUNK_AAC
 };
+
+//backends of the table of new fingerprints, see BlockIndex.h
+#define INDEX_HASHDB_NAME "HashDB"
+#define INDEX_LSM_NAME "LSM" //sequential writes, for insert heavy first backups
 //#define CHUNK_CDC_D 4096  //cdc divisor
 //#define CHUNK_CDC_R 13   //CDC ķֽ細ڵĹϣֵ (hashvalue(chunk win_buf) % CHUNK_CDC_D)
 
@@ -145,6 +384,36 @@ static const D_CDC_hashfun CDC_HASHFUN[] =
 //magic file name for temporary files
 #define MAGIC_TMP_FILE_NAME "DCBA123TMP"
 
+/*shares (in percent) of the memory budget set by Dedupe::set_memory_budget(...)*/
+#define MEM_INDEX_PCT 40 //cached HashDB entries, hooks and new entries of the block index
+/*not bounded by the budget: the fingerprint filters of the runs and the LSM
+  fences (bytes per run, see memory_usage(...)), the checksums of the new SB
+  blocks and the removed fingerprints (4 and 24 bytes per block until the
+  package is written), and the mapped runs (page cache)*/
+#define MEM_BLOOM_PCT 10 //bloom filters of the HashDBs
+#define MEM_BLOCK_PCT 30 //prefetched logic blocks of the sampled index
+#define MEM_IO_PCT    20 //copy buffer
+#define MEM_BUDGET_MIN 4194304 //4MB
+#define MEM_IO_BUF_MIN 65536 //64KB
+#define MEM_IO_BUF_MAX 67108864 //64MB
+
+
+class PackageView;
+class RestoreCache;
+typedef struct _pkg_file_view D_File_View;
+class Dedupe;
+
+//what the threads of a parallel extraction share, under lock
+typedef struct _dedup_restore_job{
+    Dedupe *dedupe;
+    const char *pkg_name;
+    char *dest_dir;
+    vector<D_Restore_Unit> units;
+    vector<unsigned int> left; // units of each file not written yet
+    unsigned int next; // the unit taken next
+    int ret; // -1: a thread failed, the others stop
+    pthread_mutex_t lock;
+} D_Restore_Job;
 
 class Dedupe{
 
@@ -154,11 +423,33 @@ public:
 
     int set_chunk_alg(const char *cname);
     int set_cdc_hashfun(const char *hashfunc_name);
+    //sample_bits > 0: sampled block index, see BlockIndex.h
+    int set_index_sampling(unsigned int sample_bits, unsigned int prefetch_nr = BINDEX_PREFETCH_NR);
+    int set_index_backend(const char *name);
+    //keep a fingerprint filter of every fingerprint index run in the package, see BlockIndex::openfilter
+    int set_index_filter(bool on);
+    //remove files without rewriting the package, compact it past compact_pct percent free space
+    int set_remove_inplace(bool on, unsigned int compact_pct = REMOVE_COMPACT_PCT);
+    //compress the new unique blocks, level: 0 (none), LZ_LEVEL_FAST or LZ_LEVEL_HIGH
+    int set_compression(int level);
+    //store near duplicate blocks as deltas, in chains of at most max_depth
+    int set_similarity(bool on, unsigned int max_depth = DELTA_MAX_DEPTH);
+    //extract in package offset order, batch_blocks blocks at a time
+    int set_restore_schedule(bool on, unsigned int batch_blocks = DEDUP_SCHED_BLOCKS);
+    //bytes of decoded blocks kept while extracting, 0: none
+    int set_restore_cache(unsigned long long bytes);
+    //extract with threads threads, 0 or 1: in this thread
+    int set_restore_threads(unsigned int threads);
+    //bytes == 0: default sizes; call before insert_files/remove_files
+    int set_memory_budget(unsigned long long bytes);
+    unsigned long long memory_usage(bool show = false);
     int create_package(const char *pkg_name);
 
     int insert_files(const char *pkg_name, int files_nr, char **src_files);
     int remove_files(const char *pkg_name, int files_nr, char **files_remove);
     int extract_all_files(const char *pkg_name, int files_nr, char **files_extract, char *dest_dir);
+    //up to len bytes of file path from offset into out, return the bytes read, -1: error
+    long long read_file(const char *pkg_name, const char *path, unsigned long long offset, unsigned int len, char *out);
 
     int show_pkg_header(const char *pkg_name);
     int show_package_files(const char *pkg_name);
@@ -168,6 +459,10 @@ private:
     void clean_tmpfiles();
     int blocks_cmp(char *buf, unsigned int len,
               fstream &ldata_file, fstream &bdata_file, unsigned int block_id);
+    //the logic block entry of block id, from ldata_file past d_ldata_base
+    int load_lbentry(fstream &ldata_file, fstream &bdata_file, block_id_t id, D_Logic_Block_Entry &lbentry);
+    //the ublock_len bytes of a block into buf, its delta chain resolved
+    int load_block(fstream &ldata_file, fstream &bdata_file, const D_Logic_Block_Entry &lbentry, char *buf);
     int register_block(char *block_buf, unsigned int block_len, unsigned char *md5val,
                        fstream &ldata_file, fstream &bdata_file,
                        unsigned int &blocks_count, unsigned int &meta_cap, block_id_t * &metadata);
@@ -189,15 +484,116 @@ private:
     int register_dir(char *fullpath, int prepos, fstream &ldata_file, fstream &bdata_file, fstream &mdata_file);
 
     int prepare_insert(ifstream &pkg_file, fstream &ldata_file, fstream &bdata_file, fstream &mdata_file);
-
-    int extract_file(ifstream &pkg_file, D_File_Entry fentry, char *dest_dir);
+    int remove_files_inplace(const char *pkg_name, int files_nr, char **files_remove, bool &compact);
+    BlockIndex* new_block_index(const D_Package_Header &pkg_hdr);
+    BigHashTable* new_pathname_table(const uint64_t tnum, const uint32_t cnum);
+    int load_refcnt(istream &pkg_file, const D_Package_Header &pkg_hdr, MappedListDB *refcnt);
+    /*append the counts of the chunks refcnt_dirty(...) marked and of the blocks
+      added since as runs of d_refcnt_ext, or every count as one run*/
+    int write_refcnt(ostream &des_file, MappedListDB *refcnt);
+    //the counts of ids changed, written again by write_refcnt(...)
+    void refcnt_dirty(const block_id_t *ids, unsigned int nr);
+    //openindex(...), and openfilter(...) if the package has filters or d_index_filter asks for them
+    int open_bindex(BlockIndex *bindex, const char *pkg_name, const D_Package_Header &pkg_hdr, const BINDEX_SEQ *seq);
+    //append the runs of bindex into d_bindex_ext and d_csum_ext
+    int write_bindex(ostream &des_file, BlockIndex *bindex);
+    int load_extents(istream &pkg_file, const D_Package_Header &pkg_hdr);
+    int write_extents(ostream &des_file);
+    int write_containers(ostream &des_file);
+    //put block id, lbentry.zblock_len bytes as stored, into the open container; sets lbentry.ublock_off
+    int container_add(fstream &bdata_file, const char *block_buf, D_Logic_Block_Entry &lbentry, block_id_t id);
+    int container_close(fstream &bdata_file);
+    //block id in the mapping or decoded into buf, see PackageView
+    int read_block(const PackageView &view, block_id_t id, char *buf, const char *&data, unsigned int &len);
+    //read_block(...) through d_rcache, data is in the mapping or in buf as well
+    int restore_block(const PackageView &view, block_id_t id, char *buf, const char *&data, unsigned int &len);
+    //the delta src of len bytes against block base into buf
+    int undelta_block(const PackageView &view, block_id_t base, const char *src, unsigned int len,
+                      char *buf, unsigned int raw_len);
+    //compress block_buf into d_zbuf unless it does not pay, return the codec
+    unsigned char pack_block(const char *block_buf, unsigned int block_len, unsigned int &len);
+    //0: block_buf went into d_dbuf as a delta, lbentry is set; 1: no base, or no gain; -1: error
+    int delta_block(const char *block_buf, unsigned int block_len, const uint64_t *sf,
+                    fstream &ldata_file, fstream &bdata_file, D_Logic_Block_Entry &lbentry);
+    bool sim_lookup(const uint64_t *sf, block_id_t &base);
+    //the runs of d_sim_ext into d_sim, one after the other
+    int load_simindex(istream &pkg_file, const D_Package_Header &pkg_hdr);
+    /*append: d_sim_new as a run, merged with the newest runs; otherwise d_sim
+      and d_sim_new as one run, without the blocks refcnt has released*/
+    int write_simindex(ostream &des_file, MappedListDB *refcnt, bool append);
+    //d_view maps pkg_name, again if the package changed
+    int open_view(const char *pkg_name);
+    void drop_view();
+    //offsets of every DEDUP_SEEK_STRIDE-th block of file fv in d_view, then of its last block; 0: error
+    const vector<unsigned long long>* seek_index(const D_File_View &fv);
+    //offset: of the file entry, from mdata_offset if file >= d_mdata_base
+    void index_path(const char *pathname, unsigned int len, unsigned long long offset, unsigned int file);
+    /*pkg_file: d_paths as a run, merged with the newest runs read from pkg_file;
+      0: d_paths holds every path of the package, one run replaces the others*/
+    int write_pathindex(ostream &des_file, istream *pkg_file);
+    //the index sections [offset, end) but the runs still listed, and the runs replaced outside it
+    void release_sections(unsigned long long offset, unsigned long long end);
+    unsigned long long lblock_offset(block_id_t id) const;
+    //offset of the i-th file entry, offset: the end of the (i-1)-th one
+    unsigned long long fentry_offset(unsigned int i, unsigned long long offset) const;
+    bool file_removed(unsigned int i) const;
+    //offset of min_len up to len bytes in a free extent, len: the bytes granted; 0: append them
+    unsigned long long alloc_free(unsigned int min_len, unsigned int &len);
+    //free [offset, offset + len) once the header no longer points at it
+    void release_free(unsigned long long offset, unsigned long long len);
+    int punch_released(const char *pkg_name);
+
+    //the file entry fv of view, buf: BUF_MAX_SIZE bytes for the blocks to decode
+    int extract_file(const PackageView &view, const D_File_View &fv, char *dest_dir, char *buf);
+    //the files files_extract name, or the files below them, found by the path index of view
+    int find_indexed_files(const PackageView &view, int files_nr, char **files_extract, vector<D_File_View> &found);
+    int extract_scheduled(const PackageView &view, const vector<D_File_View> &files, char *dest_dir, char *buf);
+    /*blocks [first, end) of fv to des_fd from dest_off, end == fblocks_nr + 1
+      writes the last block too; the runs stored whole are copied by the kernel*/
+    int write_blocks(const PackageView &view, const D_File_View &fv, unsigned int first, unsigned int end,
+                     int des_fd, unsigned long long dest_off, char *buf);
+    int extract_parallel(const PackageView &view, const vector<D_File_View> &files, const char *pkg_name, char *dest_dir);
+    static void* restorethread(void *arg);
+    int restore_worker(D_Restore_Job *job);
+    int restore_unit(const PackageView &view, D_Restore_Job *job, const D_Restore_Unit &unit, char *buf);
 
 private:
 
     D_Package_Header d_pkg_hdr;
     BigHashTable *d_htab_pathname; //hashtable for path names
-    BigHashTable *d_htab_sb_csum; //hashtable for SB file chunking
-    BigHashTable *d_htab_bindex; // hashtable for chunking blocks index
+    BlockIndex *d_bindex; // blocks index by md5, and block checksums for SB file chunking
+    MappedListDB *d_refcnt; // reference count of every unique block, while inserting
+    vector<D_Extent> d_ldata_ext; // runs of logic block entries of the package, see load_extents(...)
+    vector<D_Extent> d_mdata_ext; // runs of file entries
+    vector<D_Extent> d_path_ext; // runs of the path index, oldest first
+    vector<D_Extent> d_sim_ext;  // runs of the similarity index, first: where the run starts in d_sim
+    vector<D_Extent> d_bindex_ext; // runs of the fingerprint index, oldest first
+    vector<D_Extent> d_csum_ext; // runs of block checksums
+    vector<D_Extent> d_refcnt_ext; // runs of reference counts, first: the block id of the first count
+    vector<D_Free_Extent> d_bindex_live; // the bytes of the runs of d_bindex_ext and d_csum_ext, filters included
+    vector<bool> d_refcnt_dirty; // chunks of DEDUP_REFCNT_CHUNK counts changed by this operation
+    unsigned int d_refcnt_base; // the runs of d_refcnt_ext hold the counts of ids [0, d_refcnt_base)
+    vector<D_Free_Extent> d_stale_ext; // index runs replaced by this operation
+    unsigned int d_ldata_base; // the first block id added by this insertion, its entries are in d_ldata_name
+    unsigned int d_mdata_base; // the first file entry added by this insertion
+    vector<D_Free_Extent> d_free_ext; // free extents of the package
+    vector<D_Free_Extent> d_punch_ext; // released by this operation, punched after the header is written
+    unsigned int d_free_next; // where alloc_free(...) looks first
+    unsigned int d_free_fail; // no free extent holds this many bytes
+    vector<unsigned int> d_dead_files; // sorted numbers of the file entries removed in place
+    vector<D_Container> d_containers; // the container table, by first block id
+    D_Container d_cont; // the open container
+    vector<D_Container_Slot> d_cont_slots;
+    unsigned int d_cont_room; // bytes the open container may take, 0: none open
+    bool d_cont_free; // the open container is in a free extent, otherwise at ldata_offset
+    vector<D_Sim_Entry> d_sim; // the runs of the similarity index of the package
+    map<uint64_t, block_id_t> d_sim_new; // super features of the blocks added by this insertion, the last block of each
+    map<string, D_Path_Entry> d_paths; // the paths added by this operation, or all while the file entries are rewritten
+    PackageView *d_view; // the package read_file(...) reads
+    char d_view_name[PATH_MAX_LEN];
+    struct stat d_view_stat; // of the package when d_view mapped it
+    char *d_view_buf; // BUF_MAX_SIZE bytes for the blocks read_file(...) decodes
+    map<unsigned long long, vector<unsigned long long> > d_seek; // seek indexes of d_view by file entry offset
 
     enum D_CHUNK_ALG d_chunk_alg; //chunking algorithms
     /*CDC chunking Hash Function*/
@@ -209,6 +605,38 @@ private:
     unsigned int d_sb_block_sz; //specify the size of the sliding block
     unsigned int d_fsp_block_sz;
 
+    /*sampled block index parameters*/
+    unsigned int d_sample_bits;
+    unsigned int d_prefetch_nr;
+    int d_index_backend;
+    bool d_index_filter;
+    bool d_remove_inplace;
+    unsigned int d_compact_pct;
+    bool d_restore_sched;
+    unsigned int d_sched_blocks;
+    unsigned long long d_rcache_sz;
+    RestoreCache *d_rcache; // while extracting
+    vector<uint32_t> d_restore_refs; // references of the files extracted to each block
+    unsigned int d_restore_threads;
+
+    /*block compression*/
+    int d_compress_level;
+    char *d_zbuf;
+    unsigned int d_zbuf_sz;
+    unsigned int d_zskip_nr; // blocks taken as incompressible by the entropy test
+    unsigned int d_zfail_nr; // blocks which did not shrink enough
+
+    /*delta compression*/
+    bool d_similarity;
+    unsigned int d_delta_depth;
+    char *d_dbuf;
+    unsigned int d_dbuf_sz;
+    unsigned int d_delta_nr; // blocks stored as deltas by this insertion
+
+    /*memory budget, 0 as default sizes*/
+    unsigned long long d_mem_budget;
+    unsigned int d_io_buf_sz;
+
     bool d_rolling_hash; // default as adler32_rolling
     char d_pkg_name[PATH_MAX_LEN];
     char d_ldata_name[PATH_MAX_LEN];
@@ -226,7 +654,7 @@ private:
 |                                                     |
 |   de-duplicated files' package header               |
 |   ------------------------------------------------  |
-|   unique blocks (physical data)                     |
+|   unique blocks (physical data), in containers      |
 |   ------------------------------------------------  |
 |   logic blocks  (index and length of                |
 |               the unique blocks)                    |
@@ -244,6 +672,15 @@ private:
 |             .                                       |
 |     ----------------------------------------        |
 |     file n metadata                                 |
+|   ------------------------------------------------  |
+|   runs of the fingerprint index (md5, block id),    |
+|   each sorted and followed by its filter            |
+|   ------------------------------------------------  |
+|   runs of adler32 checksums of the unique blocks    |
+|   ------------------------------------------------  |
+|   runs of reference counts, container table,        |
+|   runs of the similarity and path indexes, extent   |
+|   table, free extents, removed file entries         |
 |_____________________________________________________|
 */
 
@@ -28,10 +28,14 @@ int uint2str(unsigned int x, unsigned char *str);
 
 //check whether the file is in file list
 bool is_file_in_list(char *filepath, int files_nr, char **files_list);
+//check whether the file is in file list, or in a directory of it
+bool is_file_under_list(const char *filepath, int files_nr, char **files_list);
 
 //create necessary directories for the target file, open the target file
 //return  the file's full path name
 int prepare_target_file(const char *filename, const char *basepath, char *fullpath);
+//the target file's full path name alone, no directory is created
+void target_file_path(const char *filename, const char *basepath, char *fullpath);
 
 /*get file extention from filename*/
 void get_file_ext(const char *filename, char * &fileext);
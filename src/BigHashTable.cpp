@@ -9,10 +9,11 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 */
 #include "BigHashTable.h"
 
-BigHashTable::BigHashTable(const char *dbname, const char *bfname)
+BigHashTable::BigHashTable(const char *dbname, const char *bfname, const uint64_t tnum, const uint32_t cnum,
+                           const bool md5keys)
 {
-    db = new HashDB(HASHDB_DEFAULT_TNUM, HASHDB_DEFAULT_BNUM, HASHDB_DEFAULT_CNUM,
-        HashFunctions::APHash, HashFunctions::JSHash);
+    db = new HashDB(tnum, HASHDB_DEFAULT_BNUM, cnum,
+        HashFunctions::APHash, HashFunctions::JSHash, md5keys);
     isnewdb = true;
     char hashdb_dbname[PATH_MAX_LEN] = {0};
     char hashdb_bfname[PATH_MAX_LEN] = {0};
@@ -66,21 +67,57 @@ void BigHashTable::insert(const void *key, const void *data, const int datasz)
     */
 }
 
-void* BigHashTable::getvalue(const void *key, int &valuesize)
+const void* BigHashTable::peekvalue(const void *key, int &valuesize)
 {
-    char value[HASHDB_VALUE_MAX_SZ] = {0};
-    void *vp = 0;
-    valuesize = 0;
+    const void *value = 0;
     int datasz = 0, ret = 0;
+    valuesize = 0;
 
-    if (0 != (ret = db->getDB((const char*)key, value, datasz)) ){
+    if (0 != (ret = db->peekDB((const char*)key, &value, datasz)) ){
         if (ret == -1){
-            fprintf(stderr, "Error: HashDB::getDB() in BigHashTable::getvalue()\n");
+            fprintf(stderr, "Error: HashDB::peekDB() in BigHashTable::peekvalue()\n");
             _exit(-1);
         }
         return 0;
     }
+    valuesize = datasz;
+    return value;
+}
+
+bool BigHashTable::getvalue(const void *key, void *buf, int &valuesize)
+{
+    int ret = 0;
+    valuesize = 0;
+    if (0 != (ret = db->getDB((const char*)key, buf, valuesize)) ){
+        if (ret == -1){
+            fprintf(stderr, "Error: HashDB::getDB() in BigHashTable::getvalue()\n");
+            _exit(-1);
+        }
+        valuesize = 0;
+        return false;
+    }
+    return true;
+}
+
+bool BigHashTable::contain(const void *key)
+{
+    int ret = db->containDB((const char*)key);
+    if (ret == -1){
+        fprintf(stderr, "Error: HashDB::containDB() in BigHashTable::contain()\n");
+        _exit(-1);
+    }
+    return 0 == ret;
+}
 
+void* BigHashTable::getvalue(const void *key, int &valuesize)
+{
+    const void *value = 0;
+    void *vp = 0;
+    int datasz = 0;
+    valuesize = 0;
+
+    if (0 == (value = peekvalue(key, datasz)))
+        return 0;
     if (0 == (vp = malloc(datasz)))
         return 0;
     memcpy(vp, value, datasz);
@@ -93,6 +130,57 @@ void* BigHashTable::getvalue(const void *key, int &valuesize)
     return vp;
 }
 
+void BigHashTable::batchinsert(const void **keys, const void **datas, const int *datasizes, const int nr)
+{
+    db->batchsetDB((const char **)keys, datas, datasizes, nr);
+}
+
+int BigHashTable::batchgetvalue(const void **keys, const int nr, void **values, int *valuesizes)
+{
+    char *buf = 0;
+    void **bufs = 0;
+    int *rets = 0;
+    int found = 0;
+
+    buf = (char *)malloc((size_t)nr * HASHDB_VALUE_MAX_SZ + 1);
+    bufs = (void **)malloc(sizeof(void *) * nr + 1);
+    rets = (int *)malloc(sizeof(int) * nr + 1);
+    if (0 == buf || 0 == bufs || 0 == rets){
+        fprintf(stderr, "Error: malloc value buffers in BigHashTable::batchgetvalue()\n");
+        found = -1;
+        goto _BATCHGETVALUE_EXIT;
+    }
+    for (int i = 0; i < nr; i++){
+        bufs[i] = buf + (size_t)i * HASHDB_VALUE_MAX_SZ;
+        values[i] = 0;
+        valuesizes[i] = 0;
+    }
+
+    if (-1 == (found = db->batchgetDB((const char **)keys, nr, bufs, valuesizes, rets))){
+        fprintf(stderr, "Error: HashDB::batchgetDB() in BigHashTable::batchgetvalue()\n");
+        goto _BATCHGETVALUE_EXIT;
+    }
+    for (int i = 0; i < nr; i++){
+        if (0 != rets[i])
+            continue;
+        if (0 == (values[i] = malloc(valuesizes[i] + 1))){
+            found--;
+            valuesizes[i] = 0;
+            continue;
+        }
+        memcpy(values[i], bufs[i], valuesizes[i]);
+    }
+
+_BATCHGETVALUE_EXIT:
+    if (buf)
+        free(buf);
+    if (bufs)
+        free(bufs);
+    if (rets)
+        free(rets);
+    return found;
+}
+
 //#define BIGHASHTABLE_TEST
 #ifdef BIGHASHTABLE_TEST
 #include <string>
@@ -0,0 +1,950 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "BlockIndex.h"
+
+static inline int hexval(const unsigned char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+int md5str2bin(const void *md5str, unsigned char *md5)
+{
+    const unsigned char *str = (const unsigned char *)md5str;
+    for (int i = 0; i < 16; i++){
+        int hi = hexval(str[2 * i]);
+        int lo = hexval(str[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return -1;
+        md5[i] = (unsigned char)((hi << 4) | lo);
+    }
+    return 0;
+}
+
+static bool bindex_less(const BINDEX_ENTRY &x, const BINDEX_ENTRY &y)
+{
+    int cmp = memcmp(x.md5, y.md5, 16);
+    return (cmp < 0) || (0 == cmp && x.bid < y.bid);
+}
+
+static uint32_t lowerbound(const BINDEX_ENTRY *entries, const uint32_t nr, const unsigned char *md5)
+//the first entry not less than md5
+{
+    uint32_t lo = 0, hi = nr;
+    while (lo < hi){
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(entries[mid].md5, md5, 16) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static uint32_t runs_kept(const vector<BINDEX_MAP> &maps, uint64_t nr)
+/*the oldest runs not merged with a new run of nr entries: the newest run is
+  merged while it is smaller than BINDEX_RUNS_RATIO times the merged run*/
+{
+    uint32_t k = maps.size();
+    while (k > 0 && maps[k - 1].nr < BINDEX_RUNS_RATIO * nr){
+        nr += maps[k - 1].nr;
+        k--;
+    }
+    return k;
+}
+
+static inline uint64_t alignup(const uint64_t offset)
+{
+    return (offset + BINDEX_ALIGN - 1) / BINDEX_ALIGN * BINDEX_ALIGN;
+}
+
+static inline int addbid(uint32_t *bids, const int nr, const uint32_t bid)
+//append bid to bids[0, nr) unless it is there already
+{
+    for (int i = 0; i < nr; i++){
+        if (bids[i] == bid)
+            return nr;
+    }
+    bids[nr] = bid;
+    return nr + 1;
+}
+
+static inline uint32_t cachehash(const unsigned char *md5)
+//md5 bytes are uniformly distributed, but the leading ones of hooks are zero
+{
+    uint32_t h = 0;
+    memcpy(&h, md5 + 4, sizeof(h));
+    return h;
+}
+
+BlockIndex::BlockIndex(bool lkup, const uint32_t cnum, const uint64_t tnum, const uint32_t snr)
+{
+    lookup = lkup;
+    spill_nr = snr > 0 ? snr : BINDEX_SPILL_NR;
+    filters = false;
+    filters_merge = false;
+    new_nr = 0;
+    spill_fd = -1;
+    memset(spill_path, 0, sizeof(spill_path));
+    spill_len = 0;
+    htab_bindex = 0;
+    lsm_bindex = 0;
+    htab_csum = 0;
+    htab_tnum = tnum;
+    htab_cnum = cnum;
+
+    sample_bits = 0;
+    prefetch_nr = BINDEX_PREFETCH_NR;
+    hooks = 0;
+    hooks_nr = 0;
+    seq_fd = -1;
+    memset(&seq, 0, sizeof(seq));
+    seq_buf = 0;
+    cache = 0;
+    cache_bucket = 0;
+    cache_mask = 0;
+    memset(seg_first, 0, sizeof(seg_first));
+    memset(seg_nr, 0, sizeof(seg_nr));
+    seg_next = 0;
+    if (lookup){
+        htab_bindex = new BigHashTable(0, 0, tnum, cnum, true);
+    }
+}
+
+void BlockIndex::memusage(uint64_t &index, uint64_t &bloom, uint64_t &block) const
+{
+    if (htab_bindex){
+        index += htab_bindex->memusage();
+        bloom += htab_bindex->bloomusage();
+    }
+    if (lsm_bindex){
+        index += lsm_bindex->memusage();
+        bloom += lsm_bindex->bloomusage();
+    }
+    if (htab_csum){
+        index += htab_csum->memusage();
+        bloom += htab_csum->bloomusage();
+    }
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        if (fp_maps[r].filter)
+            bloom += fp_maps[r].filter->bytes();
+    }
+    index += (uint64_t)hooks_nr * BINDEX_ENTRY_SZ;
+    index += new_bindex.capacity() * BINDEX_ENTRY_SZ + new_csum.capacity() * BINDEX_CSUM_SZ;
+    index += dead_bindex.capacity() * BINDEX_ENTRY_SZ;
+    if (cache){
+        block += (uint64_t)BINDEX_CACHE_SEGS * prefetch_nr * sizeof(BINDEX_CACHE_SLOT);
+        block += (uint64_t)(cache_mask + 1) * sizeof(int32_t);
+        block += (uint64_t)prefetch_nr * seq.entry_sz;
+    }
+}
+
+uint32_t BlockIndex::prefetchcost(const uint32_t entry_sz)
+//a cache slot, at most two hash chain heads, and its share of the read buffer
+{
+    return sizeof(BINDEX_CACHE_SLOT) + 4 * sizeof(int32_t) + entry_sz / BINDEX_CACHE_SEGS + 1;
+}
+
+BlockIndex::~BlockIndex()
+{
+    closeindex();
+    dropspill();
+    if (htab_bindex){
+        delete htab_bindex;
+        htab_bindex = 0;
+    }
+    if (lsm_bindex){
+        delete lsm_bindex;
+        lsm_bindex = 0;
+    }
+    if (htab_csum){
+        delete htab_csum;
+        htab_csum = 0;
+    }
+}
+
+int BlockIndex::setbackend(const int backend, const uint32_t memtable_nr)
+{
+    if (new_nr > 0){
+        fprintf(stderr, "Error: set backend after blocks are inserted in BlockIndex::setbackend(...)\n");
+        return -1;
+    }
+    if (0 == htab_bindex && 0 == lsm_bindex) //lookup == false
+        return 0;
+    switch (backend){
+    case BINDEX_BACKEND_HASHDB:
+        if (lsm_bindex){
+            delete lsm_bindex;
+            lsm_bindex = 0;
+            htab_bindex = new BigHashTable(0, 0, htab_tnum, htab_cnum, true);
+        }
+        return 0;
+    case BINDEX_BACKEND_LSM:
+        if (htab_bindex){
+            delete htab_bindex;
+            htab_bindex = 0;
+        }
+        if (lsm_bindex)
+            delete lsm_bindex;
+        lsm_bindex = new LSMIndex(0, memtable_nr);
+        return 0;
+    default:
+        fprintf(stderr, "Error: invalid backend %d in BlockIndex::setbackend(...)\n", backend);
+        return -1;
+    }
+}
+
+int BlockIndex::setsampling(const unsigned int bits, const unsigned int pnr)
+{
+    if (bits > BINDEX_MAX_SAMPLE_BITS || 0 == pnr){
+        fprintf(stderr, "Error: invalid sampling bits %u or prefetch number %u in BlockIndex::setsampling(...)\n", bits, pnr);
+        return -1;
+    }
+    if (!fp_maps.empty() || !csum_maps.empty()){
+        fprintf(stderr, "Error: set sampling after the index is opened in BlockIndex::setsampling(...)\n");
+        return -1;
+    }
+    sample_bits = bits;
+    prefetch_nr = pnr;
+    return 0;
+}
+
+int BlockIndex::mapruns(const char *pkg_name, const BINDEX_RUN *runs, const uint32_t nr,
+                        const uint32_t entry_sz, vector<BINDEX_MAP> &maps)
+//map the runs of one section read-only, each on its own
+{
+    int fd = open(pkg_name, O_RDONLY);
+    if (-1 == fd){
+        fprintf(stderr, "Error: open package %s in BlockIndex::mapruns(...)\n", pkg_name);
+        return -1;
+    }
+    for (uint32_t r = 0; r < nr; r++){
+        BINDEX_MAP m;
+        memset(&m, 0, sizeof(m));
+        m.offset = runs[r].offset;
+        m.nr = runs[r].nr;
+        m.len = (uint64_t)entry_sz * m.nr;
+        if (0 == m.nr)
+            continue;
+        uint64_t map_off = m.offset - m.offset % sysconf(_SC_PAGESIZE);
+        m.map_len = m.offset + m.len - map_off;
+        m.map_addr = mmap(0, m.map_len, PROT_READ, MAP_PRIVATE, fd, map_off);
+        if (MAP_FAILED == m.map_addr){
+            fprintf(stderr, "Error: mmap %uth run of block index of package %s in BlockIndex::mapruns(...)\n", r, pkg_name);
+            close(fd);
+            return -1;
+        }
+        madvise(m.map_addr, m.map_len, MADV_RANDOM);
+        m.entries = (const char *)m.map_addr + (m.offset - map_off);
+        maps.push_back(m);
+    }
+    close(fd);
+    return 0;
+}
+
+void BlockIndex::unmap(vector<BINDEX_MAP> &maps)
+{
+    for (uint32_t r = 0; r < maps.size(); r++){
+        if (maps[r].map_addr)
+            munmap(maps[r].map_addr, maps[r].map_len);
+        if (maps[r].filter)
+            delete maps[r].filter;
+    }
+    maps.clear();
+}
+
+int BlockIndex::openindex(const char *pkg_name, const BINDEX_RUN *fp_runs, const uint32_t fp_nr,
+                          const BINDEX_RUN *csum_runs, const uint32_t csum_nr, const BINDEX_SEQ *lseq)
+//map the runs of the fingerprint index and of the checksum set of the package
+{
+    unsigned char limit[16] = {0};
+    uint32_t bucket_nr = 1;
+    vector<uint32_t> heads;
+
+    closeindex();
+    if (0 != mapruns(pkg_name, fp_runs, fp_nr, BINDEX_ENTRY_SZ, fp_maps) ||
+        0 != mapruns(pkg_name, csum_runs, csum_nr, BINDEX_CSUM_SZ, csum_maps))
+        goto _OPENINDEX_ERR;
+    if (0 == sample_bits || fp_maps.empty())
+        return 0;
+
+    /*sampled mode: copy the hooks, the head of every run, the other
+      fingerprints are reached by prefetching*/
+    limit[0] = (unsigned char)((1U << (16 - sample_bits)) >> 8);
+    limit[1] = (unsigned char)((1U << (16 - sample_bits)) & 0xff);
+    hooks_nr = 0;
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        heads.push_back(lowerbound((const BINDEX_ENTRY *)fp_maps[r].entries, fp_maps[r].nr, limit));
+        hooks_nr += heads.back();
+    }
+    while (bucket_nr < 2 * BINDEX_CACHE_SEGS * prefetch_nr)
+        bucket_nr <<= 1;
+
+    if (0 == lseq || 0 == lseq->entry_sz){
+        fprintf(stderr, "Error: no logic block entries to prefetch in BlockIndex::openindex(...)\n");
+        goto _OPENINDEX_ERR;
+    }
+    memcpy(&seq, lseq, sizeof(seq));
+    seq_runs.clear();
+    if (lseq->runs){
+        seq_runs.assign(lseq->runs, lseq->runs + lseq->runs_nr);
+    }else{
+        BINDEX_RUN run = {lseq->offset, 0, lseq->nr};
+        seq_runs.push_back(run);
+    }
+    seq.runs = 0;
+    seq.runs_nr = seq_runs.size();
+    hooks = (BINDEX_ENTRY *)malloc(BINDEX_ENTRY_SZ * (hooks_nr + 1));
+    cache = (BINDEX_CACHE_SLOT *)malloc(sizeof(BINDEX_CACHE_SLOT) * BINDEX_CACHE_SEGS * prefetch_nr);
+    cache_bucket = (int32_t *)malloc(sizeof(int32_t) * bucket_nr);
+    seq_buf = (char *)malloc((size_t)seq.entry_sz * prefetch_nr);
+    if (0 == hooks || 0 == cache || 0 == cache_bucket || 0 == seq_buf){
+        fprintf(stderr, "Error: malloc hooks or prefetch cache in BlockIndex::openindex(...)\n");
+        goto _OPENINDEX_ERR;
+    }
+    seq_fd = open(pkg_name, O_RDONLY);
+    if (-1 == seq_fd){
+        fprintf(stderr, "Error: open package %s in BlockIndex::openindex(...)\n", pkg_name);
+        goto _OPENINDEX_ERR;
+    }
+    hooks_nr = 0;
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        memcpy(hooks + hooks_nr, fp_maps[r].entries, BINDEX_ENTRY_SZ * heads[r]);
+        hooks_nr += heads[r];
+    }
+    std::sort(hooks, hooks + hooks_nr, bindex_less);
+    memset(cache_bucket, 0xff, sizeof(int32_t) * bucket_nr);
+    cache_mask = bucket_nr - 1;
+    memset(seg_nr, 0, sizeof(seg_nr));
+    seg_next = 0;
+
+    //the rest of the persisted index is read again only when it is rewritten
+    for (uint32_t r = 0; r < fp_maps.size(); r++)
+        madvise(fp_maps[r].map_addr, fp_maps[r].map_len, MADV_DONTNEED);
+    return 0;
+
+_OPENINDEX_ERR:
+    closeindex();
+    return -1;
+}
+
+void BlockIndex::closeindex()
+{
+    unmap(fp_maps);
+    unmap(csum_maps);
+
+    if (-1 != seq_fd){
+        close(seq_fd);
+        seq_fd = -1;
+    }
+    seq_runs.clear();
+    if (hooks){
+        free(hooks);
+        hooks = 0;
+    }
+    hooks_nr = 0;
+    if (seq_buf){
+        free(seq_buf);
+        seq_buf = 0;
+    }
+    if (cache){
+        free(cache);
+        cache = 0;
+    }
+    if (cache_bucket){
+        free(cache_bucket);
+        cache_bucket = 0;
+    }
+}
+
+int BlockIndex::findhook(const unsigned char *md5, uint32_t &first) const
+{
+    uint32_t hi = 0;
+    first = hi = lowerbound(hooks, hooks_nr, md5);
+    while (hi < hooks_nr && 0 == memcmp(hooks[hi].md5, md5, 16))
+        hi++;
+    return hi - first;
+}
+
+bool BlockIndex::ishook(const unsigned char *md5) const
+{
+    return 0 == ((((uint32_t)md5[0] << 8) | md5[1]) >> (16 - sample_bits));
+}
+
+int BlockIndex::prefetch(const uint32_t bid, const bool follow)
+/*load the logic block entries [bid, bid + prefetch_nr) into the oldest cache
+  segment, with BINDEX_SEQ_WHOLE from the first entry of the run on if that
+  covers bid; a run continued by the next block ids is followed into the
+  next run if bid is near its end*/
+{
+    if (bid >= seq.nr || seq_runs.empty())
+        return 0;
+    for (uint32_t s = 0; s < BINDEX_CACHE_SEGS; s++){
+        if (bid >= seg_first[s] && bid < seg_first[s] + seg_nr[s])
+            return 0;
+    }
+
+    //the run holding bid, a prefetch stops at its end
+    uint32_t lo = 0, hi = seq_runs.size();
+    while (hi - lo > 1){
+        uint32_t mid = (lo + hi) / 2;
+        if (seq_runs[mid].first <= bid)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const BINDEX_RUN &run = seq_runs[lo];
+    if (bid < run.first || bid >= run.first + run.nr)
+        return 0;
+    uint32_t start = bid;
+    if ((seq.flags & BINDEX_SEQ_WHOLE) && bid - run.first < prefetch_nr)
+        start = run.first;
+    uint32_t nr = (run.first + run.nr - start < prefetch_nr) ? run.first + run.nr - start : prefetch_nr;
+    ssize_t len = (ssize_t)nr * seq.entry_sz;
+    if (len != pread(seq_fd, seq_buf, len, run.offset + (uint64_t)(start - run.first) * seq.entry_sz)){
+        fprintf(stderr, "Error: read logic block entries from %u in BlockIndex::prefetch(...)\n", start);
+        return -1;
+    }
+
+    uint32_t seg = seg_next;
+    seg_next = (seg_next + 1) % BINDEX_CACHE_SEGS;
+    cacheevict(seg);
+    for (uint32_t i = 0; i < nr; i++){
+        int32_t slot = seg * prefetch_nr + i;
+        const char *md5 = seq_buf + (size_t)i * seq.entry_sz + seq.md5_pos;
+        if (seq.flags & BINDEX_SEQ_BINMD5)
+            memcpy(cache[slot].md5, md5, 16);
+        else if (0 != md5str2bin(md5, cache[slot].md5))
+            memset(cache[slot].md5, 0, 16);
+        cache[slot].bid = start + i;
+        int32_t *bucket = &cache_bucket[cachehash(cache[slot].md5) & cache_mask];
+        cache[slot].next = *bucket;
+        *bucket = slot;
+    }
+    seg_first[seg] = start;
+    seg_nr[seg] = nr;
+    if ((seq.flags & BINDEX_SEQ_WHOLE) && follow && lo + 1 < seq_runs.size() &&
+        seq_runs[lo + 1].first == run.first + run.nr && run.first + run.nr - bid < prefetch_nr / 2)
+        return prefetch(seq_runs[lo + 1].first, false);
+    return 0;
+}
+
+void BlockIndex::cacheevict(const uint32_t seg)
+{
+    for (uint32_t i = 0; i < seg_nr[seg]; i++){
+        int32_t slot = seg * prefetch_nr + i;
+        int32_t *link = &cache_bucket[cachehash(cache[slot].md5) & cache_mask];
+        while (*link >= 0 && *link != slot)
+            link = &cache[*link].next;
+        if (*link == slot)
+            *link = cache[slot].next;
+    }
+    seg_nr[seg] = 0;
+}
+
+int BlockIndex::cachefind(const unsigned char *md5, uint32_t *bids, int nr, const int maxnr) const
+//append the cached block ids of md5 to bids[0, nr), return the new number of ids
+{
+    for (int32_t slot = cache_bucket[cachehash(md5) & cache_mask]; slot >= 0 && nr < maxnr; slot = cache[slot].next){
+        if (0 == memcmp(cache[slot].md5, md5, 16))
+            nr = addbid(bids, nr, cache[slot].bid);
+    }
+    return nr;
+}
+
+bool BlockIndex::infilter(const unsigned char *md5) const
+//false: no run has md5, by their filters
+{
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        if (0 == fp_maps[r].filter || fp_maps[r].filter->contains(md5, 16))
+            return true;
+    }
+    return false;
+}
+
+int BlockIndex::getvalue(const void *md5str, uint32_t *bids, const int maxnr)
+{
+    unsigned char md5[16];
+    uint32_t first = 0, nr = 0;
+    uint32_t new_list[BINDEX_NEW_BIDS_MAX + 1];
+    int new_sz = 0, n = 0;
+
+    if (maxnr <= 0 || 0 != md5str2bin(md5str, md5))
+        return 0;
+    if (0 == sample_bits){
+        for (uint32_t r = 0; r < fp_maps.size() && n < maxnr; r++){
+            if (fp_maps[r].filter && !fp_maps[r].filter->contains(md5, 16))
+                continue;
+            const BINDEX_ENTRY *entries = (const BINDEX_ENTRY *)fp_maps[r].entries;
+            for (first = lowerbound(entries, fp_maps[r].nr, md5);
+                 first < fp_maps[r].nr && 0 == memcmp(entries[first].md5, md5, 16) && n < maxnr; first++)
+                bids[n++] = entries[first].bid;
+        }
+    }else if (hooks && infilter(md5)){
+        nr = ishook(md5) ? findhook(md5, first) : 0;
+        for (uint32_t i = 0; i < nr; i++)
+            prefetch(hooks[first + i].bid);
+        n = cachefind(md5, bids, n, maxnr);
+        for (uint32_t i = 0; i < nr && n < maxnr; i++)
+            n = addbid(bids, n, hooks[first + i].bid);
+    }
+    if (htab_bindex && n < maxnr && htab_bindex->getvalue(md5str, new_list, new_sz)){
+        for (uint32_t i = 0; i < new_list[0] && n < maxnr; i++)
+            bids[n++] = new_list[i + 1];
+    }
+    if (lsm_bindex && n < maxnr)
+        n += lsm_bindex->getvalue(md5, bids + n, maxnr - n);
+    return n;
+}
+
+bool BlockIndex::contain(const void *md5str)
+{
+    uint32_t bid = 0;
+    return getvalue(md5str, &bid, 1) > 0;
+}
+
+int BlockIndex::insert(const void *md5str, const uint32_t bid)
+{
+    BINDEX_ENTRY entry;
+    if (0 != md5str2bin(md5str, entry.md5)){
+        fprintf(stderr, "Error: invalid md5 string in BlockIndex::insert(...)\n");
+        return -1;
+    }
+    entry.bid = bid;
+    new_bindex.push_back(entry);
+    new_nr++;
+    if (new_bindex.size() >= spill_nr && 0 != spill())
+        return -1;
+    if (lsm_bindex)
+        return lsm_bindex->insert(entry.md5, bid);
+    if (0 == htab_bindex)
+        return 0;
+
+    //new block ids list: <idnum|id1|...|idn>
+    uint32_t bid_list[BINDEX_NEW_BIDS_MAX + 1];
+    int value_sz = 0;
+    if (!htab_bindex->getvalue(md5str, bid_list, value_sz))
+        bid_list[0] = 0;
+    if ((int)bid_list[0] >= BINDEX_NEW_BIDS_MAX){
+        fprintf(stderr, "Error: more than %d new blocks of one md5 in BlockIndex::insert(...)\n", BINDEX_NEW_BIDS_MAX);
+        return -1;
+    }
+    bid_list[++bid_list[0]] = bid;
+    htab_bindex->insert(md5str, bid_list, sizeof(uint32_t) * (bid_list[0] + 1));
+    return 0;
+}
+
+int BlockIndex::spill()
+{
+    if (-1 == spill_fd){
+        char tmplate[] = "BlockIndex/spill_XXXXXX";
+        mkdir("data", 766);
+        mkdir("data/BlockIndex", 766);
+        snprintf(spill_path, PATH_MAX_LEN, "data/%s_%d", mktemp(tmplate), getpid());
+        spill_fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (-1 == spill_fd){
+            fprintf(stderr, "Error: create spill file %s in BlockIndex::spill()\n", spill_path);
+            return -1;
+        }
+    }
+    std::sort(new_bindex.begin(), new_bindex.end(), bindex_less);
+    ssize_t len = (ssize_t)new_bindex.size() * BINDEX_ENTRY_SZ;
+    if (len != pwrite(spill_fd, &new_bindex[0], len, spill_len)){
+        fprintf(stderr, "Error: write %u entries to spill file %s in BlockIndex::spill()\n",
+                (uint32_t)new_bindex.size(), spill_path);
+        return -1;
+    }
+    BINDEX_EXTENT run = {spill_len, (uint64_t)len};
+    spill_runs.push_back(run);
+    spill_len += len;
+    new_bindex.clear();
+    return 0;
+}
+
+void BlockIndex::dropspill()
+{
+    if (-1 != spill_fd){
+        close(spill_fd);
+        unlink(spill_path);
+        spill_fd = -1;
+    }
+    spill_len = 0;
+    spill_runs.clear();
+}
+
+int BlockIndex::openfilter(const char *pkg_name, const bool stored)
+{
+    filters = true;
+    filters_merge = !stored && !fp_maps.empty();
+    if (!stored)
+        return 0;
+
+    ifstream pkg_file(pkg_name, ios::binary | ios::in);
+    if (!pkg_file.is_open()){
+        fprintf(stderr, "Error: open package %s in BlockIndex::openfilter(...)\n", pkg_name);
+        return -1;
+    }
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        BINDEX_MAP &m = fp_maps[r];
+        uint64_t filter_off = alignup(m.offset + m.len);
+        pkg_file.seekg(filter_off, ios::beg);
+        m.filter = new CuckooFilter(0);
+        if (0 != readcf(pkg_file, m.filter)){
+            fprintf(stderr, "Error: read filter of %uth fingerprint run of package %s in BlockIndex::openfilter(...)\n",
+                    r, pkg_name);
+            delete m.filter;
+            m.filter = 0;
+            return -1;
+        }
+        m.len = filter_off + m.filter->bytes() - m.offset;
+    }
+    return 0;
+}
+
+int BlockIndex::removeindex(const void *md5str, const uint32_t bid)
+{
+    BINDEX_ENTRY entry;
+    if (0 != md5str2bin(md5str, entry.md5)){
+        fprintf(stderr, "Error: invalid md5 string in BlockIndex::removeindex(...)\n");
+        return -1;
+    }
+    entry.bid = bid;
+    dead_bindex.push_back(entry);
+    return 0;
+}
+
+bool BlockIndex::containcsum(const uint32_t c)
+{
+    for (uint32_t r = 0; r < csum_maps.size(); r++){
+        const uint32_t *csum = (const uint32_t *)csum_maps[r].entries;
+        if (std::binary_search(csum, csum + csum_maps[r].nr, c))
+            return true;
+    }
+    if (0 == htab_csum)
+        return false;
+
+    unsigned char csumstr[16] = {0};
+    uint2str(c, csumstr);
+    return htab_csum->contain(csumstr);
+}
+
+int BlockIndex::insertcsum(const uint32_t c)
+//the checksum table is made by the first insertion, only SB chunking inserts
+{
+    if (lookup && 0 == htab_csum)
+        htab_csum = new BigHashTable(0, 0, htab_tnum, htab_cnum / 2);
+    if (htab_csum){
+        if (containcsum(c))
+            return 0;
+        unsigned char csumstr[16] = {0};
+        uint2str(c, csumstr);
+        htab_csum->insert(csumstr, (void *)"1", 1);
+    }
+    new_csum.push_back(c);
+    return 0;
+}
+
+/*the sorted inputs of a merge: the runs merged and the new entries*/
+typedef struct _bindex_cursor{
+    const char *pos;
+    const char *end;
+} BINDEX_CURSOR;
+
+//orders a heap of cursors by their entries, the smallest on top
+struct cursor_greater{
+    const vector<BINDEX_CURSOR> *cur;
+    bool operator()(const uint32_t x, const uint32_t y) const
+    {
+        return bindex_less(*(const BINDEX_ENTRY *)(*cur)[y].pos, *(const BINDEX_ENTRY *)(*cur)[x].pos);
+    }
+};
+
+static void mergebegin(const vector<BINDEX_CURSOR> &cur, vector<uint32_t> &heap)
+{
+    cursor_greater greater = {&cur};
+    heap.clear();
+    for (uint32_t i = 0; i < cur.size(); i++){
+        if (cur[i].pos < cur[i].end)
+            heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), greater);
+}
+
+static const BINDEX_ENTRY *nextentry(vector<BINDEX_CURSOR> &cur, vector<uint32_t> &heap,
+                                     const vector<BINDEX_ENTRY> &dead)
+//the smallest entry of the cursors not in dead, 0 at the end
+{
+    cursor_greater greater = {&cur};
+    while (!heap.empty()){
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        uint32_t i = heap.back();
+        const BINDEX_ENTRY *entry = (const BINDEX_ENTRY *)cur[i].pos;
+        cur[i].pos += BINDEX_ENTRY_SZ;
+        if (cur[i].pos < cur[i].end)
+            std::push_heap(heap.begin(), heap.end(), greater);
+        else
+            heap.pop_back();
+        if (dead.empty() || !std::binary_search(dead.begin(), dead.end(), *entry, bindex_less))
+            return entry;
+    }
+    return 0;
+}
+
+static bool nextcsum(vector<BINDEX_CURSOR> &cur, uint32_t &c)
+{
+    int min = -1;
+    for (uint32_t i = 0; i < cur.size(); i++){
+        if (cur[i].pos < cur[i].end &&
+            (min < 0 || *(const uint32_t *)cur[i].pos < *(const uint32_t *)cur[min].pos))
+            min = i;
+    }
+    if (min < 0)
+        return false;
+    c = *(const uint32_t *)cur[min].pos;
+    cur[min].pos += BINDEX_CSUM_SZ;
+    return true;
+}
+
+static void mergeruns(const vector<BINDEX_MAP> &maps, const vector<bool> &merged, const uint32_t entry_sz,
+                      const char *new_entries, const uint64_t new_len, vector<BINDEX_CURSOR> &cur,
+                      vector<BINDEX_EXTENT> &stale)
+//cursors on the runs to be merged and on the new entries, the runs become stale; cur gets them after its own
+{
+    for (uint32_t r = 0; r < maps.size(); r++){
+        if (!merged[r])
+            continue;
+        BINDEX_CURSOR c = {(const char *)maps[r].entries, (const char *)maps[r].entries + (uint64_t)maps[r].nr * entry_sz};
+        cur.push_back(c);
+        BINDEX_EXTENT ext = {maps[r].offset, maps[r].len};
+        stale.push_back(ext);
+    }
+    BINDEX_CURSOR c = {new_entries, new_entries + new_len};
+    cur.push_back(c);
+}
+
+static void pad(ostream &out)
+{
+    const char zeros[BINDEX_ALIGN] = {0};
+    uint64_t pos = out.tellp();
+    if (pos % BINDEX_ALIGN)
+        out.write(zeros, BINDEX_ALIGN - pos % BINDEX_ALIGN);
+}
+
+static int writefprun(ostream &out, const vector<BINDEX_CURSOR> &cursors, const vector<BINDEX_ENTRY> &dead,
+                      const bool filter, BINDEX_MAP &run)
+//merge the cursors into a run at the end of out, followed by its filter if asked for
+{
+    vector<BINDEX_CURSOR> cur = cursors;
+    vector<uint32_t> heap;
+    const BINDEX_ENTRY *entry = 0, *last = 0;
+    uint64_t distinct = 0;
+
+    pad(out);
+    memset(&run, 0, sizeof(run));
+    run.offset = out.tellp();
+    mergebegin(cur, heap);
+    while (0 != (entry = nextentry(cur, heap, dead))){
+        out.write((const char *)entry, BINDEX_ENTRY_SZ);
+        if (0 == last || 0 != memcmp(last->md5, entry->md5, 16))
+            distinct++;
+        last = entry;
+        run.nr++;
+    }
+    run.len = (uint64_t)run.nr * BINDEX_ENTRY_SZ;
+    if (!filter || 0 == run.nr)
+        return 0;
+
+    //the distinct fingerprints, a full filter is built again twice as large
+    CuckooFilter *cf = 0;
+    uint64_t capacity = distinct + distinct / 4;
+    if (capacity < 1024)
+        capacity = 1024;
+    while (0 == cf){
+        bool ok = true;
+        cf = new CuckooFilter(capacity);
+        cur = cursors;
+        last = 0;
+        mergebegin(cur, heap);
+        while (ok && 0 != (entry = nextentry(cur, heap, dead))){
+            if (0 == last || 0 != memcmp(last->md5, entry->md5, 16))
+                ok = cf->insert(entry->md5, 16);
+            last = entry;
+        }
+        if (!ok){
+            delete cf;
+            cf = 0;
+            capacity *= 2;
+        }
+    }
+    pad(out);
+    uint64_t filter_off = out.tellp();
+    int ret = writecf(out, cf);
+    run.len = filter_off + cf->bytes() - run.offset;
+    delete cf;
+    if (0 != ret){
+        fprintf(stderr, "Error: write fingerprint filter in BlockIndex::writeindex(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void replaceruns(vector<BINDEX_MAP> &maps, const vector<bool> &merged, const BINDEX_MAP &run)
+//the runs not merged, then the new run, which is not mapped
+{
+    vector<BINDEX_MAP> kept;
+    for (uint32_t r = 0; r < maps.size(); r++){
+        if (!merged[r]){
+            kept.push_back(maps[r]);
+            continue;
+        }
+        if (maps[r].map_addr)
+            munmap(maps[r].map_addr, maps[r].map_len);
+        if (maps[r].filter)
+            delete maps[r].filter;
+    }
+    if (run.nr > 0)
+        kept.push_back(run);
+    maps.swap(kept);
+}
+
+int BlockIndex::writeindex(ostream &out, unsigned long long &bindex_off, unsigned int &bnr,
+                           unsigned long long &csum_off, unsigned int &cnr,
+                           unsigned long long &filter_off, unsigned long long &filter_len,
+                           vector<BINDEX_EXTENT> &stale)
+/*append the new entries as a run of each section, merged with the newest runs
+  less than BINDEX_RUNS_RATIO times larger and with the runs holding a removed
+  entry; the sections are left empty of the runs merged*/
+{
+    vector<BINDEX_CURSOR> cur;
+    vector<bool> merged;
+    BINDEX_MAP run;
+    uint32_t k = 0;
+    bool merging = false;
+    void *spill_addr = 0;
+    int ret = 0;
+
+    /*fingerprint index: the runs merged, the chunks of the spill file and
+      the entries buffered*/
+    std::sort(new_bindex.begin(), new_bindex.end(), bindex_less);
+    std::sort(dead_bindex.begin(), dead_bindex.end(), bindex_less);
+    k = filters_merge ? 0 : runs_kept(fp_maps, new_nr);
+    merged.assign(fp_maps.size(), false);
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        const BINDEX_ENTRY *entries = (const BINDEX_ENTRY *)fp_maps[r].entries;
+        merged[r] = (r >= k);
+        for (uint32_t i = 0; i < dead_bindex.size() && !merged[r]; i++)
+            merged[r] = std::binary_search(entries, entries + fp_maps[r].nr, dead_bindex[i], bindex_less);
+        merging = merging || merged[r];
+    }
+    memset(&run, 0, sizeof(run));
+    if (spill_len > 0){
+        spill_addr = mmap(0, spill_len, PROT_READ, MAP_PRIVATE, spill_fd, 0);
+        if (MAP_FAILED == spill_addr){
+            fprintf(stderr, "Error: mmap spill file %s in BlockIndex::writeindex(...)\n", spill_path);
+            return -1;
+        }
+        madvise(spill_addr, spill_len, MADV_SEQUENTIAL);
+        for (uint32_t i = 0; i < spill_runs.size(); i++){
+            BINDEX_CURSOR c = {(const char *)spill_addr + spill_runs[i].offset, 0};
+            c.end = c.pos + spill_runs[i].len;
+            cur.push_back(c);
+        }
+    }
+    if (new_nr > 0 || merging){
+        mergeruns(fp_maps, merged, BINDEX_ENTRY_SZ, new_bindex.empty() ? 0 : (const char *)&new_bindex[0],
+                  (uint64_t)new_bindex.size() * BINDEX_ENTRY_SZ, cur, stale);
+        ret = writefprun(out, cur, dead_bindex, filters, run);
+    }
+    if (spill_addr)
+        munmap(spill_addr, spill_len);
+    dropspill();
+    if (0 != ret)
+        return -1;
+    replaceruns(fp_maps, merged, run);
+    filters_merge = false;
+    bindex_off = fp_maps.empty() ? 0 : fp_maps.back().offset;
+    filter_off = (filters && !fp_maps.empty()) ? alignup(bindex_off + (uint64_t)fp_maps.back().nr * BINDEX_ENTRY_SZ) : 0;
+    bnr = 0;
+    filter_len = 0;
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        uint64_t entries_end = fp_maps[r].offset + (uint64_t)fp_maps[r].nr * BINDEX_ENTRY_SZ;
+        bnr += fp_maps[r].nr;
+        if (filters)
+            filter_len += fp_maps[r].offset + fp_maps[r].len - alignup(entries_end);
+    }
+
+    /*checksum set, the checksums are unique over every run*/
+    std::sort(new_csum.begin(), new_csum.end());
+    k = runs_kept(csum_maps, new_csum.size());
+    merged.assign(csum_maps.size(), false);
+    merging = false;
+    for (uint32_t r = k; r < csum_maps.size(); r++)
+        merging = merged[r] = true;
+    memset(&run, 0, sizeof(run));
+    cur.clear();
+    if (!new_csum.empty() || merging){
+        mergeruns(csum_maps, merged, BINDEX_CSUM_SZ, new_csum.empty() ? 0 : (const char *)&new_csum[0],
+                  (uint64_t)new_csum.size() * BINDEX_CSUM_SZ, cur, stale);
+        uint32_t c = 0, last = 0;
+        pad(out);
+        run.offset = out.tellp();
+        while (nextcsum(cur, c)){
+            if (run.nr > 0 && c == last)
+                continue;
+            out.write((const char *)(&c), BINDEX_CSUM_SZ);
+            last = c;
+            run.nr++;
+        }
+        run.len = (uint64_t)run.nr * BINDEX_CSUM_SZ;
+    }
+    replaceruns(csum_maps, merged, run);
+    csum_off = csum_maps.empty() ? 0 : csum_maps.back().offset;
+    cnr = 0;
+    for (uint32_t r = 0; r < csum_maps.size(); r++)
+        cnr += csum_maps[r].nr;
+
+    new_bindex.clear();
+    new_nr = 0;
+    new_csum.clear();
+    dead_bindex.clear();
+    if (!out.good()){
+        fprintf(stderr, "Error: write block index sections in BlockIndex::writeindex(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+void BlockIndex::runs(vector<BINDEX_RUN> &fp_runs, vector<BINDEX_RUN> &csum_runs) const
+{
+    fp_runs.clear();
+    csum_runs.clear();
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        BINDEX_RUN run = {fp_maps[r].offset, 0, fp_maps[r].nr};
+        fp_runs.push_back(run);
+    }
+    for (uint32_t r = 0; r < csum_maps.size(); r++){
+        BINDEX_RUN run = {csum_maps[r].offset, 0, csum_maps[r].nr};
+        csum_runs.push_back(run);
+    }
+}
+
+void BlockIndex::extents(vector<BINDEX_EXTENT> &live) const
+{
+    for (uint32_t r = 0; r < fp_maps.size(); r++){
+        BINDEX_EXTENT ext = {fp_maps[r].offset, fp_maps[r].len};
+        live.push_back(ext);
+    }
+    for (uint32_t r = 0; r < csum_maps.size(); r++){
+        BINDEX_EXTENT ext = {csum_maps[r].offset, csum_maps[r].len};
+        live.push_back(ext);
+    }
+}
@@ -9,6 +9,23 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 */
 #include "BloomFilter.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+unsigned char* allocbittable(std::size_t size)
+{
+    void* table = 0;
+    if (0 != posix_memalign(&table, BBF_BLOCK_BYTES, size ? size : BBF_BLOCK_BYTES))
+        return 0;
+    return static_cast<unsigned char*>(table);
+}
+
+void freebittable(unsigned char* table)
+{
+    free(table);
+}
+
 BloomParameters::BloomParameters():
     minsize(1),
     maxsize(std::numeric_limits<unsigned long long int>::max()),
@@ -106,11 +123,12 @@ BloomFilter::BloomFilter(const BloomParameters& bp)
     bf_hdr.randseed_ = bp.randseed * 0xA5A5A5A5 + 1;
     bf_hdr.desiredfpp_ = bp.fpp;
     genUniqueSalt();
-    bittable_ = new unsigned char[static_cast<std::size_t>(bf_hdr.rawtablesize_)];
+    bittable_ = allocbittable(static_cast<std::size_t>(bf_hdr.rawtablesize_));
     std::fill_n(bittable_, bf_hdr.rawtablesize_, 0x00);
 }
 
-BloomFilter::BloomFilter(const BloomFilter& bf)
+BloomFilter::BloomFilter(const BloomFilter& bf) :
+    bittable_(0)
 {
     if(this != &bf){
             this->operator=(bf);
@@ -120,10 +138,10 @@ BloomFilter::BloomFilter(const BloomFilter& bf)
 
 BloomFilter::~BloomFilter()
 {
-    delete[] bittable_;
+    freebittable(bittable_);
 }
 
-inline double BloomFilter::effectiveFPP() const
+double BloomFilter::effectiveFPP() const
 {
     //f = ( 1 - e^(-k*n/m) )^ k
     /*
@@ -148,8 +166,8 @@ inline BloomFilter& BloomFilter::operator= (const BloomFilter& bf)
 {
     if(this != &bf){ //ֹԸ
         memcpy(&bf_hdr,&bf.bf_hdr, BLOOM_HDR_SZ);
-        delete[] bittable_;
-        bittable_ = new unsigned char[static_cast<std::size_t>(bf_hdr.rawtablesize_)];
+        freebittable(bittable_);
+        bittable_ = allocbittable(static_cast<std::size_t>(bf_hdr.rawtablesize_));
         std::copy(bf.bittable_, bf.bittable_ + bf_hdr.rawtablesize_, bittable_);
         salt_ = bf.salt_;
     }
@@ -463,20 +481,30 @@ int readbf(ifstream &src_file, BloomFilter *bf)
     unsigned int rsize = 0;
     src_file.read((char*)(&(bf->bf_hdr)), BLOOM_HDR_SZ);
     rsize = src_file.gcount();
-    unsigned char* table = new unsigned char[static_cast<size_t>(bf->bf_hdr.rawtablesize_)];
+    if (BLOOM_HDR_SZ != rsize){
+        cout << "Error: read header in BloomFilter::read bf" << endl;
+        return -1;
+    }
+    unsigned char* table = allocbittable(static_cast<size_t>(bf->bf_hdr.rawtablesize_));
     memset(table, 0, bf->bf_hdr.rawtablesize_);
     src_file.read((char *)table, bf->bf_hdr.rawtablesize_);
     rsize += src_file.gcount();
     if ( (rsize - BLOOM_HDR_SZ) != bf->bf_hdr.rawtablesize_){
         cout << "Error: read table in BloomFilter::read bf" << endl;
+        freebittable(table);
+        return -1;
     }
-    delete[] bf->bittable_;
+    freebittable(bf->bittable_);
     bf->bittable_ = table;
     table = 0;
 
     for(unsigned int i = 0; i < bf->bf_hdr.saltcount_; i++ ){
             unsigned int k = 0;
             src_file.read((char *)(&k), sizeof(unsigned int));
+            if ((streamsize)sizeof(unsigned int) != src_file.gcount()){
+                cout << "Error: read salt in BloomFilter::read bf" << endl;
+                return -1;
+            }
             if(i < bf->salt_.size())
                 bf->salt_.at(i) = k;
             else
@@ -487,6 +515,336 @@ int readbf(ifstream &src_file, BloomFilter *bf)
 }
 
 
+/******************BLOCKED BLOOM FILTER CLASS *****************/
+static double blockedFPP(double elements, double blocks, unsigned int k)
+//f = sum_j Poisson(j; n/B) * ( 1 - (1 - 1/b)^(j*k) )^k, b bits per block
+{
+    if (elements <= 0.0)
+        return 0.0;
+    const double lambda = elements / blocks;
+    const double upper = lambda + 10.0 * std::sqrt(lambda) + 10.0;
+    const double miss = std::log(1.0 - 1.0 / BBF_BLOCK_BITS);
+    double fpp = 0.0;
+    for (double j = 0.0; j <= upper; j += 1.0){
+        const double poisson = std::exp(j * std::log(lambda) - lambda - std::lgamma(j + 1.0));
+        fpp += poisson * std::pow(1.0 - std::exp(j * k * miss), 1.0 * k);
+    }
+    return fpp;
+}
+
+static BloomParameters blockedParameters(const BloomParameters& bp)
+//pick the probe count (at most BBF_MAX_PROBES) that needs the fewest
+//blocks to reach bp.fpp at bp.projected_element_count elements
+{
+    BloomParameters pmt = bp;
+    const double n = pmt.projected_element_count;
+    double best = 0.0;
+    for (unsigned int k = 1; k <= BBF_MAX_PROBES; ++k){
+        //a standard bloom filter is the lower bound, grow from it by 2%
+        double blocks = std::ceil(-k * n / std::log(1.0 - std::pow(pmt.fpp, 1.0/k)) / BBF_BLOCK_BITS);
+        if (blocks < 1.0) blocks = 1.0;
+        while (blockedFPP(n, blocks, k) > pmt.fpp)
+            blocks = std::ceil(blocks * 1.02);
+        if (0.0 == best || blocks < best){
+            best = blocks;
+            pmt.optpara.numhash = k;
+        }
+    }
+    pmt.optpara.tablesize = static_cast<unsigned long long int>(best) * BBF_BLOCK_BITS;
+    return pmt;
+}
+
+static inline uint64_t mix64(uint64_t h)
+//the finalizer of MurmurHash3, spreads the randseed_ over all the bits
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline bool md5Fingerprint(const unsigned char* key, const unsigned int len,
+                                  uint64_t& h1, uint64_t& h2)
+//a 32-char hex md5 string already carries 128 uniformly distributed bits,
+//fold its four 8-byte words into two instead of hashing it;
+//only for the filters whose owner declares md5 keys
+{
+    if (len != 32)
+        return false;
+    uint64_t w[4];
+    memcpy(w, key, sizeof(w));
+    h1 = w[0] ^ (w[1] * 0x9E3779B97F4A7C15ULL);
+    h2 = w[2] ^ (w[3] * 0x9E3779B97F4A7C15ULL);
+    return true;
+}
+
+BlockedBloomFilter::BlockedBloomFilter(bool md5keys) :
+    BloomFilter(), md5keys_(md5keys)
+{
+}
+
+BlockedBloomFilter::BlockedBloomFilter(const BloomParameters& bp, bool md5keys) :
+    BloomFilter(blockedParameters(bp)), md5keys_(md5keys)
+{
+}
+
+double BlockedBloomFilter::effectiveFPP() const
+{
+    if (0 == bf_hdr.rawtablesize_)
+        return 1.0;
+    return blockedFPP(bf_hdr.inserted_element_count_,
+                      bf_hdr.rawtablesize_ / BBF_BLOCK_BYTES, salt_.size());
+}
+
+inline const unsigned char* BlockedBloomFilter::probe
+(const unsigned char* key_begin, const unsigned int len, uint64_t* mask) const
+//compute the probe bits of the key into mask, return the block of the key
+{
+    uint64_t h1, h2;
+    if (!md5keys_ || !md5Fingerprint(key_begin, len, h1, h2)){
+        h1 = (static_cast<uint64_t>(hashAP(key_begin, len, salt_[0])) << 32) |
+             hashAP(key_begin, len, salt_[salt_.size() - 1]);
+        h2 = h1;
+    }
+    h1 = mix64(h1 ^ bf_hdr.randseed_);
+    h2 = mix64(h2 + bf_hdr.randseed_ + 0x9E3779B97F4A7C15ULL);
+
+    //every probe takes the next BBF_PROBE_BITS bits of h2, which is
+    //re-mixed once its 64 bits are used up
+    const uint64_t blocks = bf_hdr.rawtablesize_ / BBF_BLOCK_BYTES;
+    const std::size_t slices = 64 / BBF_PROBE_BITS;
+    for (std::size_t i = 0; i < BBF_BLOCK_WORDS; ++i)
+        mask[i] = 0;
+    for (std::size_t i = 0; i < salt_.size(); ++i){
+        if (i && (0 == i % slices))
+            h2 = mix64(h2 + 0x9E3779B97F4A7C15ULL);
+        const uint32_t bit = (h2 >> (BBF_PROBE_BITS * (i % slices))) & (BBF_BLOCK_BITS - 1);
+        mask[bit / 64] |= 1ULL << (bit % 64);
+    }
+    return bittable_ + (h1 % blocks) * BBF_BLOCK_BYTES;
+}
+
+void BlockedBloomFilter::insert
+(const unsigned char* key_begin, const unsigned int len)
+{
+    uint64_t mask[BBF_BLOCK_WORDS] __attribute__((aligned(16)));
+    uint64_t* block = (uint64_t*)probe(key_begin, len, mask);
+    for (std::size_t i = 0; i < BBF_BLOCK_WORDS; ++i)
+        block[i] |= mask[i];
+    ++bf_hdr.inserted_element_count_;
+}
+
+bool BlockedBloomFilter::contains
+(const unsigned char* key_begin, const unsigned int len) const
+{
+    uint64_t mask[BBF_BLOCK_WORDS] __attribute__((aligned(16)));
+    const uint64_t* block = (const uint64_t*)probe(key_begin, len, mask);
+#ifdef __SSE2__
+    //the key is absent if any probe bit is set in mask but not in the block
+    __m128i miss = _mm_setzero_si128();
+    for (std::size_t i = 0; i < BBF_BLOCK_WORDS; i += 2){
+        miss = _mm_or_si128(miss, _mm_andnot_si128(
+                        _mm_load_si128((const __m128i*)(block + i)),
+                        _mm_load_si128((const __m128i*)(mask + i))));
+    }
+    return 0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi8(miss, _mm_setzero_si128()));
+#else
+    uint64_t miss = 0;
+    for (std::size_t i = 0; i < BBF_BLOCK_WORDS; ++i)
+        miss |= mask[i] & ~block[i];
+    return 0 == miss;
+#endif
+}
+
+
+/******************SCALABLE BLOOM FILTER CLASS *****************/
+ScalableBloomFilter::ScalableBloomFilter()
+{
+    sbf_hdr.magic_ = SBF_MAGIC_NUM;
+    sbf_hdr.filtercount_ = 0;
+    sbf_hdr.blocked_ = 0;
+    sbf_hdr.md5keys_ = 0;
+    sbf_hdr.initial_element_count_ = 0;
+    sbf_hdr.randseed_ = 0xA5A5A5;
+    sbf_hdr.desiredfpp_ = 0.001;
+}
+
+ScalableBloomFilter::ScalableBloomFilter(const BloomParameters& bp, bool blocked, bool md5keys)
+{
+    sbf_hdr.magic_ = SBF_MAGIC_NUM;
+    sbf_hdr.filtercount_ = 0;
+    sbf_hdr.blocked_ = blocked ? 1 : 0;
+    sbf_hdr.md5keys_ = md5keys ? 1 : 0;
+    sbf_hdr.initial_element_count_ = bp.projected_element_count;
+    sbf_hdr.randseed_ = bp.randseed;
+    sbf_hdr.desiredfpp_ = bp.fpp;
+    grow();
+}
+
+ScalableBloomFilter::~ScalableBloomFilter()
+{
+    release();
+}
+
+void ScalableBloomFilter::release()
+{
+    for (std::size_t i = 0; i < filters_.size(); ++i)
+        delete filters_[i];
+    filters_.clear();
+    sbf_hdr.filtercount_ = 0;
+}
+
+int ScalableBloomFilter::grow()
+//stage i holds initial_element_count_ * SBF_GROWTH_RATIO^i elements
+//at fpp desiredfpp_ * (1 - SBF_TIGHTEN_RATIO) * SBF_TIGHTEN_RATIO^i
+{
+    if (filters_.size() >= SBF_MAX_FILTERS)
+        return -1;
+
+    const unsigned int stage = filters_.size();
+    BloomParameters pmt;
+    pmt.projected_element_count = sbf_hdr.initial_element_count_;
+    for (unsigned int i = 0; i < stage; ++i)
+        pmt.projected_element_count *= SBF_GROWTH_RATIO;
+    pmt.fpp = sbf_hdr.desiredfpp_ * (1.0 - SBF_TIGHTEN_RATIO) * std::pow(SBF_TIGHTEN_RATIO, 1.0 * stage);
+    pmt.randseed = sbf_hdr.randseed_ + stage; //different salts for every stage
+    if (!pmt || !pmt.computeOptPara()){
+        cout << "Error: Invalid set of bloom filter parameters in ScalableBloomFilter::grow()" << endl;
+        return -1;
+    }
+
+    if (sbf_hdr.blocked_)
+        filters_.push_back(new BlockedBloomFilter(pmt, sbf_hdr.md5keys_));
+    else
+        filters_.push_back(new BloomFilter(pmt));
+    sbf_hdr.filtercount_ = filters_.size();
+    return 0;
+}
+
+unsigned long long int ScalableBloomFilter::size() const
+{
+    unsigned long long int bits = 0;
+    for (std::size_t i = 0; i < filters_.size(); ++i)
+        bits += filters_[i]->size();
+    return bits;
+}
+
+unsigned long long int ScalableBloomFilter::elementCount() const
+{
+    unsigned long long int count = 0;
+    for (std::size_t i = 0; i < filters_.size(); ++i)
+        count += filters_[i]->elementCount();
+    return count;
+}
+
+double ScalableBloomFilter::effectiveFPP() const
+//a key is falsely reported if any one of the stages reports it
+{
+    double pass = 1.0;
+    for (std::size_t i = 0; i < filters_.size(); ++i)
+        pass *= 1.0 - filters_[i]->effectiveFPP();
+    return 1.0 - pass;
+}
+
+void ScalableBloomFilter::insert
+(const unsigned char* key_begin, const unsigned int len)
+{
+    if (filters_.empty() && (0 != grow()))
+        return;
+
+    BloomFilter* bf = filters_.back();
+    bf->insert(key_begin, len);
+    //the stage is full once it reaches its projected count and its
+    //effective fpp degrades past the fpp it is designed for
+    if ( (bf->elementCount() >= bf->bf_hdr.projected_element_count_) &&
+         (bf->effectiveFPP() > bf->bf_hdr.desiredfpp_) )
+        grow();
+}
+
+void ScalableBloomFilter::insert(const char* data, const unsigned int len)
+{
+    insert(reinterpret_cast<const unsigned char*>(data), len);
+}
+
+void ScalableBloomFilter::insert(const std::string& key)
+{
+    insert(reinterpret_cast<const unsigned char*>(key.c_str()), key.length());
+}
+
+bool ScalableBloomFilter::contains
+(const unsigned char* key_begin, const unsigned int len) const
+{
+    //the newest stage is the largest one, query it first
+    for (std::size_t i = filters_.size(); i > 0; --i){
+        if (filters_[i - 1]->contains(key_begin, len))
+            return true;
+    }
+    return false;
+}
+
+bool ScalableBloomFilter::contains(const char* data, const unsigned int len) const
+{
+    return contains(reinterpret_cast<const unsigned char*>(data), len);
+}
+
+bool ScalableBloomFilter::contains(const std::string& key) const
+{
+    return contains(reinterpret_cast<const unsigned char*>(key.c_str()), key.size());
+}
+
+int writesbf(ofstream &des_file, ScalableBloomFilter *sbf)
+//ScalableBloomFilterдļdes_file
+{
+    if(!des_file.is_open()){
+        cout << "Error: invalid argument -- ofstream des_file not open in ScalableBloomFilter::writesbf " << endl;
+        return -1;
+    }
+    int wsize = SBF_HDR_SZ;
+    sbf->sbf_hdr.filtercount_ = sbf->filters_.size();
+    des_file.write((const char *)(&(sbf->sbf_hdr)), SBF_HDR_SZ);
+    for (std::size_t i = 0; i < sbf->filters_.size(); ++i){
+        int ret = writebf(des_file, sbf->filters_[i]);
+        if (ret < 0)
+            return -1;
+        wsize += ret;
+    }
+    return wsize;
+}
+
+int readsbf(ifstream &src_file, ScalableBloomFilter *sbf)
+{
+    int rsize = 0;
+    ScalableBloomHeader hdr;
+    src_file.read((char*)(&hdr), SBF_HDR_SZ);
+    if (src_file.gcount() != SBF_HDR_SZ || hdr.magic_ != SBF_MAGIC_NUM ||
+        hdr.filtercount_ > SBF_MAX_FILTERS){
+        cout << "Error: read header in ScalableBloomFilter::readsbf" << endl;
+        return -1;
+    }
+    rsize = SBF_HDR_SZ;
+
+    sbf->release();
+    memcpy(&sbf->sbf_hdr, &hdr, SBF_HDR_SZ);
+    for (unsigned int i = 0; i < hdr.filtercount_; ++i){
+        BloomFilter* bf = hdr.blocked_ ? new BlockedBloomFilter(hdr.md5keys_) : new BloomFilter;
+        int ret = readbf(src_file, bf);
+        if (ret < 0){
+            //no half loaded filter is kept, nor the stages before it
+            cout << "Error: read the " << i << "th filter in ScalableBloomFilter::readsbf" << endl;
+            delete bf;
+            sbf->release();
+            return -1;
+        }
+        rsize += ret;
+        sbf->filters_.push_back(bf);
+    }
+    sbf->sbf_hdr.filtercount_ = sbf->filters_.size();
+    return rsize;
+}
+
+
 //#define BLOOMFILTER_TEST
 #ifdef BLOOMFILTER_TEST
 
@@ -557,6 +915,36 @@ int main()
             cout << "read_bloom does not contain: " << invalid_str_list[0] << endl;
     src_file.close();
 
+    //insert 8 times the projected count into a scalable bloom filter
+    //the same with cache line blocked stages
+    ScalableBloomFilter sbf(pmt), bsbf(pmt, true);
+    char key[32] = {0};
+    for (unsigned int i = 0; i < 8 * pmt.projected_element_count; ++i){
+        sprintf(key, "key-%u", i);
+        sbf.insert(key, strlen(key));
+        bsbf.insert(key, strlen(key));
+    }
+    cout << "sbf stages: " << sbf.filterCount() << ", elements: " << sbf.elementCount()
+         << ", effective fpp: " << sbf.effectiveFPP() << endl;
+    cout << "blocked sbf stages: " << bsbf.filterCount() << ", bits: " << bsbf.size()
+         << ", effective fpp: " << bsbf.effectiveFPP() << endl;
+
+    //32-byte keys that are not md5 fingerprints must be hashed as a whole
+    BlockedBloomFilter pbf(pmt);
+    char path[40] = {0};
+    unsigned int fp = 0;
+    for (unsigned int i = 0; i < pmt.projected_element_count; ++i){
+        sprintf(path, "/home/dedup/some/long/dir/%06u", i);
+        pbf.insert(path, 32);
+    }
+    for (unsigned int i = 0; i < pmt.projected_element_count; ++i){
+        sprintf(path, "/home/dedup/other/lng/dir/%06u", i);
+        if (pbf.contains(path, 32))
+            ++fp;
+    }
+    cout << "32-byte path keys, false positives: " << fp << " of " << pmt.projected_element_count
+         << ", effective fpp: " << pbf.effectiveFPP() << endl;
+
     return 0;
 }
 #endif // BLOOMFILTER_TEST
@@ -0,0 +1,273 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "CuckooFilter.h"
+
+static inline uint64_t mixhash(const unsigned char* key_begin, const unsigned int len)
+//FNV-1a over the key, then the finalizer of MurmurHash3
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < len; i++){
+        h ^= key_begin[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+CuckooFilter::CuckooFilter(const uint64_t cap)
+{
+    memset(&cf_hdr, 0, CF_HDR_SZ);
+    cf_hdr.magic = CF_MAGIC_NUM;
+    cf_hdr.bucket_nr = (uint64_t)(cap / (CF_BUCKET_SLOTS * CF_LOAD_MAX)) + 1;
+    seed = 0x9E3779B9;
+    table = (uint16_t *)calloc(cf_hdr.bucket_nr * CF_BUCKET_SLOTS, sizeof(uint16_t));
+    if (0 == table){
+        fprintf(stderr, "Error: malloc %llu buckets in CuckooFilter::CuckooFilter(...)\n",
+                (unsigned long long)cf_hdr.bucket_nr);
+        cf_hdr.bucket_nr = 0;
+    }
+}
+
+CuckooFilter::~CuckooFilter()
+{
+    if (table){
+        free(table);
+        table = 0;
+    }
+}
+
+inline void CuckooFilter::hashkey(const unsigned char* key_begin, const unsigned int len,
+                                  uint64_t &idx, uint16_t &fp) const
+{
+    uint64_t h = mixhash(key_begin, len);
+    idx = (h & 0xFFFFFFFFFFFFULL) % cf_hdr.bucket_nr;
+    fp = (uint16_t)(h >> 48);
+    if (0 == fp)
+        fp = 1;
+}
+
+inline uint64_t CuckooFilter::altindex(const uint64_t idx, const uint16_t fp) const
+//an involution for any bucket_nr: altindex(altindex(i, fp), fp) == i
+{
+    uint64_t h = ((uint64_t)fp * 0x5bd1e995) % cf_hdr.bucket_nr;
+    return (h + cf_hdr.bucket_nr - idx) % cf_hdr.bucket_nr;
+}
+
+bool CuckooFilter::insertslot(const uint64_t idx, const uint16_t fp)
+{
+    uint16_t *bucket = table + idx * CF_BUCKET_SLOTS;
+    for (int i = 0; i < CF_BUCKET_SLOTS; i++){
+        if (0 == bucket[i]){
+            bucket[i] = fp;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CuckooFilter::findslot(const uint64_t idx, const uint16_t fp) const
+{
+    const uint16_t *bucket = table + idx * CF_BUCKET_SLOTS;
+    for (int i = 0; i < CF_BUCKET_SLOTS; i++){
+        if (fp == bucket[i])
+            return true;
+    }
+    return false;
+}
+
+bool CuckooFilter::removeslot(const uint64_t idx, const uint16_t fp)
+{
+    uint16_t *bucket = table + idx * CF_BUCKET_SLOTS;
+    for (int i = 0; i < CF_BUCKET_SLOTS; i++){
+        if (fp == bucket[i]){
+            bucket[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CuckooFilter::insert(const unsigned char* key_begin, const unsigned int len)
+{
+    uint64_t idx = 0;
+    uint16_t fp = 0;
+    if (0 == table || full())
+        return false;
+
+    hashkey(key_begin, len, idx, fp);
+    if (insertslot(idx, fp) || insertslot(altindex(idx, fp), fp)){
+        cf_hdr.count++;
+        return true;
+    }
+
+    //kick a random fingerprint of one of the buckets to its other bucket
+    if ((seed = seed * 1103515245 + 12345) & 0x10000)
+        idx = altindex(idx, fp);
+    for (int kick = 0; kick < CF_MAX_KICKS; kick++){
+        seed = seed * 1103515245 + 12345;
+        uint16_t *slot = table + idx * CF_BUCKET_SLOTS + ((seed >> 16) % CF_BUCKET_SLOTS);
+        uint16_t out = *slot;
+        *slot = fp;
+        fp = out;
+        idx = altindex(idx, fp);
+        if (insertslot(idx, fp)){
+            cf_hdr.count++;
+            return true;
+        }
+    }
+    cf_hdr.victim_fp = fp;
+    cf_hdr.victim_idx = idx;
+    cf_hdr.count++;
+    return true;
+}
+
+bool CuckooFilter::contains(const unsigned char* key_begin, const unsigned int len) const
+{
+    uint64_t idx = 0, alt = 0;
+    uint16_t fp = 0;
+    if (0 == table)
+        return true;
+
+    hashkey(key_begin, len, idx, fp);
+    alt = altindex(idx, fp);
+    if (findslot(idx, fp) || findslot(alt, fp))
+        return true;
+    return fp == cf_hdr.victim_fp && (idx == cf_hdr.victim_idx || alt == cf_hdr.victim_idx);
+}
+
+bool CuckooFilter::remove(const unsigned char* key_begin, const unsigned int len)
+{
+    uint64_t idx = 0, alt = 0;
+    uint16_t fp = 0;
+    if (0 == table)
+        return false;
+
+    hashkey(key_begin, len, idx, fp);
+    alt = altindex(idx, fp);
+    if (fp == cf_hdr.victim_fp && (idx == cf_hdr.victim_idx || alt == cf_hdr.victim_idx)){
+        cf_hdr.victim_fp = 0;
+        cf_hdr.count--;
+        return true;
+    }
+    if (!removeslot(idx, fp) && !removeslot(alt, fp))
+        return false;
+    cf_hdr.count--;
+
+    //a slot is free now, give the victim a home again
+    if (full()){
+        uint16_t victim = cf_hdr.victim_fp;
+        cf_hdr.victim_fp = 0;
+        if (insertslot(cf_hdr.victim_idx, victim) || insertslot(altindex(cf_hdr.victim_idx, victim), victim))
+            return true;
+        cf_hdr.victim_fp = victim;
+    }
+    return true;
+}
+
+double CuckooFilter::effectiveFPP() const
+//a query compares with the 2 * CF_BUCKET_SLOTS slots of its two buckets
+{
+    if (0 == cf_hdr.bucket_nr)
+        return 1.0;
+    double load = (double)cf_hdr.count / capacity();
+    return 1.0 - pow(1.0 - 1.0 / 65536, 2.0 * CF_BUCKET_SLOTS * load);
+}
+
+int writecf(ostream &des_file, CuckooFilter *cf)
+{
+    if (0 == cf || 0 == cf->table)
+        return -1;
+    des_file.write((const char *)(&cf->cf_hdr), CF_HDR_SZ);
+    des_file.write((const char *)cf->table, cf->cf_hdr.bucket_nr * CF_BUCKET_SLOTS * sizeof(uint16_t));
+    if (!des_file.good()){
+        fprintf(stderr, "Error: write cuckoo filter in writecf(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+int readcf(istream &src_file, CuckooFilter *cf)
+{
+    CuckooHeader hdr;
+    uint16_t *table = 0;
+    uint64_t len = 0;
+
+    src_file.read((char *)(&hdr), CF_HDR_SZ);
+    if ((uint64_t)src_file.gcount() != CF_HDR_SZ || CF_MAGIC_NUM != hdr.magic || 0 == hdr.bucket_nr){
+        fprintf(stderr, "Error: read cuckoo filter header in readcf(...)\n");
+        return -1;
+    }
+    len = hdr.bucket_nr * CF_BUCKET_SLOTS * sizeof(uint16_t);
+    table = (uint16_t *)malloc(len);
+    if (0 == table){
+        fprintf(stderr, "Error: malloc cuckoo filter table in readcf(...)\n");
+        return -1;
+    }
+    src_file.read((char *)table, len);
+    if ((uint64_t)src_file.gcount() != len){
+        fprintf(stderr, "Error: read cuckoo filter table in readcf(...)\n");
+        free(table);
+        return -1;
+    }
+    if (cf->table)
+        free(cf->table);
+    cf->table = table;
+    memcpy(&cf->cf_hdr, &hdr, CF_HDR_SZ);
+    return 0;
+}
+
+//#define CUCKOOFILTER_TEST
+#ifdef CUCKOOFILTER_TEST
+#define TEST_KEYS 1000000
+
+int main()
+{
+    CuckooFilter cf(TEST_KEYS);
+    uint64_t missed = 0, fp = 0;
+    char key[33] = {0};
+
+    for (uint32_t i = 0; i < TEST_KEYS; i++){
+        sprintf(key, "%032x", i);
+        if (!cf.insert((const unsigned char *)key, 32))
+            cout << "full at " << i << endl;
+    }
+    for (uint32_t i = 0; i < TEST_KEYS; i++){
+        sprintf(key, "%032x", i);
+        missed += cf.contains((const unsigned char *)key, 32) ? 0 : 1;
+        sprintf(key, "%032x", i + TEST_KEYS);
+        fp += cf.contains((const unsigned char *)key, 32) ? 1 : 0;
+    }
+    cout << "keys: " << cf.elementCount() << ", bits per key: " << (double)cf.size() / cf.elementCount()
+         << ", missed: " << missed << ", fpp: " << (double)fp / TEST_KEYS
+         << " (estimated " << cf.effectiveFPP() << ")" << endl;
+
+    //delete the even keys
+    missed = 0;
+    fp = 0;
+    for (uint32_t i = 0; i < TEST_KEYS; i += 2){
+        sprintf(key, "%032x", i);
+        missed += cf.remove((const unsigned char *)key, 32) ? 0 : 1;
+    }
+    for (uint32_t i = 0; i < TEST_KEYS; i++){
+        sprintf(key, "%032x", i);
+        if (i % 2)
+            missed += cf.contains((const unsigned char *)key, 32) ? 0 : 1;
+        else
+            fp += cf.contains((const unsigned char *)key, 32) ? 1 : 0;
+    }
+    cout << "after removing half, keys: " << cf.elementCount() << ", missed: " << missed
+         << ", removed keys found: " << fp << endl;
+    return 0;
+}
+#endif // CUCKOOFILTER_TEST
@@ -19,6 +19,8 @@ Hshdb_header:
     voff
 Hash Buckets:
     bucket[i]
+    (header.bcap slots at header.hbucket_off; the array is moved to the end of
+    the file when linear hashing needs more slots than were reserved)
 Hash Entries:
     ith hash_entry
     ith key
@@ -26,7 +28,7 @@ Hash Entries:
 **/
 
 HashDB::HashDB( uint64_t tnum, uint32_t bnum,  uint32_t cnum,
-               hashfunc_t hf1, hashfunc_t hf2)
+               hashfunc_t hf1, hashfunc_t hf2, bool md5)
 {
 
     header.tnum = tnum;
@@ -34,10 +36,15 @@ HashDB::HashDB( uint64_t tnum, uint32_t bnum,  uint32_t cnum,
     header.cnum = cnum;
     hfunc1 = hf1;
     hfunc2 = hf2;
+    md5keys = md5;
 
     header.magic = HASHDB_MAGIC;
     header.hbucket_off = HASHDB_HDR_SZ;
     header.hentry_off = HASHDB_HDR_SZ + header.bnum * HASH_BUCKET_SZ;
+    header.bnum0 = bnum;
+    header.bcap = bnum;
+    header.inum = 0;
+    bsplit = bnum;
 
     memset(dbpath, 0, PATH_MAX_LEN);
     memset(bfpath, 0, PATH_MAX_LEN);
@@ -80,15 +87,15 @@ int HashDB::openDB(const char *dbname, const char *bfname, bool isnewdb)
         //ݸò½һbloom
         BloomParameters pmt;
         pmt.projected_element_count = header.tnum; // expect to insert 1000 elements into the filter
-        pmt.fpp = 0.0001; //maximum tolerable false positive probability
+        pmt.fpp = HASHDB_BLOOM_FPP; //maximum tolerable false positive probability
         pmt.randseed = 0xA5A5A5A5;
         if(!pmt)
         {
             cout << "Error: Invalid set of bloom filter parameters!" << endl;
             return -1;
         }
-        pmt.computeOptPara();
-        bloom = new BloomFilter(pmt);
+        //the filter appends larger stages once header.tnum is exceeded
+        bloom = new ScalableBloomFilter(pmt, HASHDB_BLOCKED_BLOOM, md5keys);
 
         ofstream obf_file;
         db_file.open(dbpath, ios::binary | ios::out);
@@ -97,7 +104,7 @@ int HashDB::openDB(const char *dbname, const char *bfname, bool isnewdb)
             cout << "Error: open bloom filter file in HashDB::openDB(...)" << endl;
             return -1;
         }
-        writebf(obf_file, bloom);
+        writesbf(obf_file, bloom);
         obf_file.close();
 
     }else{ //existed hashdb
@@ -109,8 +116,13 @@ int HashDB::openDB(const char *dbname, const char *bfname, bool isnewdb)
         bf_file_i >> noskipws;
         db_file >> noskipws;
 
-        bloom = new BloomFilter;
-        readbf(bf_file_i, bloom);
+        bloom = new ScalableBloomFilter;
+        if (readsbf(bf_file_i, bloom) < 0){
+            cout << "Error: read bloom filter in HashDB::openDB(...)" << endl;
+            bf_file_i.close();
+            ret = -1;
+            goto _OPENDB_EXIT;
+        }
         bf_file_i.close();
 
         db_file.read((char *)(&header), HASHDB_HDR_SZ);
@@ -128,12 +140,16 @@ int HashDB::openDB(const char *dbname, const char *bfname, bool isnewdb)
         }
     }
 
-    if(! (bucket = (HASH_BUCKET *)malloc(header.bnum * HASH_BUCKET_SZ)) ){
+    bsplit = header.bnum0;
+    while (bsplit * 2 <= header.bnum)
+        bsplit *= 2;
+
+    if(! (bucket = (HASH_BUCKET *)malloc(header.bcap * HASH_BUCKET_SZ)) ){
        ret = -1;
        cout << "Error: malloc hash buckets in HashDB::openDB(...)" << endl;
        goto _OPENDB_EXIT;
     }
-    for (uint64_t i = 0; i < header.bnum; i++)
+    for (uint64_t i = 0; i < header.bcap; i++)
         bucket[i].off = 0;
 
     if(! (cache = (HASH_ENTRY *)malloc(header.cnum * HASH_ENTRY_SZ)) ){
@@ -143,6 +159,7 @@ int HashDB::openDB(const char *dbname, const char *bfname, bool isnewdb)
     }
     for(uint64_t i = 0; i < header.cnum; i++){
         cache[i].iscached = false;
+        cache[i].isdirty = false;
         cache[i].off = 0;
         cache[i].left = 0;
         cache[i].right = 0;
@@ -156,8 +173,9 @@ int HashDB::openDB(const char *dbname, const char *bfname, bool isnewdb)
 
     if (isnewdb){//for non-existed hashdb, ½hashdbдļ
         db_file.write((const char *)(&header), HASHDB_HDR_SZ);
-        db_file.write((const char *)(bucket), header.bnum * HASH_BUCKET_SZ);
+        db_file.write((const char *)(bucket), header.bcap * HASH_BUCKET_SZ);
     }else { //for existed hashdb, read data from it to fill up cache
+        db_file.seekg(header.hbucket_off, ios::beg);
         db_file.read( (char *)bucket, header.bnum * HASH_BUCKET_SZ);
         rwsize = db_file.gcount();
         if (rwsize != header.bnum * HASH_BUCKET_SZ){
@@ -261,6 +279,7 @@ int HashDB::read2fillcache(fstream &db_file)
         memset(cache[pos].value, 0, hentry.vsize);
         memcpy(cache[pos].value, value, hentry.vsize);
         cache[pos].iscached = true;
+        cache[pos].isdirty = false;
     }
     return 0;
 }
@@ -278,6 +297,7 @@ int HashDB::closeDB(int flash)
     ssize_t wsize = 0;
     int ret = 0;
     ofstream db_file, bf_file;
+    fstream swap_file;
 
     if (flash <= 0) //Ҫhashdbдļֱӹصhashdb
         goto _CLOSE_EXIT;
@@ -289,18 +309,21 @@ int HashDB::closeDB(int flash)
             continue;
         hash1 = hfunc1(cache[i].key);
         hash2 = cache[i].shash;
-        if (-1 == swapout(hash1, hash2, &cache[i])){
+        if (-1 == swapout(swap_file, hash1, hash2, &cache[i])){
             ret = -1;
             goto _CLOSE_EXIT;
         }
     }
+    if (swap_file.is_open())
+        swap_file.close();
 
     db_file.open(dbpath, ios::binary | ios::in);
     bf_file.open(bfpath, ios::binary);
     bf_file.seekp(0, ios::beg);
-    writebf(bf_file, bloom);
+    writesbf(bf_file, bloom);
 
     db_file.write((const char*)(&header), HASHDB_HDR_SZ);
+    db_file.seekp(header.hbucket_off, ios::beg);
     db_file.write((const char*)bucket, HASH_BUCKET_SZ * header.bnum);
 
     db_file.close();
@@ -337,6 +360,13 @@ _CLOSE_EXIT:
 
 
 int HashDB::setDB(const char* key, const void* value, const int vsize)
+{
+    fstream db_file;
+    return setDB(db_file, key, value, vsize);
+}
+
+
+int HashDB::setDB(fstream &db_file, const char* key, const void* value, const int vsize)
 /** 1)cacheвǷںйؼkeyhash_entry,
 ޣ2) cache[pos]Ѵhash_entry oldд
     2)hashdbӦĴļ뺬йؼֵhash_entry
@@ -361,7 +391,7 @@ In sum, 
     if (cache[pos].iscached && ( (hash2 != cache[pos].shash) || (strcmp(key, cache[pos].key))!= 0 ) ){
         he_hash1 = hfunc1(cache[pos].key);
         he_hash2 = cache[pos].shash;
-        if (-1 == swapout(he_hash1, he_hash2, &cache[pos])){
+        if (-1 == swapout(db_file, he_hash1, he_hash2, &cache[pos])){
             cout<< "Error: swap out the hash entry in cache[pos] into disk in HashDB::setDB\n" << endl;
             return -1;
         }
@@ -370,7 +400,7 @@ In sum, 
     /*swap the hash entry specified by key from disk hashdb file into cache[pos]
     */
     if (!cache[pos].iscached && (bloom->contains(key, strlen(key))) ){
-        if ( -1 == swapin(key, hash1, hash2, &cache[pos]) )
+        if ( -1 == swapin(db_file, key, hash1, hash2, &cache[pos]) )
             return -1;
     }
     if ( (strlen(key) > HASHDB_KEY_MAX_SZ) || (vsize > HASHDB_VALUE_MAX_SZ) ){
@@ -397,6 +427,7 @@ In sum, 
     cache[pos].tsize = HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ + HASHDB_VALUE_MAX_SZ;
   //  cache[pos].tsize = HASH_ENTRY_SZ + cache[pos].ksize + cache[pos].vsize;
     cache[pos].shash = hash2;
+    cache[pos].isdirty = true;
     if (! cache[pos].iscached){
         //new hash entry, hashdbӦļлľдںиùؼkeyhash_entry
         cache[pos].off = 0;
@@ -416,7 +447,20 @@ int HashDB::getDB(const char* key, void* value, int &vsize)
 //иùؼkeyhash_entry򷵻-2
 //쳣ʧܣ򷵻-1;
 {
-    if (!key)
+    const void *cached = 0;
+    int ret = peekDB(key, &cached, vsize);
+    //value ָһοռʵַ
+    if (0 == ret)
+        memcpy(value, cached, vsize);
+    return ret;
+}
+
+
+int HashDB::peekDB(const char* key, const void** value, int &vsize)
+//the same as getDB, but *value points to the cached value instead of a copy,
+//it is valid until the next call on the hashdb
+{
+    if (!key || !value)
         return -1;
 
     int pos, ret;
@@ -430,26 +474,242 @@ int HashDB::getDB(const char* key, void* value, int &vsize)
         return -2;
     }
 
+    fstream db_file;
     pos = hash1 % header.cnum;
     if (cache[pos].iscached && (hash2 != cache[pos].shash || 0 != strcmp(key, cache[pos].key))){
         he_hash1 = hfunc1(cache[pos].key);
         he_hash2 = cache[pos].shash;
-        if (-1 == swapout(he_hash1, he_hash2, &cache[pos]) )
+        if (-1 == swapout(db_file, he_hash1, he_hash2, &cache[pos]) )
             return -1;
     }
 
     if (!cache[pos].iscached){
-        if (0 != (ret = swapin(key, hash1, hash2, &cache[pos])) )
+        if (0 != (ret = swapin(db_file, key, hash1, hash2, &cache[pos])) )
             return ret;
     }
-    //value ָһοռʵַ
-    memcpy(value, cache[pos].value, cache[pos].vsize);
+    *value = cache[pos].value;
     vsize = cache[pos].vsize;
 
     return 0;
 }
 
 
+int HashDB::containDB(const char* key)
+/** membership only: return 0 if key exists, -2 if not, -1 on error.
+Nothing is allocated and the cache is not changed, the bucket tree is walked
+with (hash entry, key) read into a stack buffer
+**/
+{
+    if (!key)
+        return -1;
+    if (!bloom->contains(key, strlen(key)))
+        return -2;
+
+    uint32_t hash1 = hfunc1(key);
+    uint32_t hash2 = hfunc2(key);
+    uint32_t pos = hash1 % header.cnum;
+    if (cache[pos].iscached && hash2 == cache[pos].shash && 0 == strcmp(key, cache[pos].key))
+        return 0;
+
+    uint64_t root = bucket[bucketpos(hash1)].off;
+    if (!root)
+        return -2;
+
+    uint64_t hebuf[(HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ) / sizeof(uint64_t) + 1];
+    const ssize_t hebuf_sz = HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ;
+    HASH_ENTRY *hentry = (HASH_ENTRY *)hebuf;
+    char *hkey = (char *)hebuf + HASH_ENTRY_SZ;
+    int cmp = 0, ret = -2;
+    int fd = open(dbpath, O_RDONLY);
+    if (-1 == fd){
+        cout << "Error: open " << dbpath << " in HashDB::containDB(...)" << endl;
+        return -1;
+    }
+    while (root){
+        if (hebuf_sz != pread(fd, hebuf, hebuf_sz, root)){
+            cout << "Error: read hash entry at " << root << " in HashDB::containDB(...)" << endl;
+            ret = -1;
+            break;
+        }
+        hkey[HASHDB_KEY_MAX_SZ - 1] = 0;
+        if (hash2 < hentry->shash) root = hentry->left;
+        else if (hash2 > hentry->shash) root = hentry->right;
+        else if (0 == (cmp = strcmp(key, hkey))){
+            ret = 0;
+            break;
+        }else
+            root = (cmp < 0) ? hentry->left : hentry->right;
+    }
+    close(fd);
+    return ret;
+}
+
+
+static bool probe_less(const BATCH_PROBE &x, const BATCH_PROBE &y)
+{
+    return x.off < y.off;
+}
+
+
+int HashDB::batchgetDB(const char **keys, const int nr, void **values, int *vsizes, int *rets)
+/** look up nr keys at once, values[i] must point to HASHDB_VALUE_MAX_SZ bytes,
+rets[i] is set as getDB returns for keys[i] (0 : found, -2 : not exist).
+The keys passing the bloom filter and missing in the cache walk their bucket
+trees together, level by level: the nodes of one level are read in offset
+order, and a node shared by several keys is read once. The cache is not
+changed, so no hash entry is swapped out by a lookup.
+return the number of keys found, -1 on error
+**/
+{
+    if (!keys || !values || !vsizes || !rets || nr < 0)
+        return -1;
+
+    vector<BATCH_PROBE> probes, next;
+    BATCH_PROBE probe;
+    uint32_t hash1, pos;
+    int found = 0, cmp = 0;
+    int hebuf_sz = HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ + HASHDB_VALUE_MAX_SZ;
+    void *hebuf = 0;
+    HASH_ENTRY *hentry = 0;
+    char *hkey = 0;
+    ifstream db_file;
+
+    for (int i = 0; i < nr; i++){
+        rets[i] = -2;
+        vsizes[i] = 0;
+        if (!keys[i] || !bloom->contains(keys[i], strlen(keys[i])))
+            continue;
+
+        hash1 = hfunc1(keys[i]);
+        probe.hash2 = hfunc2(keys[i]);
+        probe.idx = i;
+        pos = hash1 % header.cnum;
+        if (cache[pos].iscached && probe.hash2 == cache[pos].shash && 0 == strcmp(keys[i], cache[pos].key)){
+            memcpy(values[i], cache[pos].value, cache[pos].vsize);
+            vsizes[i] = cache[pos].vsize;
+            rets[i] = 0;
+            found++;
+            continue;
+        }
+        probe.off = bucket[bucketpos(hash1)].off;
+        if (probe.off)
+            probes.push_back(probe);
+    }
+    if (probes.empty())
+        return found;
+
+    db_file.open(dbpath, ios::binary);
+    db_file >> noskipws;
+    if (!db_file.is_open() || 0 == (hebuf = malloc(hebuf_sz))){
+        cout << "Error: open " << dbpath << " or malloc hash entry buffer in HashDB::batchgetDB(...)" << endl;
+        found = -1;
+        goto _BATCHGET_EXIT;
+    }
+    hentry = (HASH_ENTRY *)hebuf;
+    hkey = (char *)hebuf + HASH_ENTRY_SZ;
+
+    while (!probes.empty()){
+        std::sort(probes.begin(), probes.end(), probe_less);
+        next.clear();
+        for (size_t j = 0; j < probes.size(); j++){
+            if (0 == j || probes[j].off != probes[j - 1].off){
+                db_file.seekg(probes[j].off, ios::beg);
+                db_file.read((char *)hebuf, hebuf_sz);
+                if (hebuf_sz != db_file.gcount()){
+                    cout << "Error: read hash entry at " << probes[j].off << " in HashDB::batchgetDB(...)" << endl;
+                    found = -1;
+                    goto _BATCHGET_EXIT;
+                }
+            }
+
+            probe = probes[j];
+            if (probe.hash2 < hentry->shash)
+                probe.off = hentry->left;
+            else if (probe.hash2 > hentry->shash)
+                probe.off = hentry->right;
+            else if (0 == (cmp = strcmp(keys[probe.idx], hkey))){
+                memcpy(values[probe.idx], hkey + HASHDB_KEY_MAX_SZ, hentry->vsize);
+                vsizes[probe.idx] = hentry->vsize;
+                rets[probe.idx] = 0;
+                found++;
+                continue;
+            }else
+                probe.off = (cmp < 0) ? hentry->left : hentry->right;
+            if (probe.off)
+                next.push_back(probe);
+        }
+        probes.swap(next);
+    }
+
+_BATCHGET_EXIT:
+    if (db_file.is_open())
+        db_file.close();
+    if (hebuf){
+        free(hebuf);
+        hebuf = 0;
+    }
+    return found;
+}
+
+
+static bool order_less(const pair<uint32_t, int> &x, const pair<uint32_t, int> &y)
+{
+    return x.first < y.first;
+}
+
+
+int HashDB::batchsetDB(const char **keys, const void **values, const int *vsizes, const int nr)
+/** set nr keys at once: the keys are applied in the order of their buckets,
+so that the swaps of consecutive keys walk the same trees, and all the swaps
+share one open disk file; a key given twice keeps its last value
+**/
+{
+    if (!keys || !values || !vsizes || nr < 0)
+        return -1;
+
+    vector< pair<uint32_t, int> > order;
+    fstream db_file;
+    int ret = 0;
+
+    order.reserve(nr);
+    for (int i = 0; i < nr; i++){
+        if (!keys[i] || !values[i])
+            return -1;
+        order.push_back(make_pair(bucketpos(hfunc1(keys[i])), i));
+    }
+    std::stable_sort(order.begin(), order.end(), order_less);
+    for (int i = 0; i < nr && 0 == ret; i++){
+        int k = order[i].second;
+        ret = setDB(db_file, keys[k], values[k], vsizes[k]);
+    }
+    if (db_file.is_open())
+        db_file.close();
+    return ret;
+}
+
+
+uint64_t HashDB::memusage() const
+{
+    uint64_t bytes = (uint64_t)header.bcap * HASH_BUCKET_SZ;
+    if (!cache)
+        return bytes;
+    bytes += (uint64_t)header.cnum * HASH_ENTRY_SZ;
+    for (uint32_t i = 0; i < header.cnum; i++){
+        if (cache[i].key)
+            bytes += cache[i].ksize + 1;
+        if (cache[i].value)
+            bytes += cache[i].vsize;
+    }
+    return bytes;
+}
+
+
+uint64_t HashDB::bloomusage() const
+{
+    return (bloom) ? bloom->size() / 8 : 0;
+}
+
+
 int HashDB::unlinkDB()
 {
     if (dbpath)
@@ -462,6 +722,14 @@ int HashDB::unlinkDB()
 
 int HashDB::swapout(const uint32_t hash1, const uint32_t hash2,
                     HASH_ENTRY* he)
+{
+    fstream db_file;
+    return swapout(db_file, hash1, hash2, he);
+}
+
+
+int HashDB::swapout(fstream &db_file, const uint32_t hash1, const uint32_t hash2,
+                    HASH_ENTRY* he)
 /**hash_entry he дhashdbĴļУ
 У
   һhash1ȷڼbucket
@@ -476,106 +744,121 @@ int HashDB::swapout(const uint32_t hash1, const uint32_t hash2,
     char value[HASHDB_VALUE_MAX_SZ] = {0};
     uint64_t root;
     uint32_t pos;
-    int cmp, lr = 0;
+    int cmp, lr = 0, ret = 0;
 
-    int hebuf_sz = HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ + HASHDB_VALUE_MAX_SZ;
-    void *hebuf = 0; // point to (hash_entry + key + value)
+    int hebuf_sz = HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ;
+    void *hebuf = 0; // point to (hash_entry + key), the value is not needed to walk the tree
     char *hkey = 0;
-    void *hvalue = 0;
     HASH_ENTRY* hentry;
 
     HASH_ENTRY parent;
     ssize_t rwsize = 0;
 
-    fstream db_file;
-    db_file.open(dbpath, ios::binary | ios::in | ios::out );
+    if (!he->isdirty) //the disk file already holds the same hash entry
+        goto _SWAPOUT_EXIT;
+
+    if (-1 == opendbfile(db_file)){
+        ret = -1;
+        goto _SWAPOUT_EXIT;
+    }
     db_file >> noskipws;
 
     if (he->off == 0){
-        //he is a new hash_entry, дļ
-        hebuf_sz  = HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ + HASHDB_VALUE_MAX_SZ;
+        //he is a new hash_entry, append it to the disk file
         if (0 == (hebuf = (void*)malloc(hebuf_sz)) ){
-            cout << "Error: malloc buffer for (hash entry, key, value) in HashDB::swapout(...)" << endl;
-            db_file.close();
-            return -1;
+            cout << "Error: malloc buffer for (hash entry, key) in HashDB::swapout(...)" << endl;
+            ret = -1;
+            goto _SWAPOUT_EXIT;
         }
-        //Ӹڵ㿪ʼҵhash_entry heĲλ
-        pos = hash1 % header.bnum;
+        //walk down from the root of the bucket to find the parent of he
+        pos = bucketpos(hash1);
         root = bucket[pos].off;
         parent.off = 0;
         while (root){
-            //rootָ(hashentry, key, value)ֵhebuf
             db_file.seekg(root, ios::beg);
-            //memset(hebuf, 0, hebuf_sz);
-           /* memset(&hentry, 0, HASH_ENTRY_SZ);
-            memset(hkey, 0, 256);
-            memset(hvalue, 0, 128);
-            */
             db_file.read((char *)hebuf, hebuf_sz);
             rwsize = db_file.gcount();
             if (hebuf_sz != rwsize){
-                cout << "Error: read hash entry, key, value in HashDB::swapout(...)" << endl;
-                db_file.close();
-                return -1;
+                cout << "Error: read hash entry, key in HashDB::swapout(...)" << endl;
+                ret = -1;
+                goto _SWAPOUT_EXIT;
             }
 
             hentry = (HASH_ENTRY *)hebuf;
             hkey = (char *)hebuf + HASH_ENTRY_SZ;
-            hvalue = (void *)((char *)hebuf + HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ);
             memcpy(&parent, hentry, HASH_ENTRY_SZ);
 
-            //ڵhash_entry heĲλ
             if ( hash2 < hentry->shash ){
                 root = hentry->left;
                 lr = 0;
             }else if (hash2 > hentry->shash){
                 root = hentry->right;
                 lr = 1;
-            }else {//ϣͻ£Ƚַ
+            }else {//same second hash value, compare the keys
                 cmp = strcmp(he->key, hkey);
                 if (cmp < 0){
                     root = hentry->left;
                     lr = 0;
-                }else if (cmp < 0){
+                }else{
                     root = hentry->right;
                     lr = 1;
                 }
-                else    //will never happen
-                {
-                }
-            }// if... else if... else
+            }
         }//while(root)
 
-
-        if (hebuf){
-            free(hebuf);
-            hebuf = 0;
-        }
-
-        /*ҵµhash_entry he Ĳλãļĩβ, ޸ĸڵ*/
+        /*append he at the end of the disk file, link it to its parent*/
         db_file.seekp(0, ios::end);
         he->off = db_file.tellp();
+        he->left = 0;
+        he->right = 0;
         if (!bucket[pos].off){
             bucket[pos].off = he->off;
-            db_file.seekp(HASHDB_HDR_SZ + pos * HASH_BUCKET_SZ, ios::beg);//轫bucket[pos]дbucket[pos] in disk hasdb file
+            db_file.seekp(header.hbucket_off + pos * HASH_BUCKET_SZ, ios::beg);
             db_file.write((const char *)(&bucket[pos]), HASH_BUCKET_SZ);
         }
-        if (parent.off) { //иڵ㣬޸ĸڵ
+        if (parent.off) {
             (lr == 0) ? (parent.left = he->off) : (parent.right = he->off);
             db_file.seekp(parent.off, ios::beg);
             db_file.write((const char *)(&parent), HASH_ENTRY_SZ);
         }
-    } //if (he->off == 0) : new hash entry
+        header.inum++;
+    }else{
+        //he was swapped in from the disk file, its children may have been
+        //re-linked since then (new entries or bucket splits), keep the ones on disk
+        db_file.seekg(he->off, ios::beg);
+        db_file.read((char *)(&parent), HASH_ENTRY_SZ);
+        rwsize = db_file.gcount();
+        if (HASH_ENTRY_SZ != rwsize){
+            cout << "Error: read hash entry at " << he->off << " in HashDB::swapout(...)" << endl;
+            ret = -1;
+            goto _SWAPOUT_EXIT;
+        }
+        he->left = parent.left;
+        he->right = parent.right;
+    }
 
     /*flush hash_entry he from memory to disk file */
     db_file.seekp(he->off, ios::beg);
     db_file.write((const char *)(he), HASH_ENTRY_SZ);
     sprintf(key, "%s", he->key);
-    db_file.write((const char *)key, HASHDB_KEY_MAX_SZ);///!20160502
+    db_file.write((const char *)key, HASHDB_KEY_MAX_SZ);
     memcpy(value, he->value, he->vsize);
-    db_file.write((const char *)value, HASHDB_VALUE_MAX_SZ); ///!20160502
+    db_file.write((const char *)value, HASHDB_VALUE_MAX_SZ);
 
-    db_file.close();
+    if (header.inum > (uint64_t)header.bnum * HASHDB_SPLIT_LOAD){
+        if (-1 == splitbucket(db_file)){
+            cout << "Error: split hash bucket in HashDB::swapout(...)" << endl;
+            ret = -1;
+        }
+    }
+
+_SWAPOUT_EXIT:
+    if (hebuf){
+        free(hebuf);
+        hebuf = 0;
+    }
+    if (-1 == ret)
+        return ret;
 
     if (he->key)
     {
@@ -595,12 +878,20 @@ int HashDB::swapout(const uint32_t hash1, const uint32_t hash2,
     he->tsize = 0;
     he->shash = 0;
     he->iscached = false;
+    he->isdirty = false;
 
     return 0;
 }
 
 
 int HashDB::swapin(const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY* he)
+{
+    fstream db_file;
+    return swapin(db_file, key, hash1, hash2, he);
+}
+
+
+int HashDB::swapin(fstream &db_file, const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY* he)
 //bucket[hash1%header.bnum]Ϊڵ
 //оhash2keyhash_entry
 //صheУhe->iscached = true
@@ -619,14 +910,15 @@ int HashDB::swapin(const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY*
     HASH_ENTRY *hentry = 0;
     ssize_t rsize = 0;
 
+    pos = bucketpos(hash1);
+    root = bucket[pos].off;
+    if (!root)
+        return -2;
+    if (-1 == opendbfile(db_file))
+        return -1;
     hebuf_sz = HASH_ENTRY_SZ + HASHDB_KEY_MAX_SZ + HASHDB_VALUE_MAX_SZ;
     if (0 == (hebuf = (void *)malloc(hebuf_sz) ) )
         return -1;
-    pos = hash1 % header.bnum;
-    root = bucket[pos].off;
-    ifstream db_file;
-    db_file.open(dbpath, ios::binary);
-    db_file >> noskipws;
     while(root) {
         db_file.seekg(root, ios::beg);
         memset(hebuf, 0, hebuf_sz);
@@ -635,7 +927,6 @@ int HashDB::swapin(const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY*
         if (rsize != hebuf_sz){
             free(hebuf);
             hebuf = 0;
-            db_file.close();
             cout << "Error: read hash entry root in HashDB::swapin(..)" << endl;
             return -1;
         }
@@ -651,14 +942,14 @@ int HashDB::swapin(const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY*
                 memcpy(he, hebuf, HASH_ENTRY_SZ);
                 he->key = strdup(hkey);
                 if (0 == (he->value = malloc(he->vsize) ) ){
-                    db_file.close();
+                    free(hebuf);
                     return -1;
                 }
                 memcpy(he->value, hvalue, he->vsize);
                 he->iscached = true;
+                he->isdirty = false;
                 free(hebuf);
                 hebuf = 0;
-                db_file.close();
                 return 0;
             }else if (cmp < 0) root = hentry->left;
             else root = hentry->right;
@@ -669,10 +960,190 @@ int HashDB::swapin(const char* key, uint32_t hash1, uint32_t hash2, HASH_ENTRY*
         free(hebuf);
         hebuf = 0;
     }
-    db_file.close();
     return -2;
 }
 
+
+int HashDB::opendbfile(fstream &db_file)
+//open the disk file once for a series of swaps, it is closed by the caller's stream
+{
+    if (db_file.is_open()){
+        db_file.clear();
+        return 0;
+    }
+    db_file.open(dbpath, ios::binary | ios::in | ios::out);
+    if (!db_file.is_open()){
+        cout << "Error: open " << dbpath << " in HashDB::opendbfile(...)" << endl;
+        return -1;
+    }
+    db_file >> noskipws;
+    return 0;
+}
+
+uint32_t HashDB::bucketpos(const uint32_t hash1) const
+/** linear hashing: buckets below (bnum - bsplit) have already been split
+and are addressed with hash1 % (2 * bsplit), the others with hash1 % bsplit
+**/
+{
+    uint64_t pos = hash1 % (bsplit * 2);
+    if (pos >= header.bnum)
+        pos -= bsplit;
+    return (uint32_t)pos;
+}
+
+
+static int splitnode_cmp(const void *a, const void *b)
+//the order used by the binary trees: second hash value first, then the key
+{
+    const SPLIT_NODE *x = (const SPLIT_NODE *)a;
+    const SPLIT_NODE *y = (const SPLIT_NODE *)b;
+    if (x->he.shash != y->he.shash)
+        return (x->he.shash < y->he.shash) ? -1 : 1;
+    return strcmp(x->key, y->key);
+}
+
+
+uint64_t HashDB::buildtree(fstream &db_file, SPLIT_NODE *nodes, int lo, int hi)
+//link the sorted nodes[lo..hi] as a balanced binary tree, return the offset of its root
+{
+    if (lo > hi)
+        return 0;
+    int mid = lo + (hi - lo) / 2;
+    nodes[mid].he.left = buildtree(db_file, nodes, lo, mid - 1);
+    nodes[mid].he.right = buildtree(db_file, nodes, mid + 1, hi);
+    db_file.seekp(nodes[mid].he.off, ios::beg);
+    db_file.write((const char *)(&nodes[mid].he), HASH_ENTRY_SZ);
+    return nodes[mid].he.off;
+}
+
+
+int HashDB::growbuckets(fstream &db_file)
+/** double the bucket slots, the bucket array is rewritten at the end of the
+disk file and header.hbucket_off is pointed at it
+**/
+{
+    uint32_t newcap = header.bcap * 2;
+    HASH_BUCKET *newbucket = (HASH_BUCKET *)realloc(bucket, newcap * HASH_BUCKET_SZ);
+    if (0 == newbucket){
+        cout << "Error: realloc hash buckets in HashDB::growbuckets(...)" << endl;
+        return -1;
+    }
+    bucket = newbucket;
+    for (uint32_t i = header.bcap; i < newcap; i++)
+        bucket[i].off = 0;
+
+    db_file.seekp(0, ios::end);
+    header.hbucket_off = db_file.tellp();
+    header.bcap = newcap;
+    db_file.write((const char *)bucket, newcap * HASH_BUCKET_SZ);
+    db_file.seekp(0, ios::beg);
+    db_file.write((const char *)(&header), HASHDB_HDR_SZ);
+    return 0;
+}
+
+
+int HashDB::splitbucket(fstream &db_file)
+/** split bucket[bnum - bsplit] into itself and the new bucket[bnum].
+The entries stay where they are in the disk file, only their left/right
+offsets are rewritten so that both buckets become balanced binary trees.
+**/
+{
+    uint32_t from = header.bnum - bsplit;
+    uint32_t to = header.bnum;
+    SPLIT_NODE *nodes = 0, *tmp_nodes = 0;
+    uint64_t *stack = 0, *tmp_stack = 0;
+    uint32_t nodes_nr = 0, nodes_cap = 0, stack_nr = 0, stack_cap = 0;
+    uint32_t lo_nr = 0;
+    uint64_t off = 0;
+    SPLIT_NODE swap_node;
+    ssize_t rsize = 0;
+    int ret = 0;
+
+    if (to >= header.bcap && -1 == growbuckets(db_file))
+        return -1;
+
+    //gather every entry of bucket[from]
+    if (bucket[from].off){
+        stack_cap = 64;
+        if (0 == (stack = (uint64_t *)malloc(stack_cap * sizeof(uint64_t)))){
+            ret = -1;
+            goto _SPLITBUCKET_EXIT;
+        }
+        stack[stack_nr++] = bucket[from].off;
+    }
+    while (stack_nr > 0){
+        off = stack[--stack_nr];
+        if (nodes_nr == nodes_cap){
+            nodes_cap = (0 == nodes_cap) ? 16 : nodes_cap * 2;
+            if (0 == (tmp_nodes = (SPLIT_NODE *)realloc(nodes, nodes_cap * sizeof(SPLIT_NODE)))){
+                ret = -1;
+                goto _SPLITBUCKET_EXIT;
+            }
+            nodes = tmp_nodes;
+        }
+        db_file.seekg(off, ios::beg);
+        db_file.read((char *)(&nodes[nodes_nr]), sizeof(SPLIT_NODE));
+        rsize = db_file.gcount();
+        if ((ssize_t)sizeof(SPLIT_NODE) != rsize){
+            cout << "Error: read hash entry at " << off << " in HashDB::splitbucket(...)" << endl;
+            ret = -1;
+            goto _SPLITBUCKET_EXIT;
+        }
+        nodes[nodes_nr].he.off = off;
+        nodes[nodes_nr].key[HASHDB_KEY_MAX_SZ - 1] = 0;
+        if (stack_nr + 2 > stack_cap){
+            stack_cap *= 2;
+            if (0 == (tmp_stack = (uint64_t *)realloc(stack, stack_cap * sizeof(uint64_t)))){
+                ret = -1;
+                goto _SPLITBUCKET_EXIT;
+            }
+            stack = tmp_stack;
+        }
+        if (nodes[nodes_nr].he.left)
+            stack[stack_nr++] = nodes[nodes_nr].he.left;
+        if (nodes[nodes_nr].he.right)
+            stack[stack_nr++] = nodes[nodes_nr].he.right;
+        nodes_nr++;
+    }
+
+    //nodes[0, lo_nr) stay in bucket[from], the others move to bucket[to]
+    for (uint32_t i = 0; i < nodes_nr; i++){
+        if (hfunc1(nodes[i].key) % (bsplit * 2) == from){
+            if (i != lo_nr){
+                memcpy(&swap_node, &nodes[lo_nr], sizeof(SPLIT_NODE));
+                memcpy(&nodes[lo_nr], &nodes[i], sizeof(SPLIT_NODE));
+                memcpy(&nodes[i], &swap_node, sizeof(SPLIT_NODE));
+            }
+            lo_nr++;
+        }
+    }
+    if (nodes_nr > 0){
+        qsort(nodes, lo_nr, sizeof(SPLIT_NODE), splitnode_cmp);
+        qsort(nodes + lo_nr, nodes_nr - lo_nr, sizeof(SPLIT_NODE), splitnode_cmp);
+    }
+    bucket[from].off = buildtree(db_file, nodes, 0, (int)lo_nr - 1);
+    bucket[to].off = buildtree(db_file, nodes, lo_nr, (int)nodes_nr - 1);
+
+    header.bnum++;
+    if (header.bnum == bsplit * 2)
+        bsplit *= 2;
+    db_file.seekp(header.hbucket_off + from * HASH_BUCKET_SZ, ios::beg);
+    db_file.write((const char *)(&bucket[from]), HASH_BUCKET_SZ);
+    db_file.seekp(header.hbucket_off + to * HASH_BUCKET_SZ, ios::beg);
+    db_file.write((const char *)(&bucket[to]), HASH_BUCKET_SZ);
+
+_SPLITBUCKET_EXIT:
+    if (nodes){
+        free(nodes);
+        nodes = 0;
+    }
+    if (stack){
+        free(stack);
+        stack = 0;
+    }
+    return ret;
+}
+
 //#define HASHDB_TEST
 #ifdef HASHDB_TEST
 
@@ -712,6 +1183,14 @@ int main()
         cout << db.getdbpath() << " does not contain key-" << key << endl;
     else
         cout << "unexpected error!" << endl;
+
+    const char *bkeys[] = {"fill", "circle", "OSDF", "not a key"};
+    char bvalues[4][HASHDB_VALUE_MAX_SZ] = {{0}};
+    void *bvalue[] = {bvalues[0], bvalues[1], bvalues[2], bvalues[3]};
+    int bvsizes[4] = {0}, brets[4] = {0};
+    cout << "batch lookup found " << db.batchgetDB(bkeys, 4, bvalue, bvsizes, brets) << " of 4 keys" << endl;
+    for (int i = 0; i < 4; i++)
+        cout << "key: " << bkeys[i] << ", ret: " << brets[i] << ", value: " << bvalues[i] << endl;
    // db.unlinkDB();
     db.closeDB();
     return 0;
@@ -0,0 +1,489 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "LSMIndex.h"
+
+static inline bool entry_less(const LSM_ENTRY &a, const LSM_ENTRY &b)
+{
+    int cmp = memcmp(a.key, b.key, LSM_KEY_SZ);
+    return (cmp < 0) || (0 == cmp && a.value < b.value);
+}
+
+static inline bool fence_less(const LSM_ENTRY &fence, const unsigned char *key)
+{
+    return memcmp(fence.key, key, LSM_KEY_SZ) < 0;
+}
+
+static inline uint32_t keyhash(const unsigned char *key)
+{
+    uint32_t h = 0, w = 0;
+    for (int i = 0; i < LSM_KEY_SZ; i += 4){
+        memcpy(&w, key + i, 4);
+        h = (h ^ w) * 2654435761U;
+    }
+    return h ^ (h >> 16);
+}
+
+LSMIndex::LSMIndex(const char *name, const uint32_t memtable_nr, bool bg)
+{
+    run_seq = 0;
+    mem_nr = 0;
+    mem_cap = (memtable_nr > 0) ? memtable_nr : LSM_MEMTABLE_NR;
+    mem_mask = 1;
+    while (mem_mask < mem_cap)
+        mem_mask <<= 1;
+    mem = (LSM_ENTRY *)malloc(LSM_ENTRY_SZ * mem_cap);
+    mem_next = (int32_t *)malloc(sizeof(int32_t) * mem_cap);
+    mem_bucket = (int32_t *)malloc(sizeof(int32_t) * mem_mask);
+    mem_mask -= 1;
+    if (mem_bucket)
+        memset(mem_bucket, 0xFF, sizeof(int32_t) * (mem_mask + 1));
+    entries_nr = 0;
+    stop = false;
+    pending = 0;
+    background = bg;
+
+    char tmplate[] = "LSMIndex/lsm_XXXXXX";
+    mkdir("data", 766);
+    mkdir("data/LSMIndex", 766);
+    if (name)
+        snprintf(prefix, PATH_MAX_LEN, "%s", name);
+    else
+        snprintf(prefix, PATH_MAX_LEN, "data/%s_%d", mktemp(tmplate), getpid());
+
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&cond, 0);
+    if (background && 0 != pthread_create(&compactor, 0, compactthread, this)){
+        fprintf(stderr, "Error: create the compaction thread in LSMIndex::LSMIndex(...), merge in flush()\n");
+        background = false;
+    }
+}
+
+LSMIndex::~LSMIndex()
+{
+    if (background){
+        pthread_mutex_lock(&lock);
+        stop = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(compactor, 0);
+    }
+    for (uint32_t i = 0; i < run_list.size(); i++)
+        freerun(run_list[i]);
+    run_list.clear();
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+    free(mem);
+    free(mem_next);
+    free(mem_bucket);
+}
+
+int LSMIndex::insert(const void *key, const uint32_t value)
+{
+    if (0 == mem || 0 == mem_next || 0 == mem_bucket)
+        return -1;
+    if (mem_nr == mem_cap && 0 != flush())
+        return -1;
+
+    uint32_t b = keyhash((const unsigned char *)key) & mem_mask;
+    memcpy(mem[mem_nr].key, key, LSM_KEY_SZ);
+    mem[mem_nr].value = value;
+    mem_next[mem_nr] = mem_bucket[b];
+    mem_bucket[b] = mem_nr;
+    mem_nr++;
+    entries_nr++;
+    return 0;
+}
+
+int LSMIndex::getvalue(const void *key, uint32_t *values, const int maxnr)
+{
+    int n = 0;
+    if (maxnr <= 0 || 0 == mem_bucket)
+        return 0;
+    for (int32_t i = mem_bucket[keyhash((const unsigned char *)key) & mem_mask]; i >= 0 && n < maxnr; i = mem_next[i]){
+        if (0 == memcmp(mem[i].key, key, LSM_KEY_SZ))
+            values[n++] = mem[i].value;
+    }
+
+    //the lock keeps the compaction thread from freeing the runs being probed
+    pthread_mutex_lock(&lock);
+    for (uint32_t i = 0; i < run_list.size() && n < maxnr; i++)
+        n = findrun(run_list[i], key, values, n, maxnr);
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+bool LSMIndex::contain(const void *key)
+{
+    uint32_t value = 0;
+    return getvalue(key, &value, 1) > 0;
+}
+
+int LSMIndex::findrun(LSM_RUN *run, const void *key, uint32_t *values, int n, const int maxnr) const
+//probe one run: bloom filter, fence pointers, then the fence blocks holding key
+{
+    const unsigned char *k = (const unsigned char *)key;
+    LSM_ENTRY block[LSM_FENCE_NR];
+    if (0 == run->nr || !run->bloom->contains(k, LSM_KEY_SZ))
+        return n;
+
+    //key may begin at the end of the block before the first fence not less than key
+    uint64_t blk = std::lower_bound(run->fences.begin(), run->fences.end(), k, fence_less) - run->fences.begin();
+    if (blk > 0)
+        blk--;
+    for (; blk < run->fences.size() && n < maxnr; blk++){
+        uint64_t first = blk * LSM_FENCE_NR;
+        uint32_t nr = (run->nr - first < LSM_FENCE_NR) ? run->nr - first : LSM_FENCE_NR;
+        ssize_t len = nr * LSM_ENTRY_SZ;
+        if (len != pread(run->fd, block, len, first * LSM_ENTRY_SZ)){
+            fprintf(stderr, "Error: read fence block %llu of %s in LSMIndex::findrun(...)\n",
+                    (unsigned long long)blk, run->path);
+            return n;
+        }
+        int cmp = 0;
+        for (uint32_t i = 0; i < nr && n < maxnr; i++){
+            cmp = memcmp(block[i].key, k, LSM_KEY_SZ);
+            if (cmp > 0)
+                return n;
+            if (0 == cmp)
+                values[n++] = block[i].value;
+        }
+        if (cmp > 0)
+            return n;
+    }
+    return n;
+}
+
+int LSMIndex::flush()
+{
+    if (0 == mem_nr)
+        return 0;
+
+    std::sort(mem, mem + mem_nr, entry_less);
+    LSM_RUN *run = newrun(0, mem_nr);
+    if (0 == run)
+        return -1;
+    for (uint32_t i = 0; i < mem_nr; i++){
+        if (0 != appendrun(run, &mem[i])){
+            freerun(run);
+            return -1;
+        }
+    }
+    if (0 != sealrun(run)){
+        freerun(run);
+        return -1;
+    }
+    mem_nr = 0;
+    memset(mem_bucket, 0xFF, sizeof(int32_t) * (mem_mask + 1));
+
+    pthread_mutex_lock(&lock);
+    run_list.push_back(run);
+    pending++;
+    if (background)
+        pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+
+    if (!background){
+        vector<LSM_RUN*> victims;
+        while (0 == pickmerge(victims)){
+            if (0 != mergeruns(victims))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+LSM_RUN* LSMIndex::newrun(const uint32_t level, const uint64_t nr_hint)
+{
+    LSM_RUN *run = new LSM_RUN;
+    run->level = level;
+    run->nr = 0;
+    run->merging = false;
+    run->wbuf_nr = 0;
+    run->bloom = 0;
+    snprintf(run->path, sizeof(run->path), "%s_%u.run", prefix, __sync_fetch_and_add(&run_seq, 1));
+    run->fd = open(run->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    run->wbuf = (LSM_ENTRY *)malloc(LSM_ENTRY_SZ * LSM_IO_NR);
+    if (run->fd < 0 || 0 == run->wbuf){
+        fprintf(stderr, "Error: create run %s in LSMIndex::newrun(...)\n", run->path);
+        freerun(run);
+        return 0;
+    }
+
+    BloomParameters pmt;
+    pmt.projected_element_count = (nr_hint > 1024) ? nr_hint : 1024;
+    pmt.fpp = LSM_BLOOM_FPP;
+    pmt.randseed = 0xA5A5A5A5;
+    run->bloom = new BlockedBloomFilter(pmt);
+    return run;
+}
+
+int LSMIndex::appendrun(LSM_RUN *run, const LSM_ENTRY *entry)
+{
+    if (0 == run->nr % LSM_FENCE_NR)
+        run->fences.push_back(*entry);
+    run->bloom->insert(entry->key, LSM_KEY_SZ);
+    run->wbuf[run->wbuf_nr++] = *entry;
+    run->nr++;
+    if (run->wbuf_nr == LSM_IO_NR)
+        return writerun(run);
+    return 0;
+}
+
+int LSMIndex::writerun(LSM_RUN *run)
+//write out the buffered entries, appending to the run file
+{
+    ssize_t len = run->wbuf_nr * LSM_ENTRY_SZ;
+    if (len > 0 && len != write(run->fd, run->wbuf, len)){
+        fprintf(stderr, "Error: write run %s in LSMIndex::sealrun(...)\n", run->path);
+        return -1;
+    }
+    run->wbuf_nr = 0;
+    return 0;
+}
+
+int LSMIndex::sealrun(LSM_RUN *run)
+//write out the last entries, the run is immutable from now on
+{
+    if (0 != writerun(run))
+        return -1;
+    free(run->wbuf);
+    run->wbuf = 0;
+    return 0;
+}
+
+void LSMIndex::freerun(LSM_RUN *run)
+{
+    if (run->fd >= 0){
+        close(run->fd);
+        unlink(run->path);
+    }
+    if (run->bloom)
+        delete run->bloom;
+    free(run->wbuf);
+    delete run;
+}
+
+int LSMIndex::pickmerge(vector<LSM_RUN*> &victims)
+//take the idle runs of the lowest level which gathers LSM_MERGE_RUNS of them
+{
+    int ret = -1;
+    uint32_t top = 0;
+    victims.clear();
+    pthread_mutex_lock(&lock);
+    for (uint32_t i = 0; i < run_list.size(); i++){
+        if (run_list[i]->level > top)
+            top = run_list[i]->level;
+    }
+    for (uint32_t level = 0; level <= top && -1 == ret; level++){
+        uint32_t nr = 0;
+        for (uint32_t i = 0; i < run_list.size(); i++){
+            if (run_list[i]->level == level && !run_list[i]->merging)
+                nr++;
+        }
+        if (nr < LSM_MERGE_RUNS)
+            continue;
+        for (uint32_t i = 0; i < run_list.size(); i++){
+            if (run_list[i]->level == level && !run_list[i]->merging){
+                run_list[i]->merging = true;
+                victims.push_back(run_list[i]);
+            }
+        }
+        ret = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int LSMIndex::mergeruns(vector<LSM_RUN*> &victims)
+//k-way merge of the victims into one run of the next level, replacing them in run_list
+{
+    uint32_t k = victims.size();
+    uint64_t total = 0;
+    int ret = 0;
+    LSM_RUN *run = 0;
+    LSM_ENTRY **bufs = (LSM_ENTRY **)calloc(k, sizeof(LSM_ENTRY *));
+    uint32_t *pos = (uint32_t *)calloc(k, sizeof(uint32_t));
+    uint32_t *lens = (uint32_t *)calloc(k, sizeof(uint32_t));
+    uint64_t *done = (uint64_t *)calloc(k, sizeof(uint64_t)); //entries read of each victim
+
+    for (uint32_t i = 0; i < k; i++)
+        total += victims[i]->nr;
+    if (0 == bufs || 0 == pos || 0 == lens || 0 == done){
+        ret = -1;
+        goto _MERGERUNS_EXIT;
+    }
+    for (uint32_t i = 0; i < k; i++){
+        bufs[i] = (LSM_ENTRY *)malloc(LSM_ENTRY_SZ * LSM_IO_NR);
+        if (0 == bufs[i]){
+            ret = -1;
+            goto _MERGERUNS_EXIT;
+        }
+    }
+    run = newrun(victims[0]->level + 1, total);
+    if (0 == run){
+        ret = -1;
+        goto _MERGERUNS_EXIT;
+    }
+
+    while (true){
+        int min = -1;
+        for (uint32_t i = 0; i < k; i++){
+            if (pos[i] == lens[i] && done[i] < victims[i]->nr){
+                //refill the read buffer of victim i
+                uint64_t nr = victims[i]->nr - done[i];
+                if (nr > LSM_IO_NR)
+                    nr = LSM_IO_NR;
+                ssize_t len = nr * LSM_ENTRY_SZ;
+                if (len != pread(victims[i]->fd, bufs[i], len, done[i] * LSM_ENTRY_SZ)){
+                    fprintf(stderr, "Error: read run %s in LSMIndex::mergeruns(...)\n", victims[i]->path);
+                    ret = -1;
+                    goto _MERGERUNS_EXIT;
+                }
+                pos[i] = 0;
+                lens[i] = nr;
+                done[i] += nr;
+            }
+            if (pos[i] < lens[i] && (-1 == min || entry_less(bufs[i][pos[i]], bufs[min][pos[min]])))
+                min = i;
+        }
+        if (-1 == min)
+            break;
+        if (0 != appendrun(run, &bufs[min][pos[min]])){
+            ret = -1;
+            goto _MERGERUNS_EXIT;
+        }
+        pos[min]++;
+    }
+    if (0 != sealrun(run)){
+        ret = -1;
+        goto _MERGERUNS_EXIT;
+    }
+
+    pthread_mutex_lock(&lock);
+    for (uint32_t i = 0; i < k; i++)
+        run_list.erase(std::find(run_list.begin(), run_list.end(), victims[i]));
+    run_list.push_back(run);
+    pthread_mutex_unlock(&lock);
+    //no lookup refers to the victims any more
+    for (uint32_t i = 0; i < k; i++)
+        freerun(victims[i]);
+    victims.clear();
+    run = 0;
+
+_MERGERUNS_EXIT:
+    if (run)
+        freerun(run);
+    if (0 != ret){
+        pthread_mutex_lock(&lock);
+        for (uint32_t i = 0; i < victims.size(); i++)
+            victims[i]->merging = false;
+        pthread_mutex_unlock(&lock);
+    }
+    for (uint32_t i = 0; bufs && i < k; i++)
+        free(bufs[i]);
+    free(bufs);
+    free(pos);
+    free(lens);
+    free(done);
+    return ret;
+}
+
+void* LSMIndex::compactthread(void *arg)
+{
+    LSMIndex *lsm = (LSMIndex *)arg;
+    vector<LSM_RUN*> victims;
+    while (true){
+        pthread_mutex_lock(&lsm->lock);
+        while (0 == lsm->pending && !lsm->stop)
+            pthread_cond_wait(&lsm->cond, &lsm->lock);
+        bool quit = lsm->stop;
+        lsm->pending = 0;
+        pthread_mutex_unlock(&lsm->lock);
+        if (quit)
+            break;
+        while (0 == lsm->pickmerge(victims)){
+            if (0 != lsm->mergeruns(victims)){
+                fprintf(stderr, "Error: merge %u runs in LSMIndex::compactthread(...)\n", (unsigned int)victims.size());
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+uint32_t LSMIndex::runs()
+{
+    pthread_mutex_lock(&lock);
+    uint32_t nr = run_list.size();
+    pthread_mutex_unlock(&lock);
+    return nr;
+}
+
+uint64_t LSMIndex::memusage()
+{
+    uint64_t sz = (uint64_t)mem_cap * (LSM_ENTRY_SZ + sizeof(int32_t)) + (uint64_t)(mem_mask + 1) * sizeof(int32_t);
+    pthread_mutex_lock(&lock);
+    for (uint32_t i = 0; i < run_list.size(); i++)
+        sz += run_list[i]->fences.capacity() * LSM_ENTRY_SZ;
+    pthread_mutex_unlock(&lock);
+    return sz;
+}
+
+uint64_t LSMIndex::bloomusage()
+{
+    uint64_t sz = 0;
+    pthread_mutex_lock(&lock);
+    for (uint32_t i = 0; i < run_list.size(); i++)
+        sz += run_list[i]->bloom->size() / 8;
+    pthread_mutex_unlock(&lock);
+    return sz;
+}
+
+//#define LSMINDEX_TEST
+#ifdef LSMINDEX_TEST
+#define TEST_KEYS 200000
+
+static void testkey(uint32_t i, unsigned char *key)
+{
+    for (int j = 0; j < LSM_KEY_SZ; j += 4){
+        uint32_t w = (i + j) * 2654435761U;
+        memcpy(key + j, &w, 4);
+    }
+}
+
+int main()
+{
+    unsigned char key[LSM_KEY_SZ];
+    uint32_t values[4];
+    uint32_t missed = 0, wrong = 0, found = 0;
+
+    LSMIndex *lsm = new LSMIndex(0, 8192);
+    for (uint32_t i = 0; i < TEST_KEYS; i++){
+        testkey(i, key);
+        lsm->insert(key, i);
+    }
+    for (uint32_t i = 0; i < TEST_KEYS; i++){
+        testkey(i, key);
+        int n = lsm->getvalue(key, values, 4);
+        if (0 == n)
+            missed++;
+        else if (1 != n || values[0] != i)
+            wrong++;
+    }
+    for (uint32_t i = TEST_KEYS; i < 2 * TEST_KEYS; i++){
+        testkey(i, key);
+        found += lsm->contain(key) ? 1 : 0;
+    }
+    cout << "runs: " << lsm->runs() << ", missed: " << missed << ", wrong: " << wrong
+         << ", absent keys found: " << found << endl;
+    delete lsm;
+    return 0;
+}
+#endif // LSMINDEX_TEST
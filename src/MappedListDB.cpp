@@ -0,0 +1,231 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "MappedListDB.h"
+
+MappedListDB::MappedListDB(unsigned int unit_sz)
+{
+    dbname = 0;
+    fd = -1;
+    unit_size = unit_sz;
+    map_addr = 0;
+    map_len = 0;
+    value_nr = 0;
+}
+
+MappedListDB::~MappedListDB()
+{
+    closedb();
+    if (dbname){
+        free(dbname);
+        dbname = 0;
+    }
+}
+
+int MappedListDB::opendb(const char *path)
+{
+    struct stat stat_buf;
+    if (0 == unit_size){
+        fprintf(stderr, "Error: zero unit size in MappedListDB::opendb(...)\n");
+        return -1;
+    }
+    closedb();
+    if (dbname)
+        free(dbname);
+    dbname = strdup(path);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == fd || 0 != fstat(fd, &stat_buf)){
+        fprintf(stderr, "Error: open ListDB %s in MappedListDB::opendb(...)\n", path);
+        return -1;
+    }
+    //an existing file keeps its values, up to the last whole unit
+    value_nr = stat_buf.st_size / unit_size;
+    map_len = 0;
+    return grow(value_nr);
+}
+
+int MappedListDB::closedb()
+{
+    if (map_addr){
+        munmap(map_addr, map_len);
+        map_addr = 0;
+    }
+    if (-1 != fd){
+        //drop the unused tail of the last extent
+        if (0 != ftruncate(fd, value_nr * unit_size))
+            fprintf(stderr, "Warning: truncate ListDB %s in MappedListDB::closedb(...)\n", dbname);
+        close(fd);
+        fd = -1;
+    }
+    map_len = 0;
+    return 0;
+}
+
+int MappedListDB::unlinkdb()
+{
+    if (dbname){
+        unlink(dbname);
+        free(dbname);
+        dbname = 0;
+    }
+    return 0;
+}
+
+int MappedListDB::grow(const uint64_t nr)
+//make room for nr values, by whole extents
+{
+    uint64_t len = nr * unit_size;
+    if (len <= map_len && map_addr)
+        return 0;
+    len = (len / LISTDB_MAP_EXTENT + 1) * LISTDB_MAP_EXTENT;
+    if (0 != ftruncate(fd, len)){
+        fprintf(stderr, "Error: extend ListDB %s to %llu bytes in MappedListDB::grow(...)\n",
+                dbname, (unsigned long long)len);
+        return -1;
+    }
+    if (map_addr)
+        munmap(map_addr, map_len);
+    map_addr = (char *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map_addr){
+        fprintf(stderr, "Error: mmap ListDB %s in MappedListDB::grow(...)\n", dbname);
+        map_addr = 0;
+        map_len = 0;
+        return -1;
+    }
+    map_len = len;
+    return 0;
+}
+
+int MappedListDB::setvalue(const unsigned int index, const void *value)
+{
+    if (index >= value_nr){
+        if (0 != grow((uint64_t)index + 1))
+            return -1;
+        value_nr = (uint64_t)index + 1;
+    }
+    memcpy(map_addr + (uint64_t)index * unit_size, value, unit_size);
+    return 0;
+}
+
+int MappedListDB::getvalue(const unsigned int index, void *value)
+{
+    if (index >= value_nr){
+        fprintf(stderr, "Warning: get value at index=%u failed, since value has not been set before in MappedListDB::getvalue(...)\n", index);
+        return -2;
+    }
+    memcpy(value, map_addr + (uint64_t)index * unit_size, unit_size);
+    return 0;
+}
+
+int MappedListDB::fillvalue(const unsigned int nr, const void *value)
+{
+    if (0 != grow(nr))
+        return -1;
+    for (unsigned int i = 0; i < nr; i++)
+        memcpy(map_addr + (uint64_t)i * unit_size, value, unit_size);
+    if (nr > value_nr)
+        value_nr = nr;
+    return 0;
+}
+
+void* MappedListDB::valueptr(const unsigned int index)
+{
+    if (index >= value_nr)
+        return 0;
+    return map_addr + (uint64_t)index * unit_size;
+}
+
+bool MappedListDB::checkbatch(const uint32_t *indexes, const unsigned int nr) const
+{
+    if (sizeof(uint32_t) != unit_size){
+        fprintf(stderr, "Error: batched operations need uint32_t values in MappedListDB::checkbatch(...)\n");
+        return false;
+    }
+    for (unsigned int i = 0; i < nr; i++){
+        if (indexes[i] >= value_nr){
+            fprintf(stderr, "Error: index %u out of %llu values in MappedListDB::checkbatch(...)\n",
+                    indexes[i], (unsigned long long)value_nr);
+            return false;
+        }
+    }
+    return true;
+}
+
+int MappedListDB::batchinc(const uint32_t *indexes, const unsigned int nr, const uint32_t delta)
+{
+    if (!checkbatch(indexes, nr))
+        return -1;
+    uint32_t *values = (uint32_t *)map_addr;
+    for (unsigned int i = 0; i < nr; i++)
+        values[indexes[i]] += delta;
+    return 0;
+}
+
+int MappedListDB::batchget(const uint32_t *indexes, const unsigned int nr, uint32_t *values)
+{
+    if (!checkbatch(indexes, nr))
+        return -1;
+    const uint32_t *stored = (const uint32_t *)map_addr;
+    for (unsigned int i = 0; i < nr; i++)
+        values[i] = stored[indexes[i]];
+    return 0;
+}
+
+int MappedListDB::batchgetorset(const uint32_t *indexes, const unsigned int nr, uint32_t *values, const uint32_t unset)
+{
+    int set_nr = 0;
+    if (!checkbatch(indexes, nr))
+        return -1;
+    uint32_t *stored = (uint32_t *)map_addr;
+    for (unsigned int i = 0; i < nr; i++){
+        if (unset == stored[indexes[i]]){
+            stored[indexes[i]] = values[i];
+            set_nr++;
+        }else
+            values[i] = stored[indexes[i]];
+    }
+    return set_nr;
+}
+
+//#define MAPPEDLISTDB_TEST
+#ifdef MAPPEDLISTDB_TEST
+#define TEST_VALUES 3000000
+
+int main()
+{
+    MappedListDB ldb(sizeof(uint32_t));
+    uint32_t zero = 0, value = 0, bad = 0;
+    uint32_t refs[4] = {7, 7, 9, TEST_VALUES - 1};
+    uint32_t got[4] = {0};
+
+    ldb.opendb("data/mapped_listdb_test.listdb");
+    ldb.fillvalue(TEST_VALUES, &zero);
+    for (uint32_t i = 0; i < TEST_VALUES; i += 3)
+        ldb.setvalue(i, &i);
+    ldb.batchinc(refs, 4);
+    for (uint32_t i = 0; i < TEST_VALUES; i++){
+        uint32_t expect = (0 == i % 3) ? i : 0;
+        expect += (7 == i) ? 2 : (9 == i || TEST_VALUES - 1 == i) ? 1 : 0;
+        ldb.getvalue(i, &value);
+        bad += (value != expect) ? 1 : 0;
+    }
+    got[0] = got[1] = got[2] = got[3] = 100;
+    int set_nr = ldb.batchgetorset(refs, 4, got, 0);
+    cout << "values: " << ldb.size() << ", wrong: " << bad << ", get-or-set: set " << set_nr
+         << ", got " << got[0] << " " << got[1] << " " << got[2] << " " << got[3] << endl;
+    ldb.closedb();
+
+    ldb.opendb("data/mapped_listdb_test.listdb");
+    ldb.getvalue(TEST_VALUES - 3, &value);
+    cout << "reopened values: " << ldb.size() << ", value " << value << " (expected " << TEST_VALUES - 3 << ")" << endl;
+    ldb.closedb();
+    ldb.unlinkdb();
+    return 0;
+}
+#endif // MAPPEDLISTDB_TEST
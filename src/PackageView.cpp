@@ -0,0 +1,395 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "PackageView.h"
+
+template <class T>
+static int find_run(const PkgSpan<T> &runs, const unsigned int n)
+//the run (or container) holding entry n, -1: none
+{
+    int lo = 0, hi = runs.nr;
+    if (0 == hi)
+        return -1;
+    while (hi - lo > 1){
+        int mid = (lo + hi) / 2;
+        if (runs[mid].first <= n)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    T run = runs[lo];
+    if (n < run.first || n >= run.first + run.nr)
+        return -1;
+    return lo;
+}
+
+PackageView::PackageView()
+{
+    fd = -1;
+    map_addr = 0;
+    map_len = 0;
+    memset(&pkg_hdr, 0, D_PKG_HDR_SZ);
+    memset(one_run, 0, sizeof(one_run));
+    ldata_runs.base = mdata_runs.base = dead_files.base = containers.base = 0;
+    ldata_runs.nr = mdata_runs.nr = dead_files.nr = containers.nr = 0;
+    path_runs.base = 0;
+    path_runs.nr = 0;
+    located = false;
+    last_cont = -1;
+    copy_mode = PKG_COPY_RANGE;
+}
+
+PackageView::~PackageView()
+{
+    close();
+}
+
+int PackageView::open(const char *pkg_name)
+{
+    struct stat stat_buf;
+    close();
+    fd = ::open(pkg_name, O_RDONLY);
+    if (-1 == fd || 0 != fstat(fd, &stat_buf)){
+        fprintf(stderr, "Error: open package %s in PackageView::open(...)\n", pkg_name);
+        close();
+        return -1;
+    }
+    if ((uint64_t)stat_buf.st_size < D_PKG_HDR_SZ){
+        fprintf(stderr, "Error: package %s shorter than its header in PackageView::open(...)\n", pkg_name);
+        close();
+        return -1;
+    }
+    map_len = stat_buf.st_size;
+    map_addr = (char *)mmap(0, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map_addr){
+        fprintf(stderr, "Error: mmap package %s in PackageView::open(...)\n", pkg_name);
+        map_addr = 0;
+        close();
+        return -1;
+    }
+    memcpy(&pkg_hdr, map_addr, D_PKG_HDR_SZ);
+    if (DEDUP_MAGIC_NUM != pkg_hdr.magic_nr){
+        fprintf(stderr, "Error: wrong magic number of package %s%s in PackageView::open(...)\n", pkg_name,
+                DEDUP_MAGIC_NUM_160427 == pkg_hdr.magic_nr ? ", of the first layout" : "");
+        close();
+        return -1;
+    }
+
+    if (0 == pkg_hdr.extent_offset){
+        one_run[0].offset = pkg_hdr.ldata_offset;
+        one_run[0].first = 0;
+        one_run[0].nr = pkg_hdr.ublocks_nr;
+        one_run[1].offset = pkg_hdr.mdata_offset;
+        one_run[1].first = 0;
+        one_run[1].nr = pkg_hdr.files_nr;
+        ldata_runs.base = (const char *)&one_run[0];
+        ldata_runs.nr = (pkg_hdr.ublocks_nr > 0) ? 1 : 0;
+        mdata_runs.base = (const char *)&one_run[1];
+        mdata_runs.nr = (pkg_hdr.files_nr > 0) ? 1 : 0;
+    }else{
+        ldata_runs.base = at(pkg_hdr.extent_offset, (uint64_t)pkg_hdr.ldata_extents_nr * D_EXTENT_SZ);
+        ldata_runs.nr = pkg_hdr.ldata_extents_nr;
+        mdata_runs.base = at(pkg_hdr.extent_offset + (uint64_t)pkg_hdr.ldata_extents_nr * D_EXTENT_SZ,
+                             (uint64_t)pkg_hdr.mdata_extents_nr * D_EXTENT_SZ);
+        mdata_runs.nr = pkg_hdr.mdata_extents_nr;
+    }
+    dead_files.base = at(pkg_hdr.dfiles_offset, (uint64_t)pkg_hdr.dfiles_nr * sizeof(unsigned int));
+    dead_files.nr = pkg_hdr.dfiles_nr;
+    containers.base = at(pkg_hdr.container_offset, (uint64_t)pkg_hdr.containers_nr * D_CONTAINER_SZ);
+    containers.nr = pkg_hdr.containers_nr;
+    if (0 != pkg_hdr.extent_offset && pkg_hdr.pathidx_runs_nr > 0){
+        path_runs.base = at(pkg_hdr.extent_offset + (uint64_t)(pkg_hdr.ldata_extents_nr + pkg_hdr.mdata_extents_nr) * D_EXTENT_SZ,
+                            (uint64_t)pkg_hdr.pathidx_runs_nr * D_EXTENT_SZ);
+        path_runs.nr = pkg_hdr.pathidx_runs_nr;
+    }else{
+        one_run[2].offset = pkg_hdr.pathidx_offset;
+        one_run[2].first = 0;
+        one_run[2].nr = pkg_hdr.pathidx_nr;
+        path_runs.base = (const char *)&one_run[2];
+        path_runs.nr = (0 != pkg_hdr.pathidx_offset && pkg_hdr.pathidx_nr > 0) ? 1 : 0;
+    }
+    bool paths_in = path_runs.nr == 0 || 0 != path_runs.base;
+    for (unsigned int r = 0; paths_in && r < path_runs.nr; r++)
+        paths_in = 0 == path_runs[r].nr || 0 != path_run(r).base;
+    if ((ldata_runs.nr > 0 && 0 == ldata_runs.base) || (mdata_runs.nr > 0 && 0 == mdata_runs.base) ||
+        (dead_files.nr > 0 && 0 == dead_files.base) || (containers.nr > 0 && 0 == containers.base) || !paths_in){
+        fprintf(stderr, "Error: tables past the end of package %s in PackageView::open(...)\n", pkg_name);
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+PkgSpan<D_Path_Entry> PackageView::path_run(const unsigned int r) const
+{
+    PkgSpan<D_Path_Entry> run;
+    D_Extent ext = path_runs[r];
+    run.base = at(ext.offset, (uint64_t)ext.nr * D_PATH_ENTRY_SZ);
+    run.nr = run.base ? ext.nr : 0;
+    return run;
+}
+
+int PackageView::locate_files() const
+//the file entries of a run follow each other, fentry_sz bytes each
+{
+    uint64_t offset = 0;
+    int r = -1;
+    D_File_Entry fentry;
+    fentry_off.clear();
+    fentry_off.reserve(pkg_hdr.files_nr);
+    for (unsigned int i = 0; i < pkg_hdr.files_nr; i++){
+        if (r + 1 < (int)mdata_runs.nr && mdata_runs[r + 1].first == i)
+            offset = mdata_runs[++r].offset;
+        const char *p = at(offset, D_FILE_ENTRY_SZ);
+        if (-1 == r || 0 == p){
+            fprintf(stderr, "Error: %uth file entry past the end of the package in PackageView::locate_files(...)\n", i);
+            fentry_off.clear();
+            return -1;
+        }
+        memcpy(&fentry, p, D_FILE_ENTRY_SZ);
+        fentry_off.push_back(offset);
+        offset += fentry.fentry_sz;
+    }
+    located = true;
+    return 0;
+}
+
+void PackageView::close()
+{
+    if (map_addr){
+        munmap(map_addr, map_len);
+        map_addr = 0;
+    }
+    if (-1 != fd){
+        ::close(fd);
+        fd = -1;
+    }
+    map_len = 0;
+    fentry_off.clear();
+    located = false;
+    path_runs.nr = 0;
+    last_cont = -1;
+}
+
+const char* PackageView::at(const uint64_t offset, const uint64_t len) const
+{
+    if (0 == map_addr || offset > map_len || len > map_len - offset)
+        return 0;
+    return map_addr + offset;
+}
+
+int PackageView::copy_to(const int des_fd, const uint64_t offset, const uint64_t len, const uint64_t dest_off) const
+{
+    uint64_t done = 0;
+    if (0 == at(offset, len))
+        return -1;
+    while (done < len){
+        loff_t in = offset + done;
+        loff_t out = dest_off + done;
+        off_t sin = offset + done;
+        ssize_t n = -1;
+        switch (copy_mode){
+        case PKG_COPY_RANGE:
+            n = copy_file_range(fd, &in, des_fd, &out, len - done, 0);
+            break;
+        case PKG_COPY_SENDFILE: //writes at the file position
+            if ((off_t)-1 == lseek(des_fd, dest_off + done, SEEK_SET))
+                break;
+            n = sendfile(des_fd, fd, &sin, len - done);
+            break;
+        default:
+            n = pwrite(des_fd, map_addr + offset + done, len - done, dest_off + done);
+            break;
+        }
+        if (-1 == n && EINTR == errno)
+            continue;
+        if (n <= 0){
+            //nothing copied yet with this mode: the file systems do not support it
+            if (PKG_COPY_WRITE != copy_mode && (0 == n || EXDEV == errno || EINVAL == errno ||
+                                                ENOSYS == errno || EOPNOTSUPP == errno)){
+                copy_mode--;
+                continue;
+            }
+            fprintf(stderr, "Error: copy %llu bytes at offset %llu in PackageView::copy_to(...)\n",
+                    (unsigned long long)(len - done), (unsigned long long)(offset + done));
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+bool PackageView::lbentry(const block_id_t id, D_Logic_Block_Entry &lbentry) const
+{
+    int r = find_run(ldata_runs, id);
+    if (-1 == r)
+        return false;
+    D_Extent run = ldata_runs[r];
+    const char *p = at(run.offset + (uint64_t)(id - run.first) * D_LOGIC_BLOCK_ENTRY_SZ, D_LOGIC_BLOCK_ENTRY_SZ);
+    if (0 == p)
+        return false;
+    memcpy(&lbentry, p, D_LOGIC_BLOCK_ENTRY_SZ);
+    return true;
+}
+
+unsigned int PackageView::block_len(const block_id_t id) const
+{
+    D_Container_Slot slot;
+    uint64_t offset = 0;
+    if (!stored(id, slot, offset))
+        return 0;
+    return slot.raw_len;
+}
+
+bool PackageView::stored(const block_id_t id, D_Container_Slot &slot, uint64_t &offset) const
+{
+    D_Logic_Block_Entry entry;
+    int c = find_run(containers, id);
+    if (-1 != c){
+        D_Container cont = containers[c];
+        const char *p = at(cont.offset + D_CONTAINER_HDR_SZ + cont.data_len + (uint64_t)(id - cont.first) * D_CONTAINER_SLOT_SZ,
+                           D_CONTAINER_SLOT_SZ);
+        if (0 == p)
+            return false;
+        memcpy(&slot, p, D_CONTAINER_SLOT_SZ);
+        offset = cont.offset + slot.offset;
+    }else{
+        if (!lbentry(id, entry))
+            return false;
+        memset(&slot, 0, D_CONTAINER_SLOT_SZ);
+        slot.len = entry.zblock_len;
+        slot.raw_len = entry.ublock_len;
+        slot.codec = entry.codec;
+        slot.base = entry.base_id;
+        offset = entry.ublock_off;
+    }
+    return 0 != at(offset, slot.len);
+}
+
+void PackageView::willneed(const uint64_t offset, const uint64_t len) const
+{
+    if (0 == at(offset, len) || 0 == len)
+        return;
+    uint64_t start = offset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise(map_addr + start, offset - start + len, MADV_WILLNEED);
+}
+
+bool PackageView::file_removed(const unsigned int i) const
+{
+    int lo = 0, hi = dead_files.nr;
+    while (lo < hi){
+        int mid = (lo + hi) / 2;
+        unsigned int n = dead_files[mid];
+        if (n == i)
+            return true;
+        if (n < i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+int PackageView::file(const unsigned int i, D_File_View &fv) const
+{
+    if (!located && 0 != locate_files())
+        return -1;
+    if (i >= fentry_off.size())
+        return -1;
+    return file_at(fentry_off[i], fv);
+}
+
+unsigned int PackageView::find_path(const unsigned int r, const char *path, const unsigned int len) const
+{
+    D_File_Entry fentry;
+    if (r >= path_runs.nr)
+        return 0;
+    PkgSpan<D_Path_Entry> paths = path_run(r);
+    unsigned int lo = 0, hi = paths.nr;
+    while (lo < hi){
+        unsigned int mid = (lo + hi) / 2;
+        D_Path_Entry pe = paths[mid];
+        const char *p = at(pe.offset, D_FILE_ENTRY_SZ);
+        if (0 == p)
+            return paths.nr;
+        memcpy(&fentry, p, D_FILE_ENTRY_SZ);
+        const char *name = at(pe.offset + D_FILE_ENTRY_SZ, fentry.fname_len);
+        if (0 == name)
+            return paths.nr;
+        int c = memcmp(name, path, fentry.fname_len < len ? fentry.fname_len : len);
+        if (c < 0 || (0 == c && fentry.fname_len < len))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int PackageView::path_file(const unsigned int r, const unsigned int k, D_File_View &fv) const
+{
+    if (k >= paths_nr(r))
+        return -1;
+    return file_at(path_run(r)[k].offset, fv);
+}
+
+bool PackageView::find_file(const char *path, const unsigned int len, D_File_View &fv) const
+{
+    for (unsigned int r = path_runs.nr; r > 0; r--){
+        unsigned int k = find_path(r - 1, path, len);
+        if (k < paths_nr(r - 1) && 0 == path_file(r - 1, k, fv) &&
+            fv.entry.fname_len == len && 0 == memcmp(fv.name, path, len))
+            return true;
+    }
+    return false;
+}
+
+int PackageView::file_at(const uint64_t fentry_offset, D_File_View &fv) const
+{
+    const char *p = at(fentry_offset, D_FILE_ENTRY_SZ);
+    if (0 == p){
+        fprintf(stderr, "Error: file entry at %llu past the end of the package in PackageView::file_at(...)\n",
+                (unsigned long long)fentry_offset);
+        return -1;
+    }
+    memcpy(&fv.entry, p, D_FILE_ENTRY_SZ);
+    uint64_t offset = fentry_offset + D_FILE_ENTRY_SZ;
+    uint64_t ids_len = (uint64_t)fv.entry.fblocks_nr * BLOCK_ID_SIZE;
+    fv.name = at(offset, fv.entry.fname_len);
+    fv.blocks.base = at(offset + fv.entry.fname_len, ids_len);
+    fv.blocks.nr = fv.entry.fblocks_nr;
+    fv.last_block = at(offset + fv.entry.fname_len + ids_len, fv.entry.last_block_sz);
+    if (0 == fv.name || 0 == fv.blocks.base || 0 == fv.last_block || fv.entry.fname_len >= PATH_MAX_LEN){
+        fprintf(stderr, "Error: file entry at %llu past the end of the package in PackageView::file_at(...)\n",
+                (unsigned long long)fentry_offset);
+        return -1;
+    }
+    return 0;
+}
+
+bool PackageView::slot(const block_id_t id, D_Container_Slot &slot, const char *&data) const
+{
+    int c = find_run(containers, id);
+    if (-1 == c)
+        return false;
+    D_Container cont = containers[c];
+    const char *p = at(cont.offset + D_CONTAINER_HDR_SZ + cont.data_len + (uint64_t)(id - cont.first) * D_CONTAINER_SLOT_SZ,
+                       D_CONTAINER_SLOT_SZ);
+    if (0 == p)
+        return false;
+    memcpy(&slot, p, D_CONTAINER_SLOT_SZ);
+    data = at(cont.offset + slot.offset, slot.len);
+    if (0 == data)
+        return false;
+    if (c != last_cont){
+        //the blocks of a file are mostly in one container, read it at once
+        willneed(cont.offset, D_CONTAINER_HDR_SZ + cont.data_len);
+        last_cont = c;
+    }
+    return true;
+}
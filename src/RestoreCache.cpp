@@ -0,0 +1,111 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "RestoreCache.h"
+
+RestoreCache::RestoreCache(uint64_t capacity)
+{
+    this->capacity = capacity;
+    used = 0;
+    hit_nr = 0;
+    lookup_nr = 0;
+    pthread_mutex_init(&lock, 0);
+}
+
+RestoreCache::~RestoreCache()
+{
+    clear();
+    pthread_mutex_destroy(&lock);
+}
+
+bool RestoreCache::get(const uint32_t id, char *buf, unsigned int &len)
+{
+    bool hit = false;
+    pthread_mutex_lock(&lock);
+    lookup_nr++;
+    map<uint32_t, list<Entry>::iterator>::iterator it = index.find(id);
+    if (it != index.end()){
+        hit_nr++;
+        lru.splice(lru.begin(), lru, it->second);
+        len = it->second->len;
+        memcpy(buf, it->second->data, len);
+        hit = true;
+    }
+    pthread_mutex_unlock(&lock);
+    return hit;
+}
+
+int RestoreCache::put(const uint32_t id, const char *data, const unsigned int len)
+{
+    Entry entry;
+    if (len > capacity)
+        return -1;
+    //copied before the lock is taken, another thread may put the same block meanwhile
+    entry.id = id;
+    entry.len = len;
+    entry.data = (char *)malloc(len > 0 ? len : 1);
+    if (0 == entry.data){
+        fprintf(stderr, "Error: malloc %u bytes for block %u in RestoreCache::put(...)\n", len, id);
+        return -1;
+    }
+    memcpy(entry.data, data, len);
+    pthread_mutex_lock(&lock);
+    if (index.end() != index.find(id)){
+        pthread_mutex_unlock(&lock);
+        free(entry.data);
+        return 0;
+    }
+    while (used + len > capacity && !lru.empty()){
+        used -= lru.back().len;
+        free(lru.back().data);
+        index.erase(lru.back().id);
+        lru.pop_back();
+    }
+    lru.push_front(entry);
+    index[id] = lru.begin();
+    used += len;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void RestoreCache::clear()
+{
+    pthread_mutex_lock(&lock);
+    for (list<Entry>::iterator it = lru.begin(); it != lru.end(); ++it)
+        free(it->data);
+    lru.clear();
+    index.clear();
+    used = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+//#define RESTORECACHE_TEST
+#ifdef RESTORECACHE_TEST
+#include <iostream>
+
+int main()
+{
+    RestoreCache cache(4 * 4096);
+    char block[4096], out[4096];
+    unsigned int len = 0, bad = 0;
+    for (uint32_t id = 0; id < 4; id++){
+        memset(block, id, sizeof(block));
+        cache.put(id, block, sizeof(block));
+    }
+    cache.get(0, out, len); //0 is the most recently used now, 1 the least
+    memset(block, 9, sizeof(block));
+    cache.put(9, block, sizeof(block));
+    bad += cache.get(1, out, len) ? 1 : 0;
+    bad += (!cache.get(0, out, len) || 4096 != len || 0 != out[100]) ? 1 : 0;
+    bad += (!cache.get(9, out, len) || 9 != out[4095]) ? 1 : 0;
+    cout << "cached bytes: " << cache.size() << ", hits " << cache.hits() << " of " << cache.lookups()
+         << ", wrong: " << bad << endl;
+    return 0;
+}
+#endif // RESTORECACHE_TEST
@@ -0,0 +1,224 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "ShardedHashTable.h"
+
+ShardedHashTable::ShardedHashTable(const unsigned int nr, const char *name)
+{
+    char dbname[PATH_MAX_LEN] = {0};
+    char bfname[PATH_MAX_LEN] = {0};
+
+    shards_nr = (0 == nr) ? 1 : ((nr > SHT_MAX_SHARDS) ? SHT_MAX_SHARDS : nr);
+    tables = (BigHashTable **)malloc(sizeof(BigHashTable *) * shards_nr);
+    locks = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t) * shards_nr);
+    if (0 == tables || 0 == locks){
+        fprintf(stderr, "Error: malloc %u shards in ShardedHashTable::ShardedHashTable()\n", shards_nr);
+        _exit(-1);
+    }
+    for (unsigned int i = 0; i < shards_nr; i++){
+        if (name){
+            snprintf(dbname, PATH_MAX_LEN, "%s_shard%u.db", name, i);
+            snprintf(bfname, PATH_MAX_LEN, "%s_shard%u.bf", name, i);
+            tables[i] = new BigHashTable(dbname, bfname);
+        }else
+            tables[i] = new BigHashTable;
+        if (0 != pthread_mutex_init(&locks[i], 0)){
+            fprintf(stderr, "Error: init the lock of shard %u in ShardedHashTable::ShardedHashTable()\n", i);
+            _exit(-1);
+        }
+    }
+}
+
+ShardedHashTable::~ShardedHashTable()
+{
+    for (unsigned int i = 0; i < shards_nr; i++){
+        delete tables[i];
+        tables[i] = 0;
+        pthread_mutex_destroy(&locks[i]);
+    }
+    free(tables);
+    tables = 0;
+    free(locks);
+    locks = 0;
+}
+
+unsigned int ShardedHashTable::shard(const void *key) const
+//the high bits of the mixed key hash, independent of the bucket/cache positions
+//which every HashDB takes from the low bits of APHash
+{
+    uint32_t h = HashFunctions::BKDRHash((const char *)key) * 2654435761U;
+    return (unsigned int)(((uint64_t)h * shards_nr) >> 32);
+}
+
+void ShardedHashTable::insert(const void *key, const void *data, const int datasz)
+{
+    unsigned int s = shard(key);
+    pthread_mutex_lock(&locks[s]);
+    tables[s]->insert(key, data, datasz);
+    pthread_mutex_unlock(&locks[s]);
+}
+
+bool ShardedHashTable::getvalue(const void *key, void *buf, int &valuesize)
+{
+    unsigned int s = shard(key);
+    bool found = false;
+    pthread_mutex_lock(&locks[s]);
+    found = tables[s]->getvalue(key, buf, valuesize);
+    pthread_mutex_unlock(&locks[s]);
+    return found;
+}
+
+bool ShardedHashTable::contain(const void *key)
+{
+    unsigned int s = shard(key);
+    bool found = false;
+    pthread_mutex_lock(&locks[s]);
+    found = tables[s]->contain(key);
+    pthread_mutex_unlock(&locks[s]);
+    return found;
+}
+
+void* ShardedHashTable::getvalue(const void *key, int &valuesize)
+{
+    unsigned int s = shard(key);
+    void *value = 0;
+    pthread_mutex_lock(&locks[s]);
+    value = tables[s]->getvalue(key, valuesize);
+    pthread_mutex_unlock(&locks[s]);
+    return value;
+}
+
+int ShardedHashTable::insertnew(const void *key, const void *data, const int datasz, void **value, int *valuesize)
+{
+    unsigned int s = shard(key);
+    void *old = 0;
+    int old_sz = 0;
+    bool found = false;
+    pthread_mutex_lock(&locks[s]);
+    if (value){
+        old = tables[s]->getvalue(key, old_sz);
+        found = (0 != old);
+    }else
+        found = tables[s]->contain(key);
+    if (!found)
+        tables[s]->insert(key, data, datasz);
+    pthread_mutex_unlock(&locks[s]);
+
+    if (value)
+        *value = old;
+    if (valuesize)
+        *valuesize = old_sz;
+    return (found) ? 0 : 1;
+}
+
+void ShardedHashTable::batchinsert(const void **keys, const void **datas, const int *datasizes, const int nr)
+{
+    vector< vector<int> > idx(shards_nr);
+    vector<const void *> skeys, sdatas;
+    vector<int> ssizes;
+
+    for (int i = 0; i < nr; i++)
+        idx[shard(keys[i])].push_back(i);
+    for (unsigned int s = 0; s < shards_nr; s++){
+        if (idx[s].empty())
+            continue;
+        skeys.clear();
+        sdatas.clear();
+        ssizes.clear();
+        for (size_t j = 0; j < idx[s].size(); j++){
+            skeys.push_back(keys[idx[s][j]]);
+            sdatas.push_back(datas[idx[s][j]]);
+            ssizes.push_back(datasizes[idx[s][j]]);
+        }
+        pthread_mutex_lock(&locks[s]);
+        tables[s]->batchinsert(&skeys[0], &sdatas[0], &ssizes[0], skeys.size());
+        pthread_mutex_unlock(&locks[s]);
+    }
+}
+
+int ShardedHashTable::batchgetvalue(const void **keys, const int nr, void **values, int *valuesizes)
+{
+    vector< vector<int> > idx(shards_nr);
+    vector<const void *> skeys;
+    vector<void *> svalues;
+    vector<int> ssizes;
+    int found = 0, ret = 0;
+
+    for (int i = 0; i < nr; i++){
+        values[i] = 0;
+        valuesizes[i] = 0;
+        idx[shard(keys[i])].push_back(i);
+    }
+    for (unsigned int s = 0; s < shards_nr; s++){
+        if (idx[s].empty())
+            continue;
+        skeys.clear();
+        for (size_t j = 0; j < idx[s].size(); j++)
+            skeys.push_back(keys[idx[s][j]]);
+        svalues.assign(skeys.size(), (void *)0);
+        ssizes.assign(skeys.size(), 0);
+
+        pthread_mutex_lock(&locks[s]);
+        ret = tables[s]->batchgetvalue(&skeys[0], skeys.size(), &svalues[0], &ssizes[0]);
+        pthread_mutex_unlock(&locks[s]);
+        if (-1 == ret){
+            fprintf(stderr, "Error: batch lookup in shard %u in ShardedHashTable::batchgetvalue()\n", s);
+            return -1;
+        }
+        found += ret;
+        for (size_t j = 0; j < idx[s].size(); j++){
+            values[idx[s][j]] = svalues[j];
+            valuesizes[idx[s][j]] = ssizes[j];
+        }
+    }
+    return found;
+}
+
+//#define SHARDEDHASHTABLE_TEST
+#ifdef SHARDEDHASHTABLE_TEST
+#include <string>
+using namespace std;
+
+#define TEST_THREADS 4
+#define TEST_KEYS 20000
+
+static ShardedHashTable *stab = 0;
+
+static void* test_ingest(void *arg)
+//every thread inserts the same keys, each key must be inserted once
+{
+    long inserted = 0;
+    char key[64] = {0};
+    int tid = (int)(long)arg;
+    for (int i = 0; i < TEST_KEYS; i++){
+        sprintf(key, "%032x", i * 2654435761U);
+        inserted += stab->insertnew(key, &tid, sizeof(tid));
+    }
+    return (void *)inserted;
+}
+
+int main()
+{
+    pthread_t threads[TEST_THREADS];
+    void *inserted = 0;
+    long total = 0;
+
+    stab = new ShardedHashTable(SHT_DEFAULT_SHARDS);
+    for (long t = 0; t < TEST_THREADS; t++)
+        pthread_create(&threads[t], 0, test_ingest, (void *)t);
+    for (int t = 0; t < TEST_THREADS; t++){
+        pthread_join(threads[t], &inserted);
+        total += (long)inserted;
+    }
+    cout << "keys inserted by " << TEST_THREADS << " threads: " << total
+         << " (expected " << TEST_KEYS << ")" << endl;
+    delete stab;
+    return 0;
+}
+#endif // SHARDEDHASHTABLE_TEST
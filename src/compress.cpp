@@ -0,0 +1,392 @@
+/*
+Copyright (c) <2016> <Cuiting Shi>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions: 
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <math.h>
+#include "compress.h"
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lzhash(const unsigned char *p)
+{
+    return (read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline unsigned int matchlen(const unsigned char *p, const unsigned char *q, const unsigned char *end)
+{
+    const unsigned char *start = p;
+    while (p < end && *p == *q){
+        p++;
+        q++;
+    }
+    return p - start;
+}
+
+static inline bool putlen(unsigned char *&op, const unsigned char *oend, unsigned int n)
+//the extra length bytes of a length of 15 or more
+{
+    for (; n >= 255; n -= 255){
+        if (op >= oend)
+            return false;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return false;
+    *op++ = (unsigned char)n;
+    return true;
+}
+
+static bool putseq(unsigned char *&op, const unsigned char *oend,
+                   const unsigned char *lit, unsigned int lit_len, unsigned int offset, unsigned int mlen)
+//one sequence, mlen == 0: the last one, literals only
+{
+    unsigned char *token = op;
+    if (op >= oend)
+        return false;
+    op++;
+    *token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15 && !putlen(op, oend, lit_len - 15))
+        return false;
+    if (op + lit_len > oend)
+        return false;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (0 == mlen)
+        return true;
+    if (op + 2 > oend)
+        return false;
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (unsigned char)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && !putlen(op, oend, mlen - 15))
+        return false;
+    return true;
+}
+
+static unsigned int lz_compress_at(const unsigned char *base, unsigned int start, unsigned int len,
+                                   char *dst, unsigned int cap, int level)
+/*compress base[start, len); the bytes before start are the dictionary:
+  they are hashed, and matched, but not written*/
+{
+    const unsigned char *ip = base + start, *anchor = base + start;
+    const unsigned char *iend = base + len;
+    const unsigned char *ilimit = (len > LZ_MIN_MATCH) ? iend - LZ_MIN_MATCH : base;
+    unsigned char *op = (unsigned char *)dst;
+    const unsigned char *oend = op + cap;
+    uint32_t htab[1 << LZ_HASH_BITS];
+    uint32_t *chain = 0;
+
+    //position + 1 of the last 4 bytes of each hash, 0: none
+    memset(htab, 0, sizeof(htab));
+    if (level >= LZ_LEVEL_HIGH && len > LZ_MIN_MATCH){
+        chain = (uint32_t *)malloc(sizeof(uint32_t) * len);
+        if (0 == chain)
+            level = LZ_LEVEL_FAST;
+    }
+    for (const unsigned char *p = base; p < base + start && p < ilimit; p++){
+        uint32_t hp = lzhash(p);
+        if (chain)
+            chain[p - base] = htab[hp];
+        htab[hp] = p - base + 1;
+    }
+
+    while (ip < ilimit){
+        uint32_t h = lzhash(ip);
+        uint32_t pos = ip - base;
+        uint32_t cand = htab[h];
+        unsigned int best_len = 0, best_off = 0;
+        for (int depth = 0; cand > 0 && depth < (chain ? LZ_HC_DEPTH : 1); depth++){
+            const unsigned char *ref = base + cand - 1;
+            if (pos - (cand - 1) > LZ_MAX_OFFSET)
+                break;
+            if (read32(ref) == read32(ip)){
+                unsigned int mlen = matchlen(ip, ref, iend);
+                if (mlen > best_len){
+                    best_len = mlen;
+                    best_off = pos - (cand - 1);
+                }
+            }
+            if (!chain)
+                break;
+            cand = chain[cand - 1];
+        }
+        if (chain)
+            chain[pos] = htab[h];
+        htab[h] = pos + 1;
+
+        if (best_len < LZ_MIN_MATCH){
+            ip++;
+            continue;
+        }
+        if (!putseq(op, oend, anchor, ip - anchor, best_off, best_len))
+            goto _LZ_COMPRESS_FULL;
+        //the positions inside the match are hashed as well
+        for (const unsigned char *p = ip + 1; p < ip + best_len && p < ilimit; p++){
+            uint32_t hp = lzhash(p);
+            if (chain)
+                chain[p - base] = htab[hp];
+            htab[hp] = p - base + 1;
+        }
+        ip += best_len;
+        anchor = ip;
+    }
+    if (!putseq(op, oend, anchor, iend - anchor, 0, 0))
+        goto _LZ_COMPRESS_FULL;
+    if (chain)
+        free(chain);
+    return op - (unsigned char *)dst;
+
+_LZ_COMPRESS_FULL:
+    if (chain)
+        free(chain);
+    return 0;
+}
+
+unsigned int lz_compress(const char *src, unsigned int len, char *dst, unsigned int cap, int level)
+{
+    return lz_compress_at((const unsigned char *)src, 0, len, dst, cap, level);
+}
+
+static inline bool getlen(const unsigned char *&ip, const unsigned char *iend, unsigned int &n)
+{
+    unsigned char b = 255;
+    while (255 == b){
+        if (ip >= iend)
+            return false;
+        b = *ip++;
+        n += b;
+    }
+    return true;
+}
+
+static int lz_decompress_at(const char *src, unsigned int len, unsigned char *out, unsigned int start, unsigned int cap)
+//decompress into out[start, cap), a match may reach back into out[0, start)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = out + start;
+    unsigned char *oend = out + cap;
+
+    while (ip < iend){
+        unsigned int token = *ip++;
+        unsigned int lit_len = token >> 4, mlen = token & 0x0f, offset = 0;
+        if (15 == lit_len && !getlen(ip, iend, lit_len))
+            return -1;
+        if (lit_len > (unsigned int)(iend - ip) || lit_len > (unsigned int)(oend - op))
+            return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend)
+            break;
+
+        if (ip + 2 > iend)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (15 == mlen && !getlen(ip, iend, mlen))
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (0 == offset || offset > (unsigned int)(op - out) || mlen > (unsigned int)(oend - op))
+            return -1;
+        //byte by byte: the match may overlap the bytes it produces
+        const unsigned char *ref = op - offset;
+        for (unsigned int i = 0; i < mlen; i++)
+            op[i] = ref[i];
+        op += mlen;
+    }
+    return op - (out + start);
+}
+
+int lz_decompress(const char *src, unsigned int len, char *dst, unsigned int cap)
+{
+    return lz_decompress_at(src, len, (unsigned char *)dst, 0, cap);
+}
+
+unsigned int lz_delta_encode(const char *base, unsigned int base_len, const char *src, unsigned int len,
+                             char *dst, unsigned int cap, int level)
+{
+    unsigned char *buf = (unsigned char *)malloc(base_len + len);
+    unsigned int dlen = 0;
+    if (0 == buf)
+        return 0;
+    memcpy(buf, base, base_len);
+    memcpy(buf + base_len, src, len);
+    dlen = lz_compress_at(buf, base_len, base_len + len, dst, cap, level);
+    free(buf);
+    return dlen;
+}
+
+int lz_delta_decode(const char *base, unsigned int base_len, const char *src, unsigned int len,
+                    char *dst, unsigned int cap)
+{
+    unsigned char *buf = (unsigned char *)malloc(base_len + cap);
+    int olen = -1;
+    if (0 == buf)
+        return -1;
+    memcpy(buf, base, base_len);
+    olen = lz_decompress_at(src, len, buf, base_len, base_len + cap);
+    if (olen > 0)
+        memcpy(dst, buf + base_len, olen);
+    free(buf);
+    return olen;
+}
+
+static uint32_t sf_gear[256];
+static uint32_t sf_mul[SF_FEATURE_NR], sf_add[SF_FEATURE_NR];
+static bool sf_ready = false;
+
+static void sf_init()
+//fixed pseudo random tables: the features of a block must not change between runs
+{
+    uint32_t seed = 0x161101;
+    for (int i = 0; i < 256; i++){
+        seed = seed * 1103515245 + 12345;
+        sf_gear[i] = (seed >> 16) | (seed << 16);
+    }
+    for (int i = 0; i < SF_FEATURE_NR; i++){
+        seed = seed * 1103515245 + 12345;
+        sf_mul[i] = seed | 1;
+        seed = seed * 1103515245 + 12345;
+        sf_add[i] = seed;
+    }
+    sf_ready = true;
+}
+
+bool super_features(const char *src, unsigned int len, uint64_t sf[SF_SUPER_NR])
+{
+    uint32_t feature[SF_FEATURE_NR];
+    uint32_t fp = 0;
+    unsigned int samples = 0;
+    if (!sf_ready)
+        sf_init();
+    if (len < SF_MIN_LEN)
+        return false;
+    memset(feature, 0, sizeof(feature));
+    for (unsigned int i = 0; i < len; i++){
+        fp = (fp << 1) + sf_gear[(unsigned char)src[i]];
+        if (i < 32 || 0 != (fp & SF_SAMPLE_MASK))
+            continue;
+        samples++;
+        for (int k = 0; k < SF_FEATURE_NR; k++){
+            uint32_t f = fp * sf_mul[k] + sf_add[k];
+            if (f > feature[k])
+                feature[k] = f;
+        }
+    }
+    if (samples < SF_FEATURE_NR)
+        return false;
+    //FNV-1a over the features of each group
+    for (int j = 0; j < SF_SUPER_NR; j++){
+        uint64_t h = 14695981039346656037ULL;
+        for (int k = j * SF_GROUP_NR; k < (j + 1) * SF_GROUP_NR; k++){
+            h ^= feature[k];
+            h *= 1099511628211ULL;
+        }
+        sf[j] = h;
+    }
+    return true;
+}
+
+bool lz_incompressible(const char *src, unsigned int len)
+{
+    unsigned int freq[256];
+    unsigned int step = 1, nr = 0;
+    double entropy = 0.0;
+    if (len < LZ_SAMPLE_NR)
+        return false;
+    step = len / LZ_SAMPLE_NR;
+    memset(freq, 0, sizeof(freq));
+    for (unsigned int i = 0; i < len && nr < LZ_SAMPLE_NR; i += step, nr++)
+        freq[(unsigned char)src[i]]++;
+    for (int c = 0; c < 256; c++){
+        if (freq[c] > 0){
+            double p = (double)freq[c] / nr;
+            entropy -= p * log2(p);
+        }
+    }
+    /*512 samples of random bytes give about 7.5 bits, not 8: the sample
+      is too small to see each byte value twice*/
+    return entropy > LZ_ENTROPY_MAX;
+}
+
+int decode_block(unsigned int codec, const char *src, unsigned int len, char *dst, unsigned int raw_len)
+{
+    switch (codec){
+    case CODEC_NONE:
+        if (len != raw_len)
+            return -1;
+        memcpy(dst, src, len);
+        return 0;
+    case CODEC_LZ:
+        return ((int)raw_len == lz_decompress(src, len, dst, raw_len)) ? 0 : -1;
+    case CODEC_DELTA: //needs the base, see lz_delta_decode(...)
+    default:
+        return -1;
+    }
+}
+
+//#define COMPRESS_TEST
+#ifdef COMPRESS_TEST
+#include <iostream>
+#include <stdio.h>
+using namespace std;
+#define TEST_LEN 65536
+
+int main()
+{
+    char *src = (char *)malloc(TEST_LEN);
+    char *zbuf = (char *)malloc(TEST_LEN);
+    char *out = (char *)malloc(TEST_LEN);
+    unsigned int seed = 12345, zlen = 0;
+
+    //log lines, then random bytes
+    for (unsigned int i = 0, n = 0; i < TEST_LEN; i += n)
+        n = snprintf(src + i, TEST_LEN - i, "2016-11-01 12:%02u:%02u INFO request %u served in %u ms\n",
+                     (i / 60) % 60, i % 60, i * 7, i % 97);
+    for (int level = LZ_LEVEL_FAST; level <= LZ_LEVEL_HIGH; level++){
+        zlen = lz_compress(src, TEST_LEN, zbuf, TEST_LEN, level);
+        int olen = lz_decompress(zbuf, zlen, out, TEST_LEN);
+        cout << "text, level " << level << ": " << TEST_LEN << " -> " << zlen << " bytes, "
+             << ((TEST_LEN == olen && 0 == memcmp(src, out, TEST_LEN)) ? "ok" : "WRONG")
+             << ", incompressible: " << lz_incompressible(src, TEST_LEN) << endl;
+    }
+    for (unsigned int i = 0; i < TEST_LEN; i++){
+        seed = seed * 1103515245 + 12345;
+        src[i] = (char)(seed >> 16);
+    }
+    zlen = lz_compress(src, TEST_LEN, zbuf, TEST_LEN - TEST_LEN / 8, LZ_LEVEL_FAST);
+    cout << "random: " << zlen << " bytes (0: does not fit), incompressible: " << lz_incompressible(src, TEST_LEN) << endl;
+
+    //a 4KB page with a few bytes changed, against the original one
+    uint64_t sf0[SF_SUPER_NR], sf1[SF_SUPER_NR];
+    int same = 0;
+    memcpy(out, src, 4096);
+    out[100] ^= 0x55;
+    out[2000] ^= 0x55;
+    out[3000] ^= 0x55;
+    super_features(src, 4096, sf0);
+    super_features(out, 4096, sf1);
+    for (int j = 0; j < SF_SUPER_NR; j++)
+        same += (sf0[j] == sf1[j]) ? 1 : 0;
+    zlen = lz_delta_encode(src, 4096, out, 4096, zbuf, 4096, LZ_LEVEL_FAST);
+    int olen = lz_delta_decode(src, 4096, zbuf, zlen, out + 4096, 4096);
+    cout << "delta: " << same << " of " << SF_SUPER_NR << " super features equal, 4096 -> " << zlen << " bytes, "
+         << ((4096 == olen && 0 == memcmp(out, out + 4096, 4096)) ? "ok" : "WRONG") << endl;
+    free(src);
+    free(zbuf);
+    free(out);
+    return 0;
+}
+#endif // COMPRESS_TEST
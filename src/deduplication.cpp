@@ -8,13 +8,23 @@ The above copyright notice and this permission notice shall be included in all c
 THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 #include "deduplication.h"
+#include "PackageView.h"
+#include "RestoreCache.h"
 
 Dedupe::Dedupe(bool vbose)
 {
     memset(&d_pkg_hdr, 0, D_PKG_HDR_SZ);
     d_htab_pathname = 0; //hashtable for path names
-    d_htab_sb_csum = 0; //hashtable for SB file chunking
-    d_htab_bindex = 0; // hashtable for chunking blocks index
+    d_bindex = 0; // blocks index and SB block checksums
+    d_refcnt = 0;
+    d_refcnt_base = 0;
+    d_ldata_base = 0;
+    d_mdata_base = 0;
+    d_free_next = 0;
+    d_free_fail = 0;
+    memset(&d_cont, 0, D_CONTAINER_SZ);
+    d_cont_room = 0;
+    d_cont_free = false;
 
     d_chunk_alg = D_CHUNK_FSP;
     d_cdc_hashfun = HashFunctions::APHash; // default as adler32_rolling
@@ -24,6 +34,32 @@ Dedupe::Dedupe(bool vbose)
 
     d_sb_block_sz = 4096; //4096; //default size  of the sliding block as 4096 bytes
     d_fsp_block_sz = 4096;
+    d_sample_bits = 0; //exact block index
+    d_prefetch_nr = BINDEX_PREFETCH_NR;
+    d_index_backend = BINDEX_BACKEND_HASHDB;
+    d_index_filter = false;
+    d_remove_inplace = false; //compact the package on every removal
+    d_compact_pct = REMOVE_COMPACT_PCT;
+    d_compress_level = 0; //blocks stored as they are
+    d_zbuf = 0;
+    d_zbuf_sz = 0;
+    d_zskip_nr = 0;
+    d_zfail_nr = 0;
+    d_similarity = false; //exact duplicates only
+    d_delta_depth = DELTA_MAX_DEPTH;
+    d_dbuf = 0;
+    d_dbuf_sz = 0;
+    d_delta_nr = 0;
+    d_restore_sched = false; //extract in file order
+    d_sched_blocks = DEDUP_SCHED_BLOCKS;
+    d_rcache_sz = DEDUP_RESTORE_CACHE;
+    d_rcache = 0;
+    d_restore_threads = 1; //extract in this thread
+    d_view = 0;
+    d_view_buf = 0;
+    memset(d_view_name, 0, PATH_MAX_LEN);
+    d_mem_budget = 0; //default sizes
+    d_io_buf_sz = BUF_MAX_SIZE;
     verbose = vbose;
     memset(d_pkg_name, 0, PATH_MAX_LEN);
     memset(d_ldata_name, 0, PATH_MAX_LEN);
@@ -36,35 +72,44 @@ Dedupe::Dedupe(bool vbose)
     sprintf(d_bdata_name, "data/.bdata_%s_%d", MAGIC_TMP_FILE_NAME, pid);
     sprintf(d_mdata_name, "data/.mdata_%s_%d", MAGIC_TMP_FILE_NAME, pid);
 
+    d_htab_pathname = new_pathname_table(HASHDB_DEFAULT_TNUM, HASHDB_DEFAULT_CNUM);
+}
+
+BigHashTable* Dedupe::new_pathname_table(const uint64_t tnum, const uint32_t cnum)
+{
     char tabname[PATH_MAX_LEN] = {0};
     char bloomname[PATH_MAX_LEN]  = {0};
+    pid_t pid = getpid();
     sprintf(tabname, "data/BigHashTable/.hashdb_pathname_%d.db", pid);
     sprintf(bloomname, "data/BigHashTable/.hashdb_pathname_%d.bf", pid);
-    d_htab_pathname = new BigHashTable(tabname, bloomname);
-
-    if (d_chunk_alg == D_CHUNK_SB){
-        memset(tabname, 0, PATH_MAX_LEN);
-        memset(bloomname, 0, PATH_MAX_LEN);
-        sprintf(tabname, "data/BigHashTable/.hashdb_sbcsum_%d.db", pid);
-        sprintf(bloomname, "data/BigHashTable/.hashdb_sbcsum_%d.bf", pid);
-        d_htab_sb_csum = new BigHashTable(tabname, bloomname);
-    }
+    return new BigHashTable(tabname, bloomname, tnum, cnum);
 }
 
 Dedupe::~Dedupe()
 {
-    if (d_htab_bindex){
-        delete d_htab_bindex;
-        d_htab_bindex = 0;
+    if (d_bindex){
+        delete d_bindex;
+        d_bindex = 0;
     }
-    if (d_htab_sb_csum){
-        delete d_htab_sb_csum;
-        d_htab_sb_csum = 0;
+    if (d_refcnt){
+        d_refcnt->closedb();
+        d_refcnt->unlinkdb();
+        delete d_refcnt;
+        d_refcnt = 0;
     }
     if (d_htab_pathname){
         delete d_htab_pathname;
         d_htab_pathname = 0;
     }
+    if (d_zbuf){
+        free(d_zbuf);
+        d_zbuf = 0;
+    }
+    if (d_dbuf){
+        free(d_dbuf);
+        d_dbuf = 0;
+    }
+    drop_view();
     clean_tmpfiles();
 }
 
@@ -96,6 +141,238 @@ int Dedupe::set_cdc_hashfun(const char *hashfunc_name)
     return -1;
 }
 
+int Dedupe::set_index_sampling(unsigned int sample_bits, unsigned int prefetch_nr)
+{
+    if (sample_bits > BINDEX_MAX_SAMPLE_BITS || 0 == prefetch_nr){
+        fprintf(stderr, "Error: set index sampling bits as %u, prefetch number as %u in Dedupe::set_index_sampling(...)\n",
+                sample_bits, prefetch_nr);
+        return -1;
+    }
+    d_sample_bits = sample_bits;
+    d_prefetch_nr = prefetch_nr;
+    if (verbose)
+        cout << "Info: keep 1/" << (1U << sample_bits) << " fingerprints as hooks, prefetch " << prefetch_nr
+             << " logic blocks per hook in Dedupe::set_index_sampling(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_index_backend(const char *name)
+{
+    if (0 == strcmp(name, INDEX_HASHDB_NAME))
+        d_index_backend = BINDEX_BACKEND_HASHDB;
+    else if (0 == strcmp(name, INDEX_LSM_NAME))
+        d_index_backend = BINDEX_BACKEND_LSM;
+    else{
+        fprintf(stderr, "Error: wrong index backend %s in Dedupe::set_index_backend(...)\n", name);
+        fprintf(stderr, ".....      <name> : \"%s\", \"%s\" \n", INDEX_HASHDB_NAME, INDEX_LSM_NAME);
+        return -1;
+    }
+    if (verbose)
+        cout << "Info: set index backend as " << name << " in Dedupe::set_index_backend(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_index_filter(bool on)
+{
+    d_index_filter = on;
+    if (verbose)
+        cout << "Info: " << (on ? "keep" : "do not add") << " a fingerprint filter in the package in Dedupe::set_index_filter(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_remove_inplace(bool on, unsigned int compact_pct)
+{
+    if (compact_pct > 100){
+        fprintf(stderr, "Error: compact the package past %u%% free space in Dedupe::set_remove_inplace(...)\n", compact_pct);
+        return -1;
+    }
+    d_remove_inplace = on;
+    d_compact_pct = compact_pct;
+    if (verbose)
+        cout << "Info: remove files " << (on ? "in place" : "by compacting the package")
+             << ", compact past " << compact_pct << "% free space in Dedupe::set_remove_inplace(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_compression(int level)
+{
+    if (level < 0 || level > LZ_LEVEL_HIGH){
+        fprintf(stderr, "Error: wrong compression level %d in Dedupe::set_compression(...)\n", level);
+        fprintf(stderr, ".....      <level> : 0 (none), %d (fast), %d (high)\n", LZ_LEVEL_FAST, LZ_LEVEL_HIGH);
+        return -1;
+    }
+    d_compress_level = level;
+    if (verbose)
+        cout << "Info: compression level " << level << " for the new unique blocks in Dedupe::set_compression(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_similarity(bool on, unsigned int max_depth)
+{
+    if (0 == max_depth || max_depth > DELTA_DEPTH_LIMIT){
+        fprintf(stderr, "Error: delta chains of at most %u blocks in Dedupe::set_similarity(...)\n", max_depth);
+        fprintf(stderr, ".....      <max_depth> : 1 to %d\n", DELTA_DEPTH_LIMIT);
+        return -1;
+    }
+    d_similarity = on;
+    d_delta_depth = max_depth;
+    if (verbose)
+        cout << "Info: " << (on ? "store" : "do not store") << " near duplicate blocks as deltas, chains of at most "
+             << max_depth << " in Dedupe::set_similarity(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_restore_schedule(bool on, unsigned int batch_blocks)
+{
+    if (0 == batch_blocks){
+        fprintf(stderr, "Error: batches of no block in Dedupe::set_restore_schedule(...)\n");
+        return -1;
+    }
+    d_restore_sched = on;
+    d_sched_blocks = batch_blocks;
+    if (verbose)
+        cout << "Info: extract " << (on ? "in package offset order" : "in file order") << ", batches of "
+             << batch_blocks << " blocks in Dedupe::set_restore_schedule(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_restore_cache(unsigned long long bytes)
+{
+    if (bytes > 0 && bytes < BUF_MAX_SIZE){
+        fprintf(stderr, "Error: restore cache of %llu bytes holds no block in Dedupe::set_restore_cache(...)\n", bytes);
+        return -1;
+    }
+    d_rcache_sz = bytes;
+    if (verbose)
+        cout << "Info: restore cache of " << bytes << " bytes in Dedupe::set_restore_cache(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_restore_threads(unsigned int threads)
+{
+    if (threads > DEDUP_RESTORE_THREADS_MAX){
+        fprintf(stderr, "Error: %u restore threads, at most %d in Dedupe::set_restore_threads(...)\n",
+                threads, DEDUP_RESTORE_THREADS_MAX);
+        return -1;
+    }
+    d_restore_threads = (0 == threads) ? 1 : threads;
+    if (verbose)
+        cout << "Info: extract with " << d_restore_threads << " threads in Dedupe::set_restore_threads(...)" << endl;
+    return 0;
+}
+
+int Dedupe::set_memory_budget(unsigned long long bytes)
+/*split bytes by MEM_*_PCT: the path name table and the buffers are sized here,
+  the block index when the package is opened, see new_block_index(...)*/
+{
+    if (bytes > 0 && bytes < MEM_BUDGET_MIN){
+        fprintf(stderr, "Error: memory budget %llu less than %d bytes in Dedupe::set_memory_budget(...)\n",
+                bytes, MEM_BUDGET_MIN);
+        return -1;
+    }
+    d_mem_budget = bytes;
+
+    uint64_t tnum = HASHDB_DEFAULT_TNUM;
+    uint32_t cnum = HASHDB_DEFAULT_CNUM;
+    if (0 == bytes){
+        d_io_buf_sz = BUF_MAX_SIZE;
+    }else{
+        unsigned long long io_sz = bytes / 100 * MEM_IO_PCT;
+        if (io_sz < MEM_IO_BUF_MIN) io_sz = MEM_IO_BUF_MIN;
+        if (io_sz > MEM_IO_BUF_MAX) io_sz = MEM_IO_BUF_MAX;
+        d_io_buf_sz = io_sz;
+
+        //a quarter of the index share and a third of the bloom share for the path names
+        cnum = bytes / 100 * MEM_INDEX_PCT / 4 / HASHDB_CACHED_ENTRY_MEM;
+        tnum = bytes / 100 * MEM_BLOOM_PCT / 3 * 8 / HASHDB_BLOOM_KEY_BITS;
+    }
+    if (d_htab_pathname)
+        delete d_htab_pathname;
+    d_htab_pathname = new_pathname_table(tnum, cnum);
+
+    if (verbose)
+        cout << "Info: set memory budget as " << bytes << " bytes, " << d_io_buf_sz << " bytes copy buffer, "
+             << cnum << " cached path names in Dedupe::set_memory_budget(...)" << endl;
+    return 0;
+}
+
+BlockIndex* Dedupe::new_block_index(const D_Package_Header &pkg_hdr)
+/*size the block index of a package by the memory budget: half of the index share
+  for the hooks, sampling the persisted fingerprints more sparsely as the package
+  grows, an eighth for the table of new fingerprints (the HashDB cache, or the
+  LSM memtable), a sixteenth for the checksum table and one for the buffer of
+  new entries to be written; the path names take the last quarter*/
+{
+    unsigned int sample_bits = d_sample_bits;
+    unsigned int prefetch_nr = d_prefetch_nr;
+    uint64_t tnum = HASHDB_DEFAULT_TNUM;
+    uint32_t cnum = HASHDB_DEFAULT_CNUM;
+    uint32_t memtable_nr = LSM_MEMTABLE_NR;
+    uint32_t spill_nr = BINDEX_SPILL_NR;
+    BlockIndex *bindex = 0;
+
+    if (d_mem_budget > 0){
+        unsigned long long hooks_sz = d_mem_budget / 100 * MEM_INDEX_PCT / 2;
+        unsigned long long index_sz = (unsigned long long)pkg_hdr.bindex_nr * BINDEX_ENTRY_SZ;
+        unsigned long long prefetch_sz = 0;
+        while ((index_sz >> sample_bits) > hooks_sz && sample_bits < BINDEX_MAX_SAMPLE_BITS)
+            sample_bits++;
+        if (sample_bits > d_sample_bits){
+            //sampled by the budget: a prefetch segment per share of the block budget
+            prefetch_sz = d_mem_budget / 100 * MEM_BLOCK_PCT / BINDEX_CACHE_SEGS;
+            prefetch_nr = prefetch_sz / BlockIndex::prefetchcost(D_LOGIC_BLOCK_ENTRY_SZ);
+            if (prefetch_nr < 64) prefetch_nr = 64;
+            if (prefetch_nr > (1U << 20)) prefetch_nr = 1U << 20;
+        }
+        cnum = d_mem_budget / 100 * MEM_INDEX_PCT / 8 / HASHDB_CACHED_ENTRY_MEM;
+        tnum = d_mem_budget / 100 * MEM_BLOOM_PCT / 3 * 8 / HASHDB_BLOOM_KEY_BITS;
+        memtable_nr = d_mem_budget / 100 * MEM_INDEX_PCT / 8 / (LSM_ENTRY_SZ + 2 * sizeof(int32_t));
+        spill_nr = d_mem_budget / 100 * MEM_INDEX_PCT / 16 / BINDEX_ENTRY_SZ;
+        if (cnum < 1024) cnum = 1024;
+        if (tnum < 1024) tnum = 1024;
+        if (memtable_nr < 1024) memtable_nr = 1024;
+        if (spill_nr < 1024) spill_nr = 1024;
+        if (verbose)
+            cout << "Info: block index of " << pkg_hdr.bindex_nr << " fingerprints keeps 1/" << (1U << sample_bits)
+                 << " as hooks, prefetch " << prefetch_nr << " logic blocks, " << cnum
+                 << " cached entries, " << spill_nr << " buffered entries in Dedupe::new_block_index(...)" << endl;
+    }
+
+    bindex = new BlockIndex(true, cnum, tnum, spill_nr);
+    if (0 != bindex->setsampling(sample_bits, prefetch_nr) ||
+        0 != bindex->setbackend(d_index_backend, memtable_nr)){
+        delete bindex;
+        return 0;
+    }
+    return bindex;
+}
+
+unsigned long long Dedupe::memory_usage(bool show)
+/*bytes held by the index caches, the bloom filters, the block caches and the copy buffer*/
+{
+    uint64_t index = 0, bloom = 0, block = 0;
+    unsigned long long total = 0;
+    if (d_htab_pathname){
+        index += d_htab_pathname->memusage();
+        bloom += d_htab_pathname->bloomusage();
+    }
+    if (d_bindex)
+        d_bindex->memusage(index, bloom, block);
+    total = index + bloom + block + d_io_buf_sz;
+    if (show){
+        cout << "Info: memory usage in Dedupe::memory_usage(...)" << endl;
+        cout << "    index caches:  " << index << " bytes" << endl;
+        cout << "    bloom filters: " << bloom << " bytes" << endl;
+        cout << "    block caches:  " << block << " bytes" << endl;
+        cout << "    I/O buffers:   " << d_io_buf_sz << " bytes" << endl;
+        cout << "    total:         " << total << " bytes";
+        if (d_mem_budget > 0)
+            cout << " of budget " << d_mem_budget << " bytes";
+        cout << endl;
+    }
+    return total;
+}
+
 int Dedupe::create_package(const char *pkg_name)
 {
     fstream pkg_file;
@@ -108,6 +385,9 @@ int Dedupe::create_package(const char *pkg_name)
     pkg_hdr.ublocks_len = 0;
     pkg_hdr.ldata_offset = D_PKG_HDR_SZ + pkg_hdr.ublocks_len;
     pkg_hdr.mdata_offset = pkg_hdr.ldata_offset + D_LOGIC_BLOCK_ENTRY_SZ * pkg_hdr.ublocks_nr;
+    pkg_hdr.bindex_offset = pkg_hdr.mdata_offset;
+    pkg_hdr.csum_offset = pkg_hdr.mdata_offset;
+    pkg_hdr.sections_offset = pkg_hdr.mdata_offset;
 
     pkg_file.open(pkg_name, ios::binary | ios::out);
     if (!pkg_file.is_open()){
@@ -144,13 +424,52 @@ int Dedupe::show_pkg_header(const char *pkg_name)
     cout << "4. fsp chunk block size:    " << pkg_hdr.fsp_block_sz << endl;
     cout << "5. sb chunk win block size: " << pkg_hdr.sb_block_sz << endl;
     cout << "6. block_id_t type size:    " << pkg_hdr.blockid_sz << endl;
-    cout << "7. unique blocks's length:  " << pkg_hdr.ublocks_len << endl;
+    cout << "7. unique blocks's length:  " << pkg_hdr.ublocks_len << ", stored: " << pkg_hdr.zblocks_len << endl;
     cout << "8. logic data offset:       " << pkg_hdr.ldata_offset << endl;
     cout << "9. file metadata offset:    " << pkg_hdr.mdata_offset << endl;
+    cout << "10. block index offset:     " << pkg_hdr.bindex_offset << ", entries: " << pkg_hdr.bindex_nr
+         << ", runs: " << pkg_hdr.bindex_runs_nr << endl;
+    cout << "11. block checksums offset: " << pkg_hdr.csum_offset << ", entries: " << pkg_hdr.csum_nr
+         << ", runs: " << pkg_hdr.csum_runs_nr << endl;
+    cout << "12. fingerprint filter offset: " << pkg_hdr.cfilter_offset << ", bytes: " << pkg_hdr.cfilter_len << endl;
+    cout << "13. reference counts offset: " << pkg_hdr.refcnt_offset << ", entries: " << pkg_hdr.refcnt_nr
+         << ", runs: " << pkg_hdr.refcnt_runs_nr << endl;
+    cout << "14. extent table offset:    " << pkg_hdr.extent_offset << ", logic block runs: " << pkg_hdr.ldata_extents_nr
+         << ", file entry runs: " << pkg_hdr.mdata_extents_nr << endl;
+    cout << "15. free extents offset:    " << pkg_hdr.free_offset << ", entries: " << pkg_hdr.free_nr
+         << ", bytes: " << pkg_hdr.free_len << endl;
+    cout << "16. removed in place:       " << pkg_hdr.dfiles_nr << " files at " << pkg_hdr.dfiles_offset
+         << ", " << pkg_hdr.dblocks_nr << " blocks" << endl;
+    cout << "17. container table offset: " << pkg_hdr.container_offset << ", containers: " << pkg_hdr.containers_nr << endl;
+    cout << "18. similarity index offset: " << pkg_hdr.simidx_offset << ", entries: " << pkg_hdr.simidx_nr
+         << ", runs: " << pkg_hdr.simidx_runs_nr << ", delta blocks: " << pkg_hdr.delta_nr
+         << ", saving " << pkg_hdr.delta_saved << " bytes" << endl;
+    cout << "19. path index offset:    " << pkg_hdr.pathidx_offset << ", entries: " << pkg_hdr.pathidx_nr
+         << ", runs: " << pkg_hdr.pathidx_runs_nr << endl;
+    cout << "20. index sections offset:  " << pkg_hdr.sections_offset << endl;
     return 0;
 }
 
 
+template <class T>
+static int find_extent(const vector<T> &exts, const unsigned int n)
+//the run (or container) holding entry n, -1: none
+{
+    int lo = 0, hi = exts.size();
+    if (0 == hi)
+        return -1;
+    while (hi - lo > 1){
+        int mid = (lo + hi) / 2;
+        if (exts[mid].first <= n)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (n < exts[lo].first || n >= exts[lo].first + exts[lo].nr)
+        return -1;
+    return lo;
+}
+
 int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove)
 {
     int ret = 0;
@@ -159,19 +478,29 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
     D_Logic_Block_Entry lbentry;
 
     unsigned int rsize = 0;
-    unsigned int remove_blocks_nr = 0, remove_files_nr = 0, remove_bytes = 0;
+    unsigned int remove_blocks_nr = 0, remove_files_nr = 0, remove_delta_nr = 0, sim_nr = 0;
+    unsigned long long remove_bytes = 0, remove_zbytes = 0, remove_delta_saved = 0;
     char buf[BLOCK_MAX_SIZE] = {0};
-    char *block_buf = 0;
-    ListDB *lookup_table = 0;
+    char *block_buf = 0, *raw_buf = 0;
+    MappedListDB *lookup_table = 0, *new_refcnt = 0;
+    BlockIndex *new_bindex = 0;
     block_id_t *metadata = 0;
     block_id_t TOBE_REMOVED = 0;
     block_id_t value = 0;
+    block_id_t *ref = 0;
     unsigned long long offset = 0;
     char pathname[PATH_MAX_LEN] = {0};
     char listdb_name[PATH_MAX_LEN] = {0};
+    bool compact = false;
+    bool csum = false; //the checksum set is rebuilt for SB chunking
 
     fstream pkg_file, ldata_file, bdata_file, mdata_file;
 
+    if (d_remove_inplace){
+        ret = remove_files_inplace(pkg_name, files_nr, files_remove, compact);
+        if (0 != ret || !compact)
+            return ret;
+    }
     pkg_file.open(pkg_name, ios::binary | ios::in);
     if (!pkg_file.is_open()){
         fprintf(stderr, "Error: open deduped package %s in Dedupe::remove_files(...)\n", pkg_name);
@@ -187,13 +516,19 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
         goto _REMOVE_FILES_EXIT;
     }
     if (DEDUP_MAGIC_NUM != pkg_hdr.magic_nr){
-        fprintf(stderr, "Error: wrong magic number for deduped package in Deedupe::remove_files(...)\n");
+        fprintf(stderr, "Error: wrong magic number for deduped package%s in Deedupe::remove_files(...)\n",
+                DEDUP_MAGIC_NUM_160427 == pkg_hdr.magic_nr ? " of the first layout" : "");
         ret = -1;
         goto _REMOVE_FILES_EXIT;
     }
 
     memcpy(&d_pkg_hdr, &pkg_hdr, D_PKG_HDR_SZ);
     TOBE_REMOVED = d_pkg_hdr.ublocks_nr;
+    if (0 != load_extents(pkg_file, pkg_hdr)){
+        fprintf(stderr, "Error: load extent table in Dedupe::remove_files(...)\n");
+        ret = -1;
+        goto _REMOVE_FILES_EXIT;
+    }
 
     ldata_file.open(d_ldata_name, ios::binary | ios::out);
     if (!ldata_file.is_open()){
@@ -216,9 +551,12 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
         goto _REMOVE_FILES_EXIT;
     }
 
-    /*traverse file metadata in the package to build up lookup_table */
-    lookup_table = new ListDB(BLOCK_ID_SIZE, DEFAULT_CACHE_SZ, DEFAULT_SWAP_SZ);
-    if (0 == lookup_table){
+    /*lookup_table starts from the reference count of every unique block,
+      the blocks of the removed files are released from it; the counts of
+      the remaining blocks go into new_refcnt by their new ids*/
+    lookup_table = new MappedListDB(BLOCK_ID_SIZE);
+    new_refcnt = new MappedListDB(BLOCK_ID_SIZE);
+    if (0 == lookup_table || 0 == new_refcnt){
         fprintf(stderr, "Error: malloc lookup table in Dedupe::remove_files(...)\n");
         ret = -1;
         goto _REMOVE_FILES_EXIT;
@@ -231,18 +569,22 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
         ret = -1;
         goto _REMOVE_FILES_EXIT;
     }
-
-    value = 0;
-    for (unsigned int i = 0; i < d_pkg_hdr.ublocks_nr; i++){
-        if (-1 == lookup_table->setvalue(i, &value)){
-            fprintf(stderr, "Error: set ListDB item's value as 0 in Dedupe::remove_files(...)\n");
-            ret = -1;
-            goto _REMOVE_FILES_EXIT;
-        }
+    sprintf(listdb_name, "data/ListDB/refcnt_%d.listdb", getpid());
+    if (-1 == new_refcnt->opendb(listdb_name)){
+        fprintf(stderr, "Error: open listdb \"%s\" in Dedupe::remove_files(...)\n", listdb_name);
+        ret = -1;
+        goto _REMOVE_FILES_EXIT;
+    }
+    if (0 != load_refcnt(pkg_file, pkg_hdr, lookup_table) ||
+        0 != load_simindex(pkg_file, pkg_hdr)){
+        fprintf(stderr, "Error: load reference counts of the ublocks in Dedupe::remove_files(...)\n");
+        ret = -1;
+        goto _REMOVE_FILES_EXIT;
     }
 
-    offset = d_pkg_hdr.mdata_offset;
+    offset = 0;
     for (unsigned int i = 0; i < d_pkg_hdr.files_nr; i++){
+        offset = fentry_offset(i, offset);
         pkg_file.seekg(offset, ios::beg);
         pkg_file.read((char *)(&fentry), D_FILE_ENTRY_SZ);
         rsize = pkg_file.gcount();
@@ -260,8 +602,8 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
             goto _REMOVE_FILES_EXIT;
         }
 
-        //discard those files which are meant to be removed sooner or later
-        if (!is_file_in_list(pathname, files_nr, files_remove)){
+        //only the block ids of the files to be removed are read
+        if (!file_removed(i) && is_file_in_list(pathname, files_nr, files_remove)){
             metadata = (block_id_t *)malloc(BLOCK_ID_SIZE * fentry.fblocks_nr);
             if (0 == metadata){
                 fprintf(stderr, "Error: malloc metadata of %uth file entry in Dedupe::remove_files(..)\n", i);
@@ -277,45 +619,79 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
                 goto _REMOVE_FILES_EXIT;
             }
 
-            for (unsigned int j = 0; j < fentry.fblocks_nr; j++){
-                value = 0;
-                if (0 != lookup_table->getvalue(metadata[j], &value)){
-                    fprintf(stderr, "Error: get %uth ublock's reference numbers from listdb lookup table in Dedupe::remove_files(...)\n",metadata[j]);
-                    ret = -1;
-                    goto _REMOVE_FILES_EXIT;
-                }
-                value++;
-                if (-1 == lookup_table->setvalue(metadata[j], &value)){
-                    fprintf(stderr, "Error: set %uth ublock's referenced numbers from listdb lookup table in Dedupe::remove_files(...)\n", metadata[j]);
-                    ret = -1;
-                    goto _REMOVE_FILES_EXIT;
-                }
+            //(uint32_t)-1 as delta: drop one reference
+            if (0 != lookup_table->batchinc(metadata, fentry.fblocks_nr, (uint32_t)-1)){
+                fprintf(stderr, "Error: release references of %uth file entry's ublocks in listdb lookup table in Dedupe::remove_files(...)\n", i);
+                ret = -1;
+                goto _REMOVE_FILES_EXIT;
             }
             if (metadata){
                 free(metadata);
                 metadata = 0;
             }
-        }//process each file entry, which does not belong to the files to be removed
+        }//process each file entry, which belongs to the files to be removed
 
         offset += fentry.fentry_sz;
     }//traverse file metadata in the deduped package, prepare for removing files
 
+    /*the deltas dropped release their bases, from the last block on: a base
+      has a smaller id, it is seen after every delta against it*/
+    for (unsigned int i = pkg_hdr.ublocks_nr; i-- > 0; ){
+        ref = (block_id_t *)lookup_table->valueptr(i);
+        if (0 == ref || 0 != *ref)
+            continue;
+        pkg_file.seekg(lblock_offset(i), ios::beg);
+        pkg_file.read((char *)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
+        if (D_LOGIC_BLOCK_ENTRY_SZ != (unsigned int)pkg_file.gcount()){
+            fprintf(stderr, "Error: read %uth logic block in Dedupe::remove_files(...)\n", i);
+            ret = -1;
+            goto _REMOVE_FILES_EXIT;
+        }
+        if (CODEC_DELTA != lbentry.codec)
+            continue;
+        ref = (block_id_t *)lookup_table->valueptr(lbentry.base_id);
+        if (0 == ref || 0 == *ref || REFCNT_RELEASED == *ref){
+            fprintf(stderr, "Error: no reference to base %u of block %u in Dedupe::remove_files(...)\n", lbentry.base_id, i);
+            ret = -1;
+            goto _REMOVE_FILES_EXIT;
+        }
+        (*ref)--;
+    }
+
     remove_blocks_nr = 0;
     block_buf = (char *)malloc(BLOCK_MAX_SIZE);
-    if (0 == block_buf){
+    raw_buf = (char *)malloc(BUF_MAX_SIZE); //a compressed block is decompressed for its checksum
+    if (0 == block_buf || 0 == raw_buf){
         fprintf(stderr, "Error: malloc block buf in Dedupe::remove_files(...)\n");
         ret = -1;
         goto _REMOVE_FILES_EXIT;
     }
+    //block index of the remaining blocks with their new ids
+    new_bindex = new BlockIndex(false);
+    csum = D_CHUNK_SB == d_chunk_alg || pkg_hdr.csum_nr > 0;
+    //the fingerprint run written gets a filter of its own
+    if ((d_index_filter || pkg_hdr.cfilter_len > 0) &&
+        0 != new_bindex->openfilter(pkg_name, false)){
+        fprintf(stderr, "Error: open fingerprint filter in Dedupe::remove_files(...)\n");
+        ret = -1;
+        goto _REMOVE_FILES_EXIT;
+    }
 
     bdata_file.seekp(0, ios::beg);
     bdata_file.write((const char *)(&pkg_hdr), D_PKG_HDR_SZ);
     ldata_file.seekp(0, ios::beg);
-    offset = pkg_hdr.ldata_offset;
+    //the remaining blocks are packed into new containers right after the header
+    d_containers.clear();
+    d_free_ext.clear();
+    d_cont_room = 0;
+    d_pkg_hdr.ldata_offset = D_PKG_HDR_SZ;
+    //every logic block entry is in the package, see load_lbentry(...)
+    d_ldata_base = pkg_hdr.ublocks_nr;
     /*start to rebuild unique blocks, logic block entries, file metadata
-    into bdata_file, ldata_file and mdata_file
+    into bdata_file, ldata_file and mdata_file, one run each
     */
     for(unsigned int i = 0; i < pkg_hdr.ublocks_nr; i++){
+        offset = lblock_offset(i);
         pkg_file.seekg(offset, ios::beg);
         pkg_file.read((char *)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
         rsize = pkg_file.gcount();
@@ -324,52 +700,84 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
             ret = -1;
             goto _REMOVE_FILES_EXIT;
         }
-        value = 0;
-        if (0 != lookup_table->getvalue(i, &value)){
-            fprintf(stderr, "Error: get %uth block's reference numbers via ListDB::getvalue in Dedupe::remove_files(...)\n", i);
+        //reference count turns into the new block id in place
+        ref = (block_id_t *)lookup_table->valueptr(i);
+        if (0 == ref){
+            fprintf(stderr, "Error: get %uth block's reference numbers via MappedListDB::valueptr in Dedupe::remove_files(...)\n", i);
             ret = -1;
             goto _REMOVE_FILES_EXIT;
         }
-        if (0 == value){
-            value = TOBE_REMOVED;
-            if (-1 == lookup_table->setvalue(i, &value)){
-                fprintf(stderr, "Error: set %uth block's value as TOBE_REMOVED via ListDB::getvalue in Dedupe::remove_files(...)\n", i);
-                ret = -1;
-                goto _REMOVE_FILES_EXIT;
-            }
-
+        if (REFCNT_RELEASED == *ref){
+            //released in place: out of the filter and of ublocks_len already
+            *ref = TOBE_REMOVED;
+            remove_blocks_nr++;
+        }else if (0 == *ref){
+            *ref = TOBE_REMOVED;
             remove_blocks_nr++;
             remove_bytes += lbentry.ublock_len;
+            remove_zbytes += lbentry.zblock_len;
+            if (CODEC_DELTA == lbentry.codec){
+                remove_delta_nr++;
+                remove_delta_saved += lbentry.ublock_len - lbentry.zblock_len;
+            }
         }else{
             value = i - remove_blocks_nr; //!tricky: set org block id i as i-remove_blocks_nr;
-            if (-1 == lookup_table->setvalue(i, &value)){
-                fprintf(stderr, "Error: set %uth ublock's new id as %d via ListDB::setvalue in Dedupe::remove_files(..)\n", i, value);
+            if (0 != new_refcnt->setvalue(value, ref)){
+                fprintf(stderr, "Error: keep reference count of %uth ublock in Dedupe::remove_files(...)\n", i);
                 ret = -1;
                 goto _REMOVE_FILES_EXIT;
             }
+            *ref = value;
             memset(block_buf, 0, BLOCK_MAX_SIZE);
             pkg_file.seekg(lbentry.ublock_off, ios::beg);
-            pkg_file.read(block_buf, lbentry.ublock_len);
+            pkg_file.read(block_buf, lbentry.zblock_len);
             rsize = pkg_file.gcount();
-            if (rsize != lbentry.ublock_len){
+            if (rsize != lbentry.zblock_len ||
+                (csum && 0 != load_block(pkg_file, pkg_file, lbentry, raw_buf))){
                 fprintf(stderr, "Error: read unique block, org_id=%u, new_id=%u in Dedupe::remove_files(...)\n ", i, value);
                 ret = -1;
                 goto _REMOVE_FILES_EXIT;
             }
-            lbentry.ublock_off -= remove_bytes;
+            //the base is kept, and has its new id already
+            if (CODEC_DELTA == lbentry.codec)
+                lbentry.base_id = *(block_id_t *)lookup_table->valueptr(lbentry.base_id);
+            //the unique blocks of an appended package are not contiguous; compressed ones stay so
+            if (0 != container_add(bdata_file, block_buf, lbentry, value)){
+                fprintf(stderr, "Error: write unique block, new_id=%u in Dedupe::remove_files(...)\n", value);
+                ret = -1;
+                goto _REMOVE_FILES_EXIT;
+            }
             ldata_file.write((const char *)(&lbentry),D_LOGIC_BLOCK_ENTRY_SZ); //!might need to seekp
-            bdata_file.write(block_buf, lbentry.ublock_len);
+            if (0 != new_bindex->insert(lbentry.block_md5, value) ||
+                (csum && 0 != new_bindex->insertcsum(adler32(raw_buf, lbentry.ublock_len)))){
+                fprintf(stderr, "Error: index %uth ublock with new id %u in Dedupe::remove_files(...)\n", i, value);
+                ret = -1;
+                goto _REMOVE_FILES_EXIT;
+            }
         }
-
-        offset += D_LOGIC_BLOCK_ENTRY_SZ;
     }
+    if (0 != container_close(bdata_file)){
+        ret = -1;
+        goto _REMOVE_FILES_EXIT;
+    }
+    //the similarity index keeps the remaining blocks, by their new ids
+    for (unsigned int i = 0; i < d_sim.size(); i++){
+        value = *(block_id_t *)lookup_table->valueptr(d_sim[i].id);
+        if (TOBE_REMOVED == value)
+            continue;
+        d_sim[sim_nr] = d_sim[i];
+        d_sim[sim_nr++].id = value;
+    }
+    d_sim.resize(sim_nr);
 
 
     /*start to rebuild file metadata */
     remove_files_nr = 0;
-    offset = pkg_hdr.mdata_offset;
+    offset = 0;
     mdata_file.seekp(0, ios::beg);
+    d_paths.clear();
     for (unsigned int i = 0; i < pkg_hdr.files_nr; i++){
+        offset = fentry_offset(i, offset);
         pkg_file.seekg(offset, ios::beg);
         pkg_file.read((char*)(&fentry), D_FILE_ENTRY_SZ);
         rsize = pkg_file.gcount();
@@ -389,7 +797,7 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
             free(metadata);
             metadata = 0;
         }
-        if (!is_file_in_list(pathname, files_nr, files_remove)){ // need to write the metadata into mdata
+        if (!file_removed(i) && !is_file_in_list(pathname, files_nr, files_remove)){ // need to write the metadata into mdata
             metadata = (block_id_t *)malloc(BLOCK_ID_SIZE * fentry.fblocks_nr);
             if (0 == metadata){
                 fprintf(stderr, "Error: malloc metadata for file \"%s\" in Dedupe::remove_files(...)\n", pathname);
@@ -403,14 +811,10 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
                 ret = -1;
                 goto _REMOVE_FILES_EXIT;
             }
-            for (unsigned int j = 0; j < fentry.fblocks_nr; j++){
-                value = 0;
-                if (0 != lookup_table->getvalue(metadata[j], &value)){
-                    fprintf(stderr, "Error: modify %uth file entry's metadata[%u] in Dedupe::remove_files(...)\n", i, j);
-                    ret = -1;
-                    goto _REMOVE_FILES_EXIT;
-                }
-                metadata[j] = value;
+            if (0 != lookup_table->batchget(metadata, fentry.fblocks_nr, metadata)){
+                fprintf(stderr, "Error: modify %uth file entry's metadata in Dedupe::remove_files(...)\n", i);
+                ret = -1;
+                goto _REMOVE_FILES_EXIT;
             }
             memset(block_buf, 0, BLOCK_MAX_SIZE);
             pkg_file.read(block_buf, fentry.last_block_sz);
@@ -421,6 +825,7 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
                 goto _REMOVE_FILES_EXIT;
             }
 
+            index_path(pathname, fentry.fname_len, mdata_file.tellp(), i - remove_files_nr);
             mdata_file.write((const char *)(&fentry), D_FILE_ENTRY_SZ);
             mdata_file.write(pathname, fentry.fname_len);
             mdata_file.write((const char *)metadata, BLOCK_ID_SIZE * fentry.fblocks_nr);
@@ -442,12 +847,26 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
     d_pkg_hdr.files_nr -= remove_files_nr;
     d_pkg_hdr.ublocks_nr -= remove_blocks_nr;
     d_pkg_hdr.ublocks_len -= remove_bytes;
-    d_pkg_hdr.ldata_offset = D_PKG_HDR_SZ + d_pkg_hdr.ublocks_len;
+    d_pkg_hdr.zblocks_len -= remove_zbytes;
+    d_pkg_hdr.delta_nr -= remove_delta_nr;
+    d_pkg_hdr.delta_saved -= remove_delta_saved;
+    //ldata_offset: the end of the last container
     d_pkg_hdr.mdata_offset = d_pkg_hdr.ldata_offset + D_LOGIC_BLOCK_ENTRY_SZ * d_pkg_hdr.ublocks_nr;
-
-    bdata_file.seekp(0, ios::beg);
-    bdata_file.write((const char *)(&d_pkg_hdr), D_PKG_HDR_SZ);
-
+    d_pkg_hdr.extent_offset = 0;
+    d_pkg_hdr.ldata_extents_nr = 0;
+    d_pkg_hdr.mdata_extents_nr = 0;
+    d_pkg_hdr.pathidx_runs_nr = 0;
+    d_pkg_hdr.simidx_runs_nr = 0;
+    d_pkg_hdr.bindex_runs_nr = 0;
+    d_pkg_hdr.csum_runs_nr = 0;
+    d_pkg_hdr.refcnt_runs_nr = 0;
+    d_pkg_hdr.free_offset = 0;
+    d_pkg_hdr.free_len = 0;
+    d_pkg_hdr.free_nr = 0;
+    d_pkg_hdr.dblocks_nr = 0;
+    d_pkg_hdr.dfiles_offset = 0;
+    d_pkg_hdr.dfiles_nr = 0;
+    d_mdata_base = 0; //every file entry is rewritten
 
     ldata_file.open(d_ldata_name, ios::binary | ios::in);
     if (!ldata_file.is_open()){
@@ -483,8 +902,26 @@ int Dedupe::remove_files(const char *pkg_name, int files_nr, char **files_remove
         rsize = mdata_file.gcount();
         bdata_file.write(buf, rsize);
     }
-    bdata_file.close();
     mdata_file.close();
+
+    //one run of each index section, as no extent table lists more
+    d_pkg_hdr.sections_offset = bdata_file.tellp();
+    d_bindex_ext.clear();
+    d_csum_ext.clear();
+    d_refcnt_ext.clear();
+    d_refcnt_base = 0;
+    if (0 != write_bindex(bdata_file, new_bindex) ||
+        0 != write_refcnt(bdata_file, new_refcnt) ||
+        0 != write_containers(bdata_file) ||
+        0 != write_simindex(bdata_file, 0, false) ||
+        0 != write_pathindex(bdata_file, 0)){
+        fprintf(stderr, "Error: write block index in Dedupe::remove_files(...)\n");
+        ret = -1;
+        goto _REMOVE_FILES_EXIT;
+    }
+    bdata_file.seekp(0, ios::beg);
+    bdata_file.write((const char *)(&d_pkg_hdr), D_PKG_HDR_SZ);
+    bdata_file.close();
     unlink(pkg_name);
     rename(d_bdata_name, pkg_name);
 
@@ -505,82 +942,349 @@ _REMOVE_FILES_EXIT:
         free(block_buf);
         block_buf = 0;
     }
+    if (raw_buf){
+        free(raw_buf);
+        raw_buf = 0;
+    }
     if (lookup_table){
         lookup_table->closedb();
         lookup_table->unlinkdb();
         delete lookup_table;
         lookup_table = 0;
     }
+    if (new_refcnt){
+        new_refcnt->closedb();
+        new_refcnt->unlinkdb();
+        delete new_refcnt;
+        new_refcnt = 0;
+    }
+    if (new_bindex){
+        delete new_bindex;
+        new_bindex = 0;
+    }
     return ret;
 }
 
-int Dedupe::insert_files(const char *pkg_name, int files_nr, char **src_files)
+int Dedupe::remove_files_inplace(const char *pkg_name, int files_nr, char **files_remove, bool &compact)
+/*release the blocks only the removed files refer to, see D_Free_Extent: no
+  byte before the index sections moves; nothing is written and compact is
+  set if the free extents would exceed d_compact_pct percent*/
 {
-    time_t start_time, end_time;
-    char buf[BUFSIZ] = {0};
-    int ret = 0, rsize = 0, prepos = 0;
-    struct stat stat_buf;
-    memset(d_pkg_name, 0, PATH_MAX_LEN);
-    sprintf(d_pkg_name, "%s", pkg_name);
-    ifstream pkg_file;
-    pkg_file.open(d_pkg_name, ios::binary | ios::in);
-    if (!pkg_file){
-        fprintf(stderr, "Error: deduped package file %s not exist in Dedupe::insert_files(...)\n", pkg_name);
+    int ret = 0;
+    D_Package_Header pkg_hdr;
+    D_File_Entry fentry;
+    D_Logic_Block_Entry lbentry;
+
+    unsigned int rsize = 0, removed_nr = 0, released_nr = 0;
+    unsigned long long offset = 0, released_bytes = 0, tail_offset = 0, pkg_end = 0, free_len = 0;
+    unsigned long long cont_bytes = 0, released_zbytes = 0, released_delta_saved = 0;
+    unsigned int released_delta_nr = 0;
+    vector<int> touched;
+    set<block_id_t> work;
+    char pathname[PATH_MAX_LEN] = {0};
+    char listdb_name[PATH_MAX_LEN] = {0};
+    block_id_t *metadata = 0;
+    block_id_t *ref = 0;
+    vector<block_id_t> released;
+    MappedListDB *refcnt = 0;
+    BlockIndex *bindex = 0;
+    fstream pkg_file;
+
+    compact = false;
+    pkg_file.open(pkg_name, ios::binary | ios::in | ios::out);
+    if (!pkg_file.is_open()){
+        fprintf(stderr, "Error: open deduped package %s in Dedupe::remove_files_inplace(...)\n", pkg_name);
         return -1;
     }
-    pkg_file.seekg(0, ios::beg);
-
     pkg_file >> noskipws;
-    fstream ldata_file, bdata_file, mdata_file;
-    ldata_file.open(d_ldata_name, ios::binary | ios::out);
-    bdata_file.open(d_bdata_name, ios::binary | ios::out);
-    mdata_file.open(d_mdata_name, ios::binary | ios::out);
-
-    if (!ldata_file.is_open() || !bdata_file.is_open() || !mdata_file.is_open()){
-        fprintf(stderr, "Error: open ldata, bdata, mdata in Dedupe::insert_files(...)\n");
+    pkg_file.seekg(0, ios::beg);
+    pkg_file.read((char *)(&pkg_hdr), D_PKG_HDR_SZ);
+    rsize = pkg_file.gcount();
+    if (D_PKG_HDR_SZ != rsize || DEDUP_MAGIC_NUM != pkg_hdr.magic_nr){
+        fprintf(stderr, "Error: read deduped package header in Dedupe::remove_files_inplace(...)\n");
         ret = -1;
-        goto _INSERT_FILES_EXIT;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+    memcpy(&d_pkg_hdr, &pkg_hdr, D_PKG_HDR_SZ);
+    if (0 != load_extents(pkg_file, pkg_hdr)){
+        fprintf(stderr, "Error: load extent table in Dedupe::remove_files_inplace(...)\n");
+        ret = -1;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+    //the index sections the last operation wrote, from sections_offset to the end, are freed
+    pkg_file.seekg(0, ios::end);
+    pkg_end = pkg_file.tellg();
+    tail_offset = pkg_hdr.sections_offset;
+
+    refcnt = new MappedListDB(BLOCK_ID_SIZE);
+    sprintf(listdb_name, "data/ListDB/refcnt_%d.listdb", getpid());
+    mkdir("data", 766);
+    mkdir("data/ListDB", 766);
+    if (-1 == refcnt->opendb(listdb_name) || 0 != load_refcnt(pkg_file, pkg_hdr, refcnt) ||
+        0 != load_simindex(pkg_file, pkg_hdr)){
+        fprintf(stderr, "Error: load reference counts of the ublocks in Dedupe::remove_files_inplace(...)\n");
+        ret = -1;
+        goto _REMOVE_INPLACE_EXIT;
     }
 
-    d_htab_bindex = new BigHashTable;
-    ret = prepare_insert(pkg_file, ldata_file, bdata_file, mdata_file);
-
-    ldata_file.close();
-    ldata_file.open(d_ldata_name, ios::binary | ios::out | ios::in );
-    bdata_file.close();
-    bdata_file.open(d_bdata_name, ios::binary | ios::out | ios::in );
-    mdata_file.close();
-    mdata_file.open(d_mdata_name, ios::binary | ios::out | ios::in );
-    ldata_file.seekp(0, ios::end);
-    bdata_file.seekp(0, ios::end);
-    mdata_file.seekp(0, ios::end);
-
-    if (0 != ret)
-            goto _INSERT_FILES_EXIT;
-    start_time = time(0);
-    for(int i = 0; i < files_nr; i++){
-        ret = stat(src_files[i], &stat_buf);
-        if (0 != ret){
-            switch(errno){
-            case ENOENT:
-                fprintf(stderr, "Warning: file %s not exist in Dedupe::insert_files(...)\n", src_files[i]);
-                break;
-            default:
-                fprintf(stderr, "Warning: stat %s in Dedupe::register_insert_files(...)\n", src_files[i]);
-            }
-            continue;
+    //only the blocks of the removed files may lose their last reference
+    d_paths.clear();
+    d_mdata_base = pkg_hdr.files_nr;
+    for (unsigned int i = 0; i < pkg_hdr.files_nr; i++){
+        offset = fentry_offset(i, offset);
+        pkg_file.seekg(offset, ios::beg);
+        pkg_file.read((char *)(&fentry), D_FILE_ENTRY_SZ);
+        rsize = pkg_file.gcount();
+        if (D_FILE_ENTRY_SZ != rsize){
+            fprintf(stderr, "Error: read %uth file entry in Dedupe::remove_files_inplace(...)\n", i);
+            ret = -1;
+            goto _REMOVE_INPLACE_EXIT;
         }
-        if (S_ISREG(stat_buf.st_mode) || S_ISDIR(stat_buf.st_mode)){
-            if (verbose)
-                fprintf(stderr, "Info: expect to dedupe file %s in Dedupe::insert_files(...)\n", src_files[i]);
-            //get filename position in pathname
-            prepos = strlen(src_files[i]) - 1;
-            if (strcmp(src_files[i], "/") != 0 &&
-                ( *(src_files[i] + prepos) == '/' || *(src_files[i] + prepos) == '\\')){
-                *(src_files[i] + prepos--) = '\0';
+        memset(pathname, 0, PATH_MAX_LEN);
+        pkg_file.read(pathname, fentry.fname_len);
+        rsize = pkg_file.gcount();
+        if (rsize != fentry.fname_len){
+            fprintf(stderr, "Error: read %uth file entry's file path name in Dedupe::remove_files_inplace(...)\n", i);
+            ret = -1;
+            goto _REMOVE_INPLACE_EXIT;
+        }
+        if (!file_removed(i) && is_file_in_list(pathname, files_nr, files_remove)){
+            metadata = (block_id_t *)realloc(metadata, BLOCK_ID_SIZE * (fentry.fblocks_nr + 1));
+            if (0 == metadata){
+                fprintf(stderr, "Error: malloc metadata of %uth file entry in Dedupe::remove_files_inplace(...)\n", i);
+                ret = -1;
+                goto _REMOVE_INPLACE_EXIT;
             }
-            while(*(src_files[i] + prepos) != '/' && *(src_files[i]+prepos) != '\\' &&  prepos >= 0) prepos--;
-            prepos++;
+            pkg_file.read((char *)metadata, BLOCK_ID_SIZE * fentry.fblocks_nr);
+            rsize = pkg_file.gcount();
+            if (BLOCK_ID_SIZE * fentry.fblocks_nr != rsize ||
+                0 != refcnt->batchinc(metadata, fentry.fblocks_nr, (uint32_t)-1)){
+                fprintf(stderr, "Error: release references of %uth file entry in Dedupe::remove_files_inplace(...)\n", i);
+                ret = -1;
+                goto _REMOVE_INPLACE_EXIT;
+            }
+            refcnt_dirty(metadata, fentry.fblocks_nr);
+            released.insert(released.end(), metadata, metadata + fentry.fblocks_nr);
+            d_dead_files.push_back(i);
+            removed_nr++;
+        }else if (!file_removed(i))
+            index_path(pathname, fentry.fname_len, offset, i);
+        offset += fentry.fentry_sz;
+    }
+    if (0 == removed_nr){
+        if (verbose)
+            cout << "Info: no file to remove in Dedupe::remove_files_inplace(...)" << endl;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+
+    bindex = new BlockIndex(false);
+    if (0 != open_bindex(bindex, pkg_name, pkg_hdr, 0)){
+        fprintf(stderr, "Error: open block index in Dedupe::remove_files_inplace(...)\n");
+        ret = -1;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+    /*from the last block on: a delta released drops its reference to its
+      base, which has a smaller id and so is seen after it*/
+    work.insert(released.begin(), released.end());
+    while (!work.empty()){
+        block_id_t bid = *work.rbegin();
+        work.erase(bid);
+        ref = (block_id_t *)refcnt->valueptr(bid);
+        if (0 == ref){
+            fprintf(stderr, "Error: get reference count of block %u in Dedupe::remove_files_inplace(...)\n", bid);
+            ret = -1;
+            goto _REMOVE_INPLACE_EXIT;
+        }
+        if (0 != *ref)
+            continue;
+        pkg_file.seekg(lblock_offset(bid), ios::beg);
+        pkg_file.read((char *)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
+        rsize = pkg_file.gcount();
+        if (D_LOGIC_BLOCK_ENTRY_SZ != rsize){
+            fprintf(stderr, "Error: read logic block %u in Dedupe::remove_files_inplace(...)\n", bid);
+            ret = -1;
+            goto _REMOVE_INPLACE_EXIT;
+        }
+        if (0 != bindex->removeindex(lbentry.block_md5, bid)){
+            fprintf(stderr, "Error: remove block %u from the block index in Dedupe::remove_files_inplace(...)\n", bid);
+            ret = -1;
+            goto _REMOVE_INPLACE_EXIT;
+        }
+        release_free(lbentry.ublock_off, lbentry.zblock_len);
+        *ref = REFCNT_RELEASED;
+        refcnt_dirty(&bid, 1);
+        released_nr++;
+        released_bytes += lbentry.ublock_len;
+        released_zbytes += lbentry.zblock_len;
+        touched.push_back(find_extent(d_containers, bid));
+        if (CODEC_DELTA != lbentry.codec)
+            continue;
+        released_delta_nr++;
+        released_delta_saved += lbentry.ublock_len - lbentry.zblock_len;
+        ref = (block_id_t *)refcnt->valueptr(lbentry.base_id);
+        if (0 == ref || 0 == *ref || REFCNT_RELEASED == *ref){
+            fprintf(stderr, "Error: no reference to base %u of block %u in Dedupe::remove_files_inplace(...)\n", lbentry.base_id, bid);
+            ret = -1;
+            goto _REMOVE_INPLACE_EXIT;
+        }
+        refcnt_dirty(&lbentry.base_id, 1);
+        if (0 == --(*ref))
+            work.insert(lbentry.base_id);
+    }
+    /*a container of released blocks only is dropped from the table, with its
+      header and slot table; its block data is free already*/
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    for (int t = (int)touched.size() - 1; t >= 0 && touched[t] >= 0; t--){
+        D_Container &cont = d_containers[touched[t]];
+        unsigned int n = 0;
+        for (n = 0; n < cont.nr; n++){
+            ref = (block_id_t *)refcnt->valueptr(cont.first + n);
+            if (0 == ref || REFCNT_RELEASED != *ref)
+                break;
+        }
+        if (n < cont.nr)
+            continue;
+        release_free(cont.offset, D_CONTAINER_HDR_SZ);
+        release_free(cont.offset + D_CONTAINER_HDR_SZ + cont.data_len, (unsigned long long)cont.nr * D_CONTAINER_SLOT_SZ);
+        cont_bytes += D_CONTAINER_HDR_SZ + (unsigned long long)cont.nr * D_CONTAINER_SLOT_SZ;
+        d_containers.erase(d_containers.begin() + touched[t]);
+    }
+    free_len = pkg_hdr.free_len + released_zbytes + cont_bytes + (pkg_end > tail_offset ? pkg_end - tail_offset : 0);
+    if (free_len * 100 > d_compact_pct * (pkg_hdr.zblocks_len - released_zbytes + free_len)){
+        if (verbose)
+            cout << "Info: " << free_len << " bytes would be free, compact the package in Dedupe::remove_files_inplace(...)" << endl;
+        compact = true;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+
+    d_pkg_hdr.ublocks_len -= released_bytes;
+    d_pkg_hdr.zblocks_len -= released_zbytes;
+    d_pkg_hdr.dblocks_nr += released_nr;
+    d_pkg_hdr.delta_nr -= released_delta_nr;
+    d_pkg_hdr.delta_saved -= released_delta_saved;
+    pkg_file.clear();
+    pkg_file.seekp(0, ios::end);
+    d_pkg_hdr.sections_offset = pkg_file.tellp();
+    if (0 != write_bindex(pkg_file, bindex) ||
+        0 != write_refcnt(pkg_file, refcnt) ||
+        0 != write_containers(pkg_file) ||
+        0 != write_simindex(pkg_file, refcnt, false) ||
+        0 != write_pathindex(pkg_file, 0)){
+        fprintf(stderr, "Error: write block index in Dedupe::remove_files_inplace(...)\n");
+        ret = -1;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+    release_sections(tail_offset, pkg_end);
+    if (0 != write_extents(pkg_file)){
+        fprintf(stderr, "Error: write extent table in Dedupe::remove_files_inplace(...)\n");
+        ret = -1;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+    pkg_file.flush();
+    if (!pkg_file.good()){
+        fprintf(stderr, "Error: append to package %s in Dedupe::remove_files_inplace(...)\n", pkg_name);
+        ret = -1;
+        goto _REMOVE_INPLACE_EXIT;
+    }
+    pkg_file.seekp(0, ios::beg);
+    pkg_file.write((const char *)(&d_pkg_hdr), D_PKG_HDR_SZ);
+    pkg_file.close();
+    punch_released(pkg_name);
+    if (verbose)
+        cout << "Info: removed " << removed_nr << " files, released " << released_nr << " blocks of "
+             << released_bytes << " bytes in Dedupe::remove_files_inplace(...)" << endl;
+
+_REMOVE_INPLACE_EXIT:
+    if (pkg_file.is_open())
+        pkg_file.close();
+    if (metadata){
+        free(metadata);
+        metadata = 0;
+    }
+    if (refcnt){
+        refcnt->closedb();
+        refcnt->unlinkdb();
+        delete refcnt;
+        refcnt = 0;
+    }
+    if (bindex){
+        delete bindex;
+        bindex = 0;
+    }
+    return ret;
+}
+
+int Dedupe::insert_files(const char *pkg_name, int files_nr, char **src_files)
+{
+    time_t start_time, end_time;
+    char buf[BUFSIZ] = {0};
+    int ret = 0, rsize = 0, prepos = 0;
+    struct stat stat_buf;
+    D_Extent ext;
+    unsigned long long tail_offset = 0, tail_end = 0;
+    memset(d_pkg_name, 0, PATH_MAX_LEN);
+    sprintf(d_pkg_name, "%s", pkg_name);
+    ifstream pkg_file;
+    pkg_file.open(d_pkg_name, ios::binary | ios::in);
+    if (!pkg_file){
+        fprintf(stderr, "Error: deduped package file %s not exist in Dedupe::insert_files(...)\n", pkg_name);
+        return -1;
+    }
+    pkg_file.seekg(0, ios::beg);
+
+    pkg_file >> noskipws;
+    //bdata_file is the package itself: the new unique blocks are appended to it
+    fstream ldata_file, bdata_file, mdata_file;
+    ldata_file.open(d_ldata_name, ios::binary | ios::out);
+    bdata_file.open(d_pkg_name, ios::binary | ios::out | ios::in);
+    mdata_file.open(d_mdata_name, ios::binary | ios::out);
+
+    if (!ldata_file.is_open() || !bdata_file.is_open() || !mdata_file.is_open()){
+        fprintf(stderr, "Error: open ldata, bdata, mdata in Dedupe::insert_files(...)\n");
+        ret = -1;
+        goto _INSERT_FILES_EXIT;
+    }
+
+    ret = prepare_insert(pkg_file, ldata_file, bdata_file, mdata_file);
+
+    ldata_file.close();
+    ldata_file.open(d_ldata_name, ios::binary | ios::out | ios::in );
+    mdata_file.close();
+    mdata_file.open(d_mdata_name, ios::binary | ios::out | ios::in );
+    ldata_file.seekp(0, ios::end);
+    bdata_file.seekp(0, ios::end);
+    mdata_file.seekp(0, ios::end);
+
+    if (0 != ret)
+            goto _INSERT_FILES_EXIT;
+    //the index sections the last operation wrote are freed, but the runs still listed
+    tail_offset = d_pkg_hdr.sections_offset;
+    tail_end = d_pkg_hdr.ldata_offset;
+    start_time = time(0);
+    for(int i = 0; i < files_nr; i++){
+        ret = stat(src_files[i], &stat_buf);
+        if (0 != ret){
+            switch(errno){
+            case ENOENT:
+                fprintf(stderr, "Warning: file %s not exist in Dedupe::insert_files(...)\n", src_files[i]);
+                break;
+            default:
+                fprintf(stderr, "Warning: stat %s in Dedupe::register_insert_files(...)\n", src_files[i]);
+            }
+            continue;
+        }
+        if (S_ISREG(stat_buf.st_mode) || S_ISDIR(stat_buf.st_mode)){
+            if (verbose)
+                fprintf(stderr, "Info: expect to dedupe file %s in Dedupe::insert_files(...)\n", src_files[i]);
+            //get filename position in pathname
+            prepos = strlen(src_files[i]) - 1;
+            if (strcmp(src_files[i], "/") != 0 &&
+                ( *(src_files[i] + prepos) == '/' || *(src_files[i] + prepos) == '\\')){
+                *(src_files[i] + prepos--) = '\0';
+            }
+            while(*(src_files[i] + prepos) != '/' && *(src_files[i]+prepos) != '\\' &&  prepos >= 0) prepos--;
+            prepos++;
 
             if (S_ISREG(stat_buf.st_mode)){
                 ret = register_file(src_files[i], prepos, ldata_file, bdata_file, mdata_file);
@@ -604,67 +1308,1059 @@ int Dedupe::insert_files(const char *pkg_name, int files_nr, char **src_files)
   //  ret = register_dir("J:/test", 3, ldata_file, bdata_file, mdata_file);
     d_pkg_hdr.fsp_block_sz = d_fsp_block_sz;
     d_pkg_hdr.sb_block_sz = d_sb_block_sz;
-    d_pkg_hdr.ldata_offset = D_PKG_HDR_SZ + d_pkg_hdr.ublocks_len;
-    d_pkg_hdr.mdata_offset = d_pkg_hdr.ldata_offset + D_LOGIC_BLOCK_ENTRY_SZ * d_pkg_hdr.ublocks_nr;
+
+    /*append the logic block entries and the file entries of this insertion,
+      one run each*/
+    if (0 != container_close(bdata_file)){
+        ret = -1;
+        goto _INSERT_FILES_EXIT;
+    }
+    ldata_file.close();
+    ldata_file.open(d_ldata_name, ios::binary | ios::in);
+    ldata_file >> noskipws;
+    bdata_file.seekp(0, ios::end);
+    cout << "the unique blocks length is " << d_pkg_hdr.ublocks_len << endl;
+    if (verbose && d_compress_level > 0)
+        cout << "Info: unique blocks stored in " << d_pkg_hdr.zblocks_len << " bytes, "
+             << d_zskip_nr << " blocks taken as incompressible, " << d_zfail_nr
+             << " did not shrink in Dedupe::insert_files(...)" << endl;
+    if (verbose && d_similarity)
+        cout << "Info: " << d_delta_nr << " new blocks stored as deltas, " << d_pkg_hdr.delta_nr
+             << " in the package save " << d_pkg_hdr.delta_saved << " bytes in Dedupe::insert_files(...)" << endl;
+    cout << "after inserting these files, bdata file size = " << bdata_file.tellp() << endl;
+    d_pkg_hdr.ldata_offset = bdata_file.tellp();
+    if (d_pkg_hdr.ublocks_nr > d_ldata_base){
+        ext.offset = d_pkg_hdr.ldata_offset;
+        ext.first = d_ldata_base;
+        ext.nr = d_pkg_hdr.ublocks_nr - d_ldata_base;
+        d_ldata_ext.push_back(ext);
+    }
+    while(!ldata_file.eof()){
+        ldata_file.read(buf, BUFSIZ);
+        rsize = ldata_file.gcount();
+      //  cout << "single read ldata size: " << rsize << endl;
+        bdata_file.write(buf, rsize);
+    }
+    ldata_file.close();
+
+    mdata_file.close();
+
+    mdata_file.open(d_mdata_name, ios::binary | ios::in);
+    mdata_file >> noskipws;
+    d_pkg_hdr.mdata_offset = bdata_file.tellp();
+    if (d_pkg_hdr.files_nr > d_mdata_base){
+        ext.offset = d_pkg_hdr.mdata_offset;
+        ext.first = d_mdata_base;
+        ext.nr = d_pkg_hdr.files_nr - d_mdata_base;
+        d_mdata_ext.push_back(ext);
+    }
+    while(!mdata_file.eof()){
+        mdata_file.read(buf, BUFSIZ);
+        rsize = mdata_file.gcount();
+      //  cout << "sing read mdata size: " << rsize << endl;
+        bdata_file.write(buf, rsize);
+    }
+    mdata_file.close();
+
+    /*every index section gets a run of the entries of this insertion, the
+      reference counts one of the counts changed*/
+    d_pkg_hdr.sections_offset = bdata_file.tellp();
+    if (0 != write_bindex(bdata_file, d_bindex) ||
+        0 != write_refcnt(bdata_file, d_refcnt) ||
+        0 != write_containers(bdata_file) ||
+        0 != write_simindex(bdata_file, 0, true) ||
+        0 != write_pathindex(bdata_file, &pkg_file)){
+        fprintf(stderr, "Error: write block index in Dedupe::insert_files(...)\n");
+        ret = -1;
+        goto _INSERT_FILES_EXIT;
+    }
+    //not before now, the new blocks must not be put there
+    release_sections(tail_offset, tail_end);
+    if (0 != write_extents(bdata_file)){
+        fprintf(stderr, "Error: write extent table in Dedupe::insert_files(...)\n");
+        ret = -1;
+        goto _INSERT_FILES_EXIT;
+    }
+    //everything appended reaches the file before the header points at it
+    bdata_file.flush();
+    if (!bdata_file.good()){
+        fprintf(stderr, "Error: append to package %s in Dedupe::insert_files(...)\n", pkg_name);
+        ret = -1;
+        goto _INSERT_FILES_EXIT;
+    }
     bdata_file.seekp(0, ios::beg);
     bdata_file.write((const char *)(&d_pkg_hdr), D_PKG_HDR_SZ);
+    bdata_file.close();
+    pkg_file.close();
+    punch_released(pkg_name);
+    ret = 0;
+    end_time = time(0);
+    cout << "Info: insert files with time " << (long)(end_time - start_time) << "s in Dedupe::insert_files(...)" << endl;
+    if (verbose)
+        memory_usage(true);
+
+_INSERT_FILES_EXIT:
+    if (pkg_file.is_open()) pkg_file.close();
+    if (ldata_file.is_open()) ldata_file.close();
+    if (bdata_file.is_open()) bdata_file.close();
+    if (mdata_file.is_open()) mdata_file.close();
+    if (d_bindex){
+        delete d_bindex;
+        d_bindex = 0;
+    }
+    if (d_refcnt){
+        d_refcnt->closedb();
+        d_refcnt->unlinkdb();
+        delete d_refcnt;
+        d_refcnt = 0;
+    }
+    return ret;
+}
+
+
+int Dedupe::load_refcnt(istream &pkg_file, const D_Package_Header &pkg_hdr, MappedListDB *refcnt)
+/*load the reference counts of the unique blocks into refcnt from the runs
+  of d_refcnt_ext, oldest first; a package without them gets the counts
+  rebuilt from the block ids of every file entry*/
+{
+    D_File_Entry fentry;
+    block_id_t *metadata = 0;
+    block_id_t value = 0;
+    unsigned long long offset = 0;
+    unsigned int len = 0;
+    int ret = 0;
+
+    d_refcnt_dirty.clear();
+    d_refcnt_base = 0;
+    if (0 != refcnt->fillvalue(pkg_hdr.ublocks_nr, &value)){
+        fprintf(stderr, "Error: set ListDB item's value as 0 in Dedupe::load_refcnt(...)\n");
+        return -1;
+    }
+    if (0 == pkg_hdr.ublocks_nr)
+        return 0;
+
+    pkg_file.clear();
+    if (pkg_hdr.refcnt_offset > 0 && pkg_hdr.refcnt_nr == pkg_hdr.ublocks_nr){
+        for (unsigned int r = 0; r < d_refcnt_ext.size(); r++){
+            if (d_refcnt_ext[r].first + d_refcnt_ext[r].nr > pkg_hdr.ublocks_nr){
+                fprintf(stderr, "Error: %uth run of reference counts past %u ublocks in Dedupe::load_refcnt(...)\n",
+                        r, pkg_hdr.ublocks_nr);
+                return -1;
+            }
+            len = BLOCK_ID_SIZE * d_refcnt_ext[r].nr;
+            pkg_file.seekg(d_refcnt_ext[r].offset, ios::beg);
+            pkg_file.read((char *)refcnt->valueptr(d_refcnt_ext[r].first), len);
+            if ((unsigned int)pkg_file.gcount() != len){
+                fprintf(stderr, "Error: read %uth run of reference counts in Dedupe::load_refcnt(...)\n", r);
+                return -1;
+            }
+        }
+        d_refcnt_base = pkg_hdr.refcnt_nr;
+        return 0;
+    }
+    //not the counts of this package, written again as one run
+    for (unsigned int r = 0; r < d_refcnt_ext.size(); r++){
+        D_Free_Extent fext = {d_refcnt_ext[r].offset, (unsigned long long)BLOCK_ID_SIZE * d_refcnt_ext[r].nr};
+        d_stale_ext.push_back(fext);
+    }
+    d_refcnt_ext.clear();
+
+    //the file entries are found by the extents loaded by load_extents(...)
+    for (unsigned int i = 0; i < pkg_hdr.files_nr; i++){
+        offset = fentry_offset(i, offset);
+        pkg_file.seekg(offset, ios::beg);
+        pkg_file.read((char *)(&fentry), D_FILE_ENTRY_SZ);
+        if (D_FILE_ENTRY_SZ != (unsigned int)pkg_file.gcount()){
+            fprintf(stderr, "Error: read %uth file entry in Dedupe::load_refcnt(...)\n", i);
+            ret = -1;
+            goto _LOAD_REFCNT_EXIT;
+        }
+        if (file_removed(i)){
+            offset += fentry.fentry_sz;
+            continue;
+        }
+        metadata = (block_id_t *)realloc(metadata, BLOCK_ID_SIZE * (fentry.fblocks_nr + 1));
+        if (0 == metadata){
+            fprintf(stderr, "Error: malloc metadata of %uth file entry in Dedupe::load_refcnt(...)\n", i);
+            ret = -1;
+            goto _LOAD_REFCNT_EXIT;
+        }
+        pkg_file.seekg(offset + D_FILE_ENTRY_SZ + fentry.fname_len, ios::beg);
+        pkg_file.read((char *)metadata, BLOCK_ID_SIZE * fentry.fblocks_nr);
+        if (BLOCK_ID_SIZE * fentry.fblocks_nr != (unsigned int)pkg_file.gcount() ||
+            0 != refcnt->batchinc(metadata, fentry.fblocks_nr)){
+            fprintf(stderr, "Error: count references of %uth file entry's ublocks in Dedupe::load_refcnt(...)\n", i);
+            ret = -1;
+            goto _LOAD_REFCNT_EXIT;
+        }
+        offset += fentry.fentry_sz;
+    }
+
+_LOAD_REFCNT_EXIT:
+    if (metadata){
+        free(metadata);
+        metadata = 0;
+    }
+    return ret;
+}
+
+int Dedupe::write_refcnt(ostream &des_file, MappedListDB *refcnt)
+/*the chunks of counts marked dirty and the counts of the blocks added since
+  d_refcnt_base, coalesced into runs; every count as one run if the runs
+  would hold more than DEDUP_RUNS_RATIO times the counts of the package*/
+{
+    D_Extent ext;
+    unsigned long long runs_len = 0, dirty_len = 0;
+    unsigned int chunks = (d_pkg_hdr.ublocks_nr + DEDUP_REFCNT_CHUNK - 1) / DEDUP_REFCNT_CHUNK;
+
+    des_file.seekp(0, ios::end);
+    d_pkg_hdr.refcnt_nr = d_pkg_hdr.ublocks_nr;
+    if (refcnt->size() < d_pkg_hdr.ublocks_nr){
+        fprintf(stderr, "Error: %llu reference counts for %u ublocks in Dedupe::write_refcnt(...)\n",
+                (unsigned long long)refcnt->size(), d_pkg_hdr.ublocks_nr);
+        return -1;
+    }
+    if (d_refcnt_base > d_pkg_hdr.ublocks_nr)
+        d_refcnt_base = 0;
+    for (unsigned int r = 0; r < d_refcnt_ext.size(); r++)
+        runs_len += d_refcnt_ext[r].nr;
+    for (unsigned int c = 0; c < d_refcnt_dirty.size() && c < chunks; c++){
+        if (d_refcnt_dirty[c])
+            dirty_len += DEDUP_REFCNT_CHUNK;
+    }
+    dirty_len += d_pkg_hdr.ublocks_nr - d_refcnt_base;
+    if (runs_len + dirty_len > (unsigned long long)DEDUP_RUNS_RATIO * d_pkg_hdr.ublocks_nr){
+        for (unsigned int r = 0; r < d_refcnt_ext.size(); r++){
+            D_Free_Extent fext = {d_refcnt_ext[r].offset, (unsigned long long)BLOCK_ID_SIZE * d_refcnt_ext[r].nr};
+            d_stale_ext.push_back(fext);
+        }
+        d_refcnt_ext.clear();
+        d_refcnt_base = 0;
+    }
+
+    for (unsigned int c = 0; c < chunks; c++){
+        bool dirty = (c < d_refcnt_dirty.size() && d_refcnt_dirty[c]) ||
+                     (unsigned long long)(c + 1) * DEDUP_REFCNT_CHUNK > d_refcnt_base;
+        if (!dirty)
+            continue;
+        ext.first = c * DEDUP_REFCNT_CHUNK;
+        while (c + 1 < chunks && ((c + 1 < d_refcnt_dirty.size() && d_refcnt_dirty[c + 1]) ||
+               (unsigned long long)(c + 2) * DEDUP_REFCNT_CHUNK > d_refcnt_base))
+            c++;
+        ext.nr = ((c + 1) * DEDUP_REFCNT_CHUNK < d_pkg_hdr.ublocks_nr) ? (c + 1) * DEDUP_REFCNT_CHUNK - ext.first :
+                 d_pkg_hdr.ublocks_nr - ext.first;
+        ext.offset = des_file.tellp();
+        des_file.write((const char *)refcnt->valueptr(ext.first), BLOCK_ID_SIZE * ext.nr);
+        d_refcnt_ext.push_back(ext);
+    }
+    d_refcnt_dirty.clear();
+    d_refcnt_base = d_pkg_hdr.ublocks_nr;
+    d_pkg_hdr.refcnt_offset = d_refcnt_ext.empty() ? 0 : d_refcnt_ext.back().offset;
+    if (!des_file.good()){
+        fprintf(stderr, "Error: write reference count section in Dedupe::write_refcnt(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+void Dedupe::refcnt_dirty(const block_id_t *ids, unsigned int nr)
+{
+    for (unsigned int i = 0; i < nr; i++){
+        unsigned int c = ids[i] / DEDUP_REFCNT_CHUNK;
+        if (ids[i] >= d_refcnt_base)
+            continue;
+        if (c >= d_refcnt_dirty.size())
+            d_refcnt_dirty.resize(c + 1, false);
+        d_refcnt_dirty[c] = true;
+    }
+}
+
+static void bindex_runs(const vector<D_Extent> &exts, vector<BINDEX_RUN> &runs)
+{
+    runs.clear();
+    for (unsigned int r = 0; r < exts.size(); r++){
+        BINDEX_RUN run = {exts[r].offset, 0, exts[r].nr};
+        runs.push_back(run);
+    }
+}
+
+static void bindex_exts(const vector<BINDEX_RUN> &runs, vector<D_Extent> &exts)
+{
+    exts.clear();
+    for (unsigned int r = 0; r < runs.size(); r++){
+        D_Extent ext;
+        ext.offset = runs[r].offset;
+        ext.first = 0;
+        ext.nr = runs[r].nr;
+        exts.push_back(ext);
+    }
+}
+
+int Dedupe::open_bindex(BlockIndex *bindex, const char *pkg_name, const D_Package_Header &pkg_hdr, const BINDEX_SEQ *seq)
+{
+    vector<BINDEX_RUN> fp_runs, csum_runs;
+    bindex_runs(d_bindex_ext, fp_runs);
+    bindex_runs(d_csum_ext, csum_runs);
+    if (0 != bindex->openindex(pkg_name, fp_runs.empty() ? 0 : &fp_runs[0], fp_runs.size(),
+                               csum_runs.empty() ? 0 : &csum_runs[0], csum_runs.size(), seq))
+        return -1;
+    if ((d_index_filter || pkg_hdr.cfilter_len > 0) &&
+        0 != bindex->openfilter(pkg_name, pkg_hdr.cfilter_len > 0)){
+        fprintf(stderr, "Error: open fingerprint filters in Dedupe::open_bindex(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+int Dedupe::write_bindex(ostream &des_file, BlockIndex *bindex)
+{
+    vector<BINDEX_EXTENT> stale, live;
+    vector<BINDEX_RUN> fp_runs, csum_runs;
+    des_file.seekp(0, ios::end);
+    if (0 != bindex->writeindex(des_file, d_pkg_hdr.bindex_offset, d_pkg_hdr.bindex_nr,
+                                d_pkg_hdr.csum_offset, d_pkg_hdr.csum_nr,
+                                d_pkg_hdr.cfilter_offset, d_pkg_hdr.cfilter_len, stale))
+        return -1;
+    for (unsigned int i = 0; i < stale.size(); i++){
+        D_Free_Extent fext = {stale[i].offset, stale[i].len};
+        d_stale_ext.push_back(fext);
+    }
+    bindex->runs(fp_runs, csum_runs);
+    bindex_exts(fp_runs, d_bindex_ext);
+    bindex_exts(csum_runs, d_csum_ext);
+    bindex->extents(live);
+    d_bindex_live.clear();
+    for (unsigned int i = 0; i < live.size(); i++){
+        D_Free_Extent fext = {live[i].offset, live[i].len};
+        d_bindex_live.push_back(fext);
+    }
+    return 0;
+}
+
+int Dedupe::load_extents(istream &pkg_file, const D_Package_Header &pkg_hdr)
+/*the runs of logic block entries, of file entries, of the path and
+  similarity indexes, of the fingerprint index, of the checksums and of the
+  reference counts of the package: the extent table, or one run each at the
+  offsets of the header; then the free extents, the file entries removed in
+  place and the container table*/
+{
+    D_Extent ext;
+    D_Free_Extent fext;
+    D_Container cont;
+    unsigned int n = 0;
+    d_ldata_ext.clear();
+    d_mdata_ext.clear();
+    d_path_ext.clear();
+    d_sim_ext.clear();
+    d_bindex_ext.clear();
+    d_csum_ext.clear();
+    d_refcnt_ext.clear();
+    d_bindex_live.clear();
+    d_stale_ext.clear();
+    d_free_ext.clear();
+    d_punch_ext.clear();
+    d_dead_files.clear();
+    d_containers.clear();
+    d_free_next = 0;
+    d_free_fail = 0;
+    d_cont_room = 0;
+    pkg_file.clear();
+    if (0 == pkg_hdr.extent_offset){
+        ext.first = 0;
+        ext.offset = pkg_hdr.ldata_offset;
+        ext.nr = pkg_hdr.ublocks_nr;
+        if (ext.nr > 0)
+            d_ldata_ext.push_back(ext);
+        ext.offset = pkg_hdr.mdata_offset;
+        ext.nr = pkg_hdr.files_nr;
+        if (ext.nr > 0)
+            d_mdata_ext.push_back(ext);
+    }else{
+        //in the order of write_extents(...)
+        vector<D_Extent> *lists[] = {&d_ldata_ext, &d_mdata_ext, &d_path_ext, &d_sim_ext,
+                                     &d_bindex_ext, &d_csum_ext, &d_refcnt_ext};
+        unsigned int nrs[] = {pkg_hdr.ldata_extents_nr, pkg_hdr.mdata_extents_nr, pkg_hdr.pathidx_runs_nr,
+                              pkg_hdr.simidx_runs_nr, pkg_hdr.bindex_runs_nr, pkg_hdr.csum_runs_nr,
+                              pkg_hdr.refcnt_runs_nr};
+        pkg_file.seekg(pkg_hdr.extent_offset, ios::beg);
+        for (unsigned int l = 0; l < sizeof(nrs) / sizeof(nrs[0]); l++){
+            for (unsigned int i = 0; i < nrs[l]; i++, n++){
+                pkg_file.read((char *)(&ext), D_EXTENT_SZ);
+                if (D_EXTENT_SZ != (unsigned int)pkg_file.gcount()){
+                    fprintf(stderr, "Error: read %uth extent in Dedupe::load_extents(...)\n", n);
+                    return -1;
+                }
+                lists[l]->push_back(ext);
+            }
+        }
+    }
+    ext.first = 0;
+    if (0 == pkg_hdr.pathidx_runs_nr && 0 != pkg_hdr.pathidx_offset && pkg_hdr.pathidx_nr > 0){
+        ext.offset = pkg_hdr.pathidx_offset;
+        ext.nr = pkg_hdr.pathidx_nr;
+        d_path_ext.push_back(ext);
+    }
+    if (0 == pkg_hdr.simidx_runs_nr && pkg_hdr.simidx_nr > 0){
+        ext.offset = pkg_hdr.simidx_offset;
+        ext.nr = pkg_hdr.simidx_nr;
+        d_sim_ext.push_back(ext);
+    }
+    if (0 == pkg_hdr.bindex_runs_nr && pkg_hdr.bindex_nr > 0){
+        ext.offset = pkg_hdr.bindex_offset;
+        ext.nr = pkg_hdr.bindex_nr;
+        d_bindex_ext.push_back(ext);
+    }
+    if (0 == pkg_hdr.csum_runs_nr && pkg_hdr.csum_nr > 0){
+        ext.offset = pkg_hdr.csum_offset;
+        ext.nr = pkg_hdr.csum_nr;
+        d_csum_ext.push_back(ext);
+    }
+    if (0 == pkg_hdr.refcnt_runs_nr && pkg_hdr.refcnt_offset > 0 && pkg_hdr.refcnt_nr > 0){
+        ext.offset = pkg_hdr.refcnt_offset;
+        ext.nr = pkg_hdr.refcnt_nr;
+        d_refcnt_ext.push_back(ext);
+    }
+
+    if (pkg_hdr.free_nr > 0)
+        pkg_file.seekg(pkg_hdr.free_offset, ios::beg);
+    for (unsigned int i = 0; i < pkg_hdr.free_nr; i++){
+        pkg_file.read((char *)(&fext), D_FREE_EXTENT_SZ);
+        if (D_FREE_EXTENT_SZ != (unsigned int)pkg_file.gcount()){
+            fprintf(stderr, "Error: read %uth free extent in Dedupe::load_extents(...)\n", i);
+            return -1;
+        }
+        d_free_ext.push_back(fext);
+    }
+    if (pkg_hdr.dfiles_nr > 0)
+        pkg_file.seekg(pkg_hdr.dfiles_offset, ios::beg);
+    for (unsigned int i = 0; i < pkg_hdr.dfiles_nr; i++){
+        pkg_file.read((char *)(&n), sizeof(n));
+        if (sizeof(n) != (unsigned int)pkg_file.gcount()){
+            fprintf(stderr, "Error: read %uth removed file number in Dedupe::load_extents(...)\n", i);
+            return -1;
+        }
+        d_dead_files.push_back(n);
+    }
+    if (pkg_hdr.containers_nr > 0)
+        pkg_file.seekg(pkg_hdr.container_offset, ios::beg);
+    for (unsigned int i = 0; i < pkg_hdr.containers_nr; i++){
+        pkg_file.read((char *)(&cont), D_CONTAINER_SZ);
+        if (D_CONTAINER_SZ != (unsigned int)pkg_file.gcount()){
+            fprintf(stderr, "Error: read %uth container in Dedupe::load_extents(...)\n", i);
+            return -1;
+        }
+        d_containers.push_back(cont);
+    }
+    return 0;
+}
+
+static bool free_extent_less(const D_Free_Extent &x, const D_Free_Extent &y)
+{
+    return x.offset < y.offset;
+}
+
+static void merge_free_extents(vector<D_Free_Extent> &exts)
+//sort exts by offset and join the adjacent ones, e.g. the released blocks of a file
+{
+    vector<D_Free_Extent> merged;
+    std::sort(exts.begin(), exts.end(), free_extent_less);
+    for (unsigned int i = 0; i < exts.size(); i++){
+        if (0 == exts[i].len)
+            continue;
+        if (!merged.empty() && merged.back().offset + merged.back().len >= exts[i].offset){
+            if (exts[i].offset + exts[i].len > merged.back().offset + merged.back().len)
+                merged.back().len = exts[i].offset + exts[i].len - merged.back().offset;
+        }else
+            merged.push_back(exts[i]);
+    }
+    exts.swap(merged);
+}
+
+int Dedupe::write_extents(ostream &des_file)
+/*append the runs of d_ldata_ext, d_mdata_ext, d_path_ext, d_sim_ext,
+  d_bindex_ext, d_csum_ext and d_refcnt_ext as the extent table, then the
+  free extents, merged, and the numbers of the file entries removed in place*/
+{
+    const vector<D_Extent> *lists[] = {&d_ldata_ext, &d_mdata_ext, &d_path_ext, &d_sim_ext,
+                                       &d_bindex_ext, &d_csum_ext, &d_refcnt_ext};
+    des_file.seekp(0, ios::end);
+    d_pkg_hdr.extent_offset = des_file.tellp();
+    d_pkg_hdr.ldata_extents_nr = d_ldata_ext.size();
+    d_pkg_hdr.mdata_extents_nr = d_mdata_ext.size();
+    d_pkg_hdr.pathidx_runs_nr = d_path_ext.size();
+    d_pkg_hdr.simidx_runs_nr = d_sim_ext.size();
+    d_pkg_hdr.bindex_runs_nr = d_bindex_ext.size();
+    d_pkg_hdr.csum_runs_nr = d_csum_ext.size();
+    d_pkg_hdr.refcnt_runs_nr = d_refcnt_ext.size();
+    for (unsigned int l = 0; l < sizeof(lists) / sizeof(lists[0]); l++){
+        if (!lists[l]->empty())
+            des_file.write((const char *)(&(*lists[l])[0]), D_EXTENT_SZ * lists[l]->size());
+    }
+
+    merge_free_extents(d_free_ext);
+    d_free_next = 0;
+    d_pkg_hdr.free_offset = des_file.tellp();
+    d_pkg_hdr.free_nr = d_free_ext.size();
+    d_pkg_hdr.free_len = 0;
+    for (unsigned int i = 0; i < d_free_ext.size(); i++){
+        d_pkg_hdr.free_len += d_free_ext[i].len;
+        des_file.write((const char *)(&d_free_ext[i]), D_FREE_EXTENT_SZ);
+    }
+
+    std::sort(d_dead_files.begin(), d_dead_files.end());
+    d_pkg_hdr.dfiles_offset = des_file.tellp();
+    d_pkg_hdr.dfiles_nr = d_dead_files.size();
+    if (!d_dead_files.empty())
+        des_file.write((const char *)(&d_dead_files[0]), sizeof(unsigned int) * d_dead_files.size());
+    if (!des_file.good()){
+        fprintf(stderr, "Error: write extent table in Dedupe::write_extents(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+int Dedupe::write_containers(ostream &des_file)
+//append d_containers as the container table
+{
+    des_file.seekp(0, ios::end);
+    d_pkg_hdr.container_offset = des_file.tellp();
+    d_pkg_hdr.containers_nr = d_containers.size();
+    if (!d_containers.empty())
+        des_file.write((const char *)(&d_containers[0]), D_CONTAINER_SZ * d_containers.size());
+    if (!des_file.good()){
+        fprintf(stderr, "Error: write container table in Dedupe::write_containers(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+static bool sim_entry_less(const D_Sim_Entry &x, const D_Sim_Entry &y)
+{
+    return x.sf < y.sf || (x.sf == y.sf && x.id < y.id);
+}
+
+static unsigned int runs_kept(const vector<D_Extent> &runs, unsigned long long nr)
+/*the oldest runs not merged with a new run of nr entries: the newest run is
+  merged while it is smaller than DEDUP_RUNS_RATIO times the merged run*/
+{
+    unsigned int k = runs.size();
+    while (k > 0 && runs[k - 1].nr < DEDUP_RUNS_RATIO * nr){
+        nr += runs[k - 1].nr;
+        k--;
+    }
+    return k;
+}
+
+int Dedupe::load_simindex(istream &pkg_file, const D_Package_Header &pkg_hdr)
+{
+    unsigned long long nr = 0;
+    d_sim.clear();
+    d_sim_new.clear();
+    for (unsigned int r = 0; r < d_sim_ext.size(); r++)
+        nr += d_sim_ext[r].nr;
+    if (nr != pkg_hdr.simidx_nr){
+        fprintf(stderr, "Error: %llu entries in the runs of a similarity index of %u in Dedupe::load_simindex(...)\n",
+                nr, pkg_hdr.simidx_nr);
+        return -1;
+    }
+    if (0 == nr)
+        return 0;
+    d_sim.resize(nr);
+    pkg_file.clear();
+    nr = 0;
+    for (unsigned int r = 0; r < d_sim_ext.size(); r++){
+        d_sim_ext[r].first = nr;
+        if (0 == d_sim_ext[r].nr)
+            continue;
+        pkg_file.seekg(d_sim_ext[r].offset, ios::beg);
+        pkg_file.read((char *)(&d_sim[nr]), D_SIM_ENTRY_SZ * d_sim_ext[r].nr);
+        if (D_SIM_ENTRY_SZ * d_sim_ext[r].nr != (unsigned long long)pkg_file.gcount()){
+            fprintf(stderr, "Error: read %uth run of the similarity index in Dedupe::load_simindex(...)\n", r);
+            d_sim.clear();
+            return -1;
+        }
+        nr += d_sim_ext[r].nr;
+    }
+    return 0;
+}
+
+int Dedupe::write_simindex(ostream &des_file, MappedListDB *refcnt, bool append)
+{
+    vector<D_Sim_Entry> merged;
+    D_Sim_Entry entry;
+    D_Extent ext;
+    D_Free_Extent fext;
+    uint32_t value = 0;
+    unsigned int k = 0, from = 0;
+    if (append){
+        if (d_sim_new.empty())
+            return 0;
+        k = runs_kept(d_sim_ext, d_sim_new.size());
+        from = (k < d_sim_ext.size()) ? d_sim_ext[k].first : d_sim.size();
+    }
+    merged.reserve(d_sim.size() - from + d_sim_new.size());
+    for (unsigned int i = from; i < d_sim.size(); i++){
+        if (refcnt && 0 == refcnt->getvalue(d_sim[i].id, &value) && REFCNT_RELEASED == value)
+            continue;
+        merged.push_back(d_sim[i]);
+    }
+    entry.reserved = 0;
+    for (map<uint64_t, block_id_t>::const_iterator it = d_sim_new.begin(); it != d_sim_new.end(); ++it){
+        entry.sf = it->first;
+        entry.id = it->second;
+        merged.push_back(entry);
+    }
+    std::sort(merged.begin(), merged.end(), sim_entry_less);
+    d_sim.resize(from);
+    d_sim.insert(d_sim.end(), merged.begin(), merged.end());
+    d_sim_new.clear();
+    for (unsigned int r = k; r < d_sim_ext.size(); r++){
+        fext.offset = d_sim_ext[r].offset;
+        fext.len = D_SIM_ENTRY_SZ * d_sim_ext[r].nr;
+        d_stale_ext.push_back(fext);
+    }
+    d_sim_ext.resize(k);
+
+    des_file.seekp(0, ios::end);
+    ext.offset = des_file.tellp();
+    ext.first = from;
+    ext.nr = merged.size();
+    if (ext.nr > 0){
+        d_sim_ext.push_back(ext);
+        des_file.write((const char *)(&merged[0]), D_SIM_ENTRY_SZ * merged.size());
+    }
+    d_pkg_hdr.simidx_offset = ext.offset;
+    d_pkg_hdr.simidx_nr = d_sim.size();
+    if (!des_file.good()){
+        fprintf(stderr, "Error: write similarity index in Dedupe::write_simindex(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+void Dedupe::index_path(const char *pathname, unsigned int len, unsigned long long offset, unsigned int file)
+{
+    D_Path_Entry &entry = d_paths[string(pathname, len)];
+    entry.offset = offset;
+    entry.file = file;
+    entry.reserved = 0;
+}
+
+int Dedupe::write_pathindex(ostream &des_file, istream *pkg_file)
+{
+    D_Path_Entry entry;
+    D_File_Entry fentry;
+    D_Extent ext;
+    D_Free_Extent fext;
+    char pathname[PATH_MAX_LEN] = {0};
+    vector<D_Path_Entry> run;
+    unsigned int k = 0;
+    unsigned long long nr = 0;
+    if (pkg_file){
+        if (d_paths.empty())
+            return 0;
+        k = runs_kept(d_path_ext, d_paths.size());
+    }
+    //the runs merged, the newest first: a path in d_paths already is in a newer one
+    for (unsigned int r = d_path_ext.size(); pkg_file && r > k; r--){
+        run.resize(d_path_ext[r - 1].nr);
+        if (run.empty())
+            continue;
+        pkg_file->clear();
+        pkg_file->seekg(d_path_ext[r - 1].offset, ios::beg);
+        pkg_file->read((char *)(&run[0]), D_PATH_ENTRY_SZ * run.size());
+        if (D_PATH_ENTRY_SZ * run.size() != (unsigned long long)pkg_file->gcount()){
+            fprintf(stderr, "Error: read %uth run of the path index in Dedupe::write_pathindex(...)\n", r - 1);
+            return -1;
+        }
+        for (unsigned int i = 0; i < run.size(); i++){
+            pkg_file->seekg(run[i].offset, ios::beg);
+            pkg_file->read((char *)(&fentry), D_FILE_ENTRY_SZ);
+            if (D_FILE_ENTRY_SZ != (unsigned int)pkg_file->gcount() || fentry.fname_len > PATH_MAX_LEN){
+                fprintf(stderr, "Error: read %uth file entry in Dedupe::write_pathindex(...)\n", run[i].file);
+                return -1;
+            }
+            pkg_file->read(pathname, fentry.fname_len);
+            if (fentry.fname_len != (unsigned int)pkg_file->gcount()){
+                fprintf(stderr, "Error: read %uth file entry's path name in Dedupe::write_pathindex(...)\n", run[i].file);
+                return -1;
+            }
+            d_paths.insert(make_pair(string(pathname, fentry.fname_len), run[i]));
+        }
+    }
+    for (unsigned int r = k; r < d_path_ext.size(); r++){
+        fext.offset = d_path_ext[r].offset;
+        fext.len = D_PATH_ENTRY_SZ * d_path_ext[r].nr;
+        d_stale_ext.push_back(fext);
+    }
+    d_path_ext.resize(k);
+    for (unsigned int r = 0; r < k; r++)
+        nr += d_path_ext[r].nr;
+
+    des_file.seekp(0, ios::end);
+    ext.offset = des_file.tellp();
+    ext.first = nr;
+    ext.nr = d_paths.size();
+    for (map<string, D_Path_Entry>::const_iterator it = d_paths.begin(); it != d_paths.end(); ++it){
+        entry = it->second;
+        if (entry.file >= d_mdata_base)
+            entry.offset += d_pkg_hdr.mdata_offset;
+        des_file.write((const char *)(&entry), D_PATH_ENTRY_SZ);
+    }
+    d_paths.clear();
+    if (ext.nr > 0)
+        d_path_ext.push_back(ext);
+    d_pkg_hdr.pathidx_offset = ext.offset;
+    d_pkg_hdr.pathidx_nr = nr + ext.nr;
+    if (!des_file.good()){
+        fprintf(stderr, "Error: write path index in Dedupe::write_pathindex(...)\n");
+        return -1;
+    }
+    return 0;
+}
+
+bool Dedupe::sim_lookup(const uint64_t *sf, block_id_t &base)
+/*the newest block sharing a super feature with sf: of this insertion, or
+  of the package, which is not released; a newer run holds the newer blocks*/
+{
+    D_Sim_Entry key;
+    uint32_t value = 0;
+    for (int j = 0; j < SF_SUPER_NR; j++){
+        map<uint64_t, block_id_t>::const_iterator it = d_sim_new.find(sf[j]);
+        if (it != d_sim_new.end()){
+            base = it->second;
+            return true;
+        }
+    }
+    key.id = (block_id_t)-1;
+    for (int j = 0; j < SF_SUPER_NR; j++){
+        key.sf = sf[j];
+        for (int r = (int)d_sim_ext.size() - 1; r >= 0; r--){
+            vector<D_Sim_Entry>::const_iterator first = d_sim.begin() + d_sim_ext[r].first;
+            vector<D_Sim_Entry>::const_iterator it = std::upper_bound(first, first + d_sim_ext[r].nr, key, sim_entry_less);
+            while (it != first && (it - 1)->sf == sf[j]){
+                --it;
+                if (0 == d_refcnt->getvalue(it->id, &value) && REFCNT_RELEASED != value){
+                    base = it->id;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+int Dedupe::container_add(fstream &bdata_file, const char *block_buf, D_Logic_Block_Entry &lbentry, block_id_t id)
+{
+    D_Container_Slot slot;
+    unsigned int room = 0;
+    unsigned int block_len = lbentry.zblock_len;
+    if (0 != md5str2bin(lbentry.block_md5, slot.md5)){
+        fprintf(stderr, "Error: bad md5 of block %u in Dedupe::container_add(...)\n", id);
+        return -1;
+    }
+    //a container is closed when full, and when the block ids are no longer consecutive
+    if (d_cont_room > 0 && (id != d_cont.first + d_cont.nr ||
+        D_CONTAINER_HDR_SZ + d_cont.data_len + block_len + (d_cont.nr + 1) * D_CONTAINER_SLOT_SZ > d_cont_room)){
+        if (0 != container_close(bdata_file))
+            return -1;
+    }
+    if (0 == d_cont_room){
+        room = DEDUP_CONTAINER_SZ;
+        d_cont.offset = alloc_free(DEDUP_CONTAINER_MIN, room);
+        d_cont_free = (0 != d_cont.offset);
+        if (!d_cont_free || D_CONTAINER_HDR_SZ + block_len + D_CONTAINER_SLOT_SZ > room){
+            if (d_cont_free){
+                D_Free_Extent fext = {d_cont.offset, room};
+                d_free_ext.push_back(fext);
+            }
+            d_cont.offset = d_pkg_hdr.ldata_offset;
+            d_cont_free = false;
+            //a block larger than a container gets one of its own
+            room = D_CONTAINER_HDR_SZ + block_len + D_CONTAINER_SLOT_SZ;
+            if (room < DEDUP_CONTAINER_SZ)
+                room = DEDUP_CONTAINER_SZ;
+        }
+        d_cont.first = id;
+        d_cont.nr = 0;
+        d_cont.data_len = 0;
+        d_cont.reserved = 0;
+        d_cont_room = room;
+        d_cont_slots.clear();
+    }
+
+    slot.offset = D_CONTAINER_HDR_SZ + d_cont.data_len;
+    slot.len = block_len;
+    slot.raw_len = lbentry.ublock_len;
+    slot.codec = lbentry.codec;
+    slot.base = (CODEC_DELTA == lbentry.codec) ? lbentry.base_id : 0;
+    lbentry.ublock_off = d_cont.offset + slot.offset;
+    bdata_file.seekp(lbentry.ublock_off, ios::beg);
+    bdata_file.write(block_buf, block_len);
+    if (!bdata_file.good()){
+        fprintf(stderr, "Error: write block %u into container at %llu in Dedupe::container_add(...)\n", id, d_cont.offset);
+        return -1;
+    }
+    d_cont_slots.push_back(slot);
+    d_cont.nr++;
+    d_cont.data_len += block_len;
+    return 0;
+}
+
+int Dedupe::container_close(fstream &bdata_file)
+/*write the slot table and the header of the open container; the room it
+  did not take goes back to the free extents, or the next one is appended
+  after it*/
+{
+    D_Container_Header chdr;
+    unsigned long long used = 0;
+    if (0 == d_cont_room)
+        return 0;
+    if (d_cont.nr > 0){
+        chdr.magic = DEDUP_CONTAINER_MAGIC;
+        chdr.nr = d_cont.nr;
+        chdr.first = d_cont.first;
+        chdr.data_len = d_cont.data_len;
+        bdata_file.seekp(d_cont.offset + D_CONTAINER_HDR_SZ + d_cont.data_len, ios::beg);
+        bdata_file.write((const char *)(&d_cont_slots[0]), D_CONTAINER_SLOT_SZ * d_cont.nr);
+        bdata_file.seekp(d_cont.offset, ios::beg);
+        bdata_file.write((const char *)(&chdr), D_CONTAINER_HDR_SZ);
+        if (!bdata_file.good()){
+            fprintf(stderr, "Error: write container at %llu in Dedupe::container_close(...)\n", d_cont.offset);
+            return -1;
+        }
+        d_containers.push_back(d_cont);
+        used = D_CONTAINER_HDR_SZ + d_cont.data_len + (unsigned long long)d_cont.nr * D_CONTAINER_SLOT_SZ;
+    }
+    if (!d_cont_free)
+        d_pkg_hdr.ldata_offset = d_cont.offset + used;
+    else if (d_cont_room > used){
+        //free already, it is not punched again
+        D_Free_Extent fext;
+        fext.offset = d_cont.offset + used;
+        fext.len = d_cont_room - used;
+        d_free_ext.push_back(fext);
+        d_free_fail = 0;
+    }
+    d_cont_room = 0;
+    d_cont_slots.clear();
+    return 0;
+}
+
+int Dedupe::read_block(const PackageView &view, block_id_t id, char *buf, const char *&data, unsigned int &len)
+/*block id from the mapping: data points at it there if it is stored whole,
+  otherwise at buf (BUF_MAX_SIZE bytes) where it is decoded; the slot of its
+  container tells how, or the logic block entry of a block in no container*/
+{
+    D_Container_Slot slot;
+    D_Logic_Block_Entry lbentry;
+    const char *src = 0;
+    if (!view.slot(id, slot, src)){
+        if (!view.lbentry(id, lbentry) || 0 == (src = view.at(lbentry.ublock_off, lbentry.zblock_len))){
+            fprintf(stderr, "Error: no unique block with id=%u in Dedupe::read_block(...)\n", id);
+            return -1;
+        }
+        slot.len = lbentry.zblock_len;
+        slot.raw_len = lbentry.ublock_len;
+        slot.codec = lbentry.codec;
+        slot.base = lbentry.base_id;
+    }
+    len = slot.raw_len;
+    if (CODEC_NONE == slot.codec && slot.len == slot.raw_len){
+        data = src;
+        return 0;
+    }
+    data = buf;
+    if (slot.raw_len > BUF_MAX_SIZE){
+        fprintf(stderr, "Error: block %u of %u bytes in Dedupe::read_block(...)\n", id, slot.raw_len);
+        return -1;
+    }
+    if (CODEC_DELTA == slot.codec)
+        return undelta_block(view, slot.base, src, slot.len, buf, slot.raw_len);
+    if (0 != decode_block(slot.codec, src, slot.len, buf, slot.raw_len)){
+        fprintf(stderr, "Error: decode block %u in Dedupe::read_block(...)\n", id);
+        return -1;
+    }
+    return 0;
+}
+
+int Dedupe::restore_block(const PackageView &view, block_id_t id, char *buf, const char *&data, unsigned int &len)
+{
+    D_Container_Slot slot;
+    uint64_t offset = 0;
+    if (0 == d_rcache || id >= d_restore_refs.size() || d_restore_refs[id] < DEDUP_CACHE_MIN_REFS ||
+        !view.stored(id, slot, offset) || CODEC_NONE == slot.codec)
+        return read_block(view, id, buf, data, len);
+    if (d_rcache->get(id, buf, len)){
+        data = buf;
+        return 0;
+    }
+    if (0 != read_block(view, id, buf, data, len))
+        return -1;
+    if (data == buf)
+        d_rcache->put(id, buf, len);
+    return 0;
+}
+
+int Dedupe::undelta_block(const PackageView &view, block_id_t base, const char *src, unsigned int len,
+                          char *buf, unsigned int raw_len)
+{
+    int ret = 0;
+    const char *base_data = 0;
+    unsigned int base_len = 0;
+    char *base_buf = (char *)malloc(BUF_MAX_SIZE);
+    if (0 == base_buf){
+        fprintf(stderr, "Error: malloc base buffer in Dedupe::undelta_block(...)\n");
+        return -1;
+    }
+    if (0 != restore_block(view, base, base_buf, base_data, base_len) ||
+        (int)raw_len != lz_delta_decode(base_data, base_len, src, len, buf, raw_len)){
+        fprintf(stderr, "Error: decode delta against block %u in Dedupe::undelta_block(...)\n", base);
+        ret = -1;
+    }
+    free(base_buf);
+    return ret;
+}
+
+unsigned long long Dedupe::lblock_offset(block_id_t id) const
+//offset of the logic block entry of block id, 0: no such block
+{
+    int e = find_extent(d_ldata_ext, id);
+    if (-1 == e)
+        return 0;
+    return d_ldata_ext[e].offset + (unsigned long long)(id - d_ldata_ext[e].first) * D_LOGIC_BLOCK_ENTRY_SZ;
+}
+
+unsigned long long Dedupe::fentry_offset(unsigned int i, unsigned long long offset) const
+{
+    int e = find_extent(d_mdata_ext, i);
+    if (-1 != e && d_mdata_ext[e].first == i)
+        return d_mdata_ext[e].offset;
+    return offset;
+}
+
+bool Dedupe::file_removed(unsigned int i) const
+//the i-th file entry is removed in place, it is skipped by every reader
+{
+    return !d_dead_files.empty() && std::binary_search(d_dead_files.begin(), d_dead_files.end(), i);
+}
 
-    ldata_file.close();
-    ldata_file.open(d_ldata_name, ios::binary | ios::in);
-    ldata_file >> noskipws;
-    bdata_file.seekp(0, ios::end);
-    cout << "the unique blocks length is " << d_pkg_hdr.ublocks_len << endl;
-    cout << "after inserting these files, bdata file size = " << bdata_file.tellp() << endl;
-    while(!ldata_file.eof()){
-        ldata_file.read(buf, BUFSIZ);
-        rsize = ldata_file.gcount();
-      //  cout << "single read ldata size: " << rsize << endl;
-        bdata_file.write(buf, rsize);
+unsigned long long Dedupe::alloc_free(unsigned int min_len, unsigned int &len)
+/*next fit: the free extents are scanned from where the last container was
+  put, a scan without a fit is not repeated for min_len as long*/
+{
+    unsigned long long offset = 0;
+    if (d_free_ext.empty() || (d_free_fail > 0 && min_len >= d_free_fail))
+        return 0;
+    for (unsigned int n = 0; n < d_free_ext.size(); n++){
+        D_Free_Extent &fext = d_free_ext[d_free_next];
+        if (fext.len >= min_len){
+            if (fext.len < len)
+                len = fext.len;
+            offset = fext.offset;
+            fext.offset += len;
+            fext.len -= len;
+            return offset;
+        }
+        d_free_next = (d_free_next + 1) % d_free_ext.size();
     }
-    ldata_file.close();
+    d_free_fail = min_len;
+    return 0;
+}
 
-    mdata_file.close();
+void Dedupe::release_free(unsigned long long offset, unsigned long long len)
+{
+    D_Free_Extent fext;
+    if (0 == len)
+        return;
+    fext.offset = offset;
+    fext.len = len;
+    d_free_ext.push_back(fext);
+    d_punch_ext.push_back(fext);
+    d_free_fail = 0;
+}
 
-    mdata_file.open(d_mdata_name, ios::binary | ios::in);
-    mdata_file >> noskipws;
-    while(!mdata_file.eof()){
-        mdata_file.read(buf, BUFSIZ);
-        rsize = mdata_file.gcount();
-      //  cout << "sing read mdata size: " << rsize << endl;
-        bdata_file.write(buf, rsize);
+void Dedupe::release_sections(unsigned long long offset, unsigned long long end)
+/*the index sections of the former header, [offset, end): the runs of the
+  indexes still listed stay, the runs this operation replaced are released
+  wherever they are*/
+{
+    vector<D_Free_Extent> kept, live = d_bindex_live;
+    D_Free_Extent fext;
+    bool tail = offset >= D_PKG_HDR_SZ && end > offset;
+    for (unsigned int r = 0; r < d_path_ext.size(); r++){
+        fext.offset = d_path_ext[r].offset;
+        fext.len = D_PATH_ENTRY_SZ * d_path_ext[r].nr;
+        live.push_back(fext);
     }
-    mdata_file.close();
-    bdata_file.close();
-    pkg_file.close();
-    unlink(pkg_name);
-    rename(d_bdata_name, pkg_name);
-    ret = 0;
-    end_time = time(0);
-    cout << "Info: insert files with time " << (long)(end_time - start_time) << "s in Dedupe::insert_files(...)" << endl;
+    for (unsigned int r = 0; r < d_sim_ext.size(); r++){
+        fext.offset = d_sim_ext[r].offset;
+        fext.len = D_SIM_ENTRY_SZ * d_sim_ext[r].nr;
+        live.push_back(fext);
+    }
+    for (unsigned int r = 0; r < d_refcnt_ext.size(); r++){
+        fext.offset = d_refcnt_ext[r].offset;
+        fext.len = (unsigned long long)BLOCK_ID_SIZE * d_refcnt_ext[r].nr;
+        live.push_back(fext);
+    }
+    for (unsigned int r = 0; r < live.size(); r++){
+        if (tail && live[r].offset >= offset && live[r].offset < end)
+            kept.push_back(live[r]);
+    }
+    for (unsigned int i = 0; i < d_stale_ext.size(); i++){
+        if (!tail || d_stale_ext[i].offset < offset || d_stale_ext[i].offset >= end)
+            release_free(d_stale_ext[i].offset, d_stale_ext[i].len);
+    }
+    d_stale_ext.clear();
+    if (!tail)
+        return;
+    std::sort(kept.begin(), kept.end(), free_extent_less);
+    for (unsigned int i = 0; i < kept.size(); i++){
+        if (kept[i].offset > offset)
+            release_free(offset, kept[i].offset - offset);
+        if (kept[i].offset + kept[i].len > offset)
+            offset = kept[i].offset + kept[i].len;
+    }
+    if (end > offset)
+        release_free(offset, end - offset);
+}
 
-_INSERT_FILES_EXIT:
-    if (pkg_file.is_open()) pkg_file.close();
-    if (ldata_file.is_open()) ldata_file.close();
-    if (bdata_file.is_open()) bdata_file.close();
-    if (mdata_file.is_open()) mdata_file.close();
-    if (d_htab_bindex){
-        delete d_htab_bindex;
-        d_htab_bindex = 0;
+int Dedupe::punch_released(const char *pkg_name)
+/*give the extents released by this operation back to the file system; the
+  header points past them already, a failure only leaves them allocated*/
+{
+    int ret = 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    //whole pages are deallocated only, a block alone rarely covers one
+    merge_free_extents(d_punch_ext);
+    int fd = open(pkg_name, O_WRONLY);
+    if (-1 == fd){
+        fprintf(stderr, "Warning: open package %s in Dedupe::punch_released(...)\n", pkg_name);
+        d_punch_ext.clear();
+        return -1;
+    }
+    for (unsigned int i = 0; i < d_punch_ext.size(); i++){
+        if (0 != fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           d_punch_ext[i].offset, d_punch_ext[i].len)){
+            fprintf(stderr, "Warning: punch %llu bytes at %llu of package %s in Dedupe::punch_released(...)\n",
+                    d_punch_ext[i].len, d_punch_ext[i].offset, pkg_name);
+            ret = -1;
+            break;
+        }
     }
+    close(fd);
+#endif
+    d_punch_ext.clear();
     return ret;
 }
 
-
 int Dedupe::prepare_insert(ifstream &pkg_file, fstream &ldata_file, fstream &bdata_file, fstream &mdata_file)
 {
-    if (!d_htab_bindex)
-        return -1;
-
     unsigned int rsize = 0;
-    int ret = 0;
     unsigned long long meta_offset = 0;
     D_File_Entry fentry;
     char pathname[PATH_MAX_LEN] = {0};
+    vector<BINDEX_RUN> lruns;
 
     D_Package_Header pkg_hdr;
     pkg_file.read((char *)(&pkg_hdr), D_PKG_HDR_SZ);
@@ -674,92 +2370,94 @@ int Dedupe::prepare_insert(ifstream &pkg_file, fstream &ldata_file, fstream &bda
         return -1;
     }
     if (pkg_hdr.magic_nr != DEDUP_MAGIC_NUM){
-        fprintf(stderr, "Error: wrong package magic number in Dedupe::insert_files::prepare_insert(...)\n");
+        fprintf(stderr, "Error: wrong package magic number%s in Dedupe::insert_files::prepare_insert(...)\n",
+                DEDUP_MAGIC_NUM_160427 == pkg_hdr.magic_nr ? " of the first layout" : "");
         return -1;
     }
     memcpy(&d_pkg_hdr, &pkg_hdr, D_PKG_HDR_SZ);
-    bdata_file.write((const char *)(&pkg_hdr), D_PKG_HDR_SZ);
-
-
-    char *buf = 0;
-    buf = (char *)malloc(BUF_MAX_SIZE);
-    if (0 == buf){
-        fprintf(stderr, "Error: malloc buf in Dedupe::prepare_insert(...)\n");
+    if (0 != load_extents(pkg_file, pkg_hdr)){
+        fprintf(stderr, "Error: load extent table in Dedupe::insert_files::prepare_insert(...)\n");
         return -1;
     }
-    memset(buf, 0, BUF_MAX_SIZE);
-    D_Logic_Block_Entry lblock_entry;
-   // unsigned char md5val[33] = {0};
-    unsigned char csumstr[16] = {0};
-    unsigned int* bid_list = 0;
-    int value_sz = 0;
-    for (unsigned int i = 0; i < d_pkg_hdr.ublocks_nr; i++){
-
-        /*read logic block i, write it into ldata_file*/
-        pkg_file.seekg(d_pkg_hdr.ldata_offset + D_LOGIC_BLOCK_ENTRY_SZ * i, ios::beg);
-        pkg_file.read((char *)(&lblock_entry), D_LOGIC_BLOCK_ENTRY_SZ);
-        rsize = pkg_file.gcount();
-        if (D_LOGIC_BLOCK_ENTRY_SZ != rsize){
-            fprintf(stderr, "Error: read logic block entry in Dedupe::prepare_insert(...)\n");
-            ret = -1;
-            goto _PREPARE_INSERT_EXIT;
-        }
+    d_ldata_base = pkg_hdr.ublocks_nr;
+    d_mdata_base = pkg_hdr.files_nr;
 
-        ldata_file.write((const char *)(&lblock_entry), D_LOGIC_BLOCK_ENTRY_SZ);
-
-        /*read physical unique block i, write it into bdata_file*/
-        pkg_file.seekg(lblock_entry.ublock_off, ios::beg); //
-        pkg_file.read(buf, lblock_entry.ublock_len);
-        rsize = pkg_file.gcount();
-        if (rsize != lblock_entry.ublock_len){
-            fprintf(stderr, "Error: read physical unique block in Dedupe::prepare_insert(...)\n");
-            ret = -1;
-            goto _PREPARE_INSERT_EXIT;
-        }
-
-        bdata_file.write( (const char *)buf, rsize);
+    /*nothing of the package is copied: the new containers are appended
+      from the end of the package on, ldata_offset is their next offset*/
+    bdata_file.seekp(0, ios::end);
+    d_pkg_hdr.ldata_offset = bdata_file.tellp();
 
-        /*rebuild BigHashTable for block index by md5: hash entry format <md5, idnum|id1|...|idn| */
-        value_sz = 0;
-        bid_list = 0;
-        bid_list = (block_id_t *)d_htab_bindex->getvalue(lblock_entry.block_md5, value_sz);
-        bid_list = (value_sz == 0) ? (block_id_t *)malloc(BLOCK_ID_SIZE * 2) :
-            (block_id_t *)realloc(bid_list, BLOCK_ID_SIZE + (unsigned int)value_sz );
-        if (0 == bid_list){
-            fprintf(stderr, "Error: malloc/realloc in Dedupe::prepare_insert(...)\n");
-            ret = -1;
-            goto _PREPARE_INSERT_EXIT;
-        }
-        *bid_list = (value_sz == 0) ? 1 : (*bid_list) + 1;
-        *(bid_list + *bid_list) = i;
-        value_sz = (*bid_list + 1) * BLOCK_ID_SIZE;
-        d_htab_bindex->insert(lblock_entry.block_md5, bid_list, value_sz);
+    d_bindex = new_block_index(pkg_hdr);
+    if (!d_bindex){
+        fprintf(stderr, "Error: create block index in Dedupe::insert_files::prepare_insert(...)\n");
+        return -1;
+    }
 
-        if (bid_list){
-            free(bid_list);
-            bid_list = 0;
+    /*map the fingerprint index and the block checksums persisted in the package,
+      instead of rebuilding them from every logic block and unique block;
+      the sampled index prefetches the fingerprints of a whole container from
+      its slot table, or the logic blocks from their runs*/
+    BINDEX_SEQ lseq;
+    lseq.offset = pkg_hdr.ldata_offset;
+    lseq.nr = pkg_hdr.ublocks_nr;
+    if (!d_containers.empty()){
+        for (unsigned int i = 0; i < d_containers.size(); i++){
+            BINDEX_RUN run = {d_containers[i].offset + D_CONTAINER_HDR_SZ + d_containers[i].data_len,
+                              d_containers[i].first, d_containers[i].nr};
+            lruns.push_back(run);
         }
-
-        /*rebuild BigHashTable for sliding block index by adler checksum*/
-        if (d_chunk_alg == D_CHUNK_SB){
-            unsigned int hkey = 0;
-            hkey = adler32(buf, rsize);
-            uint2str(hkey, csumstr);
-            d_htab_sb_csum->insert(csumstr, (void *)"1", 1);
+        lseq.entry_sz = D_CONTAINER_SLOT_SZ;
+        lseq.md5_pos = offsetof(D_Container_Slot, md5);
+        lseq.flags = BINDEX_SEQ_BINMD5 | BINDEX_SEQ_WHOLE;
+    }else{
+        for (unsigned int i = 0; i < d_ldata_ext.size(); i++){
+            BINDEX_RUN run = {d_ldata_ext[i].offset, d_ldata_ext[i].first, d_ldata_ext[i].nr};
+            lruns.push_back(run);
         }
+        lseq.entry_sz = D_LOGIC_BLOCK_ENTRY_SZ;
+        lseq.md5_pos = offsetof(D_Logic_Block_Entry, block_md5);
+        lseq.flags = 0;
+    }
+    lseq.runs = lruns.empty() ? 0 : &lruns[0];
+    lseq.runs_nr = lruns.size();
+    if (0 != open_bindex(d_bindex, d_pkg_name, pkg_hdr, &lseq)){
+        fprintf(stderr, "Error: map block index in Dedupe::insert_files::prepare_insert(...)\n");
+        return -1;
+    }
 
+    //reference counts of the unique blocks, kept up to date by register_file(...)
+    char listdb_name[PATH_MAX_LEN] = {0};
+    sprintf(listdb_name, "data/ListDB/refcnt_%d.listdb", getpid());
+    mkdir("data", 766);
+    mkdir("data/ListDB", 766);
+    d_refcnt = new MappedListDB(BLOCK_ID_SIZE);
+    if (0 == d_refcnt || -1 == d_refcnt->opendb(listdb_name) ||
+        0 != load_refcnt(pkg_file, pkg_hdr, d_refcnt)){
+        fprintf(stderr, "Error: load reference counts of the ublocks in Dedupe::insert_files::prepare_insert(...)\n");
+        return -1;
+    }
+    //loaded even without set_similarity(...): it is written back with the other sections
+    d_delta_nr = 0;
+    if (0 != load_simindex(pkg_file, pkg_hdr)){
+        fprintf(stderr, "Error: load similarity index in Dedupe::insert_files::prepare_insert(...)\n");
+        return -1;
     }
 
-    /*read file metadata: (file entry, pathname, block id list, last block),*/
-      meta_offset = d_pkg_hdr.mdata_offset;
-      for (unsigned int i = 0; i < d_pkg_hdr.files_nr; i++){
+    /*the paths of the package are in its path index, d_paths gets the new
+      ones only; a package without one has its file entries read once*/
+    d_paths.clear();
+    for (unsigned int i = 0; 0 == pkg_hdr.pathidx_offset && i < d_pkg_hdr.files_nr; i++){
+        meta_offset = fentry_offset(i, meta_offset);
         pkg_file.seekg(meta_offset, ios::beg);
         pkg_file.read((char *)(&fentry), D_FILE_ENTRY_SZ);
         rsize = pkg_file.gcount();
         if (D_FILE_ENTRY_SZ != rsize){
             fprintf(stderr, "Error: read %dth file entry in Dedupe::prepare_insert(...)\n", i);
-            ret = -1;
-            goto _PREPARE_INSERT_EXIT;
+            return -1;
+        }
+        if (file_removed(i)){
+            meta_offset += fentry.fentry_sz;
+            continue;
         }
 
         //rebuild BigHashTable for file name : d_htab_pathname
@@ -768,30 +2466,15 @@ int Dedupe::prepare_insert(ifstream &pkg_file, fstream &ldata_file, fstream &bda
         rsize = pkg_file.gcount();
         if (rsize != fentry.fname_len){
             fprintf(stderr, "Error: read %dth file entry's path name in Dedupe::prepare_insert(...)\n", i);
-            ret = -1;
-            goto _PREPARE_INSERT_EXIT;
+            return -1;
         }
         d_htab_pathname->insert(pathname, (void *)"1", 1);
+        index_path(pathname, fentry.fname_len, meta_offset, i);
         meta_offset += fentry.fentry_sz;
-      }
-     // rewrite the file metadata from pkg_file into mdata_file
-      pkg_file.seekg(d_pkg_hdr.mdata_offset, ios::beg);
-      while(!pkg_file.eof()){
-        pkg_file.read(buf, 4096);
-        rsize = pkg_file.gcount();
-        mdata_file.write(buf, rsize);
-      }
-      ret = 0;
-
-_PREPARE_INSERT_EXIT:
-    if (buf){
-        free(buf);
-        buf = 0;
     }
-    return ret;
+    return 0;
 }
 
-
 int Dedupe::register_dir(char *fullpath, int prepos, fstream &ldata_file, fstream &bdata_file, fstream &mdata_file)
 {
     if (!ldata_file.is_open() || !bdata_file.is_open() || !mdata_file.is_open()){
@@ -959,10 +2642,17 @@ int Dedupe::register_file(char *fullpath, int prepos, fstream &ldata_file, fstre
     fentry.fname_len = strlen(fullpath) - prepos;
     fentry.fentry_sz = D_FILE_ENTRY_SZ + fentry.fname_len + fentry.fblocks_nr * BLOCK_ID_SIZE + fentry.last_block_sz;
 
+    index_path(fullpath + prepos, fentry.fname_len, mdata_file.tellp(), d_pkg_hdr.files_nr);
     mdata_file.write((const char*)(&fentry), D_FILE_ENTRY_SZ);
     mdata_file.write((const char*)(fullpath + prepos), fentry.fname_len);
     mdata_file.write((const char*)(metadata), fentry.fblocks_nr * BLOCK_ID_SIZE);
     mdata_file.write((const char*)last_block, fentry.last_block_sz);
+    if (0 != d_refcnt->batchinc(metadata, blocks_count)){
+        fprintf(stderr, "Error: count references of file %s in Dedupe::register_file(...)\n", fullpath);
+        ret = -1;
+        goto _REGISTER_FILE_EXIT;
+    }
+    refcnt_dirty(metadata, blocks_count);
 
     d_pkg_hdr.files_nr++;
     d_htab_pathname->insert(fullpath, (void *)"1", 1);
@@ -1199,7 +2889,6 @@ int Dedupe::chunk_sb(ifstream& src_file, fstream &ldata_file, fstream &bdata_fil
     char *win_buf = 0; //[BLOCK_MAX_SIZE * 2] = {0};
     char adler_pre_char = 0;
     unsigned int win_hkey = 0; //hash value for sliding window, ak, sliding block
-    unsigned char csumstr[16] = {0};
     unsigned char win_md5val[33] = {0};
 
     char *block_buf = 0; //[BLOCK_MAX_SIZE * 2] = {0};
@@ -1252,18 +2941,16 @@ int Dedupe::chunk_sb(ifstream& src_file, fstream &ldata_file, fstream &bdata_fil
             win_hkey = (block_len == 0) ? adler32(win_buf, d_sb_block_sz) :
                 adler32_rolling(win_hkey, d_sb_block_sz, adler_pre_char, win_buf[d_sb_block_sz-1]);
 
-            uint2str(win_hkey, csumstr);
-
             int cmpflag = 0;
             /*cmpflag == 0 : sliding block win_buf's checksum, md5  are not identical to the existed chunk items
               cmpflag == 1 : sliding block win_buf's checksum ͬ, md5ͬ
               cmpflag == 2 : sliding block win_buf's checksum, md5 are identical to ...
             */
-            if (d_htab_sb_csum->contain(csumstr)){
+            if (d_bindex->containcsum(win_hkey)){
                 cmpflag = 1;
 
                 MD5::message_digest_func(win_buf, d_sb_block_sz, win_md5val);
-                if (d_htab_bindex->contain(win_md5val)){
+                if (d_bindex->contain(win_md5val)){
                     cmpflag = 2;
 
                     if (block_len != 0){ // insert data fragment in block_buf before inserting the slding block
@@ -1296,10 +2983,6 @@ int Dedupe::chunk_sb(ifstream& src_file, fstream &ldata_file, fstream &bdata_fil
 
                 //insert the fixed size block
                 if (block_len == d_sb_block_sz){
-                    win_hkey = adler32(block_buf, block_len);
-                    uint2str(win_hkey, csumstr);
-                    d_htab_sb_csum->insert(csumstr, (void *)"1", 1);
-
                     MD5::message_digest_func(block_buf, block_len, block_md5val);
                     ret = register_block(block_buf, block_len, block_md5val,
                             ldata_file, bdata_file, blocks_count, meta_cap, metadata);
@@ -1395,57 +3078,79 @@ int Dedupe::register_block(char *block_buf, unsigned int block_len, unsigned cha
             unsigned int &blocks_count, unsigned int &meta_cap, block_id_t * &metadata)
 {
     D_Logic_Block_Entry lbentry;
-    block_id_t *bid_list = 0;
-    int value_sz = 0;
-    bid_list = (block_id_t *)d_htab_bindex->getvalue(md5val, value_sz);
+    block_id_t bid_list[BINDEX_MAX_BIDS];
+    int bids_nr = d_bindex->getvalue(md5val, bid_list, BINDEX_MAX_BIDS);
     unsigned int reg_block_id = 0;
+    block_id_t value = 0;
     //old block
     bool is_new_block = true;
     int ret = 0;
-    if (0 != bid_list){
-        for(unsigned int i = 0; i < *bid_list; i++){
-            ret = blocks_cmp(block_buf, block_len, ldata_file, bdata_file, bid_list[i+1]);
-            if (0 == ret){
-                reg_block_id = bid_list[i+1];
-                is_new_block = false;
-                break;
-            }else if (-1 == ret){
-                fprintf(stderr, "Error: compare blocks in Dedupe::register_block::blocks_cmp(...)\n");
-                return -1;
-            }
+    for(int i = 0; i < bids_nr; i++){
+        //a block released in place may still be in the prefetch cache of the sampled index
+        if (0 == d_refcnt->getvalue(bid_list[i], &value) && REFCNT_RELEASED == value)
+            continue;
+        ret = blocks_cmp(block_buf, block_len, ldata_file, bdata_file, bid_list[i]);
+        if (0 == ret){
+            reg_block_id = bid_list[i];
+            is_new_block = false;
+            break;
+        }else if (-1 == ret){
+            fprintf(stderr, "Error: compare blocks in Dedupe::register_block::blocks_cmp(...)\n");
+            return -1;
         }
-
     }
     if (is_new_block){
-        bid_list = (0 == value_sz) ? (block_id_t *)malloc(BLOCK_ID_SIZE * 2) :
-            (block_id_t *)realloc(bid_list, value_sz + BLOCK_ID_SIZE);
-        if (0 == bid_list){
-            fprintf(stderr, "Error: malloc/realloc block id list in Dedupe::register_block(...)");
+        reg_block_id = d_pkg_hdr.ublocks_nr;
+        if (0 != d_bindex->insert(md5val, reg_block_id) ||
+            (D_CHUNK_SB == d_chunk_alg && 0 != d_bindex->insertcsum(adler32(block_buf, block_len)))){
+            fprintf(stderr, "Error: insert block %u into block index in Dedupe::register_block(...)\n", reg_block_id);
             return -1;
         }
-        *bid_list = (0 == value_sz) ? 1 : (*bid_list + 1);
-        bid_list[*bid_list] = d_pkg_hdr.ublocks_nr;
-        reg_block_id = d_pkg_hdr.ublocks_nr;
 
         memcpy(lbentry.block_md5, md5val, 33);
         lbentry.ublock_len = block_len;
-        lbentry.ublock_off = d_pkg_hdr.ldata_offset;
-
-
-        value_sz = BLOCK_ID_SIZE * (*bid_list + 1);
-        d_htab_bindex->insert(md5val, bid_list, value_sz);
-        if (bid_list){
-            free(bid_list);
-            bid_list = 0;
+        lbentry.codec = pack_block(block_buf, block_len, lbentry.zblock_len);
+        lbentry.depth = 0;
+        lbentry.base_id = 0;
+        const char *data = (CODEC_NONE == lbentry.codec) ? block_buf : d_zbuf;
+        uint64_t sf[SF_SUPER_NR];
+        bool has_sf = d_similarity && super_features(block_buf, block_len, sf);
+        if (has_sf){
+            ret = delta_block(block_buf, block_len, sf, ldata_file, bdata_file, lbentry);
+            if (-1 == ret)
+                return -1;
+            if (0 == ret)
+                data = d_dbuf;
+        }
+        //into the open container, in a free extent of the package or appended
+        if (0 != container_add(bdata_file, data, lbentry, reg_block_id)){
+            fprintf(stderr, "Error: write block %u in Dedupe::register_block(...)\n", reg_block_id);
+            return -1;
+        }
+        //a block at the end of a chain is no base
+        if (has_sf && lbentry.depth < d_delta_depth){
+            for (int j = 0; j < SF_SUPER_NR; j++)
+                d_sim_new[sf[j]] = reg_block_id;
         }
+
         ldata_file.seekp(0, ios::end);
         ldata_file.write((const char *)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
 
-        bdata_file.seekp(0, ios::end);
-        bdata_file.write((const char *)block_buf, block_len);
         d_pkg_hdr.ublocks_nr++;
         d_pkg_hdr.ublocks_len += block_len;
-        d_pkg_hdr.ldata_offset += block_len;
+        d_pkg_hdr.zblocks_len += lbentry.zblock_len;
+        if (CODEC_DELTA == lbentry.codec){
+            d_pkg_hdr.delta_nr++;
+            d_pkg_hdr.delta_saved += block_len - lbentry.zblock_len;
+            d_delta_nr++;
+        }
+
+        //counted by register_file(...) once the file is registered
+        value = 0;
+        if (0 != d_refcnt->setvalue(reg_block_id, &value)){
+            fprintf(stderr, "Error: set reference count of block %u in Dedupe::register_block(...)\n", reg_block_id);
+            return -1;
+        }
     }
 
     if ( (blocks_count + 1) >= meta_cap){
@@ -1460,6 +3165,88 @@ int Dedupe::register_block(char *block_buf, unsigned int block_len, unsigned cha
     return 0;
 }
 
+unsigned char Dedupe::pack_block(const char *block_buf, unsigned int block_len, unsigned int &len)
+/*a block the entropy test takes as compressed already is not tried; the
+  compressed one is kept only if it saves 1/COMPRESS_MIN_GAIN of the block*/
+{
+    len = block_len;
+    if (0 == d_compress_level || block_len < COMPRESS_MIN_GAIN)
+        return CODEC_NONE;
+    if (lz_incompressible(block_buf, block_len)){
+        d_zskip_nr++;
+        return CODEC_NONE;
+    }
+    if (d_zbuf_sz < block_len){
+        char *zbuf = (char *)realloc(d_zbuf, block_len);
+        if (0 == zbuf){
+            fprintf(stderr, "Warning: malloc %u bytes for compression in Dedupe::pack_block(...)\n", block_len);
+            return CODEC_NONE;
+        }
+        d_zbuf = zbuf;
+        d_zbuf_sz = block_len;
+    }
+    unsigned int zlen = lz_compress(block_buf, block_len, d_zbuf, block_len - block_len / COMPRESS_MIN_GAIN, d_compress_level);
+    if (0 == zlen){
+        d_zfail_nr++;
+        return CODEC_NONE;
+    }
+    len = zlen;
+    return CODEC_LZ;
+}
+
+int Dedupe::delta_block(const char *block_buf, unsigned int block_len, const uint64_t *sf,
+                        fstream &ldata_file, fstream &bdata_file, D_Logic_Block_Entry &lbentry)
+/*the delta against the base found by the similarity index is kept if it is
+  smaller than the block as packed so far, and saves 1/COMPRESS_MIN_GAIN of it*/
+{
+    D_Logic_Block_Entry bentry;
+    block_id_t base = 0;
+    block_id_t *ref = 0;
+    char *base_buf = 0;
+    unsigned int cap = block_len - block_len / COMPRESS_MIN_GAIN, dlen = 0;
+    if (!sim_lookup(sf, base))
+        return 1;
+    if (0 != load_lbentry(ldata_file, bdata_file, base, bentry))
+        return -1;
+    if (bentry.depth >= d_delta_depth)
+        return 1;
+    if (lbentry.zblock_len <= cap)
+        cap = lbentry.zblock_len - 1;
+    if (d_dbuf_sz < block_len){
+        char *dbuf = (char *)realloc(d_dbuf, block_len);
+        if (0 == dbuf){
+            fprintf(stderr, "Warning: malloc %u bytes for delta in Dedupe::delta_block(...)\n", block_len);
+            return 1;
+        }
+        d_dbuf = dbuf;
+        d_dbuf_sz = block_len;
+    }
+    base_buf = (char *)malloc(bentry.ublock_len);
+    if (0 == base_buf || 0 != load_block(ldata_file, bdata_file, bentry, base_buf)){
+        fprintf(stderr, "Error: read base block %u in Dedupe::delta_block(...)\n", base);
+        if (base_buf)
+            free(base_buf);
+        return -1;
+    }
+    dlen = lz_delta_encode(base_buf, bentry.ublock_len, block_buf, block_len, d_dbuf, cap,
+                           d_compress_level > 0 ? d_compress_level : LZ_LEVEL_FAST);
+    free(base_buf);
+    if (0 == dlen)
+        return 1;
+    ref = (block_id_t *)d_refcnt->valueptr(base);
+    if (0 == ref){
+        fprintf(stderr, "Error: get reference count of base %u in Dedupe::delta_block(...)\n", base);
+        return -1;
+    }
+    (*ref)++;
+    refcnt_dirty(&base, 1);
+    lbentry.codec = CODEC_DELTA;
+    lbentry.zblock_len = dlen;
+    lbentry.base_id = base;
+    lbentry.depth = bentry.depth + 1;
+    return 0;
+}
+
 //same block : return 0;
 //different blocks : return 1;
 //error: return -1;
@@ -1476,14 +3263,8 @@ int Dedupe::blocks_cmp(char *buf, unsigned int len,
     ldata_file >> noskipws;
     bdata_file >> noskipws;
     char *block_buf = 0;
-    unsigned int rsize = 0;
-    unsigned long long offset = block_id * D_LOGIC_BLOCK_ENTRY_SZ;
 
-    ldata_file.seekg(offset, ios::beg);
-    ldata_file.read((char*)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
-    rsize = ldata_file.gcount();
-    if (D_LOGIC_BLOCK_ENTRY_SZ != rsize){
-        fprintf(stderr, "Error: read logic block with id=%d in Dedupe::register_block::blocks_cmp(..)\n", block_id);
+    if (0 != load_lbentry(ldata_file, bdata_file, block_id, lbentry)){
         ret = -1;
         goto _BLOCKS_CMP_EXIT;
     }
@@ -1499,11 +3280,8 @@ int Dedupe::blocks_cmp(char *buf, unsigned int len,
         ret = -1;
         goto _BLOCKS_CMP_EXIT;
     }
-    bdata_file.seekg(lbentry.ublock_off, ios::beg);
-    bdata_file.read(block_buf, lbentry.ublock_len);
-    rsize = bdata_file.gcount();
-    if (rsize != lbentry.ublock_len){
-        fprintf(stderr, "Error: read block data in Dedupe::register_block::block_cmp(...)\n");
+    if (0 != load_block(ldata_file, bdata_file, lbentry, block_buf)){
+        fprintf(stderr, "Error: read block %u in Dedupe::register_block::block_cmp(...)\n", block_id);
         ret = -1;
         goto _BLOCKS_CMP_EXIT;
     }
@@ -1526,224 +3304,764 @@ _BLOCKS_CMP_EXIT:
     return ret;
 }
 
+int Dedupe::load_lbentry(fstream &ldata_file, fstream &bdata_file, block_id_t id, D_Logic_Block_Entry &lbentry)
+{
+    unsigned long long offset = 0;
+    //the logic block entries of former insertions are in the package (bdata_file)
+    fstream *lfile = &ldata_file;
+    if (id < d_ldata_base){
+        lfile = &bdata_file;
+        offset = lblock_offset(id);
+    }else
+        offset = (unsigned long long)(id - d_ldata_base) * D_LOGIC_BLOCK_ENTRY_SZ;
+
+    lfile->clear();
+    lfile->seekg(offset, ios::beg);
+    lfile->read((char*)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
+    if (D_LOGIC_BLOCK_ENTRY_SZ != (unsigned int)lfile->gcount()){
+        fprintf(stderr, "Error: read logic block with id=%u in Dedupe::load_lbentry(..)\n", id);
+        return -1;
+    }
+    return 0;
+}
+
+int Dedupe::load_block(fstream &ldata_file, fstream &bdata_file, const D_Logic_Block_Entry &lbentry, char *buf)
+{
+    D_Logic_Block_Entry bentry;
+    char *zbuf = 0, *base_buf = 0;
+    int ret = 0;
+
+    bdata_file.clear();
+    bdata_file.seekg(lbentry.ublock_off, ios::beg);
+    if (CODEC_NONE == lbentry.codec){
+        bdata_file.read(buf, lbentry.ublock_len);
+        if (lbentry.ublock_len != (unsigned int)bdata_file.gcount()){
+            fprintf(stderr, "Error: read block data at %llu in Dedupe::load_block(...)\n", lbentry.ublock_off);
+            return -1;
+        }
+        return 0;
+    }
+    zbuf = (char *)malloc(lbentry.zblock_len);
+    if (0 == zbuf){
+        fprintf(stderr, "Error: malloc %u bytes in Dedupe::load_block(...)\n", lbentry.zblock_len);
+        return -1;
+    }
+    bdata_file.read(zbuf, lbentry.zblock_len);
+    if (lbentry.zblock_len != (unsigned int)bdata_file.gcount()){
+        fprintf(stderr, "Error: read block data at %llu in Dedupe::load_block(...)\n", lbentry.ublock_off);
+        ret = -1;
+        goto _LOAD_BLOCK_EXIT;
+    }
+    if (CODEC_DELTA != lbentry.codec){
+        if (0 != decode_block(lbentry.codec, zbuf, lbentry.zblock_len, buf, lbentry.ublock_len)){
+            fprintf(stderr, "Error: decompress block at %llu in Dedupe::load_block(...)\n", lbentry.ublock_off);
+            ret = -1;
+        }
+        goto _LOAD_BLOCK_EXIT;
+    }
+    //the chain is at most DELTA_DEPTH_LIMIT deep, so is the recursion
+    if (0 != load_lbentry(ldata_file, bdata_file, lbentry.base_id, bentry) ||
+        0 == (base_buf = (char *)malloc(bentry.ublock_len)) ||
+        0 != load_block(ldata_file, bdata_file, bentry, base_buf) ||
+        (int)lbentry.ublock_len != lz_delta_decode(base_buf, bentry.ublock_len, zbuf, lbentry.zblock_len,
+                                                   buf, lbentry.ublock_len)){
+        fprintf(stderr, "Error: decode delta against block %u in Dedupe::load_block(...)\n", lbentry.base_id);
+        ret = -1;
+    }
+
+_LOAD_BLOCK_EXIT:
+    if (zbuf)
+        free(zbuf);
+    if (base_buf)
+        free(base_buf);
+    return ret;
+}
+
 int Dedupe::extract_all_files(const char *pkg_name, int files_nr, char **files_extract, char *dest_dir)
 {
-    ifstream pkg_file;
-    unsigned int rsize = 0;
+    PackageView view;
+    D_File_View fv;
+    vector<D_File_View> found;
+    char filename[PATH_MAX_LEN] = {0};
+    char *buf = 0;
+    int ret = 0;
 
-    pkg_file.open(pkg_name, ios::binary | ios::in);
-    if (!pkg_file.is_open()){
+    if (0 != view.open(pkg_name)){
         fprintf(stderr, "Error: open package \"%s\" in Dedupe::extract_all_files(...)\n", pkg_name);
         return -1;
     }
-    pkg_file >> noskipws;
+    memcpy(&d_pkg_hdr, &view.header(), D_PKG_HDR_SZ);
 
-    D_Package_Header pkg_hdr;
-    pkg_file.read((char *)(&pkg_hdr), D_PKG_HDR_SZ);
-    rsize = pkg_file.gcount();
-    if (D_PKG_HDR_SZ != rsize){
-        fprintf(stderr, "Error: read package header in Dedupe::extract_all_files(...)\n");
-        pkg_file.close();
+    if (0 != files_nr && view.has_path_index()){
+        if (0 != find_indexed_files(view, files_nr, files_extract, found))
+            return -1;
+    }else{
+        for(unsigned int i = 0; i < view.files_nr(); i++){
+            if (view.file_removed(i))
+                continue;
+            if (0 != view.file(i, fv)){
+                fprintf(stderr, "Error: read the %dth file entry in Dedupe::extract_all_files(...)\n", i);
+                return -1;
+            }
+            if (0 != files_nr){ //extract files in the files list -- files_extract
+                memcpy(filename, fv.name, fv.entry.fname_len);
+                filename[fv.entry.fname_len] = '\0';
+                if (!is_file_under_list(filename, files_nr, files_extract))
+                    continue;
+            }
+            found.push_back(fv);
+        }
+    }
+    /*a path inserted again has a file entry each time, or a file is below two
+      paths of the list: only its last file entry is extracted, the one a
+      sequential extraction leaves behind, else the threads of
+      extract_parallel(...) would write the file twice at once*/
+    if (found.size() > 1){
+        map<string, unsigned int> last;
+        vector<D_File_View> kept;
+        for (unsigned int k = 0; k < found.size(); k++)
+            last[string(found[k].name, found[k].entry.fname_len)] = k;
+        if (last.size() < found.size()){
+            for (unsigned int k = 0; k < found.size(); k++){
+                if (last[string(found[k].name, found[k].entry.fname_len)] == k)
+                    kept.push_back(found[k]);
+            }
+            found.swap(kept);
+        }
+    }
+
+    //the blocks stored whole are written from the mapping, buf is for the decoded ones
+    buf = (char *)malloc(BUF_MAX_SIZE);
+    if (0 == buf){
+        fprintf(stderr, "Error: malloc buf in Dedupe::extract_all_files(...)\n");
+        return -1;
+    }
+    //count the references like package_stat(...), the shared blocks are cached
+    if (d_rcache_sz > 0){
+        d_restore_refs.assign(view.header().ublocks_nr, 0);
+        for (unsigned int k = 0; k < found.size(); k++){
+            for (unsigned int j = 0; j < found[k].blocks.nr; j++){
+                block_id_t bid = found[k].blocks[j];
+                if (bid < d_restore_refs.size())
+                    d_restore_refs[bid]++;
+            }
+        }
+        d_rcache = new RestoreCache(d_rcache_sz);
+    }
+    if (d_restore_threads > 1)
+        ret = extract_parallel(view, found, pkg_name, dest_dir);
+    else if (d_restore_sched)
+        ret = extract_scheduled(view, found, dest_dir, buf);
+    else{
+        for (unsigned int k = 0; k < found.size(); k++){
+            ret = extract_file(view, found[k], dest_dir, buf);
+            if (0 != ret)
+                break;
+        }
+    }
+    if (d_rcache){
+        if (verbose && d_rcache->lookups() > 0)
+            cout << "Info: restore cache hits " << d_rcache->hits() << " of " << d_rcache->lookups() << " lookups ("
+                 << 100.0 * d_rcache->hits() / d_rcache->lookups() << "%), " << d_rcache->size()
+                 << " bytes cached in Dedupe::extract_all_files(...)" << endl;
+        delete d_rcache;
+        d_rcache = 0;
+    }
+    d_restore_refs.clear();
+    free(buf);
+    return ret;
+}
+
+
+int Dedupe::find_indexed_files(const PackageView &view, int files_nr, char **files_extract, vector<D_File_View> &found)
+//a path listed by several runs of the path index is taken from the newest one
+{
+    D_File_View fv;
+    map<string, D_File_View> matches;
+    char prefix[PATH_MAX_LEN + 1] = {0};
+    unsigned int len = 0, k = 0;
+
+    for (int i = 0; i < files_nr; i++){
+        len = strlen(files_extract[i]);
+        while (len > 1 && '/' == files_extract[i][len - 1])
+            len--;
+        if (len >= PATH_MAX_LEN)
+            continue;
+        memcpy(prefix, files_extract[i], len);
+        prefix[len] = '/';
+        matches.clear();
+        for (unsigned int r = 0; r < view.path_runs_nr(); r++){
+            //the file itself
+            k = view.find_path(r, files_extract[i], len);
+            if (k < view.paths_nr(r) && 0 == view.path_file(r, k, fv) &&
+                fv.entry.fname_len == len && 0 == memcmp(fv.name, files_extract[i], len))
+                matches[string(fv.name, len)] = fv;
+            //the files below it, "path/" sorts before all of them
+            for (k = view.find_path(r, prefix, len + 1); k < view.paths_nr(r); k++){
+                if (0 != view.path_file(r, k, fv))
+                    return -1;
+                if (fv.entry.fname_len <= len + 1 || 0 != memcmp(fv.name, prefix, len + 1))
+                    break;
+                matches[string(fv.name, fv.entry.fname_len)] = fv;
+            }
+        }
+        for (map<string, D_File_View>::const_iterator it = matches.begin(); it != matches.end(); ++it)
+            found.push_back(it->second);
+        if (matches.empty())
+            fprintf(stderr, "Warning: %s not in the package in Dedupe::find_indexed_files(...)\n", files_extract[i]);
+        else if (verbose)
+            cout << "Info: " << matches.size() << " files of " << files_extract[i] << " found by the path index" << endl;
+    }
+    return 0;
+}
+
+int Dedupe::open_view(const char *pkg_name)
+{
+    struct stat stat_buf;
+    if (0 != stat(pkg_name, &stat_buf)){
+        fprintf(stderr, "Error: stat package %s in Dedupe::open_view(...)\n", pkg_name);
+        return -1;
+    }
+    if (d_view && 0 == strcmp(d_view_name, pkg_name) && stat_buf.st_ino == d_view_stat.st_ino &&
+        stat_buf.st_size == d_view_stat.st_size && stat_buf.st_mtime == d_view_stat.st_mtime)
+        return 0;
+    drop_view();
+    d_view = new PackageView();
+    d_view_buf = (char *)malloc(BUF_MAX_SIZE);
+    if (0 == d_view_buf || 0 != d_view->open(pkg_name)){
+        fprintf(stderr, "Error: open package %s in Dedupe::open_view(...)\n", pkg_name);
+        drop_view();
+        return -1;
+    }
+    snprintf(d_view_name, PATH_MAX_LEN, "%s", pkg_name);
+    memcpy(&d_view_stat, &stat_buf, sizeof(struct stat));
+    return 0;
+}
+
+void Dedupe::drop_view()
+{
+    if (d_view){
+        delete d_view;
+        d_view = 0;
+    }
+    if (d_view_buf){
+        free(d_view_buf);
+        d_view_buf = 0;
+    }
+    d_seek.clear();
+    memset(d_view_name, 0, PATH_MAX_LEN);
+}
+
+const vector<unsigned long long>* Dedupe::seek_index(const D_File_View &fv)
+{
+    unsigned long long key = d_view->offset(fv.name) - D_FILE_ENTRY_SZ;
+    map<unsigned long long, vector<unsigned long long> >::iterator it = d_seek.find(key);
+    if (it != d_seek.end())
+        return &it->second;
+
+    vector<unsigned long long> &seek = d_seek[key];
+    unsigned long long pos = 0;
+    seek.reserve(fv.blocks.nr / DEDUP_SEEK_STRIDE + 2);
+    for (unsigned int j = 0; j < fv.blocks.nr; j++){
+        unsigned int len = d_view->block_len(fv.blocks[j]);
+        if (0 == len){
+            fprintf(stderr, "Error: no block with id=%u in Dedupe::seek_index(...)\n", fv.blocks[j]);
+            d_seek.erase(key);
+            return 0;
+        }
+        if (0 == j % DEDUP_SEEK_STRIDE)
+            seek.push_back(pos);
+        pos += len;
+    }
+    seek.push_back(pos);
+    return &seek;
+}
+
+long long Dedupe::read_file(const char *pkg_name, const char *path, unsigned long long offset, unsigned int len, char *out)
+{
+    D_File_View fv, match;
+    unsigned int plen = strlen(path);
+    const vector<unsigned long long> *seek = 0;
+    unsigned long long pos = 0, blocks_end = 0;
+    unsigned int j = 0, blen = 0, skip = 0, n = 0;
+    long long done = 0;
+    const char *data = 0;
+    bool found = false;
+
+    if (0 != open_view(pkg_name))
+        return -1;
+    if (d_view->has_path_index())
+        found = d_view->find_file(path, plen, match);
+    else{
+        //the last file entry of path, as extraction leaves it
+        for (unsigned int i = 0; i < d_view->files_nr(); i++){
+            if (d_view->file_removed(i) || 0 != d_view->file(i, fv))
+                continue;
+            if (fv.entry.fname_len == plen && 0 == memcmp(fv.name, path, plen)){
+                match = fv;
+                found = true;
+            }
+        }
+    }
+    if (!found){
+        fprintf(stderr, "Error: no file %s in package %s in Dedupe::read_file(...)\n", path, pkg_name);
         return -1;
     }
-    if (DEDUP_MAGIC_NUM != pkg_hdr.magic_nr){
-        fprintf(stderr, "Error: wrong package magic number %d of \"%s\" in Dedupe::extract_all_files(...)\n", pkg_hdr.magic_nr, pkg_name);
-        pkg_file.close();
+    if (offset >= match.entry.org_file_sz)
+        return 0;
+    if (len > match.entry.org_file_sz - offset)
+        len = match.entry.org_file_sz - offset;
+    seek = seek_index(match);
+    if (0 == seek)
         return -1;
+
+    //the block holding offset: from the nearest seek index entry on
+    blocks_end = seek->back();
+    if (offset < blocks_end){
+        unsigned int s = std::upper_bound(seek->begin(), seek->end() - 1, offset) - seek->begin() - 1;
+        j = s * DEDUP_SEEK_STRIDE;
+        pos = (*seek)[s];
+        while (pos + (blen = d_view->block_len(match.blocks[j])) <= offset){
+            pos += blen;
+            j++;
+        }
+    }else
+        j = match.blocks.nr;
+    for (; done < len && j < match.blocks.nr; j++){
+        if (0 != read_block(*d_view, match.blocks[j], d_view_buf, data, blen)){
+            fprintf(stderr, "Error: read %uth block of %s in Dedupe::read_file(...)\n", j, path);
+            return -1;
+        }
+        skip = offset + done - pos;
+        n = (blen - skip < len - done) ? blen - skip : len - done;
+        memcpy(out + done, data + skip, n);
+        done += n;
+        pos += blen;
     }
-    memcpy(&d_pkg_hdr, &pkg_hdr, D_PKG_HDR_SZ);
+    if (done < len){
+        skip = offset + done - blocks_end;
+        if (skip > match.entry.last_block_sz){
+            fprintf(stderr, "Error: file entry of %s shorter than the file in Dedupe::read_file(...)\n", path);
+            return -1;
+        }
+        n = (match.entry.last_block_sz - skip < len - done) ? match.entry.last_block_sz - skip : len - done;
+        memcpy(out + done, match.last_block + skip, n);
+        done += n;
+    }
+    return done;
+}
 
-    D_File_Entry fentry;
-    int ret = 0;
-    unsigned long long offset = d_pkg_hdr.mdata_offset;
+static int pwrite_all(int fd, const char *buf, unsigned int len, unsigned long long offset)
+{
+    while (len > 0){
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (-1 == n && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static bool fetch_less(const D_Fetch &x, const D_Fetch &y)
+{
+    return x.pkg_off < y.pkg_off || (x.pkg_off == y.pkg_off && x.id < y.id);
+}
+
+int Dedupe::extract_scheduled(const PackageView &view, const vector<D_File_View> &files, char *dest_dir, char *buf)
+{
+    vector<D_Fetch> plan;
+    vector<int> fds(files.size(), -1);
+    vector<unsigned int> batch; // numbers in files of the files of the batch
+    D_Fetch fetch;
+    D_Container_Slot slot;
+    uint64_t offset = 0;
     char filename[PATH_MAX_LEN] = {0};
-    for(unsigned int i = 0; i < d_pkg_hdr.files_nr; i++){
-        pkg_file.seekg(offset, ios::beg);
-        pkg_file.read((char*)(&fentry), D_FILE_ENTRY_SZ);
-        rsize = pkg_file.gcount();
-        if (D_FILE_ENTRY_SZ != rsize){
-            fprintf(stderr, "Error: read the %dth file entry in Dedupe::extract_all_files(...)\n", i);
-            ret = -1;
-            break;
-        }
+    char fullpath[PATH_MAX_LEN] = {0};
+    struct timespec ftime[2];
+    const char *data = 0;
+    unsigned int len = 0, next = 0, j = 0; // block j of file next is planned next
+    unsigned long long dest_off = 0; // of block j in its file
+    unsigned long long fetch_nr = 0, run_nr = 0, batch_nr = 0;
+    block_id_t decoded = DEDUP_FETCH_LAST; // the block in buf
+    int ret = 0;
 
-        if (0 == files_nr){ //extract all files
-            ret = extract_file(pkg_file, fentry, dest_dir);
-            if (0 != ret)
-                break;
-        }else { //extract files in the files list -- files_extract
-            memset(filename, 0, PATH_MAX_LEN);
-            pkg_file.read(filename, fentry.fname_len);
-            rsize = pkg_file.gcount();
-            if (rsize != fentry.fname_len){
-                fprintf(stderr, "Error: read file name of file entry %d in Dedupe::extract_all_files(...)\n", i);
-                ret = -1;
-                break;
+    plan.reserve(d_sched_blocks + DEDUP_SCHED_FILES);
+    while (next < files.size()){
+        plan.clear();
+        batch.clear();
+        while (next < files.size() && plan.size() < d_sched_blocks && batch.size() < DEDUP_SCHED_FILES){
+            const D_File_View &fv = files[next];
+            if (-1 == fds[next]){
+                memset(filename, 0, PATH_MAX_LEN);
+                memcpy(filename, fv.name, fv.entry.fname_len);
+                prepare_target_file(filename, dest_dir, fullpath);
+                fds[next] = open(fullpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (-1 == fds[next]){
+                    fprintf(stderr, "Error: create destination file %s in Dedupe::extract_scheduled(...)\n", fullpath);
+                    ret = -1;
+                    goto _EXTRACT_SCHEDULED_EXIT;
+                }
+                if (verbose)
+                    cout << "Info: extract file's path is " << fullpath << endl;
             }
-            pkg_file.seekg(offset + D_FILE_ENTRY_SZ, ios::beg);
-            if (is_file_in_list(filename, files_nr, files_extract)){
-                ret = extract_file(pkg_file, fentry, dest_dir);
-                if (0 != ret){
-                    break;
+            fetch.file = batch.size();
+            batch.push_back(next);
+            for (; j < fv.blocks.nr && plan.size() < d_sched_blocks; j++){
+                fetch.id = fv.blocks[j];
+                if (!view.stored(fetch.id, slot, offset)){
+                    fprintf(stderr, "Error: no unique block with id=%u in Dedupe::extract_scheduled(...)\n", fetch.id);
+                    ret = -1;
+                    goto _EXTRACT_SCHEDULED_EXIT;
                 }
+                fetch.pkg_off = offset;
+                fetch.dest_off = dest_off;
+                fetch.len = slot.len;
+                fetch.raw_len = slot.raw_len;
+                fetch.codec = slot.codec;
+                plan.push_back(fetch);
+                dest_off += slot.raw_len;
             }
+            if (j < fv.blocks.nr) //the file goes on in the next batch
+                break;
+            fetch.id = DEDUP_FETCH_LAST;
+            fetch.pkg_off = view.offset(fv.last_block);
+            fetch.dest_off = dest_off;
+            fetch.len = fetch.raw_len = fv.entry.last_block_sz;
+            fetch.codec = CODEC_NONE;
+            plan.push_back(fetch);
+            next++;
+            j = 0;
+            dest_off = 0;
         }
 
-        offset += fentry.fentry_sz;
+        std::sort(plan.begin(), plan.end(), fetch_less);
+        for (unsigned int r = 0; r < plan.size(); ){
+            //a run: the next fetches less than DEDUP_SCHED_GAP bytes apart
+            unsigned long long run_end = plan[r].pkg_off + plan[r].len;
+            unsigned int e = r + 1;
+            while (e < plan.size() && plan[e].pkg_off < run_end + DEDUP_SCHED_GAP &&
+                   plan[e].pkg_off + plan[e].len - plan[r].pkg_off <= DEDUP_SCHED_RUN){
+                if (plan[e].pkg_off + plan[e].len > run_end)
+                    run_end = plan[e].pkg_off + plan[e].len;
+                e++;
+            }
+            view.willneed(plan[r].pkg_off, run_end - plan[r].pkg_off);
+            run_nr++;
+            for (; r < e; r++){
+                const D_Fetch &f = plan[r];
+                if (CODEC_NONE == f.codec){
+                    data = view.at(f.pkg_off, f.len);
+                    len = f.len;
+                }else if (f.id == decoded){
+                    data = buf;
+                    len = f.raw_len;
+                }else{
+                    decoded = DEDUP_FETCH_LAST;
+                    if (0 != restore_block(view, f.id, buf, data, len)){
+                        fprintf(stderr, "Error: read ublock with id=%u in Dedupe::extract_scheduled(...)\n", f.id);
+                        ret = -1;
+                        goto _EXTRACT_SCHEDULED_EXIT;
+                    }
+                    decoded = f.id;
+                }
+                if (0 != pwrite_all(fds[batch[f.file]], data, len, f.dest_off)){
+                    fprintf(stderr, "Error: write %u bytes at %llu of %uth file in Dedupe::extract_scheduled(...)\n",
+                            len, f.dest_off, batch[f.file]);
+                    ret = -1;
+                    goto _EXTRACT_SCHEDULED_EXIT;
+                }
+            }
+        }
+        fetch_nr += plan.size();
+        batch_nr++;
+
+        //the files done, all but the one going on in the next batch
+        for (unsigned int k = 0; k < batch.size(); k++){
+            unsigned int n = batch[k];
+            if (n >= next)
+                continue;
+            ftime[0].tv_sec = files[n].entry.atime;
+            ftime[0].tv_nsec = 0;
+            ftime[1].tv_sec = files[n].entry.mtime;
+            ftime[1].tv_nsec = 0;
+            futimens(fds[n], ftime);
+            close(fds[n]);
+            fds[n] = -1;
+        }
     }
-    if (pkg_file.is_open()){
-        pkg_file.close();
+    if (verbose)
+        cout << "Info: " << files.size() << " files extracted by " << fetch_nr << " block fetches in " << run_nr
+             << " runs, " << batch_nr << " batches in Dedupe::extract_scheduled(...)" << endl;
+
+_EXTRACT_SCHEDULED_EXIT:
+    for (unsigned int n = 0; n < fds.size(); n++){
+        if (-1 != fds[n])
+            close(fds[n]);
     }
-
     return ret;
 }
 
-
-int Dedupe::extract_file(ifstream &pkg_file, D_File_Entry fentry, char *dest_dir)
+int Dedupe::write_blocks(const PackageView &view, const D_File_View &fv, unsigned int first, unsigned int end,
+                         int des_fd, unsigned long long dest_off, char *buf)
 {
-    if (!pkg_file.is_open()){
-        fprintf(stderr, "Error: package file not open in Dedupe::extract_file(...)\n");
-        return -1;
+    const char *data = 0;
+    unsigned int len = 0;
+    /*blocks stored whole are copied from the package by the kernel, the ones
+      next to each other in the package by one call*/
+    unsigned long long run_off = 0;
+    unsigned long long run_len = 0;
+    unsigned long long run_dest = 0;
+
+    for(unsigned int j = first; j < end; j++){
+        if (j == fv.blocks.nr){ //the last block is in the file entry
+            data = fv.last_block;
+            len = fv.entry.last_block_sz;
+        }else if (0 != restore_block(view, fv.blocks[j], buf, data, len)){
+            fprintf(stderr, "Error: read %dth ublock with id=%d in Dedupe::write_blocks(...)\n", j, fv.blocks[j]);
+            return -1;
+        }
+        if (data != buf && run_len > 0 && run_off + run_len == view.offset(data)){
+            run_len += len;
+            dest_off += len;
+            continue;
+        }
+        if (run_len > 0 && 0 != view.copy_to(des_fd, run_off, run_len, run_dest))
+            return -1;
+        run_len = 0;
+        if (data != buf){
+            run_off = view.offset(data);
+            run_len = len;
+            run_dest = dest_off;
+        }else if (0 != pwrite_all(des_fd, buf, len, dest_off))
+            return -1;
+        dest_off += len;
     }
+    if (run_len > 0 && 0 != view.copy_to(des_fd, run_off, run_len, run_dest))
+        return -1;
+    return 0;
+}
 
+int Dedupe::extract_file(const PackageView &view, const D_File_View &fv, char *dest_dir, char *buf)
+{
     char filename[PATH_MAX_LEN] = {0};
     char fullpath[PATH_MAX_LEN] = {0};
-    block_id_t *metadata = 0;
-    char *last_block = 0;
-    D_Logic_Block_Entry lbentry;
     struct utimbuf ftime;
+    int des_fd = -1;
+    int ret = 0;
 
-    char *buf = 0;
-    unsigned int rsize = 0;
-    fstream des_file;
-
-    metadata = (block_id_t *)malloc(BLOCK_ID_SIZE * fentry.fblocks_nr);
-    if (0 == metadata){
-        fprintf(stderr, "Error: malloc metadata in Dedupe::extract_file(...)\n");
+    memcpy(filename, fv.name, fv.entry.fname_len);
+    prepare_target_file(filename, dest_dir, fullpath);
+    des_fd = open(fullpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (-1 == des_fd){
+        fprintf(stderr, "Error: create destination file %s in Dedupe::extract_file(...)\n", fullpath);
         return -1;
     }
-    memset(metadata, 0, BLOCK_ID_SIZE * fentry.fblocks_nr);
-
-    int ret = 0;
-    buf = (char *)malloc(BUF_MAX_SIZE);
-    if (0 == buf){
-        fprintf(stderr, "Error: malloc buf in Dedupe::extract_file(...)\n");
-        ret = -1;
-        goto _EXTRACT_FILE_EXIT;
-    }
-    memset(buf, 0, BUF_MAX_SIZE);
 
-    last_block = (char *)malloc(BUF_MAX_SIZE);
-    if (0 == last_block){
-        fprintf(stderr, "Error: malloc last_block in Dedupe::extract_file(...)\n");
-        ret = -1;
-        goto _EXTRACT_FILE_EXIT;
-    }
-    memset(last_block, 0, BUF_MAX_SIZE);
+    if(verbose)
+        cout << "Info: extract file's path is " << fullpath << endl;
 
-    pkg_file.read(filename, fentry.fname_len);
-    rsize = pkg_file.gcount();
-    if (rsize != fentry.fname_len){
-        fprintf(stderr, "Error: read file name from package in Dedupe::extract_file(...)\n");
-        ret = -1;
-        goto _EXTRACT_FILE_EXIT;
+    ret = write_blocks(view, fv, 0, fv.blocks.nr + 1, des_fd, 0, buf);
+    close(des_fd);
+    if (0 != ret){
+        fprintf(stderr, "Error: write destination file %s in Dedupe::extract_file(...)\n", fullpath);
+        return -1;
     }
+    ftime.actime = fv.entry.atime;
+    ftime.modtime = fv.entry.mtime;
+    utime(fullpath, &ftime);
+    return 0;
+}
 
-    pkg_file.read((char *)metadata, fentry.fblocks_nr * BLOCK_ID_SIZE);
-    rsize = pkg_file.gcount();
-    if (rsize != fentry.fblocks_nr * BLOCK_ID_SIZE){
-        fprintf(stderr, "Error: read file metadata (blocks id list) in Dedupe::extract\n");
-        ret = -1;
-        goto _EXTRACT_FILE_EXIT;
+int Dedupe::extract_parallel(const PackageView &view, const vector<D_File_View> &files, const char *pkg_name, char *dest_dir)
+/*the files cut into units, see D_Restore_Unit, for d_restore_threads threads;
+  the threads open pkg_name again, view is only read here*/
+{
+    D_Restore_Job job;
+    D_Restore_Unit unit;
+    set<string> dirs;
+    vector<pthread_t> threads;
+    char filename[PATH_MAX_LEN] = {0};
+    char fullpath[PATH_MAX_LEN] = {0};
+    unsigned int nr = 0, n = 0;
+    int fd = -1;
+
+    job.dedupe = this;
+    job.pkg_name = pkg_name;
+    job.dest_dir = dest_dir;
+    job.next = 0;
+    job.ret = 0;
+    job.left.assign(files.size(), 0);
+    for (unsigned int k = 0; k < files.size(); k++){
+        const D_File_View &fv = files[k];
+        memset(filename, 0, PATH_MAX_LEN);
+        memcpy(filename, fv.name, fv.entry.fname_len);
+        target_file_path(filename, dest_dir, fullpath);
+        //the directories prepare_target_file(...) would make, every one once
+        for (char *p = fullpath; *p; p++){
+            if ('/' == *p)
+                dirs.insert(string(fullpath, p - fullpath + 1));
+        }
+        unit.fentry_off = view.offset(fv.name) - D_FILE_ENTRY_SZ;
+        unit.dest_off = 0;
+        unit.file = k;
+        unit.first = 0;
+        while (unit.first <= fv.blocks.nr){
+            unit.end = (fv.blocks.nr + 1 - unit.first > DEDUP_RESTORE_SPLIT) ? unit.first + DEDUP_RESTORE_SPLIT : fv.blocks.nr + 1;
+            job.units.push_back(unit);
+            job.left[k]++;
+            if (unit.end <= fv.blocks.nr){ //another range follows, from the restored lengths
+                for (unsigned int j = unit.first; j < unit.end; j++)
+                    unit.dest_off += view.block_len(fv.blocks[j]);
+            }
+            unit.first = unit.end;
+        }
+        if (verbose)
+            cout << "Info: extract file's path is " << fullpath << endl;
     }
-
-    pkg_file.read(last_block, fentry.last_block_sz);
-    rsize = pkg_file.gcount();
-    if (rsize != fentry.last_block_sz){
-        fprintf(stderr, "Error: read last block in Dedupe::extract_file(...)\n");
-        ret = -1;
-        goto _EXTRACT_FILE_EXIT;
+    //a parent sorts before the directories in it
+    for (set<string>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+        mkdir(it->c_str(), 766);
+    //the threads writing the ranges of a file open it without truncating it
+    for (unsigned int k = 0; k < files.size(); k++){
+        if (job.left[k] < 2)
+            continue;
+        memset(filename, 0, PATH_MAX_LEN);
+        memcpy(filename, files[k].name, files[k].entry.fname_len);
+        target_file_path(filename, dest_dir, fullpath);
+        fd = open(fullpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (-1 == fd){
+            fprintf(stderr, "Error: create destination file %s in Dedupe::extract_parallel(...)\n", fullpath);
+            return -1;
+        }
+        close(fd);
     }
 
-    prepare_target_file(filename, dest_dir, fullpath);
-    des_file.open(fullpath, ios::out | ios::binary);
-    if (!des_file.is_open()){
-        fprintf(stderr, "Error: create destination file %s in Dedupe::extract_file(...)\n", fullpath);
-        ret = -1;
-        goto _EXTRACT_FILE_EXIT;
+    pthread_mutex_init(&job.lock, 0);
+    nr = (d_restore_threads < job.units.size()) ? d_restore_threads : job.units.size();
+    threads.resize(nr);
+    for (n = 0; n < nr; n++){
+        if (0 != pthread_create(&threads[n], 0, restorethread, &job)){
+            fprintf(stderr, "Warning: create restore thread %u of %u in Dedupe::extract_parallel(...)\n", n + 1, nr);
+            break;
+        }
     }
+    if (0 == n && job.units.size() > 0)
+        restore_worker(&job);
+    for (unsigned int i = 0; i < n; i++)
+        pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&job.lock);
+
+    if (verbose)
+        cout << "Info: " << files.size() << " files extracted in " << job.units.size() << " ranges by "
+             << n << " threads, " << dirs.size() << " directories in Dedupe::extract_parallel(...)" << endl;
+    return job.ret;
+}
 
-    if(verbose)
-        cout << "Info: extract file's path is " << fullpath << endl;
+void* Dedupe::restorethread(void *arg)
+{
+    D_Restore_Job *job = (D_Restore_Job *)arg;
+    job->dedupe->restore_worker(job);
+    return 0;
+}
 
-    for(unsigned int i = 0; i < fentry.fblocks_nr; i++){
-        unsigned long long offset = 0;
-        offset = d_pkg_hdr.ldata_offset + metadata[i] * D_LOGIC_BLOCK_ENTRY_SZ;
-        pkg_file.seekg(offset, ios::beg);
-        pkg_file.read((char*)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
-        rsize = pkg_file.gcount();
-        if (D_LOGIC_BLOCK_ENTRY_SZ != rsize){
-            fprintf(stderr, "Error: read %dth logic block with id=%d in Dedupe::extract_file(...)\n", i, metadata[i]);
-            ret = -1;
-            goto _EXTRACT_FILE_EXIT;
-        }
+int Dedupe::restore_worker(D_Restore_Job *job)
+/*a thread of extract_parallel(...) takes the units in turn until none is
+  left or a thread failed; it reads through a view and a buffer of its own*/
+{
+    PackageView view;
+    D_Restore_Unit unit;
+    char *buf = (char *)malloc(BUF_MAX_SIZE);
+    int ret = 0;
 
-        offset = lbentry.ublock_off;
-        pkg_file.seekg(offset, ios::beg);
-        pkg_file.read(buf, lbentry.ublock_len);
-        rsize = pkg_file.gcount();
-        if (rsize != lbentry.ublock_len){
-            fprintf(stderr, "Error: read %dth ublock data with id=%d in Dedupe::extract_file(...)\n", i, metadata[i]);
-            ret = -1;
-            goto _EXTRACT_FILE_EXIT;
+    if (0 == buf){
+        fprintf(stderr, "Error: malloc buf in Dedupe::restore_worker(...)\n");
+        ret = -1;
+    }else if (0 != view.open(job->pkg_name)){
+        fprintf(stderr, "Error: open package \"%s\" in Dedupe::restore_worker(...)\n", job->pkg_name);
+        ret = -1;
+    }
+    while (0 == ret){
+        pthread_mutex_lock(&job->lock);
+        if (0 != job->ret || job->next >= job->units.size()){
+            pthread_mutex_unlock(&job->lock);
+            break;
         }
-
-        des_file.write(buf, rsize);
+        unit = job->units[job->next++];
+        pthread_mutex_unlock(&job->lock);
+        ret = restore_unit(view, job, unit, buf);
     }
-    des_file.write(last_block, fentry.last_block_sz);
-    des_file.close();
-    ftime.actime = fentry.atime;
-    ftime.modtime = fentry.mtime;
-    utime(fullpath, &ftime);
-
-_EXTRACT_FILE_EXIT:
-    if (buf){
+    if (0 != ret){
+        pthread_mutex_lock(&job->lock);
+        job->ret = -1;
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (buf)
         free(buf);
-        buf = 0;
+    return ret;
+}
+
+int Dedupe::restore_unit(const PackageView &view, D_Restore_Job *job, const D_Restore_Unit &unit, char *buf)
+{
+    D_File_View fv;
+    char filename[PATH_MAX_LEN] = {0};
+    char fullpath[PATH_MAX_LEN] = {0};
+    struct timespec ftime[2];
+    bool whole = false, last = true;
+    int des_fd = -1;
+    int ret = 0;
+
+    if (0 != view.file_at(unit.fentry_off, fv))
+        return -1;
+    whole = (0 == unit.first && fv.blocks.nr + 1 == unit.end);
+    memcpy(filename, fv.name, fv.entry.fname_len);
+    target_file_path(filename, job->dest_dir, fullpath);
+    des_fd = open(fullpath, whole ? (O_WRONLY | O_CREAT | O_TRUNC) : O_WRONLY, 0666);
+    if (-1 == des_fd){
+        fprintf(stderr, "Error: open destination file %s in Dedupe::restore_unit(...)\n", fullpath);
+        return -1;
     }
-    if (metadata){
-        free(metadata);
-        metadata = 0;
+    ret = write_blocks(view, fv, unit.first, unit.end, des_fd, unit.dest_off, buf);
+    if (0 == ret && !whole){ //the thread done with the last range of the file sets its times
+        pthread_mutex_lock(&job->lock);
+        last = (0 == --job->left[unit.file]);
+        pthread_mutex_unlock(&job->lock);
     }
-    if (last_block){
-        free(last_block);
-        last_block = 0;
+    if (0 == ret && last){
+        ftime[0].tv_sec = fv.entry.atime;
+        ftime[0].tv_nsec = 0;
+        ftime[1].tv_sec = fv.entry.mtime;
+        ftime[1].tv_nsec = 0;
+        futimens(des_fd, ftime);
     }
-    if (des_file.is_open()){
-        des_file.close();
+    close(des_fd);
+    if (0 != ret){
+        fprintf(stderr, "Error: write destination file %s in Dedupe::restore_unit(...)\n", fullpath);
+        return -1;
     }
-    return ret;
+    return 0;
 }
 
 
 int Dedupe::package_stat(const char *pkg_name)
 {
-    fstream pkg_file;
+    PackageView view;
     D_Package_Header pkg_hdr;
-    D_File_Entry fentry;
+    D_File_View fv;
     D_Logic_Block_Entry lbentry;
     int ret = 0;
-    unsigned int rsize = 0;
     struct stat stat_buf;
-    unsigned long long offset = 0;
     unsigned long long total_files_sz = 0;
     unsigned long long last_blocks_sz = 0;
+    unsigned long long fentries_sz = 0; // the file entries but their last blocks, wherever their runs lie
     unsigned long long dup_blocks_sz = 0;
     unsigned int dup_blocks_nr = 0;
     unsigned long long saved_bytes = 0;
     unsigned long long pkg_size = 0;
     unsigned long long system_overhead = 0;
-    block_id_t  *metadata = 0;
     block_id_t *lblock_array = 0;
 
     ret = stat(pkg_name, &stat_buf);
@@ -1758,25 +4076,11 @@ int Dedupe::package_stat(const char *pkg_name)
         }
     }
 
-    pkg_file.open(pkg_name, ios::binary | ios::in);
-    if (!pkg_file.is_open()){
+    if (0 != view.open(pkg_name)){
         fprintf(stderr, "Error: open deduped package %s in Dedupe::package_stat(...)\n", pkg_name);
         return -1;
     }
-    pkg_file.seekg(0, ios::beg);
-    pkg_file >> noskipws;
-    pkg_file.read((char *)(&pkg_hdr), D_PKG_HDR_SZ);
-    rsize = pkg_file.gcount();
-    if (D_PKG_HDR_SZ != rsize){
-        fprintf(stderr, "Error: read deduped package %s in Dedupe::package_stat(...)\n", pkg_name);
-        ret = -1;
-        goto _PACKAGE_STAT_EXIT;
-    }
-    if (DEDUP_MAGIC_NUM != pkg_hdr.magic_nr){
-        fprintf(stderr, "Error: wrong deduped package magic number in Dedupe::package_stat(...)\n");
-        ret = -1;
-        goto _PACKAGE_STAT_EXIT;
-    }
+    memcpy(&pkg_hdr, &view.header(), D_PKG_HDR_SZ);
 
     lblock_array = (block_id_t *)malloc(BLOCK_ID_SIZE * pkg_hdr.ublocks_nr);
     if (0 == lblock_array){
@@ -1786,62 +4090,35 @@ int Dedupe::package_stat(const char *pkg_name)
     }
     memset(lblock_array, 0, BLOCK_ID_SIZE * pkg_hdr.ublocks_nr);
 
-    offset = pkg_hdr.mdata_offset;
     for (unsigned int i = 0; i < pkg_hdr.files_nr; i++){
-        memset(&fentry, 0, D_FILE_ENTRY_SZ);
-        pkg_file.seekg(offset, ios::beg);
-        pkg_file.read((char *)(&fentry), D_FILE_ENTRY_SZ);
-        rsize = pkg_file.gcount();
-
-        if (D_FILE_ENTRY_SZ != rsize){
+        if (view.file_removed(i))
+            continue;
+        if (0 != view.file(i, fv)){
             fprintf(stderr, "Error: read %dth file entry in Dedupe::package_stat(...)\n", i);
             ret = -1;
             goto _PACKAGE_STAT_EXIT;
         }
-        last_blocks_sz += fentry.last_block_sz;
-        total_files_sz += fentry.org_file_sz;
-
-        metadata = (block_id_t *)malloc(BLOCK_ID_SIZE * fentry.fblocks_nr);
-        if (0 == metadata){
-            fprintf(stderr, "Error: malloc metadata for file entry %d in Dedupe::package_stat(...)\n", i);
-            ret = -1;
-            goto _PACKAGE_STAT_EXIT;
-        }
-        memset(metadata, 0, BLOCK_ID_SIZE * fentry.fblocks_nr);
-
-        pkg_file.seekg(offset + D_FILE_ENTRY_SZ + fentry.fname_len, ios::beg);
-        pkg_file.read((char *)metadata, BLOCK_ID_SIZE * fentry.fblocks_nr);
-        rsize = pkg_file.gcount();
-        if (rsize != BLOCK_ID_SIZE * fentry.fblocks_nr){
-            fprintf(stderr, "Error: read metadata of file entry %d in Dedupe::package_stat(...)\n", i);
-            ret = -1;
-            goto _PACKAGE_STAT_EXIT;
-        }
-        for(unsigned int j = 0; j < fentry.fblocks_nr; j++){
-            if (metadata[j] >= pkg_hdr.ublocks_nr){
-                fprintf(stderr, "Error: metadata[%d]=%d > unique blocks number %d in Dedupe::package_stat(...)\n", j, metadata[j], pkg_hdr.ublocks_nr);
+        last_blocks_sz += fv.entry.last_block_sz;
+        total_files_sz += fv.entry.org_file_sz;
+        fentries_sz += D_FILE_ENTRY_SZ + fv.entry.fname_len + (unsigned long long)fv.blocks.nr * BLOCK_ID_SIZE;
+
+        for(unsigned int j = 0; j < fv.blocks.nr; j++){
+            block_id_t bid = fv.blocks[j];
+            if (bid >= pkg_hdr.ublocks_nr){
+                fprintf(stderr, "Error: metadata[%d]=%d > unique blocks number %d in Dedupe::package_stat(...)\n", j, bid, pkg_hdr.ublocks_nr);
                 ret = -1;
                 goto _PACKAGE_STAT_EXIT;
             }
-            lblock_array[ metadata[j] ]++;
-        }
-        if (metadata){
-            free(metadata);
-            metadata = 0;
+            lblock_array[bid]++;
         }
-        offset += fentry.fentry_sz;
     }
 
     /*traverse logic blocks to get dup_block_sz*/
-    pkg_file.seekg(pkg_hdr.ldata_offset, ios::beg);
     for(unsigned int i = 0; i < pkg_hdr.ublocks_nr; i++){
         if (lblock_array[i] > 1){
             dup_blocks_nr++;
         }
-        memset(&lbentry, 0, D_LOGIC_BLOCK_ENTRY_SZ);
-        pkg_file.read((char*)(&lbentry), D_LOGIC_BLOCK_ENTRY_SZ);
-        rsize = pkg_file.gcount();
-        if (D_LOGIC_BLOCK_ENTRY_SZ != rsize){
+        if (!view.lbentry(i, lbentry)){
             fprintf(stderr, "Error: read %dth logic block entry in Dedupe::package_stat(...)\n", i);
             ret = -1;
             goto _PACKAGE_STAT_EXIT;
@@ -1851,11 +4128,10 @@ int Dedupe::package_stat(const char *pkg_name)
             saved_bytes += (lblock_array[i] - 1) * lbentry.ublock_len;
         }
     }
-    pkg_file.seekg(0, ios::end);
-    pkg_size = pkg_file.tellg();
-    pkg_file.close();
+    pkg_size = view.size();
+    view.close();
 
-    system_overhead = pkg_size - pkg_hdr.ublocks_len - last_blocks_sz;
+    system_overhead = pkg_size - pkg_hdr.zblocks_len - last_blocks_sz;
 
     show_pkg_header(pkg_name);
     /*show package statistical info */
@@ -1866,11 +4142,15 @@ int Dedupe::package_stat(const char *pkg_name)
     cout << "   total size of all original files:      " << (unsigned long long)(dup_blocks_sz + last_blocks_sz) << endl;
     cout << "3. saved bytes calculated by pkg_hdr:     " << total_files_sz - pkg_hdr.ublocks_len - last_blocks_sz << endl;
     cout << "   saved bytes via traversing:            " << saved_bytes << endl;
+    cout << "   saved bytes by compression:            " << pkg_hdr.ublocks_len - pkg_hdr.zblocks_len - pkg_hdr.delta_saved << endl;
+    cout << "   saved bytes by deltas of near dups:    " << pkg_hdr.delta_saved << " (" << pkg_hdr.delta_nr << " blocks)" << endl;
     cout << "4. size of the deduped system(stat):      " << (unsigned long)stat_buf.st_size << endl;
     cout << "   size of the deduped system(seek):      " << (unsigned long long)pkg_size << endl;
     cout << "5_0. costs of storing md5:                " << pkg_hdr.ublocks_nr * 36 << endl;
     cout << "5. costs of logic block entry:            " << pkg_hdr.ublocks_nr * D_LOGIC_BLOCK_ENTRY_SZ << endl;
-    cout << "6. costs of file metadata:               " << (unsigned long long)(pkg_size - pkg_hdr.mdata_offset - last_blocks_sz)<< endl;
+    cout << "6. costs of file metadata:               " << fentries_sz << endl;
+    cout << "6_1. costs of block index and checksums: " << (unsigned long long)pkg_hdr.bindex_nr * BINDEX_ENTRY_SZ +
+            (unsigned long long)pkg_hdr.csum_nr * BINDEX_CSUM_SZ + pkg_hdr.cfilter_len << endl;
     cout << "7. saved bytes / org_file_size:          " << (double)(1.0*saved_bytes/total_files_sz *100.0) << "%"<<endl;
     cout << endl;
     cout << "-----------Info of Origninal File System and DDE (bytes)----------" << endl;
@@ -1878,9 +4158,11 @@ int Dedupe::package_stat(const char *pkg_name)
     cout << "1. overall size of Orginal File System:           " << (unsigned long long )total_files_sz << endl;
     cout << "2. overall size of DDE system:                    " << (unsigned long long )pkg_size << endl;
     cout << "   where in DDE system, " << endl;
-    cout << "    (1) length of blocks stored in DDE:           " << (unsigned long long )(pkg_hdr.ublocks_len + last_blocks_sz) << endl;
+    cout << "    (1) length of blocks stored in DDE:           " << (unsigned long long )(pkg_hdr.zblocks_len + last_blocks_sz) << endl;
     cout << "        where, length of last blocks:             " << (unsigned long long )last_blocks_sz << endl;
     cout << "               length of unique blocks:           " << (unsigned long long )pkg_hdr.ublocks_len << endl;
+    cout << "               compressed to:                     " << (unsigned long long )pkg_hdr.zblocks_len << endl;
+    cout << "               of which deltas save:              " << (unsigned long long )pkg_hdr.delta_saved << endl;
     cout << "                 1)number of unique blocks:       " << (unsigned int)pkg_hdr.ublocks_nr << endl;
     cout << "                 2)thus, ublocks average size:    " << (double)(1.0 * pkg_hdr.ublocks_len / pkg_hdr.ublocks_nr) << endl;
     cout << "    (2) overhead(Header/logic block/metadata):    " << (unsigned long long )system_overhead << endl;
@@ -1894,12 +4176,6 @@ int Dedupe::package_stat(const char *pkg_name)
     cout << endl;
 
 _PACKAGE_STAT_EXIT:
-    if (pkg_file.is_open())
-        pkg_file.close();
-    if (metadata){
-        free(metadata);
-        metadata = 0;
-    }
     if (lblock_array){
         free(lblock_array);
         lblock_array = 0;
@@ -1909,65 +4185,27 @@ _PACKAGE_STAT_EXIT:
 
 int Dedupe::show_package_files(const char *pkg_name)
 {
-    int ret = 0;
-    D_Package_Header pkg_hdr;
-    D_File_Entry fentry;
-    unsigned long long offset;
+    PackageView view;
+    D_File_View fv;
     char pathname[PATH_MAX_LEN] = {0};
-    unsigned rsize = 0;
 
     cout << "--------------------In Dedupe::show_package_files-----------------" << endl;
-    fstream pkg_file;
-    pkg_file.open(pkg_name, ios::binary | ios::in);
-    if (!pkg_file.is_open()){
+    if (0 != view.open(pkg_name)){
         fprintf(stderr, "Error: open deduped package %s in Dedupe::show_package_files(...)\n", pkg_name);
         return -1;
     }
-
-    pkg_file >> noskipws;
-    pkg_file.seekg(0, ios::beg);
-    pkg_file.read((char*)(&pkg_hdr), D_PKG_HDR_SZ);
-    rsize = pkg_file.gcount();
-    if (D_PKG_HDR_SZ != rsize){
-        fprintf(stderr, "Error: read package header in Dedupe::show_package_files(...)\n");
-        ret = -1;
-        goto _SHOW_PACKAGE_FILES_EXIT;
-    }
-    if (DEDUP_MAGIC_NUM != pkg_hdr.magic_nr ){
-        fprintf(stderr, "Error: wrong package magic number in Dedupe::show_package_files(...)\n");
-        ret = -1;
-        goto _SHOW_PACKAGE_FILES_EXIT;
-    }
-
-    offset = pkg_hdr.mdata_offset;
-    for(unsigned int i = 0; i < pkg_hdr.files_nr; i++){
-        pkg_file.seekg(offset, ios::beg);
-        pkg_file.read((char*)(&fentry),D_FILE_ENTRY_SZ);
-        rsize = pkg_file.gcount();
-        if (D_FILE_ENTRY_SZ != rsize){
+    for(unsigned int i = 0; i < view.files_nr(); i++){
+        if (view.file_removed(i))
+            continue;
+        if (0 != view.file(i, fv)){
             fprintf(stderr, "Error: read %dth file entry in Dedupe::show_package_files(...)\n", i);
-            ret = -1;
-            goto _SHOW_PACKAGE_FILES_EXIT;
-        }
-
-        memset(pathname, 0, PATH_MAX_LEN);
-        pkg_file.read(pathname, fentry.fname_len);
-        rsize = pkg_file.gcount();
-        if (rsize != fentry.fname_len){
-            fprintf(stderr, "Error: read pathname of %dth file entry in Dedupe::show_package_files(...)\n", i);
-            ret = -1;
-            goto _SHOW_PACKAGE_FILES_EXIT;
+            return -1;
         }
+        memcpy(pathname, fv.name, fv.entry.fname_len);
+        pathname[fv.entry.fname_len] = '\0';
         fprintf(stderr, "%d.%s\n", i+1, pathname);
-        offset += fentry.fentry_sz;
-    }
-
-
-_SHOW_PACKAGE_FILES_EXIT:
-    if (pkg_file.is_open()){
-        pkg_file.close();
     }
-    return ret;
+    return 0;
 }
 
 int Dedupe::set_chunk_alg(const char *cname)
@@ -1980,13 +4218,6 @@ int Dedupe::set_chunk_alg(const char *cname)
     }
     else if (0 == strcmp(cname, CHUNCK_SB_NAME)){
         d_chunk_alg = D_CHUNK_SB;
-        if (0 == d_htab_sb_csum){
-            char tabname[PATH_MAX_LEN] = {0};
-            char bloomname[PATH_MAX_LEN]  = {0};
-            sprintf(tabname, "data/BigHashTable/.hashdb_sbcsum_%d.db", getpid());
-            sprintf(bloomname, "data/BigHashTable/.hashdb_sbcsum_%d.bf", getpid());
-            d_htab_sb_csum = new BigHashTable(tabname, bloomname);
-        }
     }else if (0 == strcmp(cname, CHUNCK_AAC_NAME)){
         d_chunk_alg = D_CHUNK_AAC;
     }else{
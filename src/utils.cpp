@@ -46,16 +46,33 @@ bool is_file_in_list(char *filepath, int files_nr, char **files_list)
     return false;
 }
 
+bool is_file_under_list(const char *filepath, int files_nr, char **files_list)
+{
+    for (int i = 0; i < files_nr; i++){
+        size_t len = strlen(files_list[i]);
+        while (len > 1 && '/' == files_list[i][len - 1])
+            len--;
+        if (0 == strncmp(filepath, files_list[i], len) && ('\0' == filepath[len] || '/' == filepath[len]))
+            return true;
+    }
+    return false;
+}
 
-int prepare_target_file(const char *filename, const char *basepath, char *fullpath)
+
+void target_file_path(const char *filename, const char *basepath, char *fullpath)
 {
-    char path[PATH_MAX_LEN] = {0};
-    char *p = 0;
-    int pos = 0;
     if (filename[1] == ':')
         sprintf(fullpath, "%s/%s", basepath, filename+2);
     else
         sprintf(fullpath, "%s/%s", basepath, filename);
+}
+
+int prepare_target_file(const char *filename, const char *basepath, char *fullpath)
+{
+    char path[PATH_MAX_LEN] = {0};
+    char *p = 0;
+    int pos = 0;
+    target_file_path(filename, basepath, fullpath);
     p = fullpath;
     while(*p){
         path[pos++] = *p;